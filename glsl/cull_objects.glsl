@@ -0,0 +1,70 @@
+#version 430
+
+// Frustum culling and level-of-detail selection, one object per
+// invocation. The draws of visible objects are appended to their bucket's
+// part of the command buffer as glMultiDrawArraysIndirect commands; the
+// same test runs on the CPU in cull_objects_cpu.
+
+layout(local_size_x = 64) in;
+
+struct cull_object {
+	vec4 sphere;        // world center and radius
+	float scale;        // world units per model unit
+	uint first_lod;
+	uint lod_levels;
+	uint instance;
+	uint bucket;
+	uint pad0, pad1, pad2;
+};
+
+struct cull_lod {
+	uint first;
+	uint count;
+	float error;
+	uint pad;
+};
+
+layout(std430, binding = 0) readonly buffer object_table { cull_object objects[]; };
+layout(std430, binding = 1) readonly buffer lod_table { cull_lod lods[]; };
+layout(std430, binding = 2) writeonly buffer command_table { uint commands[]; };   // 4 per draw
+layout(std430, binding = 3) buffer count_table { uint counts[]; };                // per bucket
+layout(std430, binding = 4) readonly buffer first_table { uint bucket_first[]; };
+
+layout(std140) uniform cull {
+	vec4 planes[6];
+	vec4 eye;
+	float lod_scale;        // pixels per unit at unit distance
+	float pixel_tolerance;
+	float min_distance;
+	uint object_count;
+};
+
+void main()
+{
+	uint i = gl_GlobalInvocationID.x;
+	if (i >= object_count)
+		return;
+	cull_object o = objects[i];
+
+	for (int p = 0; p < 6; p++)
+		if (planes[p].x*o.sphere.x + planes[p].y*o.sphere.y + planes[p].z*o.sphere.z + planes[p].w < -o.sphere.w)
+			return;
+
+	// the coarsest level whose error stays under the tolerance
+	vec3 d = eye.xyz - o.sphere.xyz;
+	float distance = max(min_distance, sqrt(d.x*d.x + d.y*d.y + d.z*d.z));
+	float pixels = lod_scale / distance * o.scale;
+	uint best = 0u;
+	for (uint l = 1u; l < o.lod_levels; l++)
+		if (lods[o.first_lod + l].error * pixels <= pixel_tolerance)
+			best = l;
+	cull_lod lod = lods[o.first_lod + best];
+	if (lod.count == 0u)
+		return;
+
+	uint slot = bucket_first[o.bucket] + atomicAdd(counts[o.bucket], 1u);
+	commands[4u*slot] = lod.count;
+	commands[4u*slot + 1u] = 1u;
+	commands[4u*slot + 2u] = lod.first;
+	commands[4u*slot + 3u] = o.instance;
+}
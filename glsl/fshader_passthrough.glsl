@@ -1,44 +1,138 @@
-// the simplest fragment shader: get the color (from the vertex shader - 
-// actually interpolated from values specified in the vertex shader - and
-// just pass them through to the render:
-// on mac: 
-//varying vec4 norm;
-varying vec4 norm;
-varying vec4 v_light;
-varying vec4 v_viewer;
-varying vec4 vnorm;
-
-uniform vec4 light_pos;
-uniform vec4 light_ambi;
-uniform vec4 light_diff;
-uniform vec4 light_spec;
-
-uniform vec4 material_ambi;
-uniform vec4 material_diff;
-uniform vec4 material_spec;
-uniform float material_shin;
+#version 120
+#extension GL_ARB_uniform_buffer_object : require
+#extension GL_EXT_gpu_shader4 : enable
+
+// Blinn-Phong with the ambient term darkened by the baked occlusion, or
+// the color lit per vertex with PER_VERTEX_LIGHTING. Point lights are
+// added with
+//   CLUSTERED_LIGHTING  the lights listed for the fragment's cluster
+//   ALL_LIGHTS          every light, to compare
+// and DEPTH_ONLY writes nothing that is kept, for a depth pre-pass.
+#if defined(DEPTH_ONLY)
+void main()
+{
+	gl_FragColor = vec4(0.0);
+}
+#elif defined(PER_VERTEX_LIGHTING)
+varying vec4 v_color;
+
+void main()
+{
+	gl_FragColor = v_color;
+}
+#else
+varying vec3 v_normal;
+varying vec3 v_light;
+varying vec3 v_viewer;
+varying float v_occlusion;
+#ifdef INSTANCED
+varying vec4 v_diffuse;     // the instance's, in place of the material's
+#define DIFFUSE v_diffuse
+#else
+#define DIFFUSE material_diffuse
+#endif
+
+layout(std140) uniform light {
+	vec4 light_position;     // in eye space
+	vec4 light_ambient;
+	vec4 light_diffuse;
+	vec4 light_specular;
+};
+
+layout(std140) uniform material {
+	vec4 material_ambient;
+	vec4 material_diffuse;
+	vec4 material_specular;
+	float material_shininess;
+};
+
+#if defined(CLUSTERED_LIGHTING) || defined(ALL_LIGHTS)
+// 2 texels per light: eye-space position and radius, then color
+uniform samplerBuffer point_lights;
+// first index into cluster_indices and count, per cluster
+uniform usamplerBuffer cluster_ranges;
+uniform usamplerBuffer cluster_indices;
+
+layout(std140) uniform clusters {
+	vec4 cluster_grid;       // tiles across, tiles up, slices, tile size in pixels
+	vec4 cluster_depth;      // slice scale and bias, light count
+};
+
+// One point light, fading to nothing at its radius
+vec4 point_light(int i, vec3 p, vec3 n, vec3 v)
+{
+	vec4 position = texelFetchBuffer(point_lights, 2*i);
+	vec3 l = position.xyz - p;
+	float d2 = dot(l, l);
+	float r2 = position.w * position.w;
+	if (d2 >= r2)
+		return vec4(0.0);
+	l *= inversesqrt(d2);
+	float nl = dot(n, l);
+	if (nl <= 0.0)
+		return vec4(0.0);
+	float fade = 1.0 - d2 / r2;
+	vec4 light = fade * fade * texelFetchBuffer(point_lights, 2*i + 1);
+	vec4 color = nl * (light * DIFFUSE);
+#ifndef NO_SPECULAR
+	if (dot(v, n) > 0.0)
+		color += pow(max(dot(normalize(l + v), n), 0.0), material_shininess) * (light * material_specular);
+#endif
+	return color;
+}
+
+vec4 point_lighting(vec3 n, vec3 v)
+{
+	vec3 p = -v_viewer;
+	vec4 color = vec4(0.0);
+#ifdef CLUSTERED_LIGHTING
+	int slice = int(clamp(floor(log(-p.z) * cluster_depth.x + cluster_depth.y), 0.0, cluster_grid.z - 1.0));
+	ivec2 tile = ivec2(min(floor(gl_FragCoord.xy / cluster_grid.w), cluster_grid.xy - 1.0));
+	int cluster = (slice * int(cluster_grid.y) + tile.y) * int(cluster_grid.x) + tile.x;
+	int first = int(texelFetchBuffer(cluster_ranges, 2*cluster).r);
+	int count = int(texelFetchBuffer(cluster_ranges, 2*cluster + 1).r);
+	for (int k = 0; k < count; k++)
+		color += point_light(int(texelFetchBuffer(cluster_indices, first + k).r), p, n, v);
+#else
+	int count = int(cluster_depth.z);
+	for (int i = 0; i < count; i++)
+		color += point_light(i, p, n, v);
+#endif
+	return color;
+}
+#endif
 
 void main() 
 {
-	// for ambient:
-	norm = light_ambi * material_ambi;
+	vec3 n = normalize(v_normal);
+	vec3 l = normalize(v_light);
+	vec3 v = normalize(v_viewer);
+	
+	// for ambient, darkened where the baked occlusion blocks the sky:
+	vec4 color = v_occlusion * light_ambient * material_ambient;
 	
 	// for diffuse:
-	float dd = max (0.0, dot(v_light, vnorm));
-	norm += dd * (light_diff * material_diff);
+	float dd = max(0.0, dot(l, n));
+	color += dd * (light_diffuse * DIFFUSE);
 	
+#ifndef NO_SPECULAR
 	// for specular:
 	float sd = 0.0;
-	if ((dot(v_light, vnorm) > 0.0) && (dot(v_viewer, vnorm) > 0.0)) {
-		sd = max(dot(normalize(v_light + v_viewer), vnorm), 0.0);
+	if (dot(l, n) > 0.0 && dot(v, n) > 0.0) {
+		sd = max(dot(normalize(l + v), n), 0.0);
 	}
 	if (sd > 0.0) {
-		sd = pow(sd, material_shin);
+		sd = pow(sd, material_shininess);
 	}
-	norm += sd * (light_spec * material_spec);
+	color += sd * (light_specular * material_specular);
+#endif
 	
-	norm.a = 1.0;
+#if defined(CLUSTERED_LIGHTING) || defined(ALL_LIGHTS)
+	color += point_lighting(n, v);
+#endif
 	
-	gl_FragColor = norm;
-} 
-
+	color.a = 1.0;
+	
+	gl_FragColor = color;
+}
+#endif
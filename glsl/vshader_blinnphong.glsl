@@ -1,20 +1,109 @@
+#version 120
+#extension GL_ARB_uniform_buffer_object : require
+
+// Variants, defined by the shader manager:
+//   PER_VERTEX_LIGHTING  Gouraud: lit here and interpolated
+//   NO_SPECULAR          diffuse and ambient only
+//   INSTANCED            placed and colored by per-instance attributes
+//   DEPTH_ONLY           position only, for a depth pre-pass
+
+// the same in every variant, so a pre-pass's depths equal the shading pass's
+invariant gl_Position;
+
 attribute vec4 vPosition;
 attribute vec4 vNorm;
-// in vec4 vPosition;
-// in vec4 vNorm;
+attribute float vOcclusion;  // baked ambient occlusion, 1 = open
+
+#ifdef INSTANCED
+// rotation, uniform scale and translation, and the instance's diffuse color
+attribute vec4 vInstanceRow0;
+attribute vec4 vInstanceRow1;
+attribute vec4 vInstanceRow2;
+attribute vec4 vInstanceColor;
+#endif
+
+// the matrices are combined once per frame on the CPU
+layout(std140, row_major) uniform camera {
+	mat4 mvp;
+	mat4 model_view;
+	mat3 normal_matrix;
+};
 
-uniform mat4 ctm;
-uniform mat4 ptm;
+layout(std140) uniform light {
+	vec4 light_position;     // in eye space
+	vec4 light_ambient;
+	vec4 light_diffuse;
+	vec4 light_specular;
+};
 
-// color, sned to fshader
-varying vec4 norm;
-varying vec4 v_light;
-varying vec4 v_viewer;
-varying vec4 vnorm;
+#ifdef PER_VERTEX_LIGHTING
+layout(std140) uniform material {
+	vec4 material_ambient;
+	vec4 material_diffuse;
+	vec4 material_specular;
+	float material_shininess;
+};
+
+varying vec4 v_color;
+
+// the same Blinn-Phong as the fragment shader's
+vec4 shade(vec3 n, vec3 l, vec3 v, float occlusion, vec4 diffuse)
+{
+	vec4 color = occlusion * light_ambient * material_ambient;
+	color += max(0.0, dot(l, n)) * (light_diffuse * diffuse);
+#ifndef NO_SPECULAR
+	if (dot(l, n) > 0.0 && dot(v, n) > 0.0) {
+		float sd = max(dot(normalize(l + v), n), 0.0);
+		if (sd > 0.0)
+			color += pow(sd, material_shininess) * (light_specular * material_specular);
+	}
+#endif
+	color.a = 1.0;
+	return color;
+}
+#else
+// to the fragment shader, in eye space
+varying vec3 v_normal;
+varying vec3 v_light;
+varying vec3 v_viewer;
+varying float v_occlusion;
+#ifdef INSTANCED
+varying vec4 v_diffuse;
+#endif
+#endif
 
 void main()
 {
-	vnorm = vNorm;
+#ifdef INSTANCED
+	// the camera block holds view and projection only
+	vec4 position = vec4(dot(vInstanceRow0, vPosition), dot(vInstanceRow1, vPosition),
+						 dot(vInstanceRow2, vPosition), 1.0);
+	vec3 normal = vec3(dot(vInstanceRow0.xyz, vNorm.xyz), dot(vInstanceRow1.xyz, vNorm.xyz),
+					   dot(vInstanceRow2.xyz, vNorm.xyz));
+	vec4 diffuse = vInstanceColor;
+#else
+	vec4 position = vPosition;
+	vec3 normal = vNorm.xyz;
+#ifdef PER_VERTEX_LIGHTING
+	vec4 diffuse = material_diffuse;
+#endif
+#endif
+	
+#ifndef DEPTH_ONLY
+	vec3 p = (model_view * position).xyz;
+#ifdef PER_VERTEX_LIGHTING
+	v_color = shade(normalize(normal_matrix * normal), normalize(light_position.xyz - p),
+					normalize(-p), vOcclusion, diffuse);
+#else
+	v_normal = normal_matrix * normal;
+	v_light = light_position.xyz - p;
+	v_viewer = -p;
+	v_occlusion = vOcclusion;
+#ifdef INSTANCED
+	v_diffuse = diffuse;
+#endif
+#endif
+#endif
 	
-	gl_Position = ptm * ctm * vPosition;
+	gl_Position = mvp * position;
 }
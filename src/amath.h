@@ -47,10 +47,6 @@
 
 namespace amath {
 
-//  Helper function to load vertex and fragment shader files
-GLuint InitShader( const char* vertexShaderFile,
-		   const char* fragmentShaderFile );
-
 //  Defined constant for when numbers are too small to be used in the
 //    denominator of a division operation.  This is only used if the
 //    DEBUG macro is defined.
@@ -0,0 +1,79 @@
+//
+//  arena.cc
+//  pipeline
+//
+
+#include <algorithm>
+#include "arena.h"
+
+using namespace std;
+
+arena::arena(size_t block_bytes) : current(0), offset(0), block_bytes(block_bytes) {}
+
+arena::~arena() {
+	free_blocks();
+}
+
+arena::arena(arena &&other) noexcept
+: blocks(std::move(other.blocks)), current(other.current), offset(other.offset), block_bytes(other.block_bytes)
+{
+	other.blocks.clear();
+	other.current = other.offset = 0;
+}
+
+void arena::add_block(size_t bytes) {
+	block b = { new char[bytes], bytes };
+	blocks.push_back(b);
+}
+
+void arena::free_blocks() {
+	for (size_t i = 0; i < blocks.size(); i++)
+		delete[] blocks[i].data;
+	blocks.clear();
+}
+
+void *arena::allocate(size_t bytes, size_t align) {
+	for (;;) {
+		if (current < blocks.size()) {
+			uintptr_t base = (uintptr_t) blocks[current].data;
+			size_t at = ((base + offset + align - 1) & ~(uintptr_t) (align - 1)) - base;
+			if (at + bytes <= blocks[current].size) {
+				offset = at + bytes;
+				return blocks[current].data + at;
+			}
+			// on to the next block; what is left of this one is wasted
+			if (current + 1 < blocks.size()) {
+				current++;
+				offset = 0;
+				continue;
+			}
+		}
+		add_block(max(block_bytes, bytes + align));
+		current = blocks.size() - 1;
+		offset = 0;
+	}
+}
+
+void arena::reset() {
+	if (blocks.size() > 1) {
+		size_t total = reserved();
+		free_blocks();
+		add_block(total);
+	}
+	current = 0;
+	offset = 0;
+}
+
+size_t arena::used() const {
+	size_t n = offset;
+	for (size_t i = 0; i < current && i < blocks.size(); i++)
+		n += blocks[i].size;
+	return n;
+}
+
+size_t arena::reserved() const {
+	size_t n = 0;
+	for (size_t i = 0; i < blocks.size(); i++)
+		n += blocks[i].size;
+	return n;
+}
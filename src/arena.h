@@ -0,0 +1,144 @@
+//
+//  arena.h
+//  pipeline
+//
+//  Memory for transient geometry work: a bump allocator that is rewound
+//  rather than freed, lists that grow inside one, and an owning array for
+//  buffers handed on to the renderer.
+//
+
+#ifndef arena_h
+#define arena_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+using namespace std;
+
+const size_t ARENA_BLOCK_BYTES = 1 << 20;
+
+/* Hands out memory by bumping an offset through large blocks, and takes it
+ * all back at once with reset(). Nothing is destroyed, so it is meant for
+ * plain data. When a round of work needed more than one block, reset()
+ * replaces them with a single block as large as all of them, so repeating
+ * the same work allocates nothing. Not thread safe: use one per thread.
+ */
+class arena {
+public:
+	explicit arena(size_t block_bytes = ARENA_BLOCK_BYTES);
+	~arena();
+	arena(arena &&other) noexcept;
+
+	void *allocate(size_t bytes, size_t align);
+
+	template <typename T>
+	T *alloc(size_t n) { return static_cast<T *>(allocate(n * sizeof(T), alignof(T))); }
+
+	void reset();
+
+	size_t used() const;                 // since the last reset
+	size_t reserved() const;             // in all blocks
+	int num_blocks() const { return (int) blocks.size(); }
+
+private:
+	struct block {
+		char *data;
+		size_t size;
+	};
+	vector<block> blocks;
+	size_t current;      // block being bumped through
+	size_t offset;       // into it
+	size_t block_bytes;
+
+	void add_block(size_t bytes);
+	void free_blocks();
+
+	arena(const arena &);
+	arena &operator= (const arena &);
+};
+
+/* A growable list of plain values whose storage comes from an arena. It
+ * doubles like a vector, but the old storage is simply abandoned to the
+ * arena, so many small lists cost no heap allocations at all.
+ */
+template <typename T>
+struct arena_list {
+	T *data;
+	uint32_t count, capacity;
+
+	arena_list() : data(NULL), count(0), capacity(0) {}
+
+	void reserve(arena &a, uint32_t n) {
+		if (n <= capacity)
+			return;
+		T *grown = a.alloc<T>(n);
+		if (count > 0)
+			memcpy(grown, data, count * sizeof(T));
+		data = grown;
+		capacity = n;
+	}
+
+	void push_back(arena &a, const T &value) {
+		if (count == capacity)
+			reserve(a, capacity < 4 ? 4 : 2 * capacity);
+		data[count++] = value;
+	}
+
+	T &operator[] (size_t i) { return data[i]; }
+	const T &operator[] (size_t i) const { return data[i]; }
+	size_t size() const { return count; }
+	void resize(uint32_t n) { count = n; }      // shrinking only
+	void clear() { count = 0; }
+};
+
+/* Owns a heap array of plain values. It can be moved but not copied, and
+ * resize() keeps the storage whenever it is already large enough, so
+ * buffers that are refilled again and again are allocated once.
+ */
+template <typename T>
+class owned_array {
+public:
+	owned_array() : ptr(NULL), count(0), room(0) {}
+	explicit owned_array(size_t n) : ptr(NULL), count(0), room(0) { resize(n); }
+	~owned_array() { delete[] ptr; }
+
+	owned_array(owned_array &&other) : ptr(other.ptr), count(other.count), room(other.room) {
+		other.ptr = NULL;
+		other.count = other.room = 0;
+	}
+
+	owned_array &operator= (owned_array &&other) {
+		std::swap(ptr, other.ptr);
+		std::swap(count, other.count);
+		std::swap(room, other.room);
+		return *this;
+	}
+
+	// Contents are not kept when the array has to grow
+	void resize(size_t n) {
+		if (n > room) {
+			delete[] ptr;
+			ptr = new T[n];
+			room = n;
+		}
+		count = n;
+	}
+
+	T *data() { return ptr; }
+	const T *data() const { return ptr; }
+	T &operator[] (size_t i) { return ptr[i]; }
+	const T &operator[] (size_t i) const { return ptr[i]; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+private:
+	T *ptr;
+	size_t count, room;
+
+	owned_array(const owned_array &);
+	owned_array &operator= (const owned_array &);
+};
+
+#endif /* arena_h */
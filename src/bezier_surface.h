@@ -1,6 +1,7 @@
 #ifndef BEZIER_H_
 #define BEZIER_H_
 
+#include <algorithm>
 #include <vector>
 #include "amath.h"
 using namespace std;
@@ -36,21 +37,30 @@ struct point {
 
 typedef point vect;
 
+/* Working points for evaluating one curve: on the stack up to degree 15,
+ * on the heap only for higher degrees.
+ */
+struct point_scratch {
+	point local[16];
+	vector<point> heap;
+
+	point *get(int n) {
+		if (n <= 16)
+			return local;
+		heap.resize(n);
+		return &heap[0];
+	}
+};
+
 class bezier_surf {
 private:
 	vector < vector<point> > controls;
 	int u_deg;
 	int v_deg;
 
-	vector<point> getControlColumn(int u) {
-		vector<point> ret;
+	void getControlColumn(int u, point *column) {
 		for (int i = 0; i <= v_deg; i++)
-			ret.push_back(controls[i][u]);
-		return ret;
-	}
-
-	vector<point> getControlRow(int v) {
-		return controls[v];
+			column[i] = controls[i][u];
 	}
 
 public:
@@ -99,6 +109,16 @@ public:
 	 * That is, # samples in u = u_deg * samples and like wise for v
 	 */
 	bool sample(int samples, vector<vec4> &vertices, vector<vec4> &normals) {
+		if (samples <= 1)
+			return false;
+		size_t n = vertices.size();
+		vertices.resize(n + u_deg*samples * v_deg*samples);
+		normals.resize(vertices.size());
+		return sample(samples, &vertices[n], &normals[n]);
+	}
+
+	// As above, into room for getUSamples() * getVSamples() of each
+	bool sample(int samples, vec4 *vertices, vec4 *normals) {
 		if (samples <= 1)
 			return false;
 
@@ -116,8 +136,8 @@ public:
 				vec4 point;
 				vec4 norm;
 				evaluate(u, v, point, norm);
-				vertices.push_back(point);
-				normals.push_back(norm);
+				*vertices++ = point;
+				*normals++ = norm;
 				u += u_spac;
 				u_c++;
 			}
@@ -128,25 +148,22 @@ public:
 	}
 
 	bool evaluate(double u, double v, vec4 &pt, vec4 &norm) {
-
-		vector<point> u_controls;
+		point_scratch u_scratch, v_scratch, column_scratch;
+		point *u_controls = u_scratch.get(v_deg+1);
+		point *v_controls = v_scratch.get(u_deg+1);
+		point *column = column_scratch.get(v_deg+1);
 
 		vect garbageTan;
-		for (int i = 0; i <= v_deg; i++) {
-			point newControl;
-			eval_bez(getControlRow(i), u_deg, u, newControl, garbageTan);
-			u_controls.push_back(newControl);
-		}
+		for (int i = 0; i <= v_deg; i++)
+			eval_bez(&controls[i][0], u_deg, u, u_controls[i], garbageTan);
 
 		point sample;
 		vect v_tan;
 		eval_bez(u_controls, v_deg, 1-v, sample, v_tan); // 1-v because v starts from bottom
 
-		vector<point> v_controls;
 		for (int i = 0; i <= u_deg; i++) {
-			point newControl;
-			eval_bez(getControlColumn(i), v_deg, 1-v, newControl, garbageTan);
-			v_controls.push_back(newControl);
+			getControlColumn(i, column);
+			eval_bez(column, v_deg, 1-v, v_controls[i], garbageTan);
 		}
 
 		point copySample;
@@ -161,6 +178,57 @@ public:
 		return true;
 	}
 
+	/* Position and exact partial derivatives at (u, v), with v measured
+	 * from the bottom row like evaluate()
+	 */
+	void evaluate_derivs(double u, double v, point &pt, vect &du, vect &dv) {
+		point_scratch pts_scratch, tans_scratch;
+		point *pts = pts_scratch.get(v_deg+1), *tans = tans_scratch.get(v_deg+1);
+		for (int j = 0; j <= v_deg; j++)
+			eval_bez_deriv(&controls[j][0], u_deg, u, pts[j], tans[j]);
+
+		vect ds;
+		eval_bez_deriv(pts, v_deg, 1-v, pt, ds);
+		dv = ds * -1.0;
+
+		vect unused_tan;
+		eval_bez_deriv(tans, v_deg, 1-v, du, unused_tan);
+	}
+
+	// Bounding box of the control net, which contains the whole patch
+	void bounds(double lo[3], double hi[3]) {
+		lo[0] = hi[0] = controls[0][0].x;
+		lo[1] = hi[1] = controls[0][0].y;
+		lo[2] = hi[2] = controls[0][0].z;
+		for (int j = 0; j <= v_deg; j++)
+			for (int i = 0; i <= u_deg; i++) {
+				const point &p = controls[j][i];
+				lo[0] = min(lo[0], p.x); hi[0] = max(hi[0], p.x);
+				lo[1] = min(lo[1], p.y); hi[1] = max(hi[1], p.y);
+				lo[2] = min(lo[2], p.z); hi[2] = max(hi[2], p.z);
+			}
+	}
+
+	/* de Casteljau down to the last two points, which give the curve
+	 * point by interpolation and the derivative as degree * (b1 - b0)
+	 */
+	static void eval_bez_deriv(const point *controlpoints, int degree, double t,
+							   point &pnt, vect &deriv) {
+		if (degree == 0) {
+			pnt = controlpoints[0];
+			deriv = point(0, 0, 0);
+			return;
+		}
+		point_scratch scratch;
+		point *work = scratch.get(degree + 1);
+		copy(controlpoints, controlpoints + degree + 1, work);
+		for (int j = degree; j > 1; j--)
+			for (int i = 0; i < j; i++)
+				work[i] = work[i]*(1-t) + work[i+1]*t;
+		pnt = work[0]*(1-t) + work[1]*t;
+		deriv = (work[1] - work[0]) * degree;
+	}
+
 	/* cur should be the last thing computed
 	 * last stores the value that should be overwritten by cur
 	 * The value immediately behind that is the value we need to subtract
@@ -171,9 +239,10 @@ public:
 	 * 4 7 9 10
 	 * 8 is workingArray[degree-1], last = 9, cur is 10
 	 */
-	static void eval_bez(const vector<point> controlpoints, int degree, double t,
+	static void eval_bez(const point *controlpoints, int degree, double t,
 														point &pnt, vect &tangent) {
-		point *workingArray = new point[degree+1];
+		point_scratch scratch;
+		point *workingArray = scratch.get(degree+1);
 		for (int i = 0; i <= degree; i++)
 			workingArray[i] = controlpoints[i];
 
@@ -190,7 +259,6 @@ public:
 		}
 		pnt = cur;
 		tangent = last - workingArray[degree-1];
-		delete workingArray;
 	}
 };
 
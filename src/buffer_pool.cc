@@ -0,0 +1,89 @@
+//
+//  buffer_pool.cc
+//  pipeline
+//
+
+#include "buffer_pool.h"
+
+using namespace std;
+
+buffer_pool::buffer_pool(GLenum target, size_t page_bytes) : target(target), page_bytes(page_bytes) {}
+
+bool buffer_pool::allocate(size_t bytes, size_t align, buffer_range &r) {
+	release(r);
+	for (size_t p = 0; p < pages.size(); p++) {
+		size_t offset = pages[p].allocate(bytes, align);
+		if (offset != range_allocator::npos) {
+			r.page = (int) p;
+			r.offset = offset;
+			r.size = bytes;
+			return true;
+		}
+	}
+
+	// nothing fits: a new page, big enough for this request at least
+	GLuint buffer;
+	glGenBuffers(1, &buffer);
+	if (buffer == 0)
+		return false;
+	size_t size = max(page_bytes, bytes);
+	glBindBuffer(target, buffer);
+	glBufferData(target, size, NULL, GL_DYNAMIC_DRAW);
+	buffers.push_back(buffer);
+	pages.push_back(range_allocator(size));
+	r.page = (int) pages.size() - 1;
+	r.offset = pages.back().allocate(bytes, align);
+	r.size = bytes;
+	return true;
+}
+
+void buffer_pool::release(buffer_range &r) {
+	if (r.page >= 0 && r.page < (int) pages.size())
+		pages[r.page].release(r.offset);
+	r = buffer_range();
+}
+
+void buffer_pool::update(const buffer_range &r, size_t offset, size_t bytes, const void *data) {
+	if (r.page < 0 || bytes == 0)
+		return;
+	if (offset + bytes > r.size) {
+		cerr << "buffer_pool: update of " << bytes << " bytes at " << offset
+			 << " overruns a range of " << r.size << endl;
+		return;
+	}
+	bind(r);
+	glBufferSubData(target, r.offset + offset, bytes, data);
+}
+
+void buffer_pool::bind(const buffer_range &r) const {
+	glBindBuffer(target, r.page >= 0 ? buffers[r.page] : 0);
+}
+
+void buffer_pool::clear() {
+	if (!buffers.empty())
+		glDeleteBuffers((GLsizei) buffers.size(), &buffers[0]);
+	buffers.clear();
+	pages.clear();
+}
+
+size_t buffer_pool::capacity() const {
+	size_t n = 0;
+	for (size_t p = 0; p < pages.size(); p++)
+		n += pages[p].capacity();
+	return n;
+}
+
+size_t buffer_pool::used() const {
+	size_t n = 0;
+	for (size_t p = 0; p < pages.size(); p++)
+		n += pages[p].used();
+	return n;
+}
+
+void buffer_pool::print_report(ostream &os) const {
+	os << pages.size() << " pages, " << used() / 1024 << "/" << capacity() / 1024 << " KB used" << endl;
+	for (size_t p = 0; p < pages.size(); p++) {
+		os << "  page " << p << ": ";
+		pages[p].print_report(os);
+	}
+}
@@ -0,0 +1,64 @@
+//
+//  buffer_pool.h
+//  pipeline
+//
+//  A few large GL buffers shared by many meshes, each mesh holding a range
+//  of one of them.
+//
+
+#ifndef buffer_pool_h
+#define buffer_pool_h
+
+#include <iostream>
+#include <vector>
+#include "amath.h"
+#include "range_allocator.h"
+using namespace std;
+
+struct buffer_range {
+	int page;          // -1 when nothing is allocated
+	size_t offset;     // in bytes, into the page's buffer
+	size_t size;
+
+	buffer_range() : page(-1), offset(0), size(0) {}
+};
+
+/* Ranges of GL buffers ("pages") of one target. Pages are page_bytes
+ * (or as large as a request that does not fit one) and are added when no
+ * existing page has room; ranges within a page come from a
+ * range_allocator. Creating a range or writing into one never reallocates
+ * a buffer, so meshes can come, go and be updated without disturbing the
+ * others.
+ */
+class buffer_pool {
+public:
+	buffer_pool(GLenum target, size_t page_bytes);
+
+	// Gives back what r held first; align must be a power of two
+	bool allocate(size_t bytes, size_t align, buffer_range &r);
+	void release(buffer_range &r);
+
+	// Writes bytes at offset into r, in place
+	void update(const buffer_range &r, size_t offset, size_t bytes, const void *data);
+
+	// Binds the page holding r to the pool's target
+	void bind(const buffer_range &r) const;
+
+	// Deletes every page; needs the GL context, unlike the destructor
+	void clear();
+
+	size_t capacity() const;
+	size_t used() const;
+	void print_report(ostream &os) const;
+
+private:
+	GLenum target;
+	size_t page_bytes;
+	vector<GLuint> buffers;
+	vector<range_allocator> pages;
+
+	buffer_pool(const buffer_pool &);
+	buffer_pool &operator= (const buffer_pool &);
+};
+
+#endif /* buffer_pool_h */
@@ -0,0 +1,458 @@
+//
+//  bvh.cc
+//  pipeline
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <stdint.h>
+#include "bvh.h"
+#include "parallel.h"
+
+using namespace std;
+
+static const int SAH_BINS = 16;
+static const int MAX_LEAF = 8;
+// cost of visiting a node relative to one triangle test
+static const float TRAVERSAL_COST = 1.0f;
+
+struct aabb {
+	float lo[3], hi[3];
+
+	void reset() {
+		lo[0] = lo[1] = lo[2] = 1e30f;
+		hi[0] = hi[1] = hi[2] = -1e30f;
+	}
+	void grow(const float *l, const float *h) {
+		for (int i = 0; i < 3; i++) {
+			lo[i] = min(lo[i], l[i]);
+			hi[i] = max(hi[i], h[i]);
+		}
+	}
+	void grow(const aabb &b) { grow(b.lo, b.hi); }
+	float area() const {
+		float dx = hi[0] - lo[0], dy = hi[1] - lo[1], dz = hi[2] - lo[2];
+		if (dx < 0.0f) return 0.0f;
+		return 2.0f * (dx*dy + dy*dz + dz*dx);
+	}
+};
+
+struct build_ctx {
+	vector<float> bounds;     // per triangle lo[3], hi[3]
+	vector<float> centroids;  // per triangle
+	vector<int> &idx;
+
+	build_ctx(vector<int> &i) : idx(i) {}
+};
+
+struct build_job {
+	int node, begin, end, depth;
+};
+
+/* Finds a binned SAH split of idx[begin, end). Returns false if the range
+ * should become a leaf, otherwise partitions it and sets mid.
+ */
+static bool split_range(build_ctx &ctx, int begin, int end, aabb &box, int &mid)
+{
+	aabb cbox;
+	box.reset();
+	cbox.reset();
+	for (int i = begin; i < end; i++) {
+		int p = ctx.idx[i];
+		box.grow(&ctx.bounds[6*p], &ctx.bounds[6*p+3]);
+		cbox.grow(&ctx.centroids[3*p], &ctx.centroids[3*p]);
+	}
+	int n = end - begin;
+	if (n <= 1)
+		return false;
+
+	float best_cost = 1e30f;
+	int best_axis = -1, best_bin = 0;
+	float parent_area = box.area();
+	for (int axis = 0; axis < 3; axis++) {
+		float extent = cbox.hi[axis] - cbox.lo[axis];
+		if (extent <= 0.0f)
+			continue;
+		float scale = SAH_BINS / extent * 0.99999f;
+
+		int count[SAH_BINS] = { 0 };
+		aabb bins[SAH_BINS];
+		for (int b = 0; b < SAH_BINS; b++)
+			bins[b].reset();
+		for (int i = begin; i < end; i++) {
+			int p = ctx.idx[i];
+			int b = (int) ((ctx.centroids[3*p+axis] - cbox.lo[axis]) * scale);
+			b = min(max(b, 0), SAH_BINS - 1);
+			count[b]++;
+			bins[b].grow(&ctx.bounds[6*p], &ctx.bounds[6*p+3]);
+		}
+
+		// right-to-left sweep first, then evaluate splits left-to-right
+		float right_area[SAH_BINS];
+		int right_count[SAH_BINS];
+		aabb acc;
+		acc.reset();
+		int sum = 0;
+		for (int b = SAH_BINS - 1; b > 0; b--) {
+			acc.grow(bins[b]);
+			sum += count[b];
+			right_area[b] = acc.area();
+			right_count[b] = sum;
+		}
+		acc.reset();
+		sum = 0;
+		for (int b = 0; b < SAH_BINS - 1; b++) {
+			acc.grow(bins[b]);
+			sum += count[b];
+			if (sum == 0 || right_count[b+1] == 0)
+				continue;
+			float cost = TRAVERSAL_COST +
+				(sum * acc.area() + right_count[b+1] * right_area[b+1]) / parent_area;
+			if (cost < best_cost) {
+				best_cost = cost;
+				best_axis = axis;
+				best_bin = b;
+			}
+		}
+	}
+
+	if (best_axis < 0) {
+		// all centroids coincide; split arbitrarily if the leaf would be too big
+		if (n <= MAX_LEAF)
+			return false;
+		mid = begin + n / 2;
+		return true;
+	}
+	if (best_cost >= (float) n && n <= MAX_LEAF)
+		return false;
+
+	float lo = cbox.lo[best_axis];
+	float scale = SAH_BINS / (cbox.hi[best_axis] - lo) * 0.99999f;
+	int *first = &ctx.idx[0] + begin, *last = &ctx.idx[0] + end;
+	int *m = std::partition(first, last, [&](int p) {
+		int b = (int) ((ctx.centroids[3*p+best_axis] - lo) * scale);
+		return min(max(b, 0), SAH_BINS - 1) <= best_bin;
+	});
+	mid = (int) (m - &ctx.idx[0]);
+	if (mid == begin || mid == end)
+		mid = begin + n / 2;
+	return true;
+}
+
+/* Builds the subtree of node over idx[begin, end). Children are allocated
+ * in pairs after their parent, which refit relies on. Ranges reaching
+ * job_depth are queued in jobs instead of being built, and those reaching
+ * BVH_MAX_DEPTH become leaves however many triangles they hold.
+ */
+static void build_node(build_ctx &ctx, vector<bvh_node> &out, int node, int begin, int end,
+					   int depth, int job_depth, vector<build_job> *jobs)
+{
+	if (jobs && depth == job_depth) {
+		build_job j = { node, begin, end, depth };
+		jobs->push_back(j);
+		return;
+	}
+
+	aabb box;
+	int mid;
+	bool inner = split_range(ctx, begin, end, box, mid) && depth < BVH_MAX_DEPTH;
+	for (int i = 0; i < 3; i++) {
+		out[node].lo[i] = box.lo[i];
+		out[node].hi[i] = box.hi[i];
+	}
+	if (!inner) {
+		out[node].index = begin;
+		out[node].count = end - begin;
+		return;
+	}
+
+	int left = (int) out.size();
+	out.resize(left + 2);
+	out[node].index = left;
+	out[node].count = 0;
+	build_node(ctx, out, left, begin, mid, depth + 1, job_depth, jobs);
+	build_node(ctx, out, left + 1, mid, end, depth + 1, job_depth, jobs);
+}
+
+void bvh::build(const vector<int> &tris, const vector<float> &verts) {
+	const int n = (int) tris.size() / 3;
+	nodes.clear();
+	prims.resize(n);
+	if (n == 0) {
+		tri.clear();
+		return;
+	}
+
+	build_ctx ctx(prims);
+	ctx.bounds.resize(6 * n);
+	ctx.centroids.resize(3 * n);
+	parallel_for(n, 4096, [&](size_t b, size_t e) {
+		for (size_t f = b; f < e; f++) {
+			prims[f] = (int) f;
+			float *bl = &ctx.bounds[6*f], *bh = bl + 3;
+			for (int c = 0; c < 3; c++) {
+				float a = verts[3*tris[3*f]+c], b = verts[3*tris[3*f+1]+c], d = verts[3*tris[3*f+2]+c];
+				bl[c] = min(a, min(b, d));
+				bh[c] = max(a, max(b, d));
+				ctx.centroids[3*f+c] = 0.5f * (bl[c] + bh[c]);
+			}
+		}
+	});
+
+	// split the top of the tree serially, then build the subtrees in parallel
+	int job_depth = 0;
+	while ((1u << job_depth) < 4 * parallel_workers() && job_depth < 10)
+		job_depth++;
+	if (n < 65536)
+		job_depth = -1;
+
+	vector<build_job> jobs;
+	nodes.reserve(2 * (n / 2 + 1));
+	nodes.resize(1);
+	build_node(ctx, nodes, 0, 0, n, 0, job_depth, job_depth >= 0 ? &jobs : NULL);
+
+	vector< vector<bvh_node> > subtrees(jobs.size());
+	parallel_for(jobs.size(), 1, [&](size_t b, size_t e) {
+		for (size_t j = b; j < e; j++) {
+			subtrees[j].reserve(2 * ((jobs[j].end - jobs[j].begin) / 2 + 1));
+			subtrees[j].resize(1);
+			build_node(ctx, subtrees[j], 0, jobs[j].begin, jobs[j].end, jobs[j].depth, -1, NULL);
+		}
+	});
+
+	// splice each subtree in; its root replaces the placeholder node
+	for (size_t j = 0; j < jobs.size(); j++) {
+		vector<bvh_node> &sub = subtrees[j];
+		int offset = (int) nodes.size() - 1;
+		for (size_t i = 0; i < sub.size(); i++)
+			if (sub[i].count == 0)
+				sub[i].index += offset;
+		nodes[jobs[j].node] = sub[0];
+		nodes.insert(nodes.end(), sub.begin() + 1, sub.end());
+		vector<bvh_node>().swap(sub);
+	}
+
+	store_triangles(tris, verts);
+}
+
+void bvh::store_triangles(const vector<int> &tris, const vector<float> &verts) {
+	const int n = (int) prims.size();
+	tri.resize(9 * n);
+	parallel_for(n, 4096, [&](size_t b, size_t e) {
+		for (size_t i = b; i < e; i++) {
+			int f = prims[i];
+			const float *p0 = &verts[3*tris[3*f]], *p1 = &verts[3*tris[3*f+1]], *p2 = &verts[3*tris[3*f+2]];
+			float *d = &tri[9*i];
+			for (int c = 0; c < 3; c++) {
+				d[c] = p0[c];
+				d[3+c] = p1[c] - p0[c];
+				d[6+c] = p2[c] - p0[c];
+			}
+		}
+	});
+}
+
+void bvh::refit(const vector<int> &tris, const vector<float> &verts) {
+	if (nodes.empty())
+		return;
+	store_triangles(tris, verts);
+
+	// children always follow their parent, so one backwards pass suffices
+	for (int i = (int) nodes.size() - 1; i >= 0; i--) {
+		bvh_node &n = nodes[i];
+		aabb box;
+		box.reset();
+		if (n.count > 0) {
+			for (int p = n.index; p < n.index + n.count; p++) {
+				const float *d = &tri[9*p];
+				float v1[3] = { d[0]+d[3], d[1]+d[4], d[2]+d[5] };
+				float v2[3] = { d[0]+d[6], d[1]+d[7], d[2]+d[8] };
+				box.grow(d, d);
+				box.grow(v1, v1);
+				box.grow(v2, v2);
+			}
+		} else {
+			box.grow(nodes[n.index].lo, nodes[n.index].hi);
+			box.grow(nodes[n.index+1].lo, nodes[n.index+1].hi);
+		}
+		for (int c = 0; c < 3; c++) {
+			n.lo[c] = box.lo[c];
+			n.hi[c] = box.hi[c];
+		}
+	}
+}
+
+bool intersect_triangle(const ray &r, const float *tri, float &t, float &u, float &v) {
+	const float *v0 = tri, *e1 = tri + 3, *e2 = tri + 6;
+	float p[3] = { r.dir[1]*e2[2] - r.dir[2]*e2[1],
+				   r.dir[2]*e2[0] - r.dir[0]*e2[2],
+				   r.dir[0]*e2[1] - r.dir[1]*e2[0] };
+	float det = e1[0]*p[0] + e1[1]*p[1] + e1[2]*p[2];
+	if (fabsf(det) < 1e-12f)
+		return false;
+	float inv_det = 1.0f / det;
+	float s[3] = { r.org[0] - v0[0], r.org[1] - v0[1], r.org[2] - v0[2] };
+	u = (s[0]*p[0] + s[1]*p[1] + s[2]*p[2]) * inv_det;
+	if (u < 0.0f || u > 1.0f)
+		return false;
+	float q[3] = { s[1]*e1[2] - s[2]*e1[1], s[2]*e1[0] - s[0]*e1[2], s[0]*e1[1] - s[1]*e1[0] };
+	v = (r.dir[0]*q[0] + r.dir[1]*q[1] + r.dir[2]*q[2]) * inv_det;
+	if (v < 0.0f || u + v > 1.0f)
+		return false;
+	t = (e2[0]*q[0] + e2[1]*q[1] + e2[2]*q[2]) * inv_det;
+	return t >= r.tmin && t <= r.tmax;
+}
+
+// Entry distance of the ray into the node's box, or a huge value on a miss
+static inline float box_entry(const bvh_node &n, const float *org, const float *inv,
+							  float tmin, float tmax)
+{
+	float tx1 = (n.lo[0] - org[0]) * inv[0], tx2 = (n.hi[0] - org[0]) * inv[0];
+	float ty1 = (n.lo[1] - org[1]) * inv[1], ty2 = (n.hi[1] - org[1]) * inv[1];
+	float tz1 = (n.lo[2] - org[2]) * inv[2], tz2 = (n.hi[2] - org[2]) * inv[2];
+	float t0 = max(max(min(tx1, tx2), min(ty1, ty2)), max(min(tz1, tz2), tmin));
+	float t1 = min(min(max(tx1, tx2), max(ty1, ty2)), min(max(tz1, tz2), tmax));
+	return t0 <= t1 ? t0 : 1e30f;
+}
+
+static inline void inverse_dir(const ray &r, float *inv) {
+	for (int i = 0; i < 3; i++) {
+		float d = r.dir[i];
+		if (fabsf(d) < 1e-20f)
+			d = d < 0.0f ? -1e-20f : 1e-20f;
+		inv[i] = 1.0f / d;
+	}
+}
+
+/* Shared traversal: visits the nearer child first and returns early on the
+ * first hit when any_hit is set.
+ */
+template <bool any_hit>
+static bool traverse(const vector<bvh_node> &nodes, const vector<int> &prims,
+					 const vector<float> &tri, const ray &r0, ray_hit &hit)
+{
+	hit.tri = -1;
+	if (nodes.empty())
+		return false;
+
+	ray r = r0;
+	float inv[3];
+	inverse_dir(r, inv);
+	if (box_entry(nodes[0], r.org, inv, r.tmin, r.tmax) >= 1e30f)
+		return false;
+
+	int stack[BVH_MAX_DEPTH];
+	float stack_t[BVH_MAX_DEPTH];
+	int sp = 0;
+	int node = 0;
+	for (;;) {
+		const bvh_node &n = nodes[node];
+		if (n.count > 0) {
+			for (int i = n.index; i < n.index + n.count; i++) {
+				float t, u, v;
+				if (intersect_triangle(r, &tri[9*i], t, u, v)) {
+					hit.tri = prims[i];
+					hit.t = t;
+					hit.u = u;
+					hit.v = v;
+					if (any_hit)
+						return true;
+					r.tmax = t;
+				}
+			}
+		} else {
+			int a = n.index, b = n.index + 1;
+			float ta = box_entry(nodes[a], r.org, inv, r.tmin, r.tmax);
+			float tb = box_entry(nodes[b], r.org, inv, r.tmin, r.tmax);
+			if (ta > tb) {
+				swap(a, b);
+				swap(ta, tb);
+			}
+			if (ta < 1e30f) {
+				if (tb < 1e30f) {
+					stack[sp] = b;
+					stack_t[sp++] = tb;
+				}
+				node = a;
+				continue;
+			}
+		}
+		// pop the next node that can still contain a closer hit
+		for (;;) {
+			if (sp == 0)
+				return hit.tri >= 0;
+			--sp;
+			if (stack_t[sp] <= r.tmax)
+				break;
+		}
+		node = stack[sp];
+	}
+}
+
+bool bvh::intersect(const ray &r, ray_hit &hit) const {
+	return traverse<false>(nodes, prims, tri, r, hit);
+}
+
+bool bvh::occluded(const ray &r) const {
+	ray_hit hit;
+	return traverse<true>(nodes, prims, tri, r, hit);
+}
+
+void bvh_benchmark(const vector<int> &tris, const vector<float> &verts, int n_rays) {
+	typedef std::chrono::steady_clock clock;
+
+	bvh tree;
+	clock::time_point start = clock::now();
+	tree.build(tris, verts);
+	double build_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+	cout << "BVH: " << tree.num_tris() << " tris, " << tree.num_nodes() << " nodes, "
+		 << tree.memory_bytes() / 1024 << " KB, built in " << build_ms << " ms" << endl;
+	if (tree.empty())
+		return;
+
+	// rays from a sphere around the model aimed at random points inside it
+	const bvh_node &root = tree.root();
+	float center[3], radius = 0.0f;
+	for (int c = 0; c < 3; c++) {
+		center[c] = 0.5f * (root.lo[c] + root.hi[c]);
+		radius = max(radius, root.hi[c] - root.lo[c]);
+	}
+	uint32_t seed = 12345;
+	vector<ray> rays(n_rays);
+	for (int i = 0; i < n_rays; i++) {
+		float p[6];
+		for (int k = 0; k < 6; k++) {
+			seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+			p[k] = (seed & 0xffffff) / 16777216.0f - 0.5f;
+		}
+		float len = sqrtf(p[0]*p[0] + p[1]*p[1] + p[2]*p[2]) + 1e-6f;
+		ray &r = rays[i];
+		for (int c = 0; c < 3; c++) {
+			r.org[c] = center[c] + 2.0f * radius * p[c] / len;
+			r.dir[c] = center[c] + p[3+c] * (root.hi[c] - root.lo[c]) - r.org[c];
+		}
+		r.tmin = 0.0f;
+		r.tmax = 1e30f;
+	}
+
+	int hits = 0;
+	start = clock::now();
+	for (int i = 0; i < n_rays; i++) {
+		ray_hit h;
+		if (tree.intersect(rays[i], h))
+			hits++;
+	}
+	double closest_s = std::chrono::duration<double>(clock::now() - start).count();
+
+	int blocked = 0;
+	start = clock::now();
+	for (int i = 0; i < n_rays; i++)
+		if (tree.occluded(rays[i]))
+			blocked++;
+	double any_s = std::chrono::duration<double>(clock::now() - start).count();
+
+	cout << "BVH: closest hit " << n_rays / closest_s / 1e6 << " Mrays/s (" << hits << " hits), "
+		 << "any hit " << n_rays / any_s / 1e6 << " Mrays/s (" << blocked << " hits), 1 thread" << endl;
+}
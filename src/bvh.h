@@ -0,0 +1,92 @@
+//
+//  bvh.h
+//  pipeline
+//
+//  Bounding volume hierarchy over the triangles of a mesh read by
+//  read_wavefront_file, built with binned SAH and stored as a flat array.
+//
+
+#ifndef bvh_h
+#define bvh_h
+
+#include <vector>
+using namespace std;
+
+// Leaves are never deeper than this, so traversal stacks of this size hold
+// every pending node
+const int BVH_MAX_DEPTH = 64;
+
+/* 32 byte node. Inner nodes have count == 0 and their two children at
+ * index and index + 1; leaves reference count triangles starting at index
+ * in the leaf-ordered triangle arrays.
+ */
+struct bvh_node {
+	float lo[3];
+	int index;
+	float hi[3];
+	int count;
+};
+
+struct ray {
+	float org[3];
+	float dir[3];
+	float tmin, tmax;
+};
+
+struct ray_hit {
+	int tri;        // face index into the tris the tree was built from, -1 if missed
+	float t;
+	float u, v;     // barycentrics of the hit relative to the face's 2nd and 3rd vertex
+};
+
+class bvh {
+public:
+	bvh() {}
+
+	// Builds the tree; top-level subtrees are built in parallel.
+	void build(const vector<int> &tris, const vector<float> &verts);
+
+	// Closest hit in [r.tmin, r.tmax]
+	bool intersect(const ray &r, ray_hit &hit) const;
+
+	// Any hit in [r.tmin, r.tmax]
+	bool occluded(const ray &r) const;
+
+	/* Updates the bounds after the vertices moved; tris must be the vector
+	 * the tree was built with. The topology of the tree is kept, so quality
+	 * degrades with large deformations and a rebuild may be preferable.
+	 */
+	void refit(const vector<int> &tris, const vector<float> &verts);
+
+	bool empty() const { return nodes.empty(); }
+	int num_nodes() const { return (int) nodes.size(); }
+	int num_tris() const { return (int) prims.size(); }
+	const bvh_node &root() const { return nodes[0]; }
+	const vector<bvh_node> &node_array() const { return nodes; }
+
+	// Triangle i in leaf order: face index, first vertex and two edges
+	int prim(int i) const { return prims[i]; }
+	const float *tri_data(int i) const { return &tri[9*i]; }
+
+	size_t memory_bytes() const {
+		return nodes.capacity() * sizeof(bvh_node) + prims.capacity() * sizeof(int)
+			 + tri.capacity() * sizeof(float);
+	}
+
+private:
+	vector<bvh_node> nodes;
+	vector<int> prims;
+	vector<float> tri;
+
+	void store_triangles(const vector<int> &tris, const vector<float> &verts);
+};
+
+/* Intersects a ray with the precomputed triangle (v0, e1, e2), returns
+ * true and fills t/u/v if it hits closer than tmax.
+ */
+bool intersect_triangle(const ray &r, const float *tri, float &t, float &u, float &v);
+
+// Prints build time, tree size and closest/any hit throughput in rays/s
+void bvh_benchmark(const vector<int> &tris, const vector<float> &verts, int n_rays);
+
+#endif /* bvh_h */
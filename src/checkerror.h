@@ -9,13 +9,14 @@
 
 #include <stdio.h>
 //#include <GL/gl.h>
+#include "gl_debug.h"
 
 //----------------------------------------------------------------------------
 
 static const char*
 ErrorString( GLenum error )
 {
-    const char*  msg;
+    const char*  msg = "unknown GL error";
     switch( error ) {
 #define Case( Token )  case Token: msg = #Token; break;
 	Case( GL_NO_ERROR );
@@ -33,20 +34,31 @@ ErrorString( GLenum error )
 
 //----------------------------------------------------------------------------
 
+//  With the debug layer up (see gl_debug.h) errors arrive on their own and
+//  this only marks the place; otherwise glGetError is polled, which waits
+//  for the GPU, and only errors are printed.
+
 static void
 _CheckError( const char* file, int line )
 {
-    GLenum  error = glGetError();
+    if (gl_debug_active()) {
+	gl_debug_mark( file, line );
+	return;
+    }
 
-    do {
+    GLenum  error;
+    while ((error = glGetError()) != GL_NO_ERROR) {
 	fprintf( stderr, "[%s:%d] %s\n", file, line, ErrorString(error) );
-    } while ((error = glGetError()) != GL_NO_ERROR );
-	
+    }
 }
 
 //----------------------------------------------------------------------------
 
+#ifdef NDEBUG
+#define CheckError()  ((void) 0)
+#else
 #define CheckError()  _CheckError( __FILE__, __LINE__ )
+#endif
 
 //----------------------------------------------------------------------------
 
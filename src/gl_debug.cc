@@ -0,0 +1,139 @@
+//
+//  gl_debug.cc
+//  pipeline
+//
+
+#include "amath.h"
+#include "gl_debug.h"
+
+#ifndef NDEBUG
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+using namespace std;
+
+enum { DEBUG_ERROR, DEBUG_UNDEFINED, DEBUG_DEPRECATED, DEBUG_PORTABILITY, DEBUG_PERFORMANCE,
+	DEBUG_OTHER, DEBUG_TYPES };
+
+static const char *type_names[DEBUG_TYPES] = {
+	"error", "undefined behavior", "deprecated", "portability", "performance", "other"
+};
+
+enum { SEVERITY_HIGH, SEVERITY_MEDIUM, SEVERITY_LOW, SEVERITY_NOTIFICATION, SEVERITIES };
+
+static const char *severity_names[SEVERITIES] = { "high", "medium", "low", "notification" };
+
+static bool active = false;
+static atomic<const char *> mark_file(NULL);
+static atomic<int> mark_line(0);
+
+// the callback may come from a driver thread
+static mutex messages_lock;
+static unordered_map<uint64_t, int> seen;       // times each message was received
+static long received[DEBUG_TYPES][SEVERITIES];
+static long suppressed = 0;
+
+#ifdef GLEW_KHR_debug
+
+static int debug_type(GLenum type) {
+	switch (type) {
+	case GL_DEBUG_TYPE_ERROR:               return DEBUG_ERROR;
+	case GL_DEBUG_TYPE_UNDEFINED_BEHAVIOR:  return DEBUG_UNDEFINED;
+	case GL_DEBUG_TYPE_DEPRECATED_BEHAVIOR: return DEBUG_DEPRECATED;
+	case GL_DEBUG_TYPE_PORTABILITY:         return DEBUG_PORTABILITY;
+	case GL_DEBUG_TYPE_PERFORMANCE:         return DEBUG_PERFORMANCE;
+	default:                                return DEBUG_OTHER;
+	}
+}
+
+static int debug_severity(GLenum severity) {
+	switch (severity) {
+	case GL_DEBUG_SEVERITY_HIGH:   return SEVERITY_HIGH;
+	case GL_DEBUG_SEVERITY_MEDIUM: return SEVERITY_MEDIUM;
+	case GL_DEBUG_SEVERITY_LOW:    return SEVERITY_LOW;
+	default:                       return SEVERITY_NOTIFICATION;
+	}
+}
+
+static const char *source_name(GLenum source) {
+	switch (source) {
+	case GL_DEBUG_SOURCE_API:             return "api";
+	case GL_DEBUG_SOURCE_WINDOW_SYSTEM:   return "window system";
+	case GL_DEBUG_SOURCE_SHADER_COMPILER: return "shader compiler";
+	case GL_DEBUG_SOURCE_THIRD_PARTY:     return "third party";
+	case GL_DEBUG_SOURCE_APPLICATION:     return "application";
+	default:                              return "other";
+	}
+}
+
+static void APIENTRY debug_callback(GLenum source, GLenum type, GLuint id, GLenum severity,
+									GLsizei, const GLchar *message, const void *) {
+	int t = debug_type(type), s = debug_severity(severity);
+	uint64_t key = ((uint64_t) source << 48) ^ ((uint64_t) type << 32) ^ id;
+	int count;
+	{
+		lock_guard<mutex> guard(messages_lock);
+		received[t][s]++;
+		count = ++seen[key];
+		if (count > GL_DEBUG_REPEATS)
+			suppressed++;
+	}
+	if (count > GL_DEBUG_REPEATS)
+		return;
+
+	const char *file = mark_file.load(memory_order_relaxed);
+	cerr << "GL " << type_names[t] << " (" << severity_names[s] << ", " << source_name(source)
+		 << ", id " << id << "): " << message;
+	if (file)
+		cerr << " [after " << file << ":" << mark_line.load(memory_order_relaxed) << "]";
+	if (count == GL_DEBUG_REPEATS)
+		cerr << " (repeats not shown)";
+	cerr << endl;
+}
+
+#endif
+
+bool gl_debug_init() {
+#ifdef GLEW_KHR_debug
+	if (!GLEW_KHR_debug && !GLEW_VERSION_4_3)
+		return false;
+	glEnable(GL_DEBUG_OUTPUT);
+	glDebugMessageCallback((GLDEBUGPROC) debug_callback, NULL);
+	glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, NULL, GL_TRUE);
+	glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_NOTIFICATION, 0, NULL, GL_FALSE);
+	active = true;
+#endif
+	return active;
+}
+
+bool gl_debug_active() {
+	return active;
+}
+
+void gl_debug_mark(const char *file, int line) {
+	mark_file.store(file, memory_order_relaxed);
+	mark_line.store(line, memory_order_relaxed);
+}
+
+void gl_debug_print_report(ostream &os) {
+	lock_guard<mutex> guard(messages_lock);
+	if (!active) {
+		os << "GL debug output: not available" << endl;
+		return;
+	}
+	long total = 0;
+	for (int t = 0; t < DEBUG_TYPES; t++)
+		for (int s = 0; s < SEVERITIES; s++)
+			total += received[t][s];
+	os << "GL debug output: " << total << " messages, " << seen.size() << " distinct, "
+	   << suppressed << " not shown" << endl;
+	for (int t = 0; t < DEBUG_TYPES; t++)
+		for (int s = 0; s < SEVERITIES; s++)
+			if (received[t][s])
+				os << "  " << type_names[t] << ", " << severity_names[s] << ": " << received[t][s] << endl;
+}
+
+#endif
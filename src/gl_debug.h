@@ -0,0 +1,47 @@
+//
+//  gl_debug.h
+//  pipeline
+//
+//  GL errors and warnings delivered by the driver through KHR_debug as they
+//  happen, instead of polled with glGetError, which waits for the GPU to
+//  catch up. Everything here compiles to nothing when NDEBUG is defined.
+//
+
+#ifndef gl_debug_h
+#define gl_debug_h
+
+// no GL headers here: checkerror.h, which amath.h includes, includes this
+#include <iostream>
+using namespace std;
+
+// Each distinct message is printed this many times and then only counted
+const int GL_DEBUG_REPEATS = 3;
+
+#ifndef NDEBUG
+
+/* Installs the message callback if the context has KHR_debug (or is GL
+ * 4.3); returns false otherwise, and CheckError keeps polling glGetError.
+ * Output is left asynchronous, so reporting costs no stall; the price is
+ * that a message cannot name the call that caused it, only the last
+ * CheckError passed before it arrived. Notifications are not asked for.
+ */
+bool gl_debug_init();
+
+bool gl_debug_active();
+
+// Remembers file:line for the messages that follow; cheap, no GL calls
+void gl_debug_mark(const char *file, int line);
+
+// Messages received by type and severity, and how many were not printed
+void gl_debug_print_report(ostream &os);
+
+#else
+
+inline bool gl_debug_init() { return false; }
+inline bool gl_debug_active() { return false; }
+inline void gl_debug_mark(const char *, int) {}
+inline void gl_debug_print_report(ostream &) {}
+
+#endif
+
+#endif /* gl_debug_h */
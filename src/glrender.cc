@@ -1,11 +1,9 @@
 // Very simple display triangle program, that allows you to rotate the
 // triangle around the Y axis.
 //
-// This program does NOT use a vertex shader to define the vertex colors.
-// Instead, it computes the colors in the display callback (using Blinn/Phong)
-// and passes those color values, one per vertex, to the vertex shader, which
-// passes them directly to the fragment shader. This achieves what is called
-// "gouraud shading".
+// Lighting is Blinn/Phong in the shaders: per pixel by default, or per
+// vertex and interpolated ("gouraud shading") when 'v' asks for it or, in
+// the automatic mode, when triangles are only a few pixels on screen.
 
 #ifdef __APPLE__
 #include <OpenGL/OpenGL.h>
@@ -16,16 +14,46 @@
 #include <GL/freeglut_ext.h>
 #endif
 
+#include <string.h>
+#include <chrono>
+#include <fstream>
 #include <vector>
 #include "amath.h"
 #include "parser.h"
+#include "simplify.h"
+#include "meshlet.h"
+#include "bvh.h"
+#include "pick.h"
+#include "normals.h"
+#include "raycast.h"
+#include "occlusion.h"
+#include "parallel.h"
+#include "loader.h"
+#include "tiles.h"
+#include "hiz.h"
+#include "instances.h"
+#include "uniform_blocks.h"
+#include "buffer_pool.h"
+#include "arena.h"
+#include "mesh_codec.h"
+#include "mesh_formats.h"
+#include "shader_manager.h"
+#include "render_queue.h"
+#include "gpu_cull.h"
+#include "light_clusters.h"
+#include "overdraw.h"
 
 using namespace std;
 
 typedef amath::vec4  point4;
 typedef amath::vec4  color4;
 
-GLuint buffers[2];
+// GPU memory for all geometry: meshes take ranges of a few large buffers
+const size_t VERTEX_PAGE_BYTES = 64 << 20;
+const size_t INDEX_PAGE_BYTES = 16 << 20;
+buffer_pool vertex_pool(GL_ARRAY_BUFFER, VERTEX_PAGE_BYTES);
+buffer_pool index_pool(GL_ELEMENT_ARRAY_BUFFER, INDEX_PAGE_BYTES);
+buffer_range model_range;   // the model's vertices
 
 // camera position
 point4 eye;
@@ -43,6 +71,10 @@ const float RMIN = 2.0;
 // Y axis constraint
 const float ZENITH = 175.0;
 const float NADIR = 5.0;
+// projection
+const float FOVY = 40.0;
+const float ZNEAR = 1.0;
+const float ZFAR = 50.0;
 
 // Bezier limits
 bool bezier_changed = false; // If vertices changed
@@ -53,11 +85,124 @@ unsigned int bezier_coarseness = 2; // Number of samples per degree
 
 vector<bezier_surf> surfaces;
 
+// OBJ levels of detail, stored one after another in the vertex buffer
+const float LOD_PIXEL_TOLERANCE = 1.0; // largest allowed projected error
+vector<mesh_lod> lods;
+vector<int> lod_first, lod_count;
+vector<float> lod_area;            // mean triangle area per level
+float model_radius = 0.0;
+
+// per-LOD clusters for frustum and normal cone culling ('c' toggles)
+vector< vector<meshlet> > lod_meshlets;
+bool cluster_culling = true;
+bool closed_mesh = false;  // cone culling is only safe without open borders
+// clusters hidden behind a coarse level rasterized on the CPU ('o' toggles)
+hiz_buffer occlusion_depth;
+bool occlusion_culling = true;
+vector<GLint> draw_firsts;
+vector<GLsizei> draw_counts;
+
+// picking acceleration: BVH over the finest OBJ level, boxes of the patches
+bvh pick_tree;
+vector<float> surface_bounds;
+
 int NumVertices;
-point4 *vertices = NULL;
-vec4 *norms = NULL;
+owned_array<point4> vertices;
+owned_array<vec4> norms;
+vector<GLubyte> occlusion;  // baked ambient factor per drawn vertex, after the normals
+
+// first vertex of each patch, and per-thread scratch for tessellation kept
+// between re-tessellations: callers outside the pool get their own too
+vector<int> patch_first;
+thread_local arena tessellation_scratch;
+
+// the model loads in the background; until it is done the finest level is
+// drawn as far as it has arrived
+model_loader loader;
+const char *model_name = "";
+bool model_ready = false;
+int preview_vertices = 0, preview_total = 0;
+string load_stage;
+float load_progress = 0.0;
+const int LOAD_POLL_MS = 16;
+const int LOAD_UPLOADS_PER_POLL = 4;  // keeps the window responsive while chunks arrive
+
+// out-of-core mode (-tiles): the tiles of a -build-tiles file are paged in
+// and out of per-tile buffers as the view moves, under a memory budget
+bool tiled_mode = false;
+tile_file tiles;
+tile_pager *pager = NULL;
+vector<buffer_range> tile_verts, tile_indices;   // empty while the tile is not resident
+vector<tile_request> tile_wanted, tile_loads, tile_evicts;
+float tiles_center[3], tiles_scale = 1.0;  // fits the model in the default view
+int tiles_loaded = 0, tiles_evicted = 0;
+const size_t TILE_DEFAULT_BUDGET_MB = 256;
+const int TILE_LOADS_PER_FRAME = 8;  // spreads uploads over frames when the view jumps
+
+// fixed for every shader variant, so one vertex layout serves them all;
+// instance rows take 3 to 5 and the instance color 6
+const GLuint vertex_loc = 0, normal_loc = 1, occlusion_loc = 2, instance_loc = 3;
+
+// instance mode (-instances n): copies of the model in a grid, drawn with
+// one instanced draw ('i' switches to one draw and block upload per copy)
+const float INSTANCE_GRID_EXTENT = 3.0;
+int instance_count = 0;
+vector<model_instance> instances;
+buffer_range instance_range;
+bool instanced_submission = true;
 
-GLint view_pos, ctm, ptm;
+// scene mode (several files): every model loads on its own thread and is
+// placed in a grid with one of a few materials (-instances n places n
+// objects, taking the models in turn); the objects are drawn through a
+// render queue sorted by program, layout and material ('m' switches between
+// multi-draw indirect and a draw per object) or culled on the GPU ('g')
+struct scene_material {
+	float diffuse[4];
+	bool shiny;    // drawn with the specular variant
+};
+const scene_material SCENE_MATERIALS[] = {
+	{ { 1.0, 0.8, 0.0, 1.0 }, true },
+	{ { 0.3, 0.6, 1.0, 1.0 }, false },
+	{ { 0.9, 0.3, 0.3, 1.0 }, true },
+	{ { 0.4, 0.9, 0.4, 1.0 }, false }
+};
+const int SCENE_MATERIAL_COUNT = sizeof(SCENE_MATERIALS) / sizeof(SCENE_MATERIALS[0]);
+const float SCENE_CELL = 2.0;   // grid spacing, each model scaled to fit its cell
+
+const float SCENE_MAX_EXTENT = 20.0;   // cells shrink so large grids stay in view
+
+struct scene_model {
+	string name;
+	model_loader *loader;      // while loading
+	model_data *model;         // once loaded, until the scene is uploaded
+	vector<mesh_lod> lods;     // errors only; the geometry is on the GPU
+	vector<int> lod_first, lod_count;
+	vector<float> lod_area;    // mean triangle area per level
+	float radius;
+	int layout;                // -1 if it failed to load
+	int base;                  // first vertex within the layout
+};
+struct scene_object {
+	int model;
+	int material;
+	int instance;              // row of instances holding its placement
+};
+vector<scene_model> scene_models;
+vector<scene_object> scene_objects;
+vector<buffer_range> scene_layouts;      // positions, normals and occlusion of a few models each
+vector<int> scene_layout_vertices;
+render_queue scene_queue;
+bool multi_draw = true;
+
+// GPU culling ('g'): bounds and levels in storage buffers, tested by a
+// compute shader that writes the indirect draws of each program and layout
+// ('k' checks its draws against the CPU reference)
+gpu_culler scene_culler;
+vector<cull_object> cull_objects;
+vector<cull_lod> cull_lods;
+bool gpu_culling = false;
+bool check_gpu_culling = false;
+float home_r = 5.0;   // the distance 'r' resets to
 
 vec4 light_position = vec4(100., 100., 100., 1.0);
 vec4 light_ambient  = vec4(0.2, 0.2, 0.2, 1.0);
@@ -67,123 +212,1058 @@ vec4 light_specular = vec4(1.0, 1.0, 1.0, 1.0);
 vec4 material_ambient  = vec4(1.0, 0.0, 1.0, 1.0);
 vec4 material_diffuse  = vec4(1.0, 0.8, 0.0, 1.0);
 vec4 material_specular = vec4(1.0, 0.8, 0.0, 1.0);
-// material_shin = 100.0
-GLint light_pos, light_spec, light_ambi, light_diff, material_ambi, material_diff, material_spec, material_shin;
+const float material_shininess = 100.0;
+
+// camera, light and material reach the shaders through uniform buffers
+// that are written only when their contents change
+uniform_block<camera_uniforms> camera_block;
+uniform_block<light_uniforms> light_block;
+uniform_block<material_uniforms> material_block;
 
+// many point lights (-lights n) scattered around the model, shaded with
+// clustered forward lighting: the lights that reach each cluster of the
+// view are listed every frame and a fragment loops over its cluster's only
+// ('l' cycles clustered, every light per fragment, and the one light)
+enum lighting_mode { ONE_LIGHT, CLUSTERED_LIGHTS, ALL_LIGHTS };
+const float LIGHT_SPREAD = 1.5;   // lights fill this many model radii
+const float LIGHT_REACH = 0.3;    // and reach this many
+const float LIGHT_INTENSITY = 0.3;    // several overlap anywhere
+const GLuint LIGHT_TEXTURE_UNIT = 0;  // lights, then cluster ranges and indices
+int light_count = 0;
+lighting_mode many_lights = CLUSTERED_LIGHTS;
+vector<point_light> point_lights;
+light_clusters clusters;
+GLuint light_buffers[3], light_textures[3];
+uniform_block<cluster_uniforms> cluster_block;
+char light_report[160] = "";
+
+// 'p' lays down depth with a position-only pass first and then shades
+// with GL_EQUAL, so each covered pixel is shaded once; 'f' draws clusters,
+// copies and scene objects front to back; 'd' counts the fragments shaded
+// per covered pixel, to see what either buys
+bool depth_prepass = false;
+bool front_to_back = false;
+bool measure_overdraw = false;
+overdraw_meter overdraw;
+char overdraw_report[96] = "";
+
+// shader variants are built from one pair of files; binaries are kept
+// between launches in shader_cache
+shader_manager shaders("shader_cache");
+bool per_vertex_lighting = false;   // as drawn
+bool specular = true;               // s toggles
 GLuint program;
 
-void loadOBJ(const char *file_name)
+// 'v' cycles per-pixel, per-vertex and automatic shading. Lit per vertex
+// and interpolated (Gouraud), a triangle smaller than a few pixels looks
+// the same for far less work, so the automatic mode switches to it, per
+// model or scene object, once the drawn level's mean triangle covers
+// fewer than GOURAUD_TRIANGLE_PIXELS. Point lights are shaded per pixel
+// only, so while they are on everything stays per pixel.
+enum shading_mode { PER_PIXEL_SHADING, PER_VERTEX_SHADING, AUTO_SHADING };
+const float GOURAUD_TRIANGLE_PIXELS = 4.0;
+shading_mode shading = PER_PIXEL_SHADING;
+char shading_report[64] = "";
+
+// Point lights are shaded per fragment only, so they keep the variant per pixel
+shader_variant shaderVariant(bool per_vertex, bool with_specular, bool instanced, lighting_mode lights) {
+	shader_variant v("vshader_blinnphong.glsl", "fshader_passthrough.glsl");
+	if (lights != ONE_LIGHT)
+		per_vertex = false;
+	if (per_vertex)
+		v.define("PER_VERTEX_LIGHTING");
+	if (!with_specular)
+		v.define("NO_SPECULAR");
+	if (instanced)
+		v.define("INSTANCED");
+	if (lights == CLUSTERED_LIGHTS)
+		v.define("CLUSTERED_LIGHTING");
+	if (lights == ALL_LIGHTS)
+		v.define("ALL_LIGHTS");
+	return v;
+}
+
+shader_variant depthVariant(bool instanced) {
+	shader_variant v("vshader_blinnphong.glsl", "fshader_passthrough.glsl");
+	v.define("DEPTH_ONLY");
+	if (instanced)
+		v.define("INSTANCED");
+	return v;
+}
+
+lighting_mode lightingMode() {
+	return light_count > 0 ? many_lights : ONE_LIGHT;
+}
+
+/* Whether triangles of the given mean area, at scale pixels per unit, are
+ * small enough to light per vertex; they face the camera at half their
+ * area on average. Never with point lights, which would drop out.
+ */
+bool smallTriangles(float area, float scale) {
+	return lightingMode() == ONE_LIGHT && 0.5 * area * scale * scale < GOURAUD_TRIANGLE_PIXELS;
+}
+
+// Once the copies are laid out; the model alone is drawn while it loads
+bool drawingInstanced() {
+	return !instances.empty() && (instanced_submission || !scene_models.empty());
+}
+
+// Switches to the current variant; keeps the last program if it failed
+void useShader() {
+	GLuint p = shaders.program(shaderVariant(per_vertex_lighting, specular, drawingInstanced(), lightingMode()));
+	if (p != 0) {
+		program = p;
+		glUseProgram(program);
+	}
+}
+
+/* Picks per-vertex or per-pixel lighting for triangles of the given mean
+ * area at scale pixels per unit, when that is left to the triangle size.
+ */
+void selectShading(float area, float scale)
 {
-	vector <int> tris;
-	vector <float> verts;
-	read_wavefront_file(file_name, tris, verts);
+	if (shading == AUTO_SHADING && smallTriangles(area, scale) != per_vertex_lighting) {
+		per_vertex_lighting = !per_vertex_lighting;
+		useShader();
+	}
+	snprintf(shading_report, sizeof(shading_report), " | %s%s, %.1f px per triangle",
+			 per_vertex_lighting && lightingMode() == ONE_LIGHT ? "per vertex" : "per pixel",
+			 shading == AUTO_SHADING ? " (auto)" : "",
+			 0.5 * area * scale * scale);
+}
+
+/* Tessellates every patch at bezier_coarseness. Patches are sampled and
+ * triangulated in parallel, each into its own range of vertices/norms.
+ * The sample grids live in each worker's arena and the output arrays are
+ * only reallocated when they grow, so re-tessellating allocates next to
+ * nothing.
+ */
+void loadBezierVertsAndNorms() {
+	vector<int> &first = patch_first;
+	first.assign(surfaces.size() + 1, 0);
+	for (int i = 0; i < surfaces.size(); ++i) {
+		first[i+1] = first[i] + 3 * ((2*surfaces[i].getUSamples(bezier_coarseness) - 2) *
+									 (surfaces[i].getVSamples(bezier_coarseness) - 1)  );
+	}
+	NumVertices = first[surfaces.size()];
 	
-	NumVertices = (int) tris.size();
-	vertices = new point4[NumVertices];
-	norms = new vec4[NumVertices];
+	vertices.resize(NumVertices);
+	norms.resize(NumVertices);
+	occlusion.assign(NumVertices, 255);
 	
-	vec4 *vert_norms = new vec4[verts.size()/3];
+	parallel_for(surfaces.size(), 1, [&](size_t sb, size_t se) {
+		arena &scratch = tessellation_scratch;
+		for (size_t i = sb; i < se; ++i) {
+			int u_sam = surfaces[i].getUSamples(bezier_coarseness);
+			int v_sam = surfaces[i].getVSamples(bezier_coarseness);
+			scratch.reset();
+			point4 *v_verts = scratch.alloc<point4>(u_sam * v_sam);
+			vec4 *v_norms = scratch.alloc<vec4>(u_sam * v_sam);
+			surfaces[i].sample(bezier_coarseness, v_verts, v_norms);
+			
+			// Triangulate
+			int vPos = first[i];
+			for (int v = 0; v < v_sam-1; v++)
+				for (int u = 0; u < u_sam-1; u++) {
+					vec4 tri1_1 = v_verts[v*u_sam + u];
+					vec4 norm1_1 = v_norms[v*u_sam + u];
+					vec4 tri1_2 = v_verts[(v+1)*u_sam + u+1];
+					vec4 norm1_2 = v_norms[(v+1)*u_sam + u+1];
+					vec4 tri1_3 = v_verts[(v+1)*u_sam + u];
+					vec4 norm1_3 = v_norms[(v+1)*u_sam + u];
+					
+					vec4 tri2_1 = tri1_2;
+					vec4 norm2_1 = norm1_2;
+					vec4 tri2_2 = tri1_1;
+					vec4 norm2_2 = norm1_1;
+					vec4 tri2_3 = v_verts[v*u_sam + u+1];
+					vec4 norm2_3 = v_norms[v*u_sam + u+1];
+					
+					vertices[vPos] = tri1_1;
+					vertices[vPos+1] = tri1_2;
+					vertices[vPos+2] = tri1_3;
+					vertices[vPos+3] = tri2_1;
+					vertices[vPos+4] = tri2_2;
+					vertices[vPos+5] = tri2_3;
+					
+					norms[vPos] = norm1_1;
+					norms[vPos+1] = norm1_2;
+					norms[vPos+2] = norm1_3;
+					norms[vPos+3] = norm2_1;
+					norms[vPos+4] = norm2_2;
+					norms[vPos+5] = norm2_3;
+					
+					vPos += 6;
+				}
+		}
+	});
+}
+
+/* Sizes the model's range of the vertex pool for n vertices, laid out as
+ * n positions, n normals and then n occlusion bytes, and points the
+ * attributes at it. A range that is big enough, but not wastefully so, is
+ * kept, so re-tessellating patches rewrites it in place.
+ */
+void allocateVertexBuffer(int n)
+{
+	size_t bytes = (2*sizeof(vec4) + sizeof(GLubyte))*n;
+	if (n == 0) {
+		vertex_pool.release(model_range);
+		return;
+	}
+	if (model_range.size < bytes || model_range.size > 2*bytes)
+		vertex_pool.allocate(bytes, sizeof(vec4), model_range);
+	vertex_pool.bind(model_range);
+	size_t base = model_range.offset;
+	glVertexAttribPointer(vertex_loc, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(base));
+	glVertexAttribPointer(normal_loc, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(base + sizeof(vec4)*n));
+	glVertexAttribPointer(occlusion_loc, 1, GL_UNSIGNED_BYTE, GL_TRUE, 0, BUFFER_OFFSET(base + 2*sizeof(vec4)*n));
+}
+
+// Uploads vertices [first, first + count) into a buffer allocated for n
+void uploadVertexRange(int n, int first, int count, const vec4 *pos, const vec4 *nrm, const GLubyte *occ)
+{
+	if (count <= 0)
+		return;
+	vertex_pool.update(model_range, sizeof(vec4)*first, sizeof(vec4)*count, pos);
+	vertex_pool.update(model_range, sizeof(vec4)*(n + first), sizeof(vec4)*count, nrm);
+	vertex_pool.update(model_range, 2*sizeof(vec4)*n + first, sizeof(GLubyte)*count, occ);
+}
+
+/* Puts instances in the vertex pool and points the per-instance attributes
+ * at them; they step once per instance, not per vertex.
+ */
+void uploadInstanceData()
+{
+	size_t bytes = sizeof(model_instance) * instances.size();
+	vertex_pool.allocate(bytes, sizeof(float), instance_range);
+	vertex_pool.update(instance_range, 0, bytes, &instances[0]);
+	vertex_pool.bind(instance_range);
+	for (GLuint k = 0; k < 4; k++) {
+		glVertexAttribPointer(instance_loc + k, 4, GL_FLOAT, GL_FALSE, sizeof(model_instance),
+							  BUFFER_OFFSET(instance_range.offset + 4*sizeof(GLfloat)*k));
+		glVertexAttribDivisor(instance_loc + k, 1);
+		glEnableVertexAttribArray(instance_loc + k);
+	}
+	useShader();
+}
+
+// Lays out the -instances copies
+void uploadInstances()
+{
+	make_instance_grid(instance_count, INSTANCE_GRID_EXTENT, model_radius, instances);
+	uploadInstanceData();
+}
+
+// Scatters the -lights point lights around what spans radius about the origin
+void placeLights(float radius)
+{
+	if (light_count <= 0)
+		return;
+	float center[3] = { 0.0f, 0.0f, 0.0f };
+	make_point_lights(light_count, center, LIGHT_SPREAD * radius, LIGHT_REACH * radius, point_lights);
+	for (size_t i = 0; i < point_lights.size(); i++)
+		for (int c = 0; c < 3; c++)
+			point_lights[i].color[c] *= LIGHT_INTENSITY;
+}
+
+// Takes over a finished model from the loader and uploads all of it
+void useModel(model_data *m)
+{
+	if (m->bezier) {
+		surfaces.swap(m->surfaces);
+		surface_bounds.swap(m->surface_bounds);
+		bezier_mode = true;
+		loadBezierVertsAndNorms();
+		allocateVertexBuffer(NumVertices);
+		uploadVertexRange(NumVertices, 0, NumVertices, vertices.data(), norms.data(), &occlusion[0]);
+	} else {
+		lods.swap(m->lods);
+		lod_area.resize(lods.size());
+		for (size_t k = 0; k < lods.size(); k++)
+			lod_area[k] = mean_triangle_area(lods[k]);
+		lod_meshlets.swap(m->lod_meshlets);
+		lod_first.swap(m->lod_first);
+		lod_count.swap(m->lod_count);
+		std::swap(pick_tree, m->tree);
+		closed_mesh = m->closed_mesh;
+		model_radius = m->radius;
+		// the staged arrays go straight to the GPU; no CPU copy is kept
+		NumVertices = (int) m->positions.size();
+		allocateVertexBuffer(NumVertices);
+		uploadVertexRange(NumVertices, 0, NumVertices, &m->positions[0], &m->normals[0], &m->occlusion[0]);
+		if (instance_count > 0)
+			uploadInstances();
+		placeLights(instance_count > 0 ? 0.5 * INSTANCE_GRID_EXTENT : model_radius);
+	}
+	model_ready = true;
+}
+
+// Handles the loader's messages every LOAD_POLL_MS until the model is complete
+void pollLoader(int)
+{
+	int uploads = 0;
+	load_message *m;
+	while (uploads < LOAD_UPLOADS_PER_POLL && (m = loader.poll()) != NULL) {
+		switch (m->kind) {
+		case load_message::STAGE:
+			load_stage = m->stage;
+			load_progress = m->progress;
+			break;
+		case load_message::PREVIEW:
+			preview_total = m->count;
+			preview_vertices = 0;
+			allocateVertexBuffer(preview_total);
+			break;
+		case load_message::CHUNK:
+			uploadVertexRange(preview_total, m->first, m->count, &m->positions[0], &m->normals[0], &m->occlusion[0]);
+			preview_vertices = m->first + m->count;
+			load_stage = "uploading preview";
+			load_progress = 0.15 + 0.15 * preview_vertices / preview_total;
+			uploads++;
+			break;
+		case load_message::DONE:
+			useModel(m->model);
+			delete m->model;
+			job_system().print_stats(cout);
+			uploads++;
+			break;
+		case load_message::FAILED:
+			load_stage = "failed";
+			break;
+		}
+		delete m;
+	}
+	glutPostRedisplay();
+	if (loader.busy())
+		glutTimerFunc(LOAD_POLL_MS, pollLoader, 0);
+}
+
+// Points the vertex attributes at one of the scene's layouts
+void bindSceneLayout(int l)
+{
+	const buffer_range &v = scene_layouts[l];
+	size_t n = scene_layout_vertices[l];
+	vertex_pool.bind(v);
+	glVertexAttribPointer(vertex_loc, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(v.offset));
+	glVertexAttribPointer(normal_loc, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(v.offset + sizeof(vec4)*n));
+	glVertexAttribPointer(occlusion_loc, 1, GL_UNSIGNED_BYTE, GL_TRUE, 0, BUFFER_OFFSET(v.offset + 2*sizeof(vec4)*n));
+}
+
+/* Lists the objects for the GPU, sorted by bucket: a bucket per vertex
+ * layout and program (shiny or matte), so each is one indirect draw.
+ */
+void buildCullTables()
+{
+	cull_objects.clear();
+	cull_lods.clear();
+	vector<int> model_first_lod(scene_models.size(), 0);
+	for (size_t m = 0; m < scene_models.size(); m++) {
+		const scene_model &sm = scene_models[m];
+		model_first_lod[m] = (int) cull_lods.size();
+		for (size_t k = 0; sm.layout >= 0 && k < sm.lods.size(); k++) {
+			cull_lod l;
+			l.first = sm.base + sm.lod_first[k];
+			l.count = sm.lod_count[k];
+			l.error = sm.lods[k].error;
+			l.pad = 0;
+			cull_lods.push_back(l);
+		}
+	}
+	for (size_t i = 0; i < scene_objects.size(); i++) {
+		const scene_object &o = scene_objects[i];
+		const scene_model &sm = scene_models[o.model];
+		const model_instance &inst = instances[o.instance];
+		const float *r0 = inst.rows[0];
+		cull_object c;
+		c.scale = sqrt(r0[0]*r0[0] + r0[1]*r0[1] + r0[2]*r0[2]);
+		for (int k = 0; k < 3; k++)
+			c.sphere[k] = inst.rows[k][3];
+		c.sphere[3] = sm.radius * c.scale;
+		c.first_lod = model_first_lod[o.model];
+		c.lod_levels = (GLuint) sm.lods.size();
+		c.instance = o.instance;
+		c.bucket = 2 * sm.layout + (SCENE_MATERIALS[o.material].shiny ? 0 : 1);
+		c.pad[0] = c.pad[1] = c.pad[2] = 0;
+		cull_objects.push_back(c);
+	}
+	stable_sort(cull_objects.begin(), cull_objects.end(),
+				[](const cull_object &a, const cull_object &b) { return a.bucket < b.bucket; });
+	scene_culler.set_objects(cull_objects, cull_lods, 2 * (int) scene_layouts.size());
+}
+
+/* Once every model is in: packs the models into as few layouts as fit a
+ * vertex page, so draws of different models share one set of attribute
+ * pointers, and places the objects in a grid, each with its own transform
+ * and material in the per-instance attributes.
+ */
+void buildScene()
+{
+	const size_t vertex_bytes = 2*sizeof(vec4) + sizeof(GLubyte);
+	for (size_t i = 0; i < scene_models.size(); i++) {
+		scene_model &sm = scene_models[i];
+		if (sm.model == NULL)
+			continue;
+		int n = (int) sm.model->positions.size();
+		if (scene_layouts.empty() || (scene_layout_vertices.back() + n) * vertex_bytes > VERTEX_PAGE_BYTES) {
+			scene_layouts.push_back(buffer_range());
+			scene_layout_vertices.push_back(0);
+		}
+		sm.layout = (int) scene_layouts.size() - 1;
+		sm.base = scene_layout_vertices.back();
+		scene_layout_vertices.back() += n;
+	}
+	for (size_t l = 0; l < scene_layouts.size(); l++)
+		vertex_pool.allocate(vertex_bytes * scene_layout_vertices[l], sizeof(vec4), scene_layouts[l]);
 	
-	// initialize to zeros
-	for (unsigned int i = 0; i < verts.size()/3; i++)
-		vert_norms[i] = vec4(0.0);
+	vector<int> loaded;
+	long long vertices = 0;
+	for (size_t i = 0; i < scene_models.size(); i++) {
+		scene_model &sm = scene_models[i];
+		if (sm.model == NULL)
+			continue;
+		model_data *m = sm.model;
+		const buffer_range &v = scene_layouts[sm.layout];
+		size_t n = scene_layout_vertices[sm.layout], count = m->positions.size();
+		if (count > 0) {
+			vertex_pool.update(v, sizeof(vec4)*sm.base, sizeof(vec4)*count, &m->positions[0]);
+			vertex_pool.update(v, sizeof(vec4)*(n + sm.base), sizeof(vec4)*count, &m->normals[0]);
+			vertex_pool.update(v, 2*sizeof(vec4)*n + sm.base, sizeof(GLubyte)*count, &m->occlusion[0]);
+		}
+		sm.lods.swap(m->lods);
+		sm.lod_area.resize(sm.lods.size());
+		for (size_t k = 0; k < sm.lods.size(); k++) {
+			sm.lod_area[k] = mean_triangle_area(sm.lods[k]);
+			vector<int>().swap(sm.lods[k].tris);
+			vector<float>().swap(sm.lods[k].verts);
+			vector<int>().swap(sm.lods[k].source);
+		}
+		sm.lod_first.swap(m->lod_first);
+		sm.lod_count.swap(m->lod_count);
+		sm.radius = m->radius;
+		loaded.push_back((int) i);
+		vertices += count;
+		delete m;
+		sm.model = NULL;
+	}
 	
-	/* Add all normals for all vertices. Shared */
-	for (unsigned int i = 0; i < NumVertices; i+=3) {
-		int p1_i = tris[i];
-		int p2_i = tris[i+1];
-		int p3_i = tris[i+2];
-		vertices[i] = point4(verts[3*p1_i], verts[3*p1_i+1], verts[3*p1_i+2], 1.0);
-		vertices[i+1] = point4(verts[3*p2_i], verts[3*p2_i+1], verts[3*p2_i+2], 1.0);
-		vertices[i+2] = point4(verts[3*p3_i], verts[3*p3_i+1], verts[3*p3_i+2], 1.0);
-		
-		vec4 norm = normalize(vec4(cross(vertices[i+1]-vertices[i], vertices[i+2]-vertices[i]), 0.0));
-		vert_norms[p1_i] += norm;
-		vert_norms[p2_i] += norm;
-		vert_norms[p3_i] += norm;
+	// a grid of cells, each object then scaled by its model's radius
+	int placed = loaded.empty() ? 0 : (instance_count > 0 ? instance_count : (int) loaded.size());
+	int side = (int) ceil(sqrt((double) placed));
+	float cell = side > 0 ? min(SCENE_CELL, SCENE_MAX_EXTENT / side) : SCENE_CELL;
+	make_instance_grid(placed, cell * side, 1.0, instances);
+	scene_objects.resize(placed);
+	for (int i = 0; i < placed; i++) {
+		scene_object &o = scene_objects[i];
+		o.model = loaded[i % loaded.size()];
+		o.material = i % SCENE_MATERIAL_COUNT;
+		o.instance = i;
+		model_instance &inst = instances[i];
+		float radius = scene_models[o.model].radius;
+		float s = radius > 0.0 ? 1.0 / radius : 1.0;
+		for (int row = 0; row < 3; row++)
+			for (int k = 0; k < 3; k++)
+				inst.rows[row][k] *= s;
+		for (int c = 0; c < 4; c++)
+			inst.color[c] = SCENE_MATERIALS[o.material].diffuse[c];
+	}
+	if (placed > 0) {
+		uploadInstanceData();
+		if (gpu_culler::supported())
+			buildCullTables();
 	}
+	placeLights(0.5 * cell * side);
 	
-	for (unsigned int i = 0; i < verts.size()/3; i++)
-		vert_norms[i] = normalize(vert_norms[i]);
+	// back far enough to see the whole grid
+	home_r = r = min(RMAX, max(5.0f, 0.5f * cell * side / tanf(0.5f * DegreesToRadians * FOVY) + cell));
+	cout << "scene: " << loaded.size() << " of " << scene_models.size() << " models, " << vertices
+		 << " vertices in " << scene_layouts.size() << " layouts, " << placed << " objects" << endl;
+	model_ready = placed > 0;
+	if (!model_ready)
+		load_stage = "failed";
+}
+
+// Gathers the scene's models every LOAD_POLL_MS as their loaders finish
+void pollScene(int)
+{
+	int loading = 0;
+	for (size_t i = 0; i < scene_models.size(); i++) {
+		scene_model &sm = scene_models[i];
+		if (sm.loader == NULL)
+			continue;
+		load_message *m;
+		while ((m = sm.loader->poll()) != NULL) {
+			// the scene appears whole, so previews are dropped
+			if (m->kind == load_message::DONE) {
+				if (m->model->bezier) {
+					cerr << sm.name << ": Bezier patches cannot be placed in a scene" << endl;
+					delete m->model;
+				} else {
+					sm.model = m->model;
+				}
+			} else if (m->kind == load_message::FAILED) {
+				cerr << "Failed to load " << sm.name << endl;
+			}
+			delete m;
+		}
+		if (sm.loader->busy()) {
+			loading++;
+		} else {
+			delete sm.loader;
+			sm.loader = NULL;
+		}
+	}
 	
-	for (unsigned int i = 0; i < NumVertices; i+=3) {
-		int p1_i = tris[i];
-		int p2_i = tris[i+1];
-		int p3_i = tris[i+2];
-		norms[i] = vert_norms[p1_i];
-		norms[i+1]= vert_norms[p2_i];
-		norms[i+2] = vert_norms[p3_i];
+	char title[192];
+	snprintf(title, sizeof(title), "Loading scene - %d of %d models", (int) scene_models.size() - loading,
+			 (int) scene_models.size());
+	glutSetWindowTitle(title);
+	if (loading > 0)
+		glutTimerFunc(LOAD_POLL_MS, pollScene, 0);
+	else
+		buildScene();
+	glutPostRedisplay();
+}
+
+/* Maps a tile file for -tiles; the model is centred and scaled to about
+ * the size of the other models so the usual camera controls apply.
+ */
+bool openTiles(const char *file, size_t budget_mb)
+{
+	if (!tiles.open(file))
+		return false;
+	const tile_header &h = tiles.info();
+	float extent = 0.0;
+	for (int k = 0; k < 3; k++) {
+		tiles_center[k] = 0.5 * (h.lo[k] + h.hi[k]);
+		extent = max(extent, h.hi[k] - h.lo[k]);
 	}
-	delete[] vert_norms;
+	tiles_scale = extent > 0.0 ? 2.0 / extent : 1.0;
+	pager = new tile_pager(budget_mb * 1024 * 1024);
+	tile_verts.assign(tiles.num_tiles(), buffer_range());
+	tile_indices.assign(tiles.num_tiles(), buffer_range());
+	cout << file << ": " << tiles.num_tiles() << " tiles, " << h.n_tris << " tris, budget "
+		 << budget_mb << " MB" << endl;
+	tiled_mode = true;
+	model_ready = true;
+	return true;
 }
 
-void loadBezierVertsAndNorms() {
-	int n_verts = 0;
-	for (int i = 0; i < surfaces.size(); ++i) {
-		n_verts += 3 * ((2*surfaces[i].getUSamples(bezier_coarseness) - 2) *
-						(surfaces[i].getVSamples(bezier_coarseness) - 1)  );
+/* Copies one tile level into ranges of the vertex and index pools. The
+ * mapped pages are dropped right after, so only the budgeted copies stay
+ * resident.
+ */
+void uploadTile(const tile_request &r)
+{
+	const tile_level &l = tiles.tile(r.tile).levels[r.level];
+	buffer_range &v = tile_verts[r.tile], &i = tile_indices[r.tile];
+	vertex_pool.allocate(24 * l.n_verts, sizeof(float), v);
+	vertex_pool.update(v, 0, 12 * l.n_verts, tiles.positions(r.tile, r.level));
+	vertex_pool.update(v, 12 * l.n_verts, 12 * l.n_verts, tiles.normals(r.tile, r.level));
+	index_pool.allocate(12 * l.n_tris, sizeof(uint32_t), i);
+	index_pool.update(i, 0, 12 * l.n_tris, tiles.indices(r.tile, r.level));
+	tiles.release(r.tile, r.level);
+}
+
+void freeTile(int t)
+{
+	vertex_pool.release(tile_verts[t]);
+	index_pool.release(tile_indices[t]);
+}
+
+/* Calls draw for a depth-only pass when the pre-pass is on, with the
+ * program to draw it with, and then with 0 for the shading pass, which
+ * with the pre-pass only shades fragments at the depth already there.
+ */
+void drawPasses(bool instanced, const std::function<void (GLuint depth_program)> &draw)
+{
+	GLuint depth = depth_prepass ? shaders.program(depthVariant(instanced)) : 0;
+	if (depth != 0) {
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		if (measure_overdraw)
+			overdraw.begin_pass(true);
+		draw(depth);
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		glDepthFunc(GL_EQUAL);
+		glDepthMask(GL_FALSE);
 	}
-	NumVertices = n_verts;
+	if (measure_overdraw)
+		overdraw.begin_pass(false);
+	draw(0);
+	if (measure_overdraw)
+		overdraw.end_pass();
+	glDepthFunc(GL_LESS);
+	glDepthMask(GL_TRUE);
+}
+
+/* Lists the point lights reaching each cluster of this frame's view and
+ * rewrites the texture buffers the fragment shader reads them from.
+ */
+void updateLightClusters(const mat4 &view)
+{
+	clusters.configure(glutGet(GLUT_WINDOW_WIDTH), glutGet(GLUT_WINDOW_HEIGHT), FOVY, 1.0, ZNEAR, ZFAR);
+	clusters.assign(point_lights, view, job_system());
 	
-	delete vertices;
-	delete norms;
-	vertices = new point4[NumVertices];
-	norms = new vec4[NumVertices];
+	const vector<float> &eye_lights = clusters.eye_lights();
+	const vector<uint32_t> &ranges = clusters.cluster_ranges();
+	const vector<uint32_t> &indices = clusters.light_indices();
+	const void *data[3] = { eye_lights.empty() ? NULL : &eye_lights[0], &ranges[0],
+							indices.empty() ? NULL : &indices[0] };
+	size_t bytes[3] = { sizeof(float) * eye_lights.size(), sizeof(uint32_t) * ranges.size(),
+						sizeof(uint32_t) * indices.size() };
+	for (int i = 0; i < 3; i++) {
+		glBindBuffer(GL_TEXTURE_BUFFER, light_buffers[i]);
+		// orphaned, so the draws of the last frame keep their copy
+		glBufferData(GL_TEXTURE_BUFFER, max(bytes[i], (size_t) 16), NULL, GL_STREAM_DRAW);
+		if (bytes[i] > 0)
+			glBufferSubData(GL_TEXTURE_BUFFER, 0, bytes[i], data[i]);
+	}
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
 	
-	vector<point4> v_verts;
-	vector<vec4> v_norms;
-	for (int i = 0; i < surfaces.size(); ++i)
-		surfaces[i].sample(bezier_coarseness, v_verts, v_norms);
+	cluster_uniforms c;
+	c.grid[0] = clusters.tiles_x();
+	c.grid[1] = clusters.tiles_y();
+	c.grid[2] = clusters.slices();
+	c.grid[3] = CLUSTER_TILE_PIXELS;
+	c.depth[0] = clusters.slice_scale();
+	c.depth[1] = clusters.slice_bias();
+	c.depth[2] = point_lights.size();
+	c.depth[3] = 0.0;
+	cluster_block.set(c);
+	cluster_block.upload();
 	
-	// Triangulate
-	int to_skip = 0;
-	int vPos = 0;
-	for (int i = 0; i < surfaces.size(); ++i) {
-		int u_sam = surfaces[i].getUSamples(bezier_coarseness);
-		int v_sam = surfaces[i].getVSamples(bezier_coarseness);
-		
-		int verts_surf = u_sam*v_sam;
-		for (int v = 0; v < v_sam-1; v++)
-			for (int u = 0; u < u_sam-1; u++) {
-				vec4 tri1_1 = v_verts[to_skip + v*u_sam + u];
-				vec4 norm1_1 = v_norms[to_skip + v*u_sam + u];
-				vec4 tri1_2 = v_verts[to_skip + (v+1)*u_sam + u+1];
-				vec4 norm1_2 = v_norms[to_skip + (v+1)*u_sam + u+1];
-				vec4 tri1_3 = v_verts[to_skip + (v+1)*u_sam + u];
-				vec4 norm1_3 = v_norms[to_skip + (v+1)*u_sam + u];
-				
-				vec4 tri2_1 = tri1_2;
-				vec4 norm2_1 = norm1_2;
-				vec4 tri2_2 = tri1_1;
-				vec4 norm2_2 = norm1_1;
-				vec4 tri2_3 = v_verts[to_skip + v*u_sam + u+1];
-				vec4 norm2_3 = v_norms[to_skip + v*u_sam + u+1];
-				
-				vertices[vPos] = tri1_1;
-				vertices[vPos+1] = tri1_2;
-				vertices[vPos+2] = tri1_3;
-				vertices[vPos+3] = tri2_1;
-				vertices[vPos+4] = tri2_2;
-				vertices[vPos+5] = tri2_3;
-				
-				norms[vPos] = norm1_1;
-				norms[vPos+1] = norm1_2;
-				norms[vPos+2] = norm1_3;
-				norms[vPos+3] = norm2_1;
-				norms[vPos+4] = norm2_2;
-				norms[vPos+5] = norm2_3;
-				
-				vPos += 6;
+	const light_cluster_stats &s = clusters.stats();
+	snprintf(light_report, sizeof(light_report), " | %d lights %s, %d in view, %.1f per lit cluster (max %d),"
+			 " assigned in %.2f ms%s", s.lights, many_lights == CLUSTERED_LIGHTS ? "clustered" : "unsorted",
+			 s.visible, s.occupied > 0 ? (double) s.references / s.occupied : 0.0, s.max_lights, s.assign_ms,
+			 per_vertex_lighting ? ", shaded per pixel as they need" : "");
+}
+
+// Camera block for drawing with model placed in the world; written only if it changed
+void setCamera(const mat4 &proj, const mat4 &view, const mat4 &model)
+{
+	camera_uniforms c;
+	set_camera_uniforms(proj, view, model, c);
+	camera_block.set(c);
+	camera_block.upload();
+}
+
+// Centres and scales the tiled model to fit the default view
+mat4 tilesModel()
+{
+	return Scale(tiles_scale, tiles_scale, tiles_scale) *
+		Translate(-tiles_center[0], -tiles_center[1], -tiles_center[2]);
+}
+
+/* Pages tiles for the current view and draws the visible ones at the
+ * level they have, which may be coarser than wanted while loads catch up.
+ */
+void drawTiles(const mat4 &proj, const mat4 &view)
+{
+	mat4 model = tilesModel();
+	
+	// culling and level selection happen in the file's own units
+	frustum f;
+	extract_frustum(proj * view * model, f);
+	float eye_pos[3];
+	for (int k = 0; k < 3; k++)
+		eye_pos[k] = eye[k] / tiles_scale + tiles_center[k];
+	int h = glutGet(GLUT_WINDOW_HEIGHT);
+	tile_requests(tiles, f, eye_pos, FOVY, h, LOD_PIXEL_TOLERANCE, tile_wanted);
+	pager->update(tiles, tile_wanted, TILE_LOADS_PER_FRAME, tile_loads, tile_evicts);
+	
+	for (size_t i = 0; i < tile_evicts.size(); i++)
+		freeTile(tile_evicts[i].tile);
+	for (size_t i = 0; i < tile_loads.size(); i++)
+		uploadTile(tile_loads[i]);
+	tiles_loaded += (int) tile_loads.size();
+	tiles_evicted += (int) tile_evicts.size();
+	
+	// loads were capped: the next frame's start reading while this one draws
+	bool pending = (int) tile_loads.size() == TILE_LOADS_PER_FRAME;
+	for (size_t i = 0; i < tile_wanted.size() && pending; i++)
+		if (pager->resident_level(tile_wanted[i].tile) != tile_wanted[i].level)
+			tiles.prefetch(tile_wanted[i].tile, tile_wanted[i].level);
+	
+	// tiles carry no baked occlusion
+	glDisableVertexAttribArray(occlusion_loc);
+	glVertexAttrib1f(occlusion_loc, 1.0);
+	long long drawn = 0;
+	for (size_t i = 0; i < tile_wanted.size(); i++) {
+		int t = tile_wanted[i].tile, l = pager->resident_level(t);
+		if (l < 0)
+			continue;
+		const tile_level &tl = tiles.tile(t).levels[l];
+		const buffer_range &v = tile_verts[t], &ix = tile_indices[t];
+		vertex_pool.bind(v);
+		glVertexAttribPointer(vertex_loc, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(v.offset));
+		glVertexAttribPointer(normal_loc, 3, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(v.offset + 12 * tl.n_verts));
+		index_pool.bind(ix);
+		glDrawElements(GL_TRIANGLES, 3 * tl.n_tris, GL_UNSIGNED_INT, BUFFER_OFFSET(ix.offset));
+		drawn += tl.n_tris;
+	}
+	
+	char title[192];
+	snprintf(title, sizeof(title), "Tiles - %d/%d resident, %.1f/%.0f MB, %lld tris drawn"
+			 " | %d visible, %d loads, %d evictions",
+			 pager->resident_tiles(), tiles.num_tiles(), pager->resident_bytes() / 1048576.0,
+			 pager->budget() / 1048576.0, drawn, (int) tile_wanted.size(), tiles_loaded, tiles_evicted);
+	glutSetWindowTitle(title);
+	if (pending)
+		glutPostRedisplay();
+}
+
+/* Draws the -instances grid at the level of detail one copy needs: with a
+ * single instanced draw, or, to compare, with a draw per copy after
+ * writing its placement and color into the camera and material blocks.
+ */
+void drawInstances(const mat4 &proj, const mat4 &view)
+{
+	const float *row = instances[0].rows[0];
+	float instance_scale = sqrt(row[0]*row[0] + row[1]*row[1] + row[2]*row[2]);
+	float scale = pixels_per_unit(r, FOVY, glutGet(GLUT_WINDOW_HEIGHT)) * instance_scale;
+	int lod = select_lod(lods, scale, LOD_PIXEL_TOLERANCE);
+	selectShading(lod_area[lod], scale);
+	
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	float eye_pos[3] = { eye.x, eye.y, eye.z };
+	if (front_to_back && sort_instances_front_to_back(instances, eye_pos))
+		vertex_pool.update(instance_range, 0, sizeof(model_instance) * instances.size(), &instances[0]);
+	int draws = 0;
+	drawPasses(instanced_submission, [&](GLuint depth) {
+		glUseProgram(depth ? depth : program);
+		if (instanced_submission) {
+			glDrawArraysInstanced(GL_TRIANGLES, lod_first[lod], lod_count[lod], instance_count);
+			draws++;
+			return;
+		}
+		material_uniforms base = material_block.get(), m = base;
+		for (size_t i = 0; i < instances.size(); i++) {
+			const model_instance &inst = instances[i];
+			const float *r0 = inst.rows[0], *r1 = inst.rows[1], *r2 = inst.rows[2];
+			setCamera(proj, view, mat4(vec4(r0[0], r0[1], r0[2], r0[3]), vec4(r1[0], r1[1], r1[2], r1[3]),
+									   vec4(r2[0], r2[1], r2[2], r2[3]), vec4(0.0, 0.0, 0.0, 1.0)));
+			for (int c = 0; c < 4; c++)
+				m.diffuse[c] = inst.color[c];
+			material_block.set(m);
+			material_block.upload();
+			glDrawArrays(GL_TRIANGLES, lod_first[lod], lod_count[lod]);
+			draws++;
+		}
+		material_block.set(base);
+		material_block.upload();
+	});
+	double submit_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	
+	char title[512];
+	snprintf(title, sizeof(title), "Instances - %d copies at LOD %d (%d tris each), %s: %d draws, submitted in %.2f ms%s%s%s",
+			 instance_count, lod, lod_count[lod]/3, instanced_submission ? "instanced" : "one draw per copy",
+			 draws, submit_ms, shading_report, light_report, overdraw_report);
+	glutSetWindowTitle(title);
+}
+
+/* Compares the GPU's draws with the CPU reference for the same view. The
+ * shader appends in whatever order its invocations finish, so each
+ * bucket's commands are compared sorted.
+ */
+void checkGpuCulling(const cull_uniforms &u)
+{
+	vector<draw_arrays_command> gpu, cpu;
+	vector<GLuint> gpu_counts, cpu_counts;
+	scene_culler.read_back(gpu, gpu_counts);
+	cull_objects_cpu(cull_objects, cull_lods, scene_culler.bucket_first(), u, cpu, cpu_counts);
+	
+	struct command_order {
+		bool operator()(const draw_arrays_command &a, const draw_arrays_command &b) const {
+			return a.base_instance != b.base_instance ? a.base_instance < b.base_instance : a.first < b.first;
+		}
+	};
+	const vector<GLuint> &first = scene_culler.bucket_first();
+	int drawn = 0, differ = 0;
+	for (size_t b = 0; b < cpu_counts.size(); b++) {
+		vector<draw_arrays_command> g(gpu.begin() + first[b], gpu.begin() + first[b] + min(gpu_counts[b], first[b+1] - first[b]));
+		vector<draw_arrays_command> c(cpu.begin() + first[b], cpu.begin() + first[b] + cpu_counts[b]);
+		sort(g.begin(), g.end(), command_order());
+		sort(c.begin(), c.end(), command_order());
+		size_t i = 0, j = 0;
+		while (i < g.size() || j < c.size()) {
+			if (i < g.size() && j < c.size() && !command_order()(g[i], c[j]) && !command_order()(c[j], g[i])) {
+				differ += g[i].count != c[j].count ? 1 : 0;
+				i++;
+				j++;
+			} else if (j == c.size() || (i < g.size() && command_order()(g[i], c[j]))) {
+				differ++;
+				i++;
+			} else {
+				differ++;
+				j++;
+			}
+		}
+		drawn += cpu_counts[b];
+	}
+	cout << "gpu culling: " << drawn << " of " << cull_objects.size() << " objects drawn by the CPU reference, "
+		 << differ << " draws differ on the GPU" << endl;
+}
+
+/* Culls the scene's objects against the frustum, picks each one's level of
+ * detail and draws them through the render queue. The two variants the
+ * materials need are the only programs; placement and color ride in the
+ * per-instance attributes, so materials never split a draw. With GPU
+ * culling the same happens in a compute shader and the CPU only issues
+ * one indirect draw per program and layout.
+ */
+void drawScene(const mat4 &proj, const mat4 &view)
+{
+	int h = glutGet(GLUT_WINDOW_HEIGHT);
+	GLuint shiny = shaders.program(shaderVariant(per_vertex_lighting, specular, true, lightingMode()));
+	GLuint matte = shaders.program(shaderVariant(per_vertex_lighting, false, true, lightingMode()));
+	// the automatic mode picks per object, between these and the above
+	GLuint gouraud_shiny = shaders.program(shaderVariant(true, specular, true, lightingMode()));
+	GLuint gouraud_matte = shaders.program(shaderVariant(true, false, true, lightingMode()));
+	
+	char title[512];
+	if (gpu_culling) {
+		cull_uniforms u;
+		set_cull_uniforms(proj * view, eye, FOVY, h, LOD_PIXEL_TOLERANCE, ZNEAR, (int) cull_objects.size(), u);
+		scene_culler.cull(shaders.program(shader_variant("cull_objects.glsl")), u);
+		if (check_gpu_culling) {
+			checkGpuCulling(u);
+			check_gpu_culling = false;
+		}
+		const vector<GLuint> &first = scene_culler.bucket_first();
+		int draws = 0;
+		drawPasses(true, [&](GLuint depth) {
+			for (size_t l = 0; l < scene_layouts.size(); l++) {
+				bindSceneLayout((int) l);
+				for (int b = 2 * (int) l; b < 2 * (int) l + 2; b++) {
+					if (first[b + 1] == first[b])
+						continue;
+					glUseProgram(depth ? depth : b % 2 == 0 ? shiny : matte);
+					scene_culler.draw(b);
+					draws++;
+				}
+			}
+		});
+		snprintf(title, sizeof(title), "Scene - %d objects culled on the GPU in %.2f ms | %d indirect draws%s%s",
+				 scene_culler.objects(), scene_culler.cull_ms(), draws, light_report, overdraw_report);
+		glutSetWindowTitle(title);
+		return;
+	}
+	
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	frustum f;
+	extract_frustum(proj * view, f);
+	int visible = 0, culled = 0, gouraud = 0;
+	long long tris = 0;
+	scene_queue.clear();
+	for (size_t i = 0; i < scene_objects.size(); i++) {
+		const scene_object &o = scene_objects[i];
+		const scene_model &sm = scene_models[o.model];
+		const model_instance &inst = instances[o.instance];
+		float center[3] = { inst.rows[0][3], inst.rows[1][3], inst.rows[2][3] };
+		const float *r0 = inst.rows[0];
+		float scale = sqrt(r0[0]*r0[0] + r0[1]*r0[1] + r0[2]*r0[2]);
+		if (!sphere_in_frustum(f, center, sm.radius * scale)) {
+			culled++;
+			continue;
+		}
+		float dx = eye.x - center[0], dy = eye.y - center[1], dz = eye.z - center[2];
+		float distance = max(ZNEAR, sqrtf(dx*dx + dy*dy + dz*dz));
+		float pixels = pixels_per_unit(distance, FOVY, h) * scale;
+		int lod = select_lod(sm.lods, pixels, LOD_PIXEL_TOLERANCE);
+		if (sm.lod_count[lod] == 0)
+			continue;
+		bool per_vertex = shading == AUTO_SHADING && smallTriangles(sm.lod_area[lod], pixels);
+		render_item item;
+		if (per_vertex)
+			item.program = SCENE_MATERIALS[o.material].shiny ? gouraud_shiny : gouraud_matte;
+		else
+			item.program = SCENE_MATERIALS[o.material].shiny ? shiny : matte;
+		gouraud += (per_vertex || per_vertex_lighting) && lightingMode() == ONE_LIGHT ? 1 : 0;
+		item.layout = sm.layout;
+		item.material = o.material;
+		item.first = sm.base + sm.lod_first[lod];
+		item.count = sm.lod_count[lod];
+		item.instance = o.instance;
+		item.depth = distance;
+		scene_queue.add(item);
+		visible++;
+		tris += sm.lod_count[lod]/3;
+	}
+	double cull_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	scene_queue.prepare(multi_draw, front_to_back);
+	drawPasses(true, [&](GLuint depth) { scene_queue.draw(bindSceneLayout, depth); });
+	
+	const render_queue_stats &s = scene_queue.stats();
+	snprintf(title, sizeof(title), "Scene - %d objects (%d lit per vertex), %d culled in %.2f ms, %lld tris | %s:"
+			 " %d draws, %d program, %d layout, %d material changes, %.2f ms%s%s",
+			 visible, gouraud, culled, cull_ms, tris, multi_draw && render_queue::multi_draw_supported() ?
+			 "multi-draw indirect" : "draw per object", s.draws, s.program_changes, s.layout_changes,
+			 s.material_changes, s.submit_ms, light_report, overdraw_report);
+	glutSetWindowTitle(title);
+}
+
+// place the eye on the sphere of radius r given by theta and phi
+void updateCamera()
+{
+	GLfloat p = DegreesToRadians*phi;
+	GLfloat t = DegreesToRadians*theta;
+	eye = point4(r*sin(p)*sin(t), r*cos(p), r*sin(p)*cos(t), 1.0);
+	up = normalize(vec4(cross(normalize(cross(normalize(viewer - eye), vec4(0, 1, 0, 0))), normalize(viewer - eye)), 0.0));
+}
+
+/* Ray casts the model from the current view into an image file (PPM, or
+ * PNG by extension) without opening a window.
+ */
+int renderHeadless(const char *file_name, const char *image_name, int size)
+{
+	vector<int> tris;
+	vector<float> verts, vert_norms;
+	vector<unsigned char> vert_occlusion;
+	const mesh_format *format = find_mesh_format(file_name);
+	if (format == NULL)
+		return 1;
+	if (!format->patches()) {
+		if (!format->read(file_name, tris, verts, &vert_norms, &vert_occlusion))
+			return 1;
+		if (vert_norms.size() != verts.size())
+			compute_vertex_normals(tris, verts, vert_norms);
+		if (vert_occlusion.empty())
+			read_occlusion(occlusion_file(file_name).c_str(), verts.size()/3, vert_occlusion);
+	} else {
+		// tessellate the patches and keep the triangle soup with its normals
+		read_bezier_file(file_name, surfaces);
+		bezier_coarseness = MAX_DETAIL / 2;
+		loadBezierVertsAndNorms();
+		for (int i = 0; i < NumVertices; i++) {
+			tris.push_back(i);
+			for (int c = 0; c < 3; c++) {
+				verts.push_back(vertices[i][c]);
+				vert_norms.push_back(norms[i][c]);
 			}
-		to_skip += verts_surf;
+		}
+	}
+	
+	bvh tree;
+	tree.build(tris, verts);
+	
+	shading_params params;
+	params.light_position = light_position;
+	params.light_ambient = light_ambient;
+	params.light_diffuse = light_diffuse;
+	params.light_specular = light_specular;
+	params.material_ambient = material_ambient;
+	params.material_diffuse = material_diffuse;
+	params.material_specular = material_specular;
+	params.shininess = material_shininess;
+	params.background = vec4(1.0, 1.0, 1.0, 1.0);  // matches glClearColor
+	
+	updateCamera();
+	job_pool &pool = job_system();
+	rgb_image img(size, size);
+	render_stats stats;
+	raycast_image(tree, tris, verts, vert_norms, vert_occlusion, Perspective(FOVY, 1.0, ZNEAR, ZFAR),
+				  LookAt(eye, viewer, up), params, pool, img, stats);
+	print_render_stats(cout, stats);
+	pool.print_stats(cout);
+	
+	if (!write_image(image_name, img)) {
+		cerr << "Failed to write " << image_name << endl;
+		return 1;
 	}
+	return 0;
+}
+
+/* Bakes per-vertex ambient occlusion for a mesh and writes it next to the
+ * model, where loadOBJ and -render pick it up.
+ */
+int bakeOcclusion(const char *file_name, int rays)
+{
+	vector<int> tris;
+	vector<float> verts, vert_norms;
+	if (!read_mesh_file(file_name, tris, verts))
+		return 1;
+	compute_vertex_normals(tris, verts, vert_norms);
+	
+	bvh tree;
+	tree.build(tris, verts);
 	
+	job_pool &pool = job_system();
+	vector<unsigned char> baked;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	bake_vertex_occlusion(tree, verts, vert_norms, rays, 0.0, pool, baked, &cout);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	
+	size_t n_verts = baked.size();
+	cout << n_verts << " vertices x " << rays << " rays on " << pool.workers() << " workers in "
+		 << seconds << " s (" << (n_verts * rays / seconds) / 1e6 << " Mrays/s)" << endl;
+	pool.print_stats(cout);
+	
+	string out = occlusion_file(file_name);
+	if (!write_occlusion(out.c_str(), baked, rays)) {
+		cerr << "Failed to write " << out << endl;
+		return 1;
+	}
+	cout << "wrote " << out << endl;
+	return 0;
 }
 
-void loadBezier(const char *file_name) {
-	read_bezier_file(file_name, surfaces);
-	bezier_mode = true;
-	loadBezierVertsAndNorms();
+/* Writes a mesh (with its baked occlusion, if any) as a coded mesh and
+ * reports the compression and how fast it decodes into vec4 arrays.
+ */
+int compressMesh(const char *file_name, const char *out_name, int position_bits)
+{
+	vector<int> tris;
+	vector<float> verts, vert_norms;
+	vector<unsigned char> vert_occlusion;
+	if (!read_mesh_file(file_name, tris, verts, &vert_occlusion))
+		return 1;
+	compute_vertex_normals(tris, verts, vert_norms);
+	bool has_occlusion = !vert_occlusion.empty() ||
+		read_occlusion(occlusion_file(file_name).c_str(), verts.size()/3, vert_occlusion);
+	
+	vector<unsigned char> coded;
+	if (!encode_mesh(tris, verts, &vert_norms, has_occlusion ? &vert_occlusion : NULL, position_bits, coded) ||
+		!write_coded_mesh_file(out_name, coded)) {
+		cerr << "Failed to write " << out_name << endl;
+		return 1;
+	}
+	
+	ifstream obj(file_name, ios::binary | ios::ate);
+	double text_bytes = (double) obj.tellg();
+	// positions and normals as 3 floats, indices as 3 ints, occlusion as bytes
+	double raw_bytes = 12.0 * (tris.size()/3) + 24.0 * (verts.size()/3) + vert_occlusion.size();
+	coded_mesh_info info;
+	read_coded_mesh_info(&coded[0], coded.size(), info);
+	cout << "wrote " << out_name << ": " << coded.size() << " bytes, " << text_bytes / coded.size()
+		 << ":1 against the OBJ, " << raw_bytes / coded.size() << ":1 against raw arrays, "
+		 << 8.0 * coded.size() / (tris.size()/3) << " bits per triangle, position error <= "
+		 << info.max_error << endl;
+	
+	// straight into the layout the renderer uploads
+	owned_array<int> indices(tris.size());
+	owned_array<vec4> positions(verts.size()/3), normals(verts.size()/3);
+	owned_array<unsigned char> occl(vert_occlusion.size());
+	mesh_decode_target target;
+	target.indices = indices.data();
+	target.positions = &positions[0].x;
+	target.position_stride = 4;
+	target.normals = &normals[0].x;
+	target.normal_stride = 4;
+	target.occlusion = occl.data();
+	int runs = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	double seconds = 0.0;
+	do {
+		decode_mesh(&coded[0], coded.size(), target);
+		runs++;
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	} while (seconds < 0.5);
+	double decoded = raw_bytes * runs;
+	cout << "decode: " << 1e3 * seconds / runs << " ms, " << decoded / seconds / 1e9 << " GB/s of arrays, "
+		 << coded.size() * (double) runs / seconds / 1e6 << " MB/s of input, "
+		 << (tris.size()/3) * (double) runs / seconds / 1e6 << " Mtris/s" << endl;
+	return 0;
 }
 
 // initialization: set up a Vertex Array Object (VAO) and then
@@ -203,62 +1283,88 @@ void init()
     glBindVertexArray( vao );       // make it active
 #endif
     
-    // set up vertex buffer object - this will be memory on the GPU where
-    // we are going to store our vertex data (that is currently in the "points"
-    // array)
-    glGenBuffers(1, buffers);
-    glBindBuffer(GL_ARRAY_BUFFER, buffers[0]);  // make it active
+    // vertex data lives in ranges of vertex_pool's buffers, which are
+    // created as the geometry arrives
     
-    // specify that its part of a VAO, what its size is, and where the
-    // data is located, and finally a "hint" about how we are going to use
-    // the data (the driver will put it in a good memory location, hopefully)
-    glBufferData(GL_ARRAY_BUFFER, 2*sizeof(vec4)*NumVertices, NULL, GL_STATIC_DRAW);
-    
-    // load in these two shaders...  (note: InitShader is defined in the
-    // accompanying initshader.c code).
     // the shaders themselves must be text glsl files in the same directory
-    // as we are running this program:
-    program = InitShader("vshader_blinnphong.glsl", "fshader_passthrough.glsl");
- 
-    // ...and set them to be active
-    glUseProgram(program);
-    
+    // as we are running this program. Every variant is started at once, so
+    // the driver can compile them side by side; the one in use is waited for.
+	shaders.bind_attribute("vPosition", vertex_loc);
+	shaders.bind_attribute("vNorm", normal_loc);
+	shaders.bind_attribute("vOcclusion", occlusion_loc);
+	shaders.bind_attribute("vInstanceRow0", instance_loc);
+	shaders.bind_attribute("vInstanceRow1", instance_loc + 1);
+	shaders.bind_attribute("vInstanceRow2", instance_loc + 2);
+	shaders.bind_attribute("vInstanceColor", instance_loc + 3);
+	shaders.bind_uniform_block("camera", CAMERA_BLOCK_BINDING);
+	shaders.bind_uniform_block("light", LIGHT_BLOCK_BINDING);
+	shaders.bind_uniform_block("material", MATERIAL_BLOCK_BINDING);
+	shaders.bind_uniform_block("cull", CULL_BLOCK_BINDING);
+	shaders.bind_uniform_block("clusters", CLUSTER_BLOCK_BINDING);
+	shaders.bind_sampler("point_lights", LIGHT_TEXTURE_UNIT);
+	shaders.bind_sampler("cluster_ranges", LIGHT_TEXTURE_UNIT + 1);
+	shaders.bind_sampler("cluster_indices", LIGHT_TEXTURE_UNIT + 2);
+	vector<shader_variant> variants;
+	for (int lights = light_count > 0 ? CLUSTERED_LIGHTS : ONE_LIGHT; lights >= ONE_LIGHT; lights--)
+		for (int instanced = instance_count > 0 || !scene_models.empty(); instanced >= 0; instanced--)
+			for (int per_vertex = 0; per_vertex < 2; per_vertex++)
+				for (int with_specular = 1; with_specular >= 0; with_specular--)
+					variants.push_back(shaderVariant(per_vertex, with_specular, instanced, (lighting_mode) lights));
+	for (int instanced = instance_count > 0 || !scene_models.empty(); instanced >= 0; instanced--)
+		variants.push_back(depthVariant(instanced));
+	if (!scene_models.empty() && gpu_culler::supported())
+		variants.push_back(shader_variant("cull_objects.glsl"));
+	shaders.prepare(variants);
+	program = shaders.program(shaderVariant(per_vertex_lighting, specular, drawingInstanced(), lightingMode()));
+	if (program == 0)
+		exit(EXIT_FAILURE);
+	glUseProgram(program);
+	shaders.print_report(cout);
     
-    // this time, we are sending TWO attributes through: the position of each
-    // transformed vertex, and the color we have calculated in tri().
-    GLuint loc, loc2;
     
-    loc = glGetAttribLocation(program, "vPosition");
-    glEnableVertexAttribArray(loc);
-    
-    // the vPosition attribute is a series of 4-vecs of floats, starting at the
-    // beginning of the buffer
-    glVertexAttribPointer(loc, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
-
-    loc2 = glGetAttribLocation(program, "vNorm");
-    glEnableVertexAttribArray(loc2);
-
-    // the vColor attribute is a series of 4-vecs of floats, starting just after
-    // the points in the buffer
-    glVertexAttribPointer(loc2, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(sizeof(vec4)*NumVertices));
-	
-	// set uniform values
-	view_pos = glGetUniformLocation(program, "view_pos");
-	ctm = glGetUniformLocation(program, "ctm");
-	ptm = glGetUniformLocation(program, "ptm");
-	
-	// pass light/material parameters
-	light_spec = glGetUniformLocation(program, "light_spec");
-	light_pos = glGetUniformLocation(program, "light_pos");
-	light_ambi = glGetUniformLocation(program, "light_ambi");
-	light_diff = glGetUniformLocation(program, "light_diff");
-	material_ambi = glGetUniformLocation(program, "material_ambi");
-	material_diff = glGetUniformLocation(program, "material_diff");
-	material_spec = glGetUniformLocation(program, "material_spec");
-	material_shin = glGetUniformLocation(program, "material_shin");
+    // this time, we are sending THREE attributes through: the position of
+    // each vertex, its normal and its baked occlusion. They are pointed at
+    // the model's range once the loader delivers geometry (see
+    // allocateVertexBuffer).
+    glEnableVertexAttribArray(vertex_loc);
+    glEnableVertexAttribArray(normal_loc);
+    glEnableVertexAttribArray(occlusion_loc);
+	
+	// the uniform blocks; the material never changes, so it is written once
+	camera_block.create(CAMERA_BLOCK_BINDING);
+	light_block.create(LIGHT_BLOCK_BINDING);
+	material_block.create(MATERIAL_BLOCK_BINDING);
+	
+	material_uniforms m;
+	copy_uniform(material_ambient, m.ambient);
+	copy_uniform(material_diffuse, m.diffuse);
+	copy_uniform(material_specular, m.specular);
+	m.shininess = material_shininess;
+	m.pad[0] = m.pad[1] = m.pad[2] = 0.0;
+	material_block.set(m);
+	material_block.upload();
+	
+	// the point lights and their cluster lists are texture buffers, bound
+	// once to their units and rewritten every frame
+	if (light_count > 0) {
+		cluster_block.create(CLUSTER_BLOCK_BINDING);
+		GLenum formats[3] = { GL_RGBA32F, GL_R32UI, GL_R32UI };
+		glGenBuffers(3, light_buffers);
+		glGenTextures(3, light_textures);
+		for (int i = 0; i < 3; i++) {
+			glBindBuffer(GL_TEXTURE_BUFFER, light_buffers[i]);
+			glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+			glActiveTexture(GL_TEXTURE0 + LIGHT_TEXTURE_UNIT + i);
+			glBindTexture(GL_TEXTURE_BUFFER, light_textures[i]);
+			glTexBuffer(GL_TEXTURE_BUFFER, formats[i], light_buffers[i]);
+		}
+		glActiveTexture(GL_TEXTURE0);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	}
     
     // set the background color (white)
     glClearColor(1.0, 1.0, 1.0, 1.0); 
+	CheckError();
 }
 
 
@@ -270,48 +1376,128 @@ void display( void )
     // for this example).
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); 
 	
-	GLfloat p = DegreesToRadians*phi;
-	GLfloat t = DegreesToRadians*theta;
-	eye = point4(r*sin(p)*sin(t), r*cos(p), r*sin(p)*cos(t), 1.0);
-	up = normalize(vec4(cross(normalize(cross(normalize(viewer - eye), vec4(0, 1, 0, 0))), normalize(viewer - eye)), 0.0));
-	
-	glUniform4fv(view_pos, 1, eye);
+	updateCamera();
+	shaders.poll();
 	
-	glUniform4fv(light_pos, 1, light_position);
-	glUniform4fv(light_spec, 1, light_specular);
-	glUniform4fv(light_ambi, 1, light_ambient);
-	glUniform4fv(light_diff, 1, light_diffuse);
-	glUniform4fv(material_ambi, 1, material_ambient);
-	glUniform4fv(material_diff, 1, material_diffuse);
-	glUniform4fv(material_spec, 1, material_specular);
-	glUniform1f(material_shin, 100.0);
+	mat4 view = LookAt(eye, viewer, up);
+	mat4 proj = Perspective(FOVY, 1.0, ZNEAR, ZFAR);
+	setCamera(proj, view, tiled_mode ? tilesModel() : mat4());
 	
-	glUniformMatrix4fv(ctm, 1, GL_TRUE, LookAt(eye, viewer, up));
-	glUniformMatrix4fv(ptm, 1, GL_TRUE, Perspective(40, 1.0, 1, 50));
+	// the light is placed in the world, so it moves in eye space with the camera
+	light_uniforms l;
+	copy_uniform(view * light_position, l.position);
+	copy_uniform(light_ambient, l.ambient);
+	copy_uniform(light_diffuse, l.diffuse);
+	copy_uniform(light_specular, l.specular);
+	light_block.set(l);
+	light_block.upload();
 	
-	glBufferSubData( GL_ARRAY_BUFFER, 0, sizeof(vec4)*NumVertices, vertices );
-	glBufferSubData( GL_ARRAY_BUFFER, sizeof(vec4)*NumVertices, sizeof(vec4)*NumVertices, norms );
+	light_report[0] = '\0';
+	if (lightingMode() != ONE_LIGHT && !tiled_mode)
+		updateLightClusters(view);
+	if (measure_overdraw)
+		overdraw.begin_frame();
 	
 	if (bezier_mode && bezier_changed) {
 		loadBezierVertsAndNorms();
-		glBufferData(GL_ARRAY_BUFFER, 2*sizeof(vec4)*NumVertices, NULL, GL_STATIC_DRAW);
-		
-		GLuint loc, loc2;
-		loc = glGetAttribLocation(program, "vPosition");
-		glEnableVertexAttribArray(loc);
-		glVertexAttribPointer(loc, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
-		
-		loc2 = glGetAttribLocation(program, "vNorm");
-		glEnableVertexAttribArray(loc2);
-		glVertexAttribPointer(loc2, 4, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(sizeof(vec4)*NumVertices));
-		
-		glBufferSubData( GL_ARRAY_BUFFER, 0, sizeof(vec4)*NumVertices, vertices );
-		glBufferSubData( GL_ARRAY_BUFFER, sizeof(vec4)*NumVertices, sizeof(vec4)*NumVertices, norms );
+		allocateVertexBuffer(NumVertices);
+		uploadVertexRange(NumVertices, 0, NumVertices, vertices.data(), norms.data(), &occlusion[0]);
 	}
 	bezier_changed = false;
 	
     // draw the VAO:
-    glDrawArrays(GL_TRIANGLES, 0, NumVertices);
+	if (tiled_mode) {
+		drawTiles(proj, view);
+	} else if (!scene_models.empty()) {
+		if (model_ready)
+			drawScene(proj, view);
+		else if (load_stage == "failed")
+			glutSetWindowTitle("Failed to load the scene");
+	} else if (!model_ready) {
+		// whatever part of the finest level has arrived so far
+		if (preview_vertices > 0)
+			glDrawArrays(GL_TRIANGLES, 0, preview_vertices);
+		
+		char title[192];
+		if (load_stage == "failed")
+			snprintf(title, sizeof(title), "Failed to load %s", model_name);
+		else
+			snprintf(title, sizeof(title), "Loading %s - %s (%.0f%%)", model_name, load_stage.c_str(),
+					 100.0 * load_progress);
+		glutSetWindowTitle(title);
+	} else if (!instances.empty()) {
+		drawInstances(proj, view);
+	} else if (bezier_mode) {
+		drawPasses(false, [](GLuint depth) {
+			glUseProgram(depth ? depth : program);
+			glDrawArrays(GL_TRIANGLES, 0, NumVertices);
+		});
+	} else {
+		// pick the coarsest level whose error stays below a pixel at distance r
+		float scale = pixels_per_unit(r, FOVY, glutGet(GLUT_WINDOW_HEIGHT));
+		int lod = select_lod(lods, scale, LOD_PIXEL_TOLERANCE);
+		selectShading(lod_area[lod], scale);
+		
+		cull_stats stats = { 0, 0, 0, 0, lod_count[lod]/3, 0 };
+		if (cluster_culling) {
+			frustum f;
+			extract_frustum(proj * view, f);
+			float eye_pos[3] = { eye.x, eye.y, eye.z };
+			
+			// occluders: the drawn level, or the finest coarser one small
+			// enough; clusters are grown by how far apart the two may be
+			hiz_buffer *occluders = NULL;
+			float margin = 0.0;
+			if (occlusion_culling) {
+				int occ = lod;
+				while (occ + 1 < (int) lods.size() && (int) lods[occ].tris.size()/3 > HIZ_MAX_OCCLUDER_TRIS)
+					occ++;
+				if (occ != lod)
+					margin = lods[occ].error + lods[lod].error;
+				occlusion_depth.begin(proj * view);
+				occlusion_depth.add_occluders(lods[occ].tris, lods[occ].verts, closed_mesh);
+				occlusion_depth.finish();
+				occluders = &occlusion_depth;
+			}
+			
+			stats.tris = 0;
+			draw_firsts.clear();
+			draw_counts.clear();
+			int ranges = cull_meshlets(lod_meshlets[lod], lod_first[lod], f, eye_pos, closed_mesh,
+									   draw_firsts, draw_counts, stats, occluders, margin, front_to_back);
+			if (ranges > 0)
+				drawPasses(false, [&](GLuint depth) {
+					glUseProgram(depth ? depth : program);
+					glMultiDrawArrays(GL_TRIANGLES, &draw_firsts[0], &draw_counts[0], ranges);
+				});
+		} else {
+			drawPasses(false, [&](GLuint depth) {
+				glUseProgram(depth ? depth : program);
+				glDrawArrays(GL_TRIANGLES, lod_first[lod], lod_count[lod]);
+			});
+		}
+		
+		char title[512];
+		snprintf(title, sizeof(title), "Rotate OBJ File - LOD %d: %d tris, error %.2f px, size %.0f px"
+				 " | culled %d/%d clusters (%d occluded), %d tris | hi-z %.2f ms%s%s%s",
+				 lod, lod_count[lod]/3, lods[lod].error * scale, 2.0 * model_radius * scale,
+				 stats.frustum_culled + stats.backface_culled + stats.occlusion_culled, stats.clusters,
+				 stats.occlusion_culled, stats.tris_culled,
+				 cluster_culling && occlusion_culling ? occlusion_depth.stats().raster_ms : 0.0, shading_report,
+				 light_report, overdraw_report);
+		glutSetWindowTitle(title);
+	}
+	// shown in the next frame's title
+	if (measure_overdraw) {
+		overdraw.end_frame(glutGet(GLUT_WINDOW_WIDTH), glutGet(GLUT_WINDOW_HEIGHT));
+		const overdraw_stats &s = overdraw.stats();
+		snprintf(overdraw_report, sizeof(overdraw_report), " | %s%s%.2f shaded per pixel, %.2f depth-only",
+				 depth_prepass ? "pre-pass, " : "", front_to_back ? "front to back, " : "",
+				 s.shaded_per_pixel, s.depth_per_pixel);
+	}
+	// only a mark for the debug layer; polling glGetError every frame would stall
+	if (gl_debug_active())
+		CheckError();
 	
     // move the buffer we drew into to the screen, and give us access to the one
     // that was there before:
@@ -377,13 +1563,44 @@ void mouse_move_translate (int x, int y)
 }
 
 
+// right clicking picks the triangle or Bezier patch under the cursor and
+// prints it along with the hit's (u,v) coordinates
+void mouse_pick(int button, int state, int x, int y)
+{
+	if (button != GLUT_RIGHT_BUTTON || state != GLUT_DOWN || !model_ready || tiled_mode || !scene_models.empty())
+		return;
+	
+	ray pr = pick_ray(x, y, glutGet(GLUT_WINDOW_WIDTH), glutGet(GLUT_WINDOW_HEIGHT),
+					  Perspective(FOVY, 1.0, ZNEAR, ZFAR), LookAt(eye, viewer, up));
+	
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	if (bezier_mode) {
+		patch_hit hit;
+		if (pick_patch(surfaces, surface_bounds, pr, hit))
+			cout << "picked patch " << hit.patch << " at (u,v) = (" << hit.u << ", " << hit.v << ")";
+		else
+			cout << "picked nothing";
+	} else {
+		ray_hit hit;
+		if (pick_tree.intersect(pr, hit)) {
+			const vector<int> &tris = lods[0].tris;
+			cout << "picked triangle " << hit.tri << " (" << tris[3*hit.tri] << " " << tris[3*hit.tri+1]
+				 << " " << tris[3*hit.tri+2] << ") at (u,v) = (" << hit.u << ", " << hit.v << ")";
+		} else {
+			cout << "picked nothing";
+		}
+	}
+	double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+	cout << " in " << us << " us" << endl;
+}
+
+
 // the keyboard callback, called whenever the user types something with the
 // regular keys.
 void mykey(unsigned char key, int mousex, int mousey)
 {
 	if(key=='q'|| key=='Q') {
-		delete vertices;
-		delete norms;
+		gl_debug_print_report(cout);
 		exit(0);
 	}
 	
@@ -391,7 +1608,7 @@ void mykey(unsigned char key, int mousex, int mousey)
 	if (key =='r') {
 		theta = 0;
 		phi = 90.0;
-		r = 5.0;
+		r = home_r;
 		glutPostRedisplay();
 	}
 	
@@ -407,6 +1624,100 @@ void mykey(unsigned char key, int mousex, int mousey)
 		glutPostRedisplay();
 	}
 	
+	// c toggles cluster culling
+	if (key == 'c') {
+		cluster_culling = !cluster_culling;
+		glutPostRedisplay();
+	}
+	
+	// i switches the copies of -instances between one instanced draw and a draw each
+	if (key == 'i' && !instances.empty()) {
+		instanced_submission = !instanced_submission;
+		useShader();
+		glutPostRedisplay();
+	}
+	
+	// m switches the scene between multi-draw indirect and a draw per object
+	if (key == 'm' && !scene_models.empty()) {
+		multi_draw = !multi_draw;
+		glutPostRedisplay();
+	}
+	
+	// g switches the scene between CPU and GPU culling
+	if (key == 'g' && !scene_models.empty()) {
+		if (gpu_culler::supported())
+			gpu_culling = !gpu_culling;
+		else
+			cerr << "GPU culling needs compute shaders and multi-draw indirect" << endl;
+		glutPostRedisplay();
+	}
+	
+	// k compares the GPU's culling with the CPU reference on the next frame
+	if (key == 'k' && gpu_culling) {
+		check_gpu_culling = true;
+		glutPostRedisplay();
+	}
+	
+	// p toggles the depth pre-pass
+	if (key == 'p') {
+		depth_prepass = !depth_prepass;
+		glutPostRedisplay();
+	}
+	
+	// f toggles front-to-back ordering
+	if (key == 'f') {
+		front_to_back = !front_to_back;
+		glutPostRedisplay();
+	}
+	
+	// d toggles counting the fragments shaded per pixel, and reports the last count
+	if (key == 'd') {
+		measure_overdraw = !measure_overdraw;
+		if (!measure_overdraw) {
+			cout << "overdraw: ";
+			print_overdraw_stats(cout, overdraw.stats());
+			overdraw_report[0] = '\0';
+		}
+		glutPostRedisplay();
+	}
+	
+	// o toggles occlusion culling
+	if (key == 'o') {
+		occlusion_culling = !occlusion_culling;
+		glutPostRedisplay();
+	}
+	
+	// b reports how the buffer pools are used
+	if (key == 'b') {
+		cout << "vertex pool: ";
+		vertex_pool.print_report(cout);
+		cout << "index pool: ";
+		index_pool.print_report(cout);
+	}
+	
+	// v cycles per-pixel, per-vertex and automatic lighting
+	if (key == 'v') {
+		shading = (shading_mode) ((shading + 1) % 3);
+		per_vertex_lighting = shading == PER_VERTEX_SHADING;
+		useShader();
+		glutPostRedisplay();
+	}
+	
+	// l cycles -lights between clustered, every light per fragment, and none
+	if (key == 'l' && light_count > 0) {
+		many_lights = many_lights == CLUSTERED_LIGHTS ? ALL_LIGHTS : many_lights == ALL_LIGHTS ? ONE_LIGHT :
+			CLUSTERED_LIGHTS;
+		useShader();
+		glutPostRedisplay();
+	}
+	
+	// s turns the specular highlight on and off
+	if (key == 's') {
+		specular = !specular;
+		useShader();
+		glutPostRedisplay();
+	}
+	
 	// < decreases detail
 	if (key == '<' && bezier_coarseness > MIN_DETAIL) {
 		bezier_coarseness--;
@@ -425,10 +1736,57 @@ void mykey(unsigned char key, int mousex, int mousey)
 
 int main(int argc, char** argv)
 {
-	if (checkIfOBJFileType(argv[1]))
-		loadOBJ(argv[1]);
-	else
-		loadBezier(argv[1]);
+	// the options come first, in any order; the rest is parsed as usual
+	//   -threads n          sizes the shared worker pool
+	//   -weld tolerance     merges vertices closer than that when loading; off otherwise
+	//   -instances n        draws n copies of the model in a grid
+	//   -lights n           adds n point lights around the model
+	float weld_tolerance = NO_WELD;
+	while (argc > 2) {
+		const char *value = argv[2];
+		if (strcmp(argv[1], "-threads") == 0)
+			set_job_workers(atoi(value));
+		else if (strcmp(argv[1], "-weld") == 0)
+			weld_tolerance = atof(value);
+		else if (strcmp(argv[1], "-instances") == 0)
+			instance_count = atoi(value);
+		else if (strcmp(argv[1], "-lights") == 0)
+			light_count = atoi(value);
+		else
+			break;
+		argv[2] = argv[0];
+		argv += 2;
+		argc -= 2;
+	}
+	
+	if (argc < 2) {
+		cerr << "usage: " << argv[0] << " [-threads n] [-weld tolerance] [-instances n] [-lights n] file [file ...]" << endl;
+		cerr << "       " << argv[0] << " -bench-bvh file" << endl;
+		cerr << "       " << argv[0] << " -render file image.(ppm|png) [size]" << endl;
+		cerr << "       " << argv[0] << " -bake-ao file [rays]" << endl;
+		cerr << "       " << argv[0] << " -build-tiles file.obj out.tiles [max_tris]" << endl;
+		cerr << "       " << argv[0] << " -compress file out.pmc [position_bits]" << endl;
+		cerr << "       " << argv[0] << " -tiles file.tiles [budget_mb]" << endl;
+		return 1;
+	}
+	
+	// tool modes run headless and exit
+	if (strcmp(argv[1], "-bench-bvh") == 0 && argc > 2) {
+		vector<int> tris;
+		vector<float> verts;
+		if (!read_mesh_file(argv[2], tris, verts))
+			return 1;
+		bvh_benchmark(tris, verts, 1000000);
+		return 0;
+	}
+	if (strcmp(argv[1], "-render") == 0 && argc > 3)
+		return renderHeadless(argv[2], argv[3], argc > 4 ? atoi(argv[4]) : 512);
+	if (strcmp(argv[1], "-bake-ao") == 0 && argc > 2)
+		return bakeOcclusion(argv[2], argc > 3 ? atoi(argv[3]) : AO_DEFAULT_RAYS);
+	if (strcmp(argv[1], "-compress") == 0 && argc > 3)
+		return compressMesh(argv[2], argv[3], argc > 4 ? atoi(argv[4]) : CODEC_DEFAULT_POSITION_BITS);
+	if (strcmp(argv[1], "-build-tiles") == 0 && argc > 3)
+		return build_tile_file(argv[2], argv[3], argc > 4 ? atoi(argv[4]) : TILE_DEFAULT_MAX_TRIS) ? 0 : 1;
 	
 	// std::cout << sizeof(points[0]) << ", " << sizeof(points) << endl;
 
@@ -446,6 +1804,9 @@ int main(int argc, char** argv)
     // when the mouse is moved, call this function!
     // you can change this to mouse_move_translate to see how it works
     glutMotionFunc(mouse_move_rotate);
+    
+    // right clicks pick what is under the cursor
+    glutMouseFunc(mouse_pick);
  
     // for any keyboard activity, here is the callback:
     glutKeyboardFunc(mykey);
@@ -454,12 +1815,50 @@ int main(int argc, char** argv)
     // initialize the extension manager: sometimes needed, sometimes not!
     glewInit();
 #endif
+	// GL errors and warnings are reported by the driver as they happen
+	gl_debug_init();
+
+	// several files make a scene, their models loaded side by side; every
+	// object is drawn as its own instance, which needs base instances
+	if (argc > 2 && strcmp(argv[1], "-tiles") != 0) {
+		if (!render_queue::base_instance_supported()) {
+			cerr << "Drawing several files as a scene needs GL 4.2 or ARB_base_instance" << endl;
+			return 1;
+		}
+		for (int i = 1; i < argc; i++) {
+			scene_model sm;
+			sm.name = argv[i];
+			sm.loader = NULL;
+			sm.model = NULL;
+			sm.radius = 0.0;
+			sm.layout = -1;
+			sm.base = 0;
+			scene_models.push_back(sm);
+		}
+	}
 
     // call the init() function, defined above:
     init();
     
     // enable the z-buffer for hidden surface removel:
     glEnable(GL_DEPTH_TEST);
+    
+    // the window is up; the model follows from the loader thread (a thread
+    // per model for a scene), or is paged from a tile file as it is drawn
+    if (strcmp(argv[1], "-tiles") == 0 && argc > 2) {
+        if (!openTiles(argv[2], argc > 3 ? atoi(argv[3]) : TILE_DEFAULT_BUDGET_MB))
+            return 1;
+    } else if (!scene_models.empty()) {
+        for (size_t i = 0; i < scene_models.size(); i++) {
+            scene_models[i].loader = new model_loader;
+            scene_models[i].loader->start(scene_models[i].name.c_str(), weld_tolerance);
+        }
+        glutTimerFunc(0, pollScene, 0);
+    } else {
+        model_name = argv[1];
+        loader.start(argv[1], weld_tolerance);
+        glutTimerFunc(0, pollLoader, 0);
+    }
 
     // once we call this, we no longer have control except through the callbacks:
     glutMainLoop();
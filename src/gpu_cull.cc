@@ -0,0 +1,196 @@
+//
+//  gpu_cull.cc
+//  pipeline
+//
+
+#include <algorithm>
+#include <cmath>
+#include "gpu_cull.h"
+#include "meshlet.h"
+
+using namespace std;
+
+// Storage buffer bindings, as in cull_objects.glsl
+enum { OBJECT_BINDING = 0, LOD_BINDING = 1, COMMAND_BINDING = 2, COUNT_BINDING = 3, FIRST_BINDING = 4 };
+
+void set_cull_uniforms(const mat4 &proj_view, const vec4 &eye, float fovy, int viewport_h,
+					   float pixel_tolerance, float min_distance, int objects, cull_uniforms &u) {
+	frustum f;
+	extract_frustum(proj_view, f);
+	for (int p = 0; p < 6; p++)
+		for (int k = 0; k < 4; k++)
+			u.planes[p][k] = f.planes[p][k];
+	copy_uniform(eye, u.eye);
+	u.lod_scale = viewport_h / (2.0f * tanf(0.5f * fovy * (float) M_PI / 180.0f));
+	u.pixel_tolerance = pixel_tolerance;
+	u.min_distance = min_distance;
+	u.objects = objects;
+}
+
+void cull_objects_cpu(const vector<cull_object> &objects, const vector<cull_lod> &lods,
+					  const vector<GLuint> &bucket_first, const cull_uniforms &u,
+					  vector<draw_arrays_command> &commands, vector<GLuint> &counts) {
+	commands.assign(bucket_first.empty() ? 0 : bucket_first.back(), draw_arrays_command());
+	counts.assign(bucket_first.empty() ? 0 : bucket_first.size() - 1, 0);
+	for (size_t i = 0; i < objects.size() && i < u.objects; i++) {
+		const cull_object &o = objects[i];
+		bool inside = true;
+		for (int p = 0; p < 6 && inside; p++) {
+			const GLfloat *pl = u.planes[p];
+			inside = pl[0]*o.sphere[0] + pl[1]*o.sphere[1] + pl[2]*o.sphere[2] + pl[3] >= -o.sphere[3];
+		}
+		if (!inside)
+			continue;
+		float d[3] = { u.eye[0] - o.sphere[0], u.eye[1] - o.sphere[1], u.eye[2] - o.sphere[2] };
+		float distance = max(u.min_distance, sqrtf(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]));
+		float pixels = u.lod_scale / distance * o.scale;
+		GLuint best = 0;
+		for (GLuint l = 1; l < o.lod_levels; l++)
+			if (lods[o.first_lod + l].error * pixels <= u.pixel_tolerance)
+				best = l;
+		const cull_lod &lod = lods[o.first_lod + best];
+		if (lod.count == 0)
+			continue;
+		draw_arrays_command &c = commands[bucket_first[o.bucket] + counts[o.bucket]++];
+		c.count = lod.count;
+		c.instance_count = 1;
+		c.first = lod.first;
+		c.base_instance = o.instance;
+	}
+}
+
+gpu_culler::gpu_culler()
+	: object_buffer(0), lod_buffer(0), command_buffer(0), count_buffer(0), first_buffer(0),
+	  timer(0), timing(false), last_ms(-1.0), n_objects(0), draw_count(false) {}
+
+bool gpu_culler::supported() {
+#if defined(GLEW_ARB_compute_shader) && defined(GLEW_ARB_shader_storage_buffer_object)
+	return GLEW_ARB_compute_shader && GLEW_ARB_shader_storage_buffer_object &&
+		render_queue::multi_draw_supported();
+#else
+	return false;
+#endif
+}
+
+static void storage_data(GLuint &buffer, size_t bytes, const void *data, GLenum usage) {
+	if (buffer == 0)
+		glGenBuffers(1, &buffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+	// an empty buffer cannot be bound
+	glBufferData(GL_SHADER_STORAGE_BUFFER, max(bytes, (size_t) 16), data, usage);
+}
+
+void gpu_culler::set_objects(const vector<cull_object> &objects, const vector<cull_lod> &lods, int buckets) {
+	if (object_buffer == 0) {
+		block.create(CULL_BLOCK_BINDING);
+#ifdef GLEW_ARB_indirect_parameters
+		draw_count = GLEW_ARB_indirect_parameters;
+#endif
+	}
+	n_objects = (int) objects.size();
+	first.assign(buckets + 1, 0);
+	for (size_t i = 0; i < objects.size(); i++)
+		first[objects[i].bucket + 1]++;
+	for (int b = 0; b < buckets; b++)
+		first[b + 1] += first[b];
+	zero_counts.assign(buckets, 0);
+	zero_commands.assign(draw_count ? 0 : objects.size(), draw_arrays_command());
+
+	storage_data(object_buffer, sizeof(cull_object) * objects.size(), objects.empty() ? NULL : &objects[0],
+				 GL_STATIC_DRAW);
+	storage_data(lod_buffer, sizeof(cull_lod) * lods.size(), lods.empty() ? NULL : &lods[0], GL_STATIC_DRAW);
+	storage_data(command_buffer, sizeof(draw_arrays_command) * objects.size(), NULL, GL_DYNAMIC_DRAW);
+	storage_data(count_buffer, sizeof(GLuint) * buckets, NULL, GL_DYNAMIC_DRAW);
+	storage_data(first_buffer, sizeof(GLuint) * first.size(), &first[0], GL_STATIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void gpu_culler::cull(GLuint program, const cull_uniforms &u) {
+	if (program == 0 || n_objects == 0)
+		return;
+	// the time of the cull before last, if it is in, without waiting
+	if (timing) {
+		GLint available = 0;
+		glGetQueryObjectiv(timer, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available) {
+			GLuint64 ns = 0;
+			glGetQueryObjectui64v(timer, GL_QUERY_RESULT, &ns);
+			last_ms = ns / 1e6;
+			timing = false;
+		}
+	}
+	if (timer == 0)
+		glGenQueries(1, &timer);
+
+	block.set(u);
+	block.upload();
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, count_buffer);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint) * zero_counts.size(), &zero_counts[0]);
+	if (!draw_count) {
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, command_buffer);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(draw_arrays_command) * zero_commands.size(),
+						&zero_commands[0]);
+	}
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, OBJECT_BINDING, object_buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LOD_BINDING, lod_buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, COMMAND_BINDING, command_buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, COUNT_BINDING, count_buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, FIRST_BINDING, first_buffer);
+
+	glUseProgram(program);
+	if (!timing)
+		glBeginQuery(GL_TIME_ELAPSED, timer);
+	glDispatchCompute((n_objects + GPU_CULL_GROUP_SIZE - 1) / GPU_CULL_GROUP_SIZE, 1, 1);
+	if (!timing) {
+		glEndQuery(GL_TIME_ELAPSED);
+		timing = true;
+	}
+	// the draws read what the shader wrote as commands and counts
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+void gpu_culler::draw(int bucket) {
+	GLsizei capacity = first[bucket + 1] - first[bucket];
+	if (capacity == 0)
+		return;
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer);
+	const GLvoid *commands = BUFFER_OFFSET(sizeof(draw_arrays_command) * first[bucket]);
+#ifdef GLEW_ARB_indirect_parameters
+	if (draw_count) {
+		glBindBuffer(GL_PARAMETER_BUFFER_ARB, count_buffer);
+		glMultiDrawArraysIndirectCountARB(GL_TRIANGLES, commands, sizeof(GLuint) * bucket, capacity, 0);
+		glBindBuffer(GL_PARAMETER_BUFFER_ARB, 0);
+	} else
+#endif
+	{
+		// culled objects left zero commands, which draw nothing
+		glMultiDrawArraysIndirect(GL_TRIANGLES, commands, capacity, 0);
+	}
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+
+void gpu_culler::read_back(vector<draw_arrays_command> &commands, vector<GLuint> &counts) {
+	commands.resize(n_objects);
+	counts.resize(zero_counts.size());
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	if (n_objects > 0) {
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, command_buffer);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(draw_arrays_command) * n_objects, &commands[0]);
+	}
+	if (!counts.empty()) {
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, count_buffer);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint) * counts.size(), &counts[0]);
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void gpu_culler::release() {
+	GLuint buffers[5] = { object_buffer, lod_buffer, command_buffer, count_buffer, first_buffer };
+	glDeleteBuffers(5, buffers);
+	object_buffer = lod_buffer = command_buffer = count_buffer = first_buffer = 0;
+	if (timer)
+		glDeleteQueries(1, &timer);
+	timer = 0;
+	timing = false;
+	n_objects = 0;
+}
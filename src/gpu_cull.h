@@ -0,0 +1,115 @@
+//
+//  gpu_cull.h
+//  pipeline
+//
+//  Frustum culling and level-of-detail selection of many objects in a
+//  compute shader, which compacts the draws of the visible ones into
+//  indirect commands that are drawn without the CPU seeing them. The same
+//  test runs on the CPU for comparison.
+//
+
+#ifndef gpu_cull_h
+#define gpu_cull_h
+
+#include <iostream>
+#include <vector>
+#include "amath.h"
+#include "render_queue.h"
+#include "uniform_blocks.h"
+using namespace std;
+
+const int GPU_CULL_GROUP_SIZE = 64;   // local_size_x of cull_objects.glsl
+
+/* Mirrors of the shader's std430 structs. Objects are grouped in buckets,
+ * one per program and vertex layout, and each bucket's commands go to its
+ * own part of the command buffer, so a bucket is one draw.
+ */
+struct cull_object {
+	GLfloat sphere[4];      // world center and radius
+	GLfloat scale;          // world units per model unit, for the level errors
+	GLuint first_lod;       // into the level table
+	GLuint lod_levels;
+	GLuint instance;        // the draw's base instance
+	GLuint bucket;
+	GLuint pad[3];
+};
+
+struct cull_lod {
+	GLuint first, count;    // vertices, in the object's layout
+	GLfloat error;          // in model units
+	GLuint pad;
+};
+
+// The std140 block "cull"
+struct cull_uniforms {
+	GLfloat planes[6][4];   // world-space frustum, normalized
+	GLfloat eye[4];
+	GLfloat lod_scale;      // pixels per unit at unit distance
+	GLfloat pixel_tolerance;
+	GLfloat min_distance;
+	GLuint objects;
+};
+
+void set_cull_uniforms(const mat4 &proj_view, const vec4 &eye, float fovy, int viewport_h,
+					   float pixel_tolerance, float min_distance, int objects, cull_uniforms &u);
+
+/* Culls on the CPU exactly as the shader does, writing each bucket's
+ * commands from bucket_first[b] on in object order, and how many there are
+ * into counts.
+ */
+void cull_objects_cpu(const vector<cull_object> &objects, const vector<cull_lod> &lods,
+					  const vector<GLuint> &bucket_first, const cull_uniforms &u,
+					  vector<draw_arrays_command> &commands, vector<GLuint> &counts);
+
+/* The GPU side: object and level tables in shader storage buffers, a
+ * command buffer with a region per bucket and a counter per bucket. With
+ * ARB_indirect_parameters the counters give the draw counts; without it
+ * the commands are cleared each frame and every region is drawn in full.
+ */
+class gpu_culler {
+public:
+	gpu_culler();
+
+	// Needs compute shaders, storage buffers and multi-draw indirect (GL 4.3)
+	static bool supported();
+
+	/* Uploads the tables; objects must be sorted by bucket. Called again
+	 * when objects are added or removed, not when the view moves.
+	 */
+	void set_objects(const vector<cull_object> &objects, const vector<cull_lod> &lods, int buckets);
+
+	// Runs program (cull_objects.glsl) over every object
+	void cull(GLuint program, const cull_uniforms &u);
+
+	// Draws what cull() left in bucket b, with the layout and program in place
+	void draw(int bucket);
+
+	// Reads the last cull's commands and counts back, stalling the GPU
+	void read_back(vector<draw_arrays_command> &commands, vector<GLuint> &counts);
+
+	const vector<GLuint> &bucket_first() const { return first; }
+	int objects() const { return n_objects; }
+
+	// Milliseconds the GPU spent culling, a frame or two late; -1 until known
+	double cull_ms() const { return last_ms; }
+
+	// Deletes the buffers; needs the GL context
+	void release();
+
+private:
+	GLuint object_buffer, lod_buffer, command_buffer, count_buffer, first_buffer;
+	GLuint timer;
+	bool timing;
+	double last_ms;
+	int n_objects;
+	vector<GLuint> first;           // bucket regions, and the end of the last
+	vector<GLuint> zero_counts;
+	vector<draw_arrays_command> zero_commands;
+	uniform_block<cull_uniforms> block;
+	bool draw_count;                // ARB_indirect_parameters
+
+	gpu_culler(const gpu_culler &);
+	gpu_culler &operator= (const gpu_culler &);
+};
+
+#endif /* gpu_cull_h */
@@ -0,0 +1,257 @@
+//
+//  halfedge.cc
+//  pipeline
+//
+
+#include <stdint.h>
+#include "halfedge.h"
+#include "parallel.h"
+
+using namespace std;
+
+// Undirected key of the edge (a, b)
+static inline uint64_t edge_key(int a, int b) {
+	if (a > b) { int t = a; a = b; b = t; }
+	return ((uint64_t) (uint32_t) a << 32) | (uint32_t) b;
+}
+
+static inline uint64_t edge_hash(uint64_t key) {
+	key ^= key >> 29;
+	return key * 0x9E3779B97F4A7C15ull;
+}
+
+bool halfedge_mesh::build(const vector<int> &t, int nv) {
+	tris = &t;
+	n_verts = nv;
+	twin.clear();
+	vert_he.clear();
+
+	info.faces = (int) t.size() / 3;
+	info.verts = nv;
+	info.boundary_edges = info.non_manifold_edges = 0;
+	info.non_manifold_verts = info.isolated_verts = info.degenerate_faces = 0;
+
+	if (t.size() % 3 != 0) {
+		std::cerr << "Half-edge error: index count is not a multiple of 3" << std::endl;
+		return false;
+	}
+	for (size_t i = 0; i < t.size(); i++) {
+		if (t[i] < 0 || t[i] >= nv) {
+			std::cerr << "Half-edge error: invalid vertex index " << t[i]
+					  << " in face " << i / 3 << std::endl;
+			return false;
+		}
+	}
+
+	match_edges();
+	find_vertex_halfedges();
+	classify_vertices();
+	return true;
+}
+
+/* Half-edges are bucketed by the hash of their undirected key (a two pass
+ * counting sort done in parallel over chunks), then every bucket is matched
+ * independently with a small open addressing table. Buckets are sized to
+ * keep their tables cache resident.
+ */
+void halfedge_mesh::match_edges() {
+	const vector<int> &t = *tris;
+	const size_t n_he = t.size();
+	twin.assign(n_he, BOUNDARY);
+	if (n_he == 0)
+		return;
+
+	int bits = 0;
+	while ((n_he >> bits) > 65536 && bits < 12)
+		bits++;
+	const size_t parts = (size_t) 1 << bits;
+	const size_t chunk = 1 << 16;
+	const size_t n_chunks = (n_he + chunk - 1) / chunk;
+
+	vector<uint32_t> offsets(n_chunks * parts, 0);
+	#define PART_OF(key) (bits ? (size_t) (edge_hash(key) >> (64 - bits)) : 0)
+
+	parallel_for(n_chunks, 1, [&](size_t cb, size_t ce) {
+		for (size_t c = cb; c < ce; c++) {
+			size_t end = (c + 1) * chunk < n_he ? (c + 1) * chunk : n_he;
+			uint32_t *cnt = &offsets[c * parts];
+			for (size_t h = c * chunk; h < end; h++)
+				cnt[PART_OF(edge_key(t[h], t[next((int) h)]))]++;
+		}
+	});
+
+	vector<uint32_t> part_start(parts + 1, 0);
+	uint32_t running = 0;
+	for (size_t p = 0; p < parts; p++) {
+		part_start[p] = running;
+		for (size_t c = 0; c < n_chunks; c++) {
+			uint32_t n = offsets[c * parts + p];
+			offsets[c * parts + p] = running;
+			running += n;
+		}
+	}
+	part_start[parts] = running;
+
+	vector<int> order(n_he);
+	parallel_for(n_chunks, 1, [&](size_t cb, size_t ce) {
+		for (size_t c = cb; c < ce; c++) {
+			size_t end = (c + 1) * chunk < n_he ? (c + 1) * chunk : n_he;
+			uint32_t *pos = &offsets[c * parts];
+			for (size_t h = c * chunk; h < end; h++)
+				order[pos[PART_OF(edge_key(t[h], t[next((int) h)]))]++] = (int) h;
+		}
+	});
+	#undef PART_OF
+
+	struct slot {
+		uint64_t key;
+		int first, second, count;
+	};
+	const uint64_t EMPTY = ~(uint64_t) 0;
+
+	parallel_for(parts, 1, [&](size_t pb, size_t pe) {
+		vector<slot> table;
+		for (size_t p = pb; p < pe; p++) {
+			size_t begin = part_start[p], end = part_start[p + 1];
+			size_t size = 16;
+			while (size < 2 * (end - begin))
+				size <<= 1;
+			slot empty = { EMPTY, -1, -1, 0 };
+			table.assign(size, empty);
+			const size_t mask = size - 1;
+
+			for (size_t i = begin; i < end; i++) {
+				int h = order[i];
+				int a = t[h], b = t[next(h)];
+				if (a == b)
+					continue;
+				uint64_t key = edge_key(a, b);
+				size_t s = edge_hash(key) & mask;
+				while (table[s].key != EMPTY && table[s].key != key)
+					s = (s + 1) & mask;
+				slot &e = table[s];
+				e.key = key;
+				if (e.count == 0) e.first = h;
+				else if (e.count == 1) e.second = h;
+				e.count++;
+			}
+
+			for (size_t i = begin; i < end; i++) {
+				int h = order[i];
+				int a = t[h], b = t[next(h)];
+				if (a == b) {
+					twin[h] = NON_MANIFOLD;
+					continue;
+				}
+				uint64_t key = edge_key(a, b);
+				size_t s = edge_hash(key) & mask;
+				while (table[s].key != key)
+					s = (s + 1) & mask;
+				const slot &e = table[s];
+				if (e.count == 1)
+					twin[h] = BOUNDARY;
+				else if (e.count == 2 && t[e.first] == t[next(e.second)])
+					twin[h] = (h == e.first) ? e.second : e.first;
+				else
+					twin[h] = NON_MANIFOLD;
+			}
+		}
+	});
+
+	for (size_t h = 0; h < n_he; h++) {
+		if (twin[h] == BOUNDARY) info.boundary_edges++;
+		else if (twin[h] == NON_MANIFOLD) info.non_manifold_edges++;
+	}
+	for (size_t f = 0; f < n_he; f += 3)
+		if (t[f] == t[f+1] || t[f+1] == t[f+2] || t[f] == t[f+2])
+			info.degenerate_faces++;
+}
+
+void halfedge_mesh::find_vertex_halfedges() {
+	const vector<int> &t = *tris;
+	vert_he.assign(n_verts, -1);
+	for (size_t h = 0; h < t.size(); h++) {
+		int v = t[h];
+		if (vert_he[v] < 0 || twin[h] < 0)
+			vert_he[v] = (int) h;
+	}
+}
+
+/* A vertex is manifold if walking its fan from vertex_halfedge() reaches
+ * every face that references it.
+ */
+void halfedge_mesh::classify_vertices() {
+	const vector<int> &t = *tris;
+	vector<int> incident(n_verts, 0);
+	for (size_t h = 0; h < t.size(); h++)
+		incident[t[h]]++;
+
+	int non_manifold = 0, isolated = 0;
+	for (int v = 0; v < n_verts; v++) {
+		int start = vert_he[v];
+		if (start < 0) {
+			isolated++;
+			continue;
+		}
+		int walked = 0;
+		int h = start;
+		do {
+			walked++;
+			h = rotate(h);
+		} while (h >= 0 && h != start && walked <= incident[v]);
+		if (walked != incident[v])
+			non_manifold++;
+	}
+	info.non_manifold_verts = non_manifold;
+	info.isolated_verts = isolated;
+}
+
+bool halfedge_mesh::is_boundary_vertex(int v) const {
+	int h = vert_he[v];
+	return h >= 0 && twin[h] < 0;
+}
+
+void halfedge_mesh::one_ring(int v, vector<int> &ring) const {
+	ring.clear();
+	int start = vert_he[v];
+	if (start < 0)
+		return;
+	int h = start, last = start;
+	do {
+		ring.push_back(dest(h));
+		last = h;
+		h = rotate(h);
+	} while (h >= 0 && h != start);
+	// an open fan also ends at the far vertex of the last face
+	if (h < 0)
+		ring.push_back(origin(prev(last)));
+}
+
+void halfedge_mesh::vertex_faces(int v, vector<int> &faces) const {
+	faces.clear();
+	int start = vert_he[v];
+	if (start < 0)
+		return;
+	int h = start;
+	do {
+		faces.push_back(face(h));
+		h = rotate(h);
+	} while (h >= 0 && h != start);
+}
+
+void halfedge_mesh::boundary_edges(vector<int> &edges) const {
+	edges.clear();
+	for (size_t h = 0; h < twin.size(); h++)
+		if (twin[h] == BOUNDARY)
+			edges.push_back((int) h);
+}
+
+void halfedge_mesh::print_report(ostream &os) const {
+	os << "half-edge mesh: " << info.faces << " faces, " << info.verts << " verts, "
+	   << info.boundary_edges << " boundary edges, "
+	   << info.non_manifold_edges << " non-manifold edges, "
+	   << info.non_manifold_verts << " non-manifold verts, "
+	   << info.isolated_verts << " isolated verts, "
+	   << info.degenerate_faces << " degenerate faces ("
+	   << memory_bytes() / 1024 << " KB)" << std::endl;
+}
@@ -0,0 +1,103 @@
+//
+//  halfedge.h
+//  pipeline
+//
+//  Compact index-based half-edge mesh built on top of the tris vector
+//  produced by read_wavefront_file.
+//
+
+#ifndef halfedge_h
+#define halfedge_h
+
+#include <iostream>
+#include <vector>
+using namespace std;
+
+/* Half-edge h is the edge of face h/3 going from tris[h] to tris[next(h)],
+ * so faces, origins and next/prev pointers are implicit in the index
+ * buffer and only the opposite links are stored.
+ *
+ * Memory: 4 bytes per half-edge (12 bytes per triangle) for the opposite
+ * links plus 4 bytes per vertex for the outgoing half-edge, which is about
+ * 14 bytes per triangle on closed meshes (V ~ F/2). The tris vector is
+ * referenced, not copied, and must outlive the mesh. Building needs an extra
+ * 12 bytes per triangle of scratch space that is released afterwards.
+ */
+class halfedge_mesh {
+public:
+	// values stored in place of an opposite half-edge
+	enum { BOUNDARY = -1, NON_MANIFOLD = -2 };
+
+	struct stats {
+		int faces;
+		int verts;
+		int boundary_edges;       // half-edges without an opposite
+		int non_manifold_edges;   // half-edges on edges shared by != 2 faces or misoriented
+		int non_manifold_verts;   // vertices whose faces do not form a single fan
+		int isolated_verts;       // vertices not referenced by any face
+		int degenerate_faces;     // faces with a repeated vertex index
+	};
+
+	halfedge_mesh() : tris(NULL), n_verts(0) {}
+
+	/* Builds the connectivity in linear time. Edge matching is done by
+	 * hashing each half-edge's undirected key into partitions that are
+	 * matched in parallel. Returns false if nothing could be built.
+	 */
+	bool build(const vector<int> &tris, int n_verts);
+
+	int num_faces() const { return (int) twin.size() / 3; }
+	int num_halfedges() const { return (int) twin.size(); }
+	int num_verts() const { return n_verts; }
+
+	static int face(int h) { return h / 3; }
+	static int next(int h) { return (h % 3 == 2) ? h - 2 : h + 1; }
+	static int prev(int h) { return (h % 3 == 0) ? h + 2 : h - 1; }
+
+	int origin(int h) const { return (*tris)[h]; }
+	int dest(int h) const { return (*tris)[next(h)]; }
+
+	// Opposite half-edge, or BOUNDARY / NON_MANIFOLD
+	int opposite(int h) const { return twin[h]; }
+	bool has_opposite(int h) const { return twin[h] >= 0; }
+
+	/* Outgoing half-edge of v, or -1 for isolated vertices. For boundary
+	 * vertices this is the outgoing boundary half-edge so that a walk with
+	 * rotate() visits the whole fan.
+	 */
+	int vertex_halfedge(int v) const { return vert_he[v]; }
+
+	// Next outgoing half-edge around origin(h), -1 once a border is reached
+	int rotate(int h) const { return twin[prev(h)] >= 0 ? twin[prev(h)] : -1; }
+
+	bool is_boundary_edge(int h) const { return twin[h] == BOUNDARY; }
+	bool is_boundary_vertex(int v) const;
+
+	// Neighbouring vertices / faces of v in fan order
+	void one_ring(int v, vector<int> &ring) const;
+	void vertex_faces(int v, vector<int> &faces) const;
+
+	// Half-edges whose opposite is BOUNDARY
+	void boundary_edges(vector<int> &edges) const;
+
+	const stats &report() const { return info; }
+	void print_report(ostream &os) const;
+
+	// Bytes held by the connectivity (excluding the referenced tris)
+	size_t memory_bytes() const {
+		return twin.capacity() * sizeof(int) + vert_he.capacity() * sizeof(int);
+	}
+
+private:
+	const vector<int> *tris;
+	int n_verts;
+	vector<int> twin;
+	vector<int> vert_he;
+	stats info;
+
+	void match_edges();
+	void find_vertex_halfedges();
+	void classify_vertices();
+};
+
+#endif /* halfedge_h */
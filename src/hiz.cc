@@ -0,0 +1,242 @@
+//
+//  hiz.cc
+//  pipeline
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include "hiz.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+const float FAR_DEPTH = 1.0f;
+
+hiz_buffer::hiz_buffer(int width, int height) : w(width), h(height) {
+	for (int lw = w, lh = h; ; lw = (lw + 1) / 2, lh = (lh + 1) / 2) {
+		int stride = (lw + 3) & ~3;
+		widths.push_back(lw);
+		heights.push_back(lh);
+		strides.push_back(stride);
+		levels.push_back(vector<float>((size_t) stride * lh, FAR_DEPTH));
+		if (lw == 1 && lh == 1)
+			break;
+	}
+	for (int i = 0; i < 16; i++)
+		m[i] = i % 5 == 0 ? 1.0f : 0.0f;
+	frame_stats = hiz_stats();
+}
+
+void hiz_buffer::begin(const float *matrix) {
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (int i = 0; i < 16; i++)
+		m[i] = matrix[i];
+	fill(levels[0].begin(), levels[0].end(), FAR_DEPTH);
+	frame_stats = hiz_stats();
+	frame_stats.raster_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+/* a, b and c are (x, y, z) in pixels and NDC depth, counter-clockwise on
+ * screen. Pixels are sampled at their centres, four at a time.
+ */
+void hiz_buffer::raster_triangle(const float *a, const float *b, const float *c) {
+	float area = (b[0] - a[0]) * (c[1] - a[1]) - (b[1] - a[1]) * (c[0] - a[0]);
+	if (!(area > 0.0f))
+		return;
+	// pixels whose centres fall in the triangle's box
+	int x0 = max(0, (int) ceilf(min(a[0], min(b[0], c[0])) - 0.5f));
+	int x1 = min(w - 1, (int) floorf(max(a[0], max(b[0], c[0])) - 0.5f));
+	int y0 = max(0, (int) ceilf(min(a[1], min(b[1], c[1])) - 0.5f));
+	int y1 = min(h - 1, (int) floorf(max(a[1], max(b[1], c[1])) - 0.5f));
+	if (x0 > x1 || y0 > y1)
+		return;
+	frame_stats.rasterized_tris++;
+
+	const float *v[3] = { a, b, c };
+	float ea[3], eb[3], ec[3];
+	for (int i = 0; i < 3; i++) {
+		const float *p = v[i], *q = v[(i + 1) % 3];
+		ea[i] = p[1] - q[1];
+		eb[i] = q[0] - p[0];
+		ec[i] = -ea[i] * p[0] - eb[i] * p[1];
+	}
+	float dzdx = ((b[2] - a[2]) * (c[1] - a[1]) - (c[2] - a[2]) * (b[1] - a[1])) / area;
+	float dzdy = ((c[2] - a[2]) * (b[0] - a[0]) - (b[2] - a[2]) * (c[0] - a[0])) / area;
+	float z0 = a[2] - dzdx * a[0] - dzdy * a[1];
+	float z_max = max(a[2], max(b[2], c[2]));
+
+	vector<float> &depth = levels[0];
+	int stride = strides[0];
+	x0 &= ~3;
+	for (int y = y0; y <= y1; y++) {
+		float cy = y + 0.5f, cx = x0 + 0.5f;
+		float *row = &depth[(size_t) y * stride];
+#ifdef __SSE2__
+		const __m128 lane = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+		__m128 e[3], step[3];
+		for (int i = 0; i < 3; i++) {
+			e[i] = _mm_add_ps(_mm_set1_ps(ea[i] * cx + eb[i] * cy + ec[i]), _mm_mul_ps(lane, _mm_set1_ps(ea[i])));
+			step[i] = _mm_set1_ps(4.0f * ea[i]);
+		}
+		__m128 z = _mm_add_ps(_mm_set1_ps(z0 + dzdx * cx + dzdy * cy), _mm_mul_ps(lane, _mm_set1_ps(dzdx)));
+		__m128 z_step = _mm_set1_ps(4.0f * dzdx), z_cap = _mm_set1_ps(z_max), zero = _mm_setzero_ps();
+		for (int x = x0; x <= x1; x += 4) {
+			__m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e[0], zero), _mm_cmpge_ps(e[1], zero)),
+									   _mm_cmpge_ps(e[2], zero));
+			if (_mm_movemask_ps(inside)) {
+				__m128 old = _mm_loadu_ps(row + x);
+				__m128 nearer = _mm_min_ps(old, _mm_min_ps(z, z_cap));
+				_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, old)));
+			}
+			for (int i = 0; i < 3; i++)
+				e[i] = _mm_add_ps(e[i], step[i]);
+			z = _mm_add_ps(z, z_step);
+		}
+#else
+		for (int x = x0; x <= x1; x++) {
+			float px = x + 0.5f;
+			if (ea[0] * px + eb[0] * cy + ec[0] >= 0.0f && ea[1] * px + eb[1] * cy + ec[1] >= 0.0f &&
+				ea[2] * px + eb[2] * cy + ec[2] >= 0.0f)
+				row[x] = min(row[x], min(z0 + dzdx * px + dzdy * cy, z_max));
+		}
+#endif
+	}
+}
+
+void hiz_buffer::add_occluders(const vector<int> &tris, const vector<float> &verts, bool cull_backfaces) {
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	// every vertex to pixels and depth once; w < 0 marks those not usable
+	size_t n = verts.size() / 3;
+	screen.resize(4 * n);
+	for (size_t i = 0; i < n; i++) {
+		const float *p = &verts[3 * i];
+		float c[4];
+		for (int r = 0; r < 4; r++)
+			c[r] = m[4 * r] * p[0] + m[4 * r + 1] * p[1] + m[4 * r + 2] * p[2] + m[4 * r + 3];
+		float *s = &screen[4 * i];
+		if (c[3] <= 0.0f || c[2] < -c[3]) {
+			s[3] = -1.0f;
+			continue;
+		}
+		float inv_w = 1.0f / c[3];
+		s[0] = (c[0] * inv_w * 0.5f + 0.5f) * w;
+		s[1] = (c[1] * inv_w * 0.5f + 0.5f) * h;
+		s[2] = c[2] * inv_w;
+		s[3] = 1.0f;
+	}
+
+	for (size_t t = 0; t + 2 < tris.size(); t += 3) {
+		frame_stats.occluder_tris++;
+		const float *a = &screen[4 * tris[t]], *b = &screen[4 * tris[t + 1]], *c = &screen[4 * tris[t + 2]];
+		if (a[3] < 0.0f || b[3] < 0.0f || c[3] < 0.0f)
+			continue;
+		float area = (b[0] - a[0]) * (c[1] - a[1]) - (b[1] - a[1]) * (c[0] - a[0]);
+		if (area < 0.0f) {
+			if (cull_backfaces)
+				continue;
+			raster_triangle(a, c, b);
+		} else {
+			raster_triangle(a, b, c);
+		}
+	}
+	frame_stats.raster_ms += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+/* Centre samples can cover a pixel only partly, at silhouettes and at
+ * cracks between occluders, so every pixel takes the farthest depth of the
+ * 3x3 around it before the pyramid is built. Occluders thereby lose a
+ * pixel all round, and what remains is covered with depths no nearer than
+ * the samples around it.
+ */
+void hiz_buffer::finish() {
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	vector<float> &depth = levels[0];
+	int stride = strides[0];
+	filtered.resize(depth.size());
+	for (int y = 0; y < h; y++) {
+		const float *row = &depth[(size_t) y * stride];
+		float *out = &filtered[(size_t) y * stride];
+		for (int x = 0; x < w; x++)
+			out[x] = max(row[max(x - 1, 0)], max(row[x], row[min(x + 1, w - 1)]));
+	}
+	for (int y = 0; y < h; y++) {
+		const float *above = &filtered[(size_t) max(y - 1, 0) * stride];
+		const float *row = &filtered[(size_t) y * stride];
+		const float *below = &filtered[(size_t) min(y + 1, h - 1) * stride];
+		float *out = &depth[(size_t) y * stride];
+		for (int x = 0; x < w; x++)
+			out[x] = max(above[x], max(row[x], below[x]));
+	}
+	// pixels outside the window count as far, so edges shrink too
+	for (int x = 0; x < w; x++)
+		depth[x] = depth[(size_t) (h - 1) * stride + x] = FAR_DEPTH;
+	for (int y = 0; y < h; y++)
+		depth[(size_t) y * stride] = depth[(size_t) y * stride + w - 1] = FAR_DEPTH;
+
+	for (size_t l = 1; l < levels.size(); l++) {
+		const vector<float> &src = levels[l - 1];
+		vector<float> &dst = levels[l];
+		int sw = widths[l - 1], sh = heights[l - 1], ss = strides[l - 1];
+		for (int y = 0; y < heights[l]; y++) {
+			int ya = 2 * y, yb = min(2 * y + 1, sh - 1);
+			for (int x = 0; x < widths[l]; x++) {
+				int xa = 2 * x, xb = min(2 * x + 1, sw - 1);
+				dst[(size_t) y * strides[l] + x] = max(max(src[(size_t) ya * ss + xa], src[(size_t) ya * ss + xb]),
+													   max(src[(size_t) yb * ss + xa], src[(size_t) yb * ss + xb]));
+			}
+		}
+	}
+	frame_stats.raster_ms += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+/* The corners of the sphere's box give its screen rectangle and nearest
+ * depth. The rectangle is tested at the level where it spans at most two
+ * texels each way, so a test reads no more than four depths.
+ */
+bool hiz_buffer::sphere_occluded(const float *center, float radius) {
+	frame_stats.tests++;
+	float lo_x = 1e30f, lo_y = 1e30f, hi_x = -1e30f, hi_y = -1e30f, near_z = 1e30f;
+	for (int k = 0; k < 8; k++) {
+		float p[3] = { center[0] + (k & 1 ? radius : -radius), center[1] + (k & 2 ? radius : -radius),
+			center[2] + (k & 4 ? radius : -radius) };
+		float c[4];
+		for (int r = 0; r < 4; r++)
+			c[r] = m[4 * r] * p[0] + m[4 * r + 1] * p[1] + m[4 * r + 2] * p[2] + m[4 * r + 3];
+		if (c[3] <= 0.0f || c[2] < -c[3])
+			return false;
+		float inv_w = 1.0f / c[3];
+		float sx = (c[0] * inv_w * 0.5f + 0.5f) * w, sy = (c[1] * inv_w * 0.5f + 0.5f) * h;
+		lo_x = min(lo_x, sx);
+		hi_x = max(hi_x, sx);
+		lo_y = min(lo_y, sy);
+		hi_y = max(hi_y, sy);
+		near_z = min(near_z, c[2] * inv_w);
+	}
+	if (hi_x < 0.0f || hi_y < 0.0f || lo_x >= w || lo_y >= h)
+		return false;   // off screen: the frustum test's business
+	int x0 = max(0, (int) floorf(lo_x)), x1 = min(w - 1, (int) floorf(hi_x));
+	int y0 = max(0, (int) floorf(lo_y)), y1 = min(h - 1, (int) floorf(hi_y));
+
+	int l = 0;
+	while (l + 1 < (int) levels.size() && ((x1 >> l) - (x0 >> l) > 1 || (y1 >> l) - (y0 >> l) > 1))
+		l++;
+	const vector<float> &depth = levels[l];
+	float farthest = -1.0f;
+	for (int y = y0 >> l; y <= y1 >> l; y++)
+		for (int x = x0 >> l; x <= x1 >> l; x++)
+			farthest = max(farthest, depth[(size_t) y * strides[l] + x]);
+	if (near_z > farthest) {
+		frame_stats.occluded++;
+		return true;
+	}
+	return false;
+}
+
+void print_hiz_stats(ostream &os, const hiz_stats &stats) {
+	os << "occlusion: " << stats.rasterized_tris << "/" << stats.occluder_tris << " occluder tris in "
+	   << stats.raster_ms << " ms, " << stats.occluded << "/" << stats.tests << " tests occluded" << endl;
+}
@@ -0,0 +1,80 @@
+//
+//  hiz.h
+//  pipeline
+//
+//  Software occlusion culling: a few occluder triangles are rasterized on
+//  the CPU into a small depth buffer, which is reduced to a pyramid of
+//  farthest depths, and bounding spheres are tested against the pyramid
+//  before they are drawn.
+//
+//  Nothing here depends on OpenGL so the culling can be exercised without
+//  a context.
+//
+
+#ifndef hiz_h
+#define hiz_h
+
+#include <iostream>
+#include <vector>
+using namespace std;
+
+const int HIZ_DEFAULT_SIZE = 128;          // pixels across the depth buffer
+const int HIZ_MAX_OCCLUDER_TRIS = 4000;    // the renderer picks a level of detail below this
+
+struct hiz_stats {
+	int occluder_tris;      // offered
+	int rasterized_tris;    // in front of the near plane, facing the camera and on screen
+	int tests;
+	int occluded;
+	double raster_ms;       // clearing, rasterizing and building the pyramid
+};
+
+/* Depths are NDC z, -1 near to 1 far. Occluders are rasterized at pixel
+ * centres and then shrunk by a pixel (see finish), so that what they hide
+ * errs on the side of drawing too much. Triangles crossing the near plane
+ * are left out.
+ */
+class hiz_buffer {
+public:
+	explicit hiz_buffer(int width = HIZ_DEFAULT_SIZE, int height = HIZ_DEFAULT_SIZE);
+
+	/* Starts a frame with every pixel at the far plane. m is the row-major
+	 * projection * view * model matrix of the occluders and the tests.
+	 */
+	void begin(const float *m);
+
+	/* Rasterizes triangles (3 vertex indices each) of verts (3 floats per
+	 * vertex) into the depth buffer. Back faces are skipped if asked,
+	 * which is safe for closed meshes.
+	 */
+	void add_occluders(const vector<int> &tris, const vector<float> &verts, bool cull_backfaces);
+
+	// Builds the pyramid; the tests below need it
+	void finish();
+
+	// True if every point of the sphere is behind the occluders
+	bool sphere_occluded(const float *center, float radius);
+
+	const hiz_stats &stats() const { return frame_stats; }
+
+	int width() const { return w; }
+	int height() const { return h; }
+
+	// Depth of level 0 at (x, y), for inspection
+	float depth(int x, int y) const { return levels[0][y * strides[0] + x]; }
+
+private:
+	int w, h;
+	float m[16];
+	vector< vector<float> > levels;     // levels[0] is the raster, rows padded to 4
+	vector<int> widths, heights, strides;
+	vector<float> screen;               // occluder vertices in pixels and depth
+	vector<float> filtered;
+	hiz_stats frame_stats;
+
+	void raster_triangle(const float *a, const float *b, const float *c);
+};
+
+void print_hiz_stats(ostream &os, const hiz_stats &stats);
+
+#endif /* hiz_h */
@@ -0,0 +1,118 @@
+//
+//  image.cc
+//  pipeline
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "image.h"
+
+using namespace std;
+
+bool write_ppm(const char *file, const rgb_image &img) {
+	FILE *fp = fopen(file, "wb");
+	if (fp == NULL)
+		return false;
+	fprintf(fp, "P6\n%d %d\n255\n", img.width, img.height);
+	size_t n = fwrite(&img.pixels[0], 1, img.pixels.size(), fp);
+	fclose(fp);
+	return n == img.pixels.size();
+}
+
+static uint32_t crc_table[256];
+
+static uint32_t crc32(uint32_t crc, const unsigned char *data, size_t len) {
+	if (crc_table[1] == 0) {
+		for (uint32_t n = 0; n < 256; n++) {
+			uint32_t c = n;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			crc_table[n] = c;
+		}
+	}
+	crc = ~crc;
+	for (size_t i = 0; i < len; i++)
+		crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void put32(vector<unsigned char> &out, uint32_t v) {
+	out.push_back(v >> 24);
+	out.push_back(v >> 16);
+	out.push_back(v >> 8);
+	out.push_back(v);
+}
+
+static void write_chunk(FILE *fp, const char *type, const vector<unsigned char> &data) {
+	vector<unsigned char> buf;
+	put32(buf, (uint32_t) data.size());
+	buf.insert(buf.end(), type, type + 4);
+	buf.insert(buf.end(), data.begin(), data.end());
+	put32(buf, crc32(0, &buf[4], buf.size() - 4));
+	fwrite(&buf[0], 1, buf.size(), fp);
+}
+
+bool write_png(const char *file, const rgb_image &img) {
+	FILE *fp = fopen(file, "wb");
+	if (fp == NULL)
+		return false;
+
+	static const unsigned char signature[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+	fwrite(signature, 1, 8, fp);
+
+	vector<unsigned char> header;
+	put32(header, img.width);
+	put32(header, img.height);
+	header.push_back(8);   // bit depth
+	header.push_back(2);   // truecolor
+	header.push_back(0);
+	header.push_back(0);
+	header.push_back(0);
+	write_chunk(fp, "IHDR", header);
+
+	// scanlines with filter type 0
+	size_t row = 3 * (size_t) img.width;
+	vector<unsigned char> raw;
+	raw.reserve((row + 1) * img.height);
+	for (int y = 0; y < img.height; y++) {
+		raw.push_back(0);
+		raw.insert(raw.end(), img.pixels.begin() + y * row, img.pixels.begin() + (y + 1) * row);
+	}
+
+	// zlib stream of stored blocks
+	vector<unsigned char> z;
+	z.push_back(0x78);
+	z.push_back(0x01);
+	uint32_t a = 1, b = 0;
+	size_t pos = 0;
+	do {
+		size_t len = raw.size() - pos < 65535 ? raw.size() - pos : 65535;
+		z.push_back(pos + len == raw.size() ? 1 : 0);
+		z.push_back(len & 0xff);
+		z.push_back(len >> 8);
+		z.push_back(~len & 0xff);
+		z.push_back((~len >> 8) & 0xff);
+		for (size_t i = 0; i < len; i++) {
+			unsigned char c = raw[pos + i];
+			z.push_back(c);
+			a = (a + c) % 65521;
+			b = (b + a) % 65521;
+		}
+		pos += len;
+	} while (pos < raw.size());
+	put32(z, (b << 16) | a);
+	write_chunk(fp, "IDAT", z);
+
+	write_chunk(fp, "IEND", vector<unsigned char>());
+	bool ok = ferror(fp) == 0;
+	fclose(fp);
+	return ok;
+}
+
+bool write_image(const char *file, const rgb_image &img) {
+	size_t n = strlen(file);
+	if (n > 4 && (strcmp(file + n - 4, ".png") == 0 || strcmp(file + n - 4, ".PNG") == 0))
+		return write_png(file, img);
+	return write_ppm(file, img);
+}
@@ -0,0 +1,29 @@
+//
+//  image.h
+//  pipeline
+//
+//  Writers for 8-bit RGB images.
+//
+
+#ifndef image_h
+#define image_h
+
+#include <vector>
+using namespace std;
+
+struct rgb_image {
+	int width, height;
+	vector<unsigned char> pixels;   // rows top to bottom, 3 bytes per pixel
+
+	rgb_image(int w = 0, int h = 0) : width(w), height(h), pixels(3 * w * h, 0) {}
+};
+
+bool write_ppm(const char *file, const rgb_image &img);
+
+// Valid PNG with stored (uncompressed) deflate blocks, so no zlib is needed
+bool write_png(const char *file, const rgb_image &img);
+
+// Picks the writer from the file extension (.png, anything else is PPM)
+bool write_image(const char *file, const rgb_image &img);
+
+#endif /* image_h */
@@ -0,0 +1,77 @@
+//
+//  instances.cc
+//  pipeline
+//
+
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include "instances.h"
+
+using namespace std;
+
+static uint32_t hash_index(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+static float unit_random(uint32_t i, uint32_t salt) {
+	return (hash_index(i * 2654435761u ^ salt) & 0xffffff) / 16777216.0f;
+}
+
+// Saturated colors around the hue circle
+static void hue_color(float hue, float *rgb) {
+	for (int c = 0; c < 3; c++) {
+		float k = fmodf(hue * 6.0f + 4.0f - 2.0f * c + 6.0f, 6.0f);
+		rgb[c] = 1.0f - 0.75f * fmaxf(0.0f, fminf(fminf(k, 4.0f - k), 1.0f));
+	}
+}
+
+void make_instance_grid(int n, float extent, float model_radius, vector<model_instance> &out) {
+	out.resize(n > 0 ? n : 0);
+	if (n <= 0)
+		return;
+	int side = (int) ceil(sqrt((double) n));
+	float cell = extent / side;
+	float scale = model_radius > 0.0f ? 0.45f * cell / model_radius : 1.0f;
+	for (int i = 0; i < n; i++) {
+		model_instance &m = out[i];
+		float x = -0.5f * extent + cell * (i % side + 0.5f);
+		float y = 0.5f * extent - cell * (i / side + 0.5f);
+		float angle = 6.2831853f * unit_random(i, 1);
+		float c = cosf(angle) * scale, s = sinf(angle) * scale;
+		float rows[3][4] = {
+			{ c, 0.0f, s, x },
+			{ 0.0f, scale, 0.0f, y },
+			{ -s, 0.0f, c, 0.0f }
+		};
+		for (int r = 0; r < 3; r++)
+			for (int k = 0; k < 4; k++)
+				m.rows[r][k] = rows[r][k];
+		hue_color(unit_random(i, 2), m.color);
+		m.color[3] = 1.0f;
+	}
+}
+
+bool sort_instances_front_to_back(vector<model_instance> &instances, const float *eye) {
+	vector< pair<float, size_t> > order(instances.size());
+	bool sorted = true;
+	for (size_t i = 0; i < instances.size(); i++) {
+		const model_instance &m = instances[i];
+		float d[3] = { m.rows[0][3] - eye[0], m.rows[1][3] - eye[1], m.rows[2][3] - eye[2] };
+		order[i] = make_pair(d[0]*d[0] + d[1]*d[1] + d[2]*d[2], i);
+		sorted = sorted && (i == 0 || order[i - 1].first <= order[i].first);
+	}
+	if (sorted)
+		return false;
+	sort(order.begin(), order.end());
+	vector<model_instance> moved(instances.size());
+	for (size_t i = 0; i < order.size(); i++)
+		moved[i] = instances[order[i].second];
+	instances.swap(moved);
+	return true;
+}
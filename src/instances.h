@@ -0,0 +1,37 @@
+//
+//  instances.h
+//  pipeline
+//
+//  Many copies of one model, each with its own placement and color, laid
+//  out for drawing with a single instanced draw call.
+//
+
+#ifndef instances_h
+#define instances_h
+
+#include <vector>
+using namespace std;
+
+/* Read by the vertex shader as four per-instance attributes. The rows are
+ * the top of a model matrix made of a rotation, a uniform scale and a
+ * translation, so normals can be transformed by the same rows.
+ */
+struct model_instance {
+	float rows[3][4];
+	float color[4];      // diffuse
+};
+
+/* n copies in a square grid across extent in the x-y plane, centred on the
+ * origin and facing +z. Each is scaled to fill most of its cell, given the
+ * model's radius, turned about y and colored by a hash of its index, so the
+ * layout is the same on every run.
+ */
+void make_instance_grid(int n, float extent, float model_radius, vector<model_instance> &out);
+
+/* Orders the copies nearest to eye first, by their translations, so one
+ * instanced draw rasterizes them front to back. Returns whether anything
+ * moved.
+ */
+bool sort_instances_front_to_back(vector<model_instance> &instances, const float *eye);
+
+#endif /* instances_h */
@@ -0,0 +1,262 @@
+//
+//  jobs.cc
+//  pipeline
+//
+
+#include "jobs.h"
+
+using namespace std;
+
+struct job_pool::group::batch {
+	vector<job> jobs;
+	vector< vector<int> > next;
+	std::unique_ptr< std::atomic<int>[] > deps;
+	std::atomic<int> remaining;
+	std::atomic<int> queued;     // items of this batch waiting in a deque
+};
+
+static thread_local unsigned int worker_index = 0;
+
+task_graph::task task_graph::add(const job &fn) {
+	jobs.push_back(fn);
+	next.push_back(vector<int>());
+	deps.push_back(0);
+	return (task) jobs.size() - 1;
+}
+
+void task_graph::depend(task t, task on) {
+	next[on].push_back(t);
+	deps[t]++;
+}
+
+bool job_pool::group::done() const {
+	return !b || b->remaining == 0;
+}
+
+job_pool::job_pool(unsigned int n) : queued(0), quit(false) {
+	if (n == 0)
+		n = std::thread::hardware_concurrency();
+	if (n == 0)
+		n = 1;
+	stats_start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i <= n; i++)
+		queues.push_back(new worker);
+	for (unsigned int i = 1; i <= n; i++)
+		threads.push_back(std::thread(&job_pool::worker_main, this, i));
+}
+
+job_pool::~job_pool() {
+	{
+		std::lock_guard<std::mutex> l(sleep_lock);
+		quit = true;
+	}
+	wake.notify_all();
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+	for (size_t i = 0; i < queues.size(); i++)
+		delete queues[i];
+}
+
+unsigned int job_pool::current_worker() {
+	return worker_index;
+}
+
+void job_pool::notify() {
+	{
+		// taking the lock orders the change before any sleeper's check
+		std::lock_guard<std::mutex> l(sleep_lock);
+	}
+	wake.notify_all();
+}
+
+void job_pool::push(unsigned int self, const item &it) {
+	worker &q = *queues[self];
+	queued++;
+	it.b->queued++;
+	std::lock_guard<std::mutex> l(q.lock);
+	q.items.push_back(it);
+}
+
+// Own deque from the back, then steal from the front of the others
+bool job_pool::take(unsigned int self, item &out) {
+	const unsigned int n = (unsigned int) queues.size();
+	for (unsigned int i = 0; i < n; i++) {
+		worker &q = *queues[(self + i) % n];
+		std::lock_guard<std::mutex> l(q.lock);
+		if (q.items.empty())
+			continue;
+		if (i == 0) {
+			out = q.items.back();
+			q.items.pop_back();
+		} else {
+			out = q.items.front();
+			q.items.pop_front();
+			// the inbox of outside threads is shared, not stolen from
+			if ((self + i) % n != 0)
+				queues[self]->steals++;
+		}
+		queued--;
+		out.b->queued--;
+		return true;
+	}
+	return false;
+}
+
+// The oldest queued item of batch b, from any deque
+bool job_pool::take_from(unsigned int self, const group::batch *b, item &out) {
+	const unsigned int n = (unsigned int) queues.size();
+	for (unsigned int i = 0; i < n && b->queued > 0; i++) {
+		worker &q = *queues[(self + i) % n];
+		std::lock_guard<std::mutex> l(q.lock);
+		for (std::deque<item>::iterator it = q.items.begin(); it != q.items.end(); ++it)
+			if (it->b.get() == b) {
+				out = *it;
+				q.items.erase(it);
+				queued--;
+				out.b->queued--;
+				return true;
+			}
+	}
+	return false;
+}
+
+void job_pool::execute(unsigned int self, item &it) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	it.b->jobs[it.index]();
+	worker &w = *queues[self];
+	w.busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - start).count();
+	w.jobs++;
+
+	// release the jobs that were waiting on this one
+	bool released = false;
+	const vector<int> &next = it.b->next[it.index];
+	for (size_t i = 0; i < next.size(); i++)
+		if (--it.b->deps[next[i]] == 0) {
+			item ready = { it.b, next[i] };
+			push(self, ready);
+			released = true;
+		}
+	if (--it.b->remaining == 0 || released)
+		notify();
+}
+
+void job_pool::worker_main(unsigned int self) {
+	worker_index = self;
+	for (;;) {
+		item it;
+		if (take(self, it)) {
+			execute(self, it);
+			continue;
+		}
+		std::unique_lock<std::mutex> l(sleep_lock);
+		wake.wait(l, [this]() { return quit || queued > 0; });
+		if (quit)
+			return;
+	}
+}
+
+job_pool::group job_pool::start(const std::shared_ptr<group::batch> &b) {
+	group g;
+	g.b = b;
+	const int n = (int) b->jobs.size();
+	b->remaining = n;
+	b->queued = 0;
+	if (n == 0)
+		return g;
+
+	const unsigned int self = worker_index;
+	for (int i = 0; i < n; i++)
+		if (b->deps[i] == 0) {
+			item it = { b, i };
+			push(self, it);
+		}
+	notify();
+	return g;
+}
+
+job_pool::group job_pool::submit(const vector<job> &jobs) {
+	std::shared_ptr<group::batch> b(new group::batch);
+	b->jobs = jobs;
+	b->next.resize(jobs.size());
+	b->deps.reset(new std::atomic<int>[jobs.size()]);
+	for (size_t i = 0; i < jobs.size(); i++)
+		b->deps[i] = 0;
+	return start(b);
+}
+
+job_pool::group job_pool::submit(const task_graph &graph) {
+	std::shared_ptr<group::batch> b(new group::batch);
+	b->jobs = graph.jobs;
+	b->next = graph.next;
+	b->deps.reset(new std::atomic<int>[graph.size()]);
+	for (size_t i = 0; i < graph.size(); i++)
+		b->deps[i] = graph.deps[i];
+	return start(b);
+}
+
+void job_pool::wait(const group &g) {
+	if (!g.b)
+		return;
+	const unsigned int self = worker_index;
+	group::batch &b = *g.b;
+	while (b.remaining > 0) {
+		// workers help with whatever is queued; outside threads, which may
+		// have a frame to finish, only with this batch
+		item it;
+		if (self != 0 ? take(self, it) : take_from(self, &b, it)) {
+			execute(self, it);
+			continue;
+		}
+		std::unique_lock<std::mutex> l(sleep_lock);
+		wake.wait(l, [this, self, &b]() {
+			return b.remaining == 0 || (self != 0 ? queued > 0 : b.queued > 0);
+		});
+	}
+}
+
+void job_pool::stats(vector<worker_stats> &out, double &seconds) const {
+	seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - stats_start).count();
+	out.resize(queues.size());
+	for (size_t i = 0; i < queues.size(); i++) {
+		out[i].jobs = queues[i]->jobs;
+		out[i].steals = queues[i]->steals;
+		out[i].busy = queues[i]->busy_ns * 1e-9;
+	}
+}
+
+void job_pool::reset_stats() {
+	for (size_t i = 0; i < queues.size(); i++) {
+		queues[i]->jobs = 0;
+		queues[i]->steals = 0;
+		queues[i]->busy_ns = 0;
+	}
+	stats_start = std::chrono::steady_clock::now();
+}
+
+void job_pool::print_stats(ostream &os) const {
+	vector<worker_stats> s;
+	double seconds;
+	stats(s, seconds);
+	os << "jobs: " << workers() << " workers over " << seconds << " s" << endl;
+	for (size_t i = 0; i < s.size(); i++) {
+		if (i == 0)
+			os << "  callers: ";
+		else
+			os << "  worker " << i << ": ";
+		os << s[i].jobs << " jobs, " << s[i].steals << " stolen, "
+		   << (seconds > 0.0 ? 100.0 * s[i].busy / seconds : 0.0) << "% busy" << endl;
+	}
+}
+
+static unsigned int requested_workers = 0;
+
+// Never destroyed, so threads still using it while the program exits are safe
+job_pool &job_system() {
+	static job_pool *pool = new job_pool(requested_workers);
+	return *pool;
+}
+
+void set_job_workers(unsigned int workers) {
+	requested_workers = workers;
+}
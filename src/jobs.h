@@ -0,0 +1,166 @@
+//
+//  jobs.h
+//  pipeline
+//
+//  Work-stealing scheduler shared by the loading, mesh processing and
+//  rendering stages: persistent workers, task dependencies, parallel_for.
+//
+
+#ifndef jobs_h
+#define jobs_h
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+/* Jobs plus "runs after" edges between them. Jobs without dependencies
+ * start right away; the others are queued by whichever worker finishes
+ * their last dependency.
+ */
+class task_graph {
+public:
+	typedef std::function<void()> job;
+	typedef int task;
+
+	task add(const job &fn);
+	void depend(task t, task on);   // t runs after on has finished
+
+	size_t size() const { return jobs.size(); }
+
+private:
+	friend class job_pool;
+	vector<job> jobs;
+	vector< vector<int> > next;
+	vector<int> deps;
+};
+
+/* Every worker thread owns a deque; it pops its own jobs from the back and,
+ * when that runs dry, steals from the front of the others. Threads outside
+ * the pool (the GLUT thread, a loader thread) submit into a shared inbox.
+ * A thread waiting on a batch runs jobs until it is done instead of
+ * sleeping, which also makes waiting from inside a job safe: a worker runs
+ * whatever is queued, an outside thread only the jobs of its own batch, so
+ * the GLUT thread never picks up a slice of a background load.
+ */
+class job_pool {
+public:
+	typedef std::function<void()> job;
+
+	// Completion state of one submitted batch; copies refer to the same batch
+	class group {
+	public:
+		group() {}
+		bool done() const;
+	private:
+		friend class job_pool;
+		struct batch;
+		std::shared_ptr<batch> b;
+	};
+
+	struct worker_stats {
+		long long jobs;     // jobs run
+		long long steals;   // of which were taken from another worker
+		double busy;        // seconds spent inside jobs
+	};
+
+	// workers == 0 starts one worker thread per hardware thread
+	explicit job_pool(unsigned int workers = 0);
+	~job_pool();
+
+	unsigned int workers() const { return (unsigned int) threads.size(); }
+
+	// Queues the jobs and returns at once
+	group submit(const vector<job> &jobs);
+	group submit(const task_graph &graph);
+
+	// Runs jobs, as above, until the batch has finished
+	void wait(const group &g);
+
+	void run(const vector<job> &jobs) { wait(submit(jobs)); }
+	void run(const task_graph &graph) { wait(submit(graph)); }
+
+	/* Index of the calling pool thread, 1 to workers(); 0 on threads that
+	 * are not part of the pool.
+	 */
+	static unsigned int current_worker();
+
+	/* Per worker counters since construction or the last reset_stats();
+	 * entry 0 collects the jobs run by outside threads while waiting.
+	 */
+	void stats(vector<worker_stats> &out, double &seconds) const;
+	void reset_stats();
+	void print_stats(ostream &os) const;
+
+private:
+	struct item {
+		std::shared_ptr<group::batch> b;
+		int index;
+	};
+	struct worker {
+		std::mutex lock;
+		std::deque<item> items;
+		std::atomic<long long> jobs, steals, busy_ns;
+		worker() : jobs(0), steals(0), busy_ns(0) {}
+	};
+
+	vector<worker *> queues;     // 0 is the inbox of outside threads
+	vector<std::thread> threads;
+	std::chrono::steady_clock::time_point stats_start;
+
+	std::mutex sleep_lock;
+	std::condition_variable wake;
+	std::atomic<int> queued;     // items waiting in a deque
+	bool quit;
+
+	group start(const std::shared_ptr<group::batch> &b);
+	void push(unsigned int self, const item &it);
+	bool take(unsigned int self, item &out);
+	bool take_from(unsigned int self, const group::batch *b, item &out);
+	void execute(unsigned int self, item &it);
+	void notify();
+	void worker_main(unsigned int self);
+
+	job_pool(const job_pool &);
+	job_pool &operator= (const job_pool &);
+};
+
+/* The pool all stages share, started on first use with the count given to
+ * set_job_workers (0, the default, means one per hardware thread).
+ */
+job_pool &job_system();
+void set_job_workers(unsigned int workers);
+
+/* Calls fn(begin, end) on contiguous sub-ranges of [0, count) on the pool
+ * and returns when all of them are done. Ranges are cut a few per worker
+ * so that stealing can even out uneven work, but never below grain;
+ * inputs of a single grain run on the calling thread.
+ */
+template <typename Fn>
+void parallel_for(job_pool &pool, size_t count, size_t grain, const Fn &fn) {
+	if (grain == 0)
+		grain = 1;
+	size_t chunk = count / (4 * (size_t) pool.workers());
+	if (chunk < grain)
+		chunk = grain;
+	if (count <= chunk) {
+		if (count > 0)
+			fn((size_t) 0, count);
+		return;
+	}
+	vector<job_pool::job> jobs;
+	for (size_t b = 0; b < count; b += chunk) {
+		size_t e = b + chunk < count ? b + chunk : count;
+		jobs.push_back([&fn, b, e]() { fn(b, e); });
+	}
+	pool.run(jobs);
+}
+
+#endif /* jobs_h */
@@ -0,0 +1,174 @@
+//
+//  light_clusters.cc
+//  pipeline
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include "light_clusters.h"
+
+using namespace std;
+
+light_clusters::light_clusters()
+	: width(0), height(0), nx(0), ny(0), nz(0), fovy(0.0f), aspect(1.0f), znear(1.0f), zfar(2.0f) {
+	frame_stats = light_cluster_stats();
+}
+
+void light_clusters::configure(int w, int h, float fy, float a, float zn, float zf) {
+	width = w;
+	height = h;
+	fovy = fy;
+	aspect = a;
+	znear = zn;
+	zfar = zf;
+	nx = max(1, (w + CLUSTER_TILE_PIXELS - 1) / CLUSTER_TILE_PIXELS);
+	ny = max(1, (h + CLUSTER_TILE_PIXELS - 1) / CLUSTER_TILE_PIXELS);
+	nz = CLUSTER_SLICES;
+	slice_counts.resize(nz);
+	slice_indices.resize(nz);
+}
+
+float light_clusters::slice_scale() const {
+	return nz / logf(zfar / znear);
+}
+
+float light_clusters::slice_bias() const {
+	return -logf(znear) * slice_scale();
+}
+
+// Tile of an NDC coordinate, clamped to the grid
+static int tile_of(float ndc, int pixels, int tiles) {
+	int t = (int) floorf((0.5f * ndc + 0.5f) * pixels / CLUSTER_TILE_PIXELS);
+	return min(max(t, 0), tiles - 1);
+}
+
+void light_clusters::assign_slice(int k, size_t n_lights) {
+	float d0 = znear * powf(zfar / znear, (float) k / nz);
+	float d1 = znear * powf(zfar / znear, (float) (k + 1) / nz);
+	float ty = tanf(0.5f * fovy * (float) M_PI / 180.0f), tx = ty * aspect;
+	vector<uint32_t> &counts = slice_counts[k];
+	counts.assign(nx * ny + 1, 0);
+
+	// the tile rectangle of every light reaching into the slice
+	vector<int> rects;
+	for (size_t i = 0; i < n_lights; i++) {
+		const float *l = &lights_eye[8 * i];
+		float depth = -l[2], r = l[3];
+		if (depth + r < d0 || depth - r > d1)
+			continue;
+		float dmin = max(d0, depth - r), dmax = min(d1, depth + r);
+		// x / depth is extreme at the corners of the box's range of x and depth
+		float x0 = min((l[0] - r) / dmin, (l[0] - r) / dmax) / tx;
+		float x1 = max((l[0] + r) / dmin, (l[0] + r) / dmax) / tx;
+		float y0 = min((l[1] - r) / dmin, (l[1] - r) / dmax) / ty;
+		float y1 = max((l[1] + r) / dmin, (l[1] + r) / dmax) / ty;
+		if (x1 < -1.0f || x0 > 1.0f || y1 < -1.0f || y0 > 1.0f)
+			continue;
+		int rect[5] = { (int) i, tile_of(x0, width, nx), tile_of(x1, width, nx),
+						tile_of(y0, height, ny), tile_of(y1, height, ny) };
+		rects.insert(rects.end(), rect, rect + 5);
+		for (int y = rect[3]; y <= rect[4]; y++)
+			for (int x = rect[1]; x <= rect[2]; x++)
+				counts[y * nx + x + 1]++;
+	}
+
+	// counts[c] becomes where cluster c's list starts, then where it ends
+	for (int c = 0; c < nx * ny; c++)
+		counts[c + 1] += counts[c];
+	vector<uint32_t> &list = slice_indices[k];
+	list.resize(counts[nx * ny]);
+	for (size_t j = 0; j < rects.size(); j += 5)
+		for (int y = rects[j + 3]; y <= rects[j + 4]; y++)
+			for (int x = rects[j + 1]; x <= rects[j + 2]; x++)
+				list[counts[y * nx + x]++] = rects[j];
+}
+
+void light_clusters::assign(const vector<point_light> &lights, const float *view, job_pool &pool) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	size_t n = lights.size();
+	lights_eye.resize(8 * n);
+	parallel_for(pool, n, 256, [&](size_t b, size_t e) {
+		for (size_t i = b; i < e; i++) {
+			const point_light &l = lights[i];
+			float *out = &lights_eye[8 * i];
+			for (int r = 0; r < 3; r++)
+				out[r] = view[4*r] * l.position[0] + view[4*r + 1] * l.position[1] +
+					view[4*r + 2] * l.position[2] + view[4*r + 3];
+			out[3] = l.radius;
+			for (int c = 0; c < 3; c++)
+				out[4 + c] = l.color[c];
+			out[7] = 0.0f;
+		}
+	});
+	parallel_for(pool, nz, 1, [&](size_t b, size_t e) {
+		for (size_t k = b; k < e; k++)
+			assign_slice((int) k, n);
+	});
+
+	// join the slices; their lists end where the next cluster's start
+	int per_slice = nx * ny;
+	ranges.resize(2 * per_slice * nz);
+	indices.clear();
+	light_cluster_stats &s = frame_stats;
+	s = light_cluster_stats();
+	for (int k = 0; k < nz; k++) {
+		const vector<uint32_t> &ends = slice_counts[k];
+		uint32_t base = (uint32_t) indices.size(), begin = 0;
+		for (int c = 0; c < per_slice; c++) {
+			uint32_t count = ends[c] - begin;
+			ranges[2 * (k * per_slice + c)] = base + begin;
+			ranges[2 * (k * per_slice + c) + 1] = count;
+			s.occupied += count > 0 ? 1 : 0;
+			s.max_lights = max(s.max_lights, (int) count);
+			begin = ends[c];
+		}
+		indices.insert(indices.end(), slice_indices[k].begin(), slice_indices[k].end());
+	}
+	vector<char> listed(n, 0);
+	for (size_t i = 0; i < indices.size(); i++)
+		listed[indices[i]] = 1;
+	s.lights = (int) n;
+	s.visible = (int) count(listed.begin(), listed.end(), 1);
+	s.clusters = per_slice * nz;
+	s.references = (long long) indices.size();
+	s.assign_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static uint32_t hash_light(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+static float light_random(uint32_t i, uint32_t salt) {
+	return (hash_light(i * 2654435761u ^ salt) & 0xffffff) / 16777216.0f;
+}
+
+void make_point_lights(int n, const float *center, float radius, float light_radius, vector<point_light> &out) {
+	out.resize(max(n, 0));
+	for (int i = 0; i < n; i++) {
+		point_light &l = out[i];
+		// uniform in the sphere: a direction, and the cube root for the distance
+		float z = 2.0f * light_random(i, 1) - 1.0f, a = 6.2831853f * light_random(i, 2);
+		float d = radius * cbrtf(light_random(i, 3)), s = sqrtf(1.0f - z*z);
+		l.position[0] = center[0] + d * s * cosf(a);
+		l.position[1] = center[1] + d * s * sinf(a);
+		l.position[2] = center[2] + d * z;
+		l.radius = light_radius;
+		float hue = fmodf(0.618034f * i, 1.0f);
+		for (int c = 0; c < 3; c++) {
+			float h = fmodf(hue * 6.0f + 4.0f - 2.0f * c + 6.0f, 6.0f);
+			l.color[c] = 1.0f - fmaxf(0.0f, fminf(fminf(h, 4.0f - h), 1.0f));
+		}
+	}
+}
+
+void print_light_cluster_stats(ostream &os, const light_cluster_stats &stats) {
+	os << stats.lights << " lights (" << stats.visible << " in view), " << stats.occupied << "/" << stats.clusters
+	   << " clusters lit, " << stats.references << " list entries, at most " << stats.max_lights
+	   << " per cluster, assigned in " << stats.assign_ms << " ms" << endl;
+}
@@ -0,0 +1,94 @@
+//
+//  light_clusters.h
+//  pipeline
+//
+//  Clustered forward lighting: the view frustum is cut into screen tiles
+//  and depth slices, and every frame each cluster is given the list of
+//  point lights that can reach it, so a fragment only loops over the lights
+//  of its own cluster.
+//
+//  Nothing here depends on OpenGL; the lists are laid out for texture
+//  buffers (see fshader_passthrough.glsl).
+//
+
+#ifndef light_clusters_h
+#define light_clusters_h
+
+#include <stdint.h>
+#include <iostream>
+#include <vector>
+#include "jobs.h"
+using namespace std;
+
+const int CLUSTER_TILE_PIXELS = 32;
+const int CLUSTER_SLICES = 16;
+
+struct point_light {
+	float position[3];      // world
+	float radius;           // no light at all beyond this
+	float color[3];
+};
+
+struct light_cluster_stats {
+	int lights;
+	int visible;            // in some cluster
+	int clusters, occupied;
+	long long references;   // entries in all the lists
+	int max_lights;         // in one cluster
+	double assign_ms;
+};
+
+/* Slices are spaced exponentially in depth between znear and zfar, so
+ * clusters stay about as deep as they are wide. Lights are assigned with
+ * one job per slice: each keeps its own lists, which are then joined
+ * without locks. A light is listed in every cluster of a slice that the
+ * screen rectangle of its bounding box over the slice's depths touches,
+ * which is conservative.
+ */
+class light_clusters {
+public:
+	light_clusters();
+
+	// The grid for a viewport and projection; cheap when nothing changed
+	void configure(int width, int height, float fovy, float aspect, float znear, float zfar);
+
+	// view is the row-major world-to-eye matrix
+	void assign(const vector<point_light> &lights, const float *view, job_pool &pool);
+
+	int tiles_x() const { return nx; }
+	int tiles_y() const { return ny; }
+	int slices() const { return nz; }
+
+	// slice = floor(log(depth) * slice_scale() + slice_bias())
+	float slice_scale() const;
+	float slice_bias() const;
+
+	// Eye-space position and radius, then color and 0: 8 floats per light
+	const vector<float> &eye_lights() const { return lights_eye; }
+
+	// First index and count per cluster, x fastest, then y, then slice
+	const vector<uint32_t> &cluster_ranges() const { return ranges; }
+	const vector<uint32_t> &light_indices() const { return indices; }
+
+	const light_cluster_stats &stats() const { return frame_stats; }
+
+private:
+	int width, height, nx, ny, nz;
+	float fovy, aspect, znear, zfar;
+	vector<float> lights_eye;
+	vector<uint32_t> ranges, indices;
+	vector< vector<uint32_t> > slice_counts, slice_indices;    // per slice while assigning
+	light_cluster_stats frame_stats;
+
+	void assign_slice(int slice, size_t n_lights);
+};
+
+/* n lights scattered through a sphere of the given radius around center,
+ * each reaching light_radius, with colors spread around the hue circle; the
+ * same on every run.
+ */
+void make_point_lights(int n, const float *center, float radius, float light_radius, vector<point_light> &out);
+
+void print_light_cluster_stats(ostream &os, const light_cluster_stats &stats);
+
+#endif /* light_clusters_h */
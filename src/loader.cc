@@ -0,0 +1,252 @@
+//
+//  loader.cc
+//  pipeline
+//
+
+#include <chrono>
+#include "loader.h"
+#include "halfedge.h"
+#include "mesh_formats.h"
+#include "normals.h"
+#include "occlusion.h"
+#include "parser.h"
+#include "pick.h"
+#include "weld.h"
+
+using namespace std;
+
+// OBJ levels of detail, stored one after another in the vertex buffer
+static const float LOD_RATIOS[] = { 0.5, 0.25, 0.1, 0.03 };
+static const float LOD_MAX_ERROR = 0.05;      // in model units
+
+// Enough chunks in flight to keep the upload busy, few enough to bound staging memory
+static const size_t LOAD_QUEUE_SIZE = 8;
+
+/* Appends corners [begin, end) of a level, de-indexed, with the level's
+ * smooth normals. Occlusion is looked up through the input vertex each
+ * level vertex survives from.
+ */
+static void stage_corners(const mesh_lod &lod, const vector<float> &vert_norms,
+						  const vector<unsigned char> &mesh_occlusion, size_t begin, size_t end,
+						  vector<vec4> &positions, vector<vec4> &normals,
+						  vector<unsigned char> &occlusion)
+{
+	for (size_t i = begin; i < end; i++) {
+		int p = lod.tris[i];
+		positions.push_back(vec4(lod.verts[3*p], lod.verts[3*p+1], lod.verts[3*p+2], 1.0));
+		normals.push_back(vec4(vert_norms[3*p], vert_norms[3*p+1], vert_norms[3*p+2], 0.0));
+		occlusion.push_back(mesh_occlusion.empty() ? 255 : mesh_occlusion[lod.source[p]]);
+	}
+}
+
+model_loader::model_loader() : queue(LOAD_QUEUE_SIZE), cancel(false), running(false) {}
+
+model_loader::~model_loader() {
+	stop();
+}
+
+void model_loader::start(const char *file, float weld_tolerance) {
+	stop();
+	cancel = false;
+	running = true;
+	thread = std::thread(&model_loader::run, this, string(file), weld_tolerance);
+}
+
+void model_loader::stop() {
+	if (!thread.joinable())
+		return;
+	cancel = true;
+	thread.join();
+	load_message *m;
+	while (queue.pop(m)) {
+		delete m->model;
+		delete m;
+	}
+	running = false;
+}
+
+load_message *model_loader::poll() {
+	load_message *m;
+	if (!queue.pop(m))
+		return NULL;
+	if (m->kind == load_message::DONE || m->kind == load_message::FAILED)
+		running = false;
+	return m;
+}
+
+// Waits for room when the render thread is behind
+void model_loader::post(load_message *m) {
+	while (!queue.push(m)) {
+		if (cancel) {
+			delete m->model;
+			delete m;
+			return;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+void model_loader::stage(const char *name, float progress) {
+	load_message *m = new load_message(load_message::STAGE);
+	m->stage = name;
+	m->progress = progress;
+	post(m);
+}
+
+void model_loader::run(string file, float weld_tolerance) {
+	const char *name = file.c_str();
+	model_data *model = new model_data;
+	model->bezier = false;
+	model->closed_mesh = false;
+	model->radius = 0.0;
+
+	stage("reading", 0.0);
+	const mesh_format *format = find_mesh_format(name);
+	if (format == NULL) {
+		delete model;
+		post(new load_message(load_message::FAILED));
+		return;
+	}
+	if (format->patches()) {
+		model->bezier = true;
+		read_bezier_file(name, model->surfaces);
+		patch_bounds(model->surfaces, model->surface_bounds);
+		load_message *m = new load_message(load_message::DONE);
+		m->model = model;
+		post(m);
+		return;
+	}
+
+	vector<int> tris;
+	vector<float> verts;
+	vector<float> mesh_normals;       // coded meshes store theirs
+	vector<unsigned char> mesh_occlusion;
+	if (!format->read(name, tris, verts, &mesh_normals, &mesh_occlusion) || tris.empty() || cancel) {
+		if (!cancel)
+			cerr << "No triangles in " << name << endl;
+		delete model;
+		post(new load_message(load_message::FAILED));
+		return;
+	}
+
+	// baked with -bake-ao (coded meshes carry theirs); without one the
+	// ambient term is left as it was
+	if (mesh_occlusion.empty() && read_occlusion(occlusion_file(name).c_str(), verts.size()/3, mesh_occlusion))
+		cout << "using ambient occlusion from " << occlusion_file(name) << endl;
+
+	// faces that repeat their neighbours' corners would not be smoothed across
+	if (weld_tolerance >= 0.0) {
+		stage("welding", 0.05);
+		weld_params weld;
+		weld.tolerance = weld_tolerance;
+		if (!mesh_normals.empty())
+			weld.normals = &mesh_normals;
+		weld_result welded;
+		weld_vertices(tris, verts, weld, welded);
+		weld_vertex_data(welded, 1, mesh_occlusion);
+		if (welded.verts_after < welded.verts_before || welded.tris_after < welded.tris_before)
+			welded.print_report(cout);
+	}
+	if (tris.empty()) {
+		cerr << "Only degenerate faces in " << name << endl;
+		delete model;
+		post(new load_message(load_message::FAILED));
+		return;
+	}
+
+	// report open and non-manifold topology up front
+	stage("checking topology", 0.1);
+	halfedge_mesh topology;
+	if (topology.build(tris, (int) verts.size()/3))
+		topology.print_report(cout);
+	model->closed_mesh = topology.report().boundary_edges == 0 && topology.report().non_manifold_edges == 0;
+
+	/* The finest level is clustered first, so the preview is already in its
+	 * final face order and the chain is simplified from the reordered faces.
+	 */
+	stage("normals", 0.15);
+	vector<meshlet> finest_meshlets;
+	build_meshlets(tris, verts, MESHLET_MAX_TRIS, finest_meshlets);
+	mesh_lod finest;
+	finest.tris = tris;
+	finest.verts = verts;
+	finest.source.resize(verts.size() / 3);
+	for (size_t v = 0; v < finest.source.size(); v++)
+		finest.source[v] = (int) v;
+	vector<float> vert_norms;
+	if (mesh_normals.size() == verts.size())
+		vert_norms.swap(mesh_normals);
+	else
+		compute_vertex_normals(tris, verts, vert_norms);
+
+	// room for the chain too: the levels add up to less than twice the finest
+	model->positions.reserve(2 * tris.size());
+	model->normals.reserve(2 * tris.size());
+	model->occlusion.reserve(2 * tris.size());
+	load_message *preview = new load_message(load_message::PREVIEW);
+	preview->count = (int) tris.size();
+	post(preview);
+	for (size_t first = 0; first < tris.size() && !cancel; first += LOAD_CHUNK_VERTICES) {
+		size_t last = min(first + LOAD_CHUNK_VERTICES, tris.size());
+		load_message *m = new load_message(load_message::CHUNK);
+		m->first = (int) first;
+		m->count = (int) (last - first);
+		m->positions.reserve(m->count);
+		m->normals.reserve(m->count);
+		m->occlusion.reserve(m->count);
+		stage_corners(finest, vert_norms, mesh_occlusion, first, last,
+					  m->positions, m->normals, m->occlusion);
+		// the finest level is also the start of the final vertex arrays
+		model->positions.insert(model->positions.end(), m->positions.begin(), m->positions.end());
+		model->normals.insert(model->normals.end(), m->normals.begin(), m->normals.end());
+		model->occlusion.insert(model->occlusion.end(), m->occlusion.begin(), m->occlusion.end());
+		post(m);
+	}
+
+	stage("building levels of detail", 0.3);
+	if (!cancel)
+		build_lod_chain(tris, verts, LOD_RATIOS, sizeof(LOD_RATIOS)/sizeof(LOD_RATIOS[0]),
+						LOD_MAX_ERROR, model->lods);
+
+	stage("clustering", 0.8);
+	vector<mesh_lod> &lods = model->lods;
+	model->lod_meshlets.resize(lods.size());
+	int n_vertices = 0;
+	for (unsigned int i = 0; i < lods.size() && !cancel; i++) {
+		// reorders the level's faces so that each cluster is one draw range
+		if (i == 0)
+			model->lod_meshlets[0].swap(finest_meshlets);
+		else
+			build_meshlets(lods[i].tris, lods[i].verts, MESHLET_MAX_TRIS, model->lod_meshlets[i]);
+		model->lod_first.push_back(n_vertices);
+		model->lod_count.push_back((int) lods[i].tris.size());
+		n_vertices += (int) lods[i].tris.size();
+		cout << "LOD " << i << ": " << lods[i].tris.size()/3 << " tris, error "
+			 << lods[i].error << ", " << model->lod_meshlets[i].size() << " clusters" << endl;
+	}
+
+	// after clustering, so hit faces index the reordered level 0
+	stage("building picking BVH", 0.85);
+	if (!cancel)
+		model->tree.build(lods[0].tris, lods[0].verts);
+
+	stage("staging vertices", 0.95);
+	for (unsigned int i = 1; i < lods.size() && !cancel; i++) {
+		compute_vertex_normals(lods[i].tris, lods[i].verts, vert_norms);
+		stage_corners(lods[i], vert_norms, mesh_occlusion, 0, lods[i].tris.size(),
+					  model->positions, model->normals, model->occlusion);
+	}
+
+	for (unsigned int i = 0; i < verts.size(); i+=3) {
+		float d = sqrt(verts[i]*verts[i] + verts[i+1]*verts[i+1] + verts[i+2]*verts[i+2]);
+		if (d > model->radius) model->radius = d;
+	}
+
+	if (cancel) {
+		delete model;
+		return;
+	}
+	load_message *m = new load_message(load_message::DONE);
+	m->model = model;
+	post(m);
+}
@@ -0,0 +1,112 @@
+//
+//  loader.h
+//  pipeline
+//
+//  Background model loading: read, parse, normals and vertex staging run
+//  on a loader thread that hands finished pieces to the render thread.
+//
+
+#ifndef loader_h
+#define loader_h
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "amath.h"
+#include "bezier_surface.h"
+#include "bvh.h"
+#include "meshlet.h"
+#include "simplify.h"
+#include "spsc_queue.h"
+using namespace std;
+
+/* Everything the renderer needs for one model. For OBJ files the vertex
+ * arrays hold all levels of detail back to back, de-indexed for
+ * glDrawArrays; Bezier files are tessellated by the renderer instead.
+ */
+struct model_data {
+	bool bezier;
+
+	vector<mesh_lod> lods;
+	vector< vector<meshlet> > lod_meshlets;
+	vector<int> lod_first, lod_count;
+	bool closed_mesh;      // cone culling is only safe without open borders
+	float radius;
+	bvh tree;              // over lods[0], for picking
+
+	vector<bezier_surf> surfaces;
+	vector<float> surface_bounds;
+
+	vector<vec4> positions, normals;
+	vector<unsigned char> occlusion;
+};
+
+struct load_message {
+	enum kind_t {
+		STAGE,      // the loader moved on to stage, progress done so far
+		PREVIEW,    // count vertices of the finest level will follow in chunks
+		CHUNK,      // preview vertices [first, first + count)
+		DONE,       // model holds the finished model
+		FAILED
+	} kind;
+
+	string stage;
+	float progress;        // 0 to 1 over the whole load
+	int first, count;
+	vector<vec4> positions, normals;
+	vector<unsigned char> occlusion;
+	model_data *model;
+
+	load_message(kind_t k) : kind(k), progress(0.0), first(0), count(0), model(NULL) {}
+};
+
+/* Runs the load of one file on its own thread. The finest level is
+ * streamed out in CHUNK messages as soon as its normals are known, so it
+ * can be drawn while the levels of detail, clusters and BVH are built.
+ * Messages pass through a bounded queue; when the render thread falls
+ * behind the loader waits rather than staging more.
+ */
+// Weld tolerance that leaves the vertices as the file has them
+const float NO_WELD = -1.0;
+
+class model_loader {
+public:
+	model_loader();
+	~model_loader();
+
+	/* Vertices closer than weld_tolerance are merged first; at 0 only
+	 * vertices at equal positions are, and at NO_WELD none are, so that
+	 * corners split on purpose for hard edges stay split.
+	 */
+	void start(const char *file, float weld_tolerance = NO_WELD);
+
+	// Next message, or NULL if none is ready; the caller deletes it
+	load_message *poll();
+
+	// True from start() until the DONE or FAILED message has been taken
+	bool busy() const { return running; }
+
+	/* Abandons a load in progress: the loader stops after its current
+	 * stage and undelivered messages are dropped.
+	 */
+	void stop();
+
+private:
+	spsc_queue<load_message *> queue;
+	std::thread thread;
+	std::atomic<bool> cancel;
+	bool running;
+
+	void run(string file, float weld_tolerance);
+	void post(load_message *m);
+	void stage(const char *name, float progress);
+
+	model_loader(const model_loader &);
+	model_loader &operator= (const model_loader &);
+};
+
+// Vertices per CHUNK message
+const int LOAD_CHUNK_VERTICES = 65536;
+
+#endif /* loader_h */
@@ -569,6 +569,53 @@ mat4 transpose( const mat4& A ) {
 		 A[0][3], A[1][3], A[2][3], A[3][3] );
 }
 
+inline
+mat4 inverse( const mat4& A ) {
+    // cofactor expansion using 2x2 sub-determinants of the top and
+    //   bottom row pairs
+    GLfloat s0 = A[0][0]*A[1][1] - A[1][0]*A[0][1];
+    GLfloat s1 = A[0][0]*A[1][2] - A[1][0]*A[0][2];
+    GLfloat s2 = A[0][0]*A[1][3] - A[1][0]*A[0][3];
+    GLfloat s3 = A[0][1]*A[1][2] - A[1][1]*A[0][2];
+    GLfloat s4 = A[0][1]*A[1][3] - A[1][1]*A[0][3];
+    GLfloat s5 = A[0][2]*A[1][3] - A[1][2]*A[0][3];
+
+    GLfloat c5 = A[2][2]*A[3][3] - A[3][2]*A[2][3];
+    GLfloat c4 = A[2][1]*A[3][3] - A[3][1]*A[2][3];
+    GLfloat c3 = A[2][1]*A[3][2] - A[3][1]*A[2][2];
+    GLfloat c2 = A[2][0]*A[3][3] - A[3][0]*A[2][3];
+    GLfloat c1 = A[2][0]*A[3][2] - A[3][0]*A[2][2];
+    GLfloat c0 = A[2][0]*A[3][1] - A[3][0]*A[2][1];
+
+    GLfloat det = s0*c5 - s1*c4 + s2*c3 + s3*c2 - s4*c1 + s5*c0;
+#ifdef DEBUG
+    if ( std::fabs(det) < DivideByZeroTolerance ) {
+	std::cerr << "[" << __FILE__ << ":" << __LINE__ << "] "
+		  << "Singular matrix" << std::endl;
+	return mat4();
+    }
+#endif // DEBUG
+    GLfloat r = GLfloat(1.0) / det;
+
+    return mat4(
+	vec4( ( A[1][1]*c5 - A[1][2]*c4 + A[1][3]*c3) * r,
+	      (-A[0][1]*c5 + A[0][2]*c4 - A[0][3]*c3) * r,
+	      ( A[3][1]*s5 - A[3][2]*s4 + A[3][3]*s3) * r,
+	      (-A[2][1]*s5 + A[2][2]*s4 - A[2][3]*s3) * r ),
+	vec4( (-A[1][0]*c5 + A[1][2]*c2 - A[1][3]*c1) * r,
+	      ( A[0][0]*c5 - A[0][2]*c2 + A[0][3]*c1) * r,
+	      (-A[3][0]*s5 + A[3][2]*s2 - A[3][3]*s1) * r,
+	      ( A[2][0]*s5 - A[2][2]*s2 + A[2][3]*s1) * r ),
+	vec4( ( A[1][0]*c4 - A[1][1]*c2 + A[1][3]*c0) * r,
+	      (-A[0][0]*c4 + A[0][1]*c2 - A[0][3]*c0) * r,
+	      ( A[3][0]*s4 - A[3][1]*s2 + A[3][3]*s0) * r,
+	      (-A[2][0]*s4 + A[2][1]*s2 - A[2][3]*s0) * r ),
+	vec4( (-A[1][0]*c3 + A[1][1]*c1 - A[1][2]*c0) * r,
+	      ( A[0][0]*c3 - A[0][1]*c1 + A[0][2]*c0) * r,
+	      (-A[3][0]*s3 + A[3][1]*s1 - A[3][2]*s0) * r,
+	      ( A[2][0]*s3 - A[2][1]*s1 + A[2][2]*s0) * r ) );
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //
 //  Helpful Matrix Methods
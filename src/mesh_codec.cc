@@ -0,0 +1,690 @@
+//
+//  mesh_codec.cc
+//  pipeline
+//
+
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <string.h>
+#include "mesh_codec.h"
+#include "arena.h"
+#include "parallel.h"
+
+using namespace std;
+
+static const char CODEC_MAGIC[4] = { 'P', 'M', 'C', '1' };
+static const uint32_t CODEC_VERSION = 1;
+static const uint32_t CODEC_NORMALS = 1, CODEC_OCCLUSION = 2;
+
+// Vertex cache the face order is tuned for
+static const int CODEC_CACHE_SIZE = 16;
+
+struct codec_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t n_verts, n_tris;
+	uint32_t flags;
+	uint32_t position_bits;
+	float lo[3];
+	float step[3];     // quantization step per axis
+};
+
+// ---------------------------------------------------------------------------
+// order-0 rANS over bytes, four interleaved states (after Giesen's ryg_rans)
+//
+// States are renormalized 16 bits at a time, which with 12 bit frequencies
+// means at most one read per symbol.
+
+static const int RANS_SCALE_BITS = 12;
+static const uint32_t RANS_SCALE = 1u << RANS_SCALE_BITS;
+static const uint32_t RANS_L = 1u << 16;      // lower bound of the normalized state
+
+enum { STREAM_STORED = 0, STREAM_RANS = 1 };
+
+/* Decoding table entry per slot, packed into one word: the symbol in the
+ * low byte, then its frequency - 1 and the slot's offset into its range,
+ * 12 bits each.
+ */
+typedef uint32_t rans_slot;
+
+// Scales counts to sum to RANS_SCALE, keeping every present symbol
+static void normalize_freqs(const size_t counts[256], size_t total, uint32_t freq[256]) {
+	uint32_t sum = 0;
+	for (int s = 0; s < 256; s++) {
+		freq[s] = counts[s] == 0 ? 0 : (uint32_t) max((size_t) 1, counts[s] * RANS_SCALE / total);
+		sum += freq[s];
+	}
+	// the rounding error goes to (or comes from) the most frequent symbols
+	while (sum != RANS_SCALE) {
+		int best = 0;
+		for (int s = 1; s < 256; s++)
+			if (freq[s] > freq[best])
+				best = s;
+		if (sum < RANS_SCALE) {
+			freq[best] += RANS_SCALE - sum;
+			sum = RANS_SCALE;
+		} else {
+			uint32_t cut = min(sum - RANS_SCALE, freq[best] - 1);
+			freq[best] -= cut;
+			sum -= cut;
+		}
+	}
+}
+
+static void rans_encode(const unsigned char *in, size_t n, const uint32_t freq[256],
+						vector<unsigned char> &out)
+{
+	uint32_t start[256];
+	for (int s = 0, c = 0; s < 256; c += freq[s], s++)
+		start[s] = c;
+
+	// at most 12 bits a symbol, rounded up to words, plus the four final states
+	vector<unsigned char> buffer(2 * n + 16);
+	unsigned char *end = &buffer[0] + buffer.size(), *ptr = end;
+	uint32_t r[4] = { RANS_L, RANS_L, RANS_L, RANS_L };
+	for (size_t i = n; i-- > 0;) {
+		uint32_t &x = r[i & 3];
+		uint32_t f = freq[in[i]];
+		uint64_t x_max = ((uint64_t) (RANS_L >> RANS_SCALE_BITS) << 16) * f;
+		if (x >= x_max) {
+			ptr -= 2;
+			uint16_t w = (uint16_t) x;
+			memcpy(ptr, &w, 2);
+			x >>= 16;
+		}
+		x = ((x / f) << RANS_SCALE_BITS) + (x % f) + start[in[i]];
+	}
+	for (int k = 3; k >= 0; k--) {
+		ptr -= 4;
+		memcpy(ptr, &r[k], 4);
+	}
+	out.insert(out.end(), ptr, end);
+}
+
+static bool rans_decode(const unsigned char *in, size_t size, const uint32_t freq[256],
+						unsigned char *out, size_t n)
+{
+	if (size < 16)
+		return false;
+	rans_slot table[RANS_SCALE];
+	for (uint32_t s = 0, c = 0; s < 256; c += freq[s], s++)
+		for (uint32_t k = 0; k < freq[s]; k++)
+			table[c + k] = s | ((freq[s] - 1) << 8) | (k << 20);
+
+	const unsigned char *ptr = in + 16, *end = in + size;
+	uint32_t r[4];
+	for (int k = 0; k < 4; k++)
+		memcpy(&r[k], in + 4*k, 4);
+
+	const uint32_t mask = RANS_SCALE - 1;
+#define RANS_STEP(x, i) { \
+		rans_slot e = table[x & mask]; \
+		out[i] = (unsigned char) e; \
+		x = (((e >> 8) & mask) + 1) * (x >> RANS_SCALE_BITS) + (e >> 20); \
+		if (x < RANS_L) { \
+			uint16_t w; \
+			memcpy(&w, ptr, 2); \
+			x = (x << 16) | w; \
+			ptr += 2; \
+		} \
+	}
+	uint32_t x0 = r[0], x1 = r[1], x2 = r[2], x3 = r[3];
+	size_t i = 0;
+	// four steps read at most 8 bytes; the last few are checked one by one
+	while (i + 4 <= n && end - ptr >= 8) {
+		RANS_STEP(x0, i);
+		RANS_STEP(x1, i+1);
+		RANS_STEP(x2, i+2);
+		RANS_STEP(x3, i+3);
+		i += 4;
+	}
+#undef RANS_STEP
+	uint32_t *tail[4] = { &x0, &x1, &x2, &x3 };
+	for (; i < n; i++) {
+		uint32_t &x = *tail[i & 3];
+		rans_slot e = table[x & mask];
+		out[i] = (unsigned char) e;
+		x = (((e >> 8) & mask) + 1) * (x >> RANS_SCALE_BITS) + (e >> 20);
+		if (x < RANS_L) {
+			if (end - ptr < 2)
+				return false;
+			x = (x << 16) | ptr[0] | (ptr[1] << 8);
+			ptr += 2;
+		}
+	}
+	return ptr == end;
+}
+
+static void put_u32(vector<unsigned char> &out, uint32_t v) {
+	unsigned char b[4];
+	memcpy(b, &v, 4);
+	out.insert(out.end(), b, b + 4);
+}
+
+/* A stream is a mode byte, its raw and payload sizes, then for rANS the
+ * 256 frequencies (16 bits each) and the payload. Streams that do not
+ * shrink are stored.
+ */
+static void write_stream(const vector<unsigned char> &raw, vector<unsigned char> &out) {
+	size_t counts[256] = { 0 };
+	for (size_t i = 0; i < raw.size(); i++)
+		counts[raw[i]]++;
+
+	vector<unsigned char> coded;
+	if (raw.size() > 0) {
+		uint32_t freq[256];
+		normalize_freqs(counts, raw.size(), freq);
+		for (int s = 0; s < 256; s++) {
+			uint16_t f = (uint16_t) freq[s];
+			coded.push_back((unsigned char) f);
+			coded.push_back((unsigned char) (f >> 8));
+		}
+		rans_encode(raw.empty() ? NULL : &raw[0], raw.size(), freq, coded);
+	}
+
+	bool stored = raw.empty() || coded.size() >= raw.size();
+	out.push_back(stored ? STREAM_STORED : STREAM_RANS);
+	put_u32(out, (uint32_t) raw.size());
+	const vector<unsigned char> &payload = stored ? raw : coded;
+	put_u32(out, (uint32_t) payload.size());
+	out.insert(out.end(), payload.begin(), payload.end());
+}
+
+/* Decodes the stream at p into raw (or just skips it when raw is NULL),
+ * moving p past it.
+ */
+static bool read_stream(const unsigned char *&p, const unsigned char *end, owned_array<unsigned char> *raw) {
+	if (end - p < 9)
+		return false;
+	int mode = p[0];
+	uint32_t raw_size, payload_size;
+	memcpy(&raw_size, p + 1, 4);
+	memcpy(&payload_size, p + 5, 4);
+	p += 9;
+	if ((size_t) (end - p) < payload_size)
+		return false;
+	const unsigned char *payload = p;
+	p += payload_size;
+	if (!raw)
+		return true;
+
+	raw->resize(raw_size);
+	if (mode == STREAM_STORED) {
+		if (payload_size != raw_size)
+			return false;
+		if (raw_size > 0)
+			memcpy(raw->data(), payload, raw_size);
+		return true;
+	}
+	if (mode != STREAM_RANS || payload_size < 512)
+		return false;
+	uint32_t freq[256], sum = 0;
+	for (int s = 0; s < 256; s++) {
+		freq[s] = payload[2*s] | (payload[2*s+1] << 8);
+		sum += freq[s];
+	}
+	if (sum != RANS_SCALE)
+		return false;
+	return rans_decode(payload + 512, payload_size - 512, freq, raw->data(), raw_size);
+}
+
+// ---------------------------------------------------------------------------
+// integer coding
+
+static void put_varint(vector<unsigned char> &out, uint32_t v) {
+	while (v >= 0x80) {
+		out.push_back((unsigned char) (v | 0x80));
+		v >>= 7;
+	}
+	out.push_back((unsigned char) v);
+}
+
+static inline bool get_varint(const unsigned char *&p, const unsigned char *end, uint32_t &v) {
+	// one byte is by far the most common case
+	if (p < end && *p < 0x80) {
+		v = *p++;
+		return true;
+	}
+	v = 0;
+	for (int shift = 0; shift < 35 && p < end; shift += 7) {
+		unsigned char b = *p++;
+		v |= (uint32_t) (b & 0x7f) << shift;
+		if (b < 0x80)
+			return true;
+	}
+	return false;
+}
+
+static inline uint32_t zigzag(int32_t v) {
+	return ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t v) {
+	return (int32_t) (v >> 1) ^ -(int32_t) (v & 1);
+}
+
+// Unit normal to two bytes on the octahedron
+static void oct_encode(const float *n, unsigned char *out) {
+	float l = fabsf(n[0]) + fabsf(n[1]) + fabsf(n[2]);
+	float x = l > 0.0f ? n[0] / l : 0.0f, y = l > 0.0f ? n[1] / l : 0.0f;
+	if (l > 0.0f && n[2] < 0.0f) {
+		float ox = x;
+		x = (1.0f - fabsf(y)) * (ox >= 0.0f ? 1.0f : -1.0f);
+		y = (1.0f - fabsf(ox)) * (y >= 0.0f ? 1.0f : -1.0f);
+	}
+	out[0] = (unsigned char) lrintf((x * 0.5f + 0.5f) * 255.0f);
+	out[1] = (unsigned char) lrintf((y * 0.5f + 0.5f) * 255.0f);
+}
+
+static inline void oct_decode(unsigned char a, unsigned char b, float *n) {
+	float x = a * (2.0f / 255.0f) - 1.0f, y = b * (2.0f / 255.0f) - 1.0f;
+	float z = 1.0f - fabsf(x) - fabsf(y);
+	if (z < 0.0f) {
+		float ox = x;
+		x = (1.0f - fabsf(y)) * (ox >= 0.0f ? 1.0f : -1.0f);
+		y = (1.0f - fabsf(ox)) * (y >= 0.0f ? 1.0f : -1.0f);
+	}
+	float s = 1.0f / sqrtf(x*x + y*y + z*z);
+	n[0] = x * s;
+	n[1] = y * s;
+	n[2] = z * s;
+}
+
+// ---------------------------------------------------------------------------
+// face order
+
+/* Tipsify (Sander, Nehab and Barczak 2007): fans around a vertex at a time,
+ * moving on to a vertex still in the cache with the most faces left.
+ * Returns the faces in their new order.
+ */
+static void tipsify(const vector<int> &tris, int n_verts, int cache_size, vector<int> &order) {
+	int n_faces = (int) tris.size() / 3;
+	order.clear();
+	if (n_faces == 0)
+		return;
+	vector<int> first(n_verts + 1, 0), faces(tris.size());
+	for (size_t i = 0; i < tris.size(); i++)
+		first[tris[i] + 1]++;
+	for (int v = 0; v < n_verts; v++)
+		first[v + 1] += first[v];
+	vector<int> fill(first.begin(), first.end() - 1);
+	for (size_t i = 0; i < tris.size(); i++)
+		faces[fill[tris[i]]++] = (int) (i / 3);
+
+	vector<int> live(n_verts), cache_time(n_verts, 0), dead_end, candidates;
+	for (int v = 0; v < n_verts; v++)
+		live[v] = first[v + 1] - first[v];
+	vector<char> emitted(n_faces, 0);
+	order.reserve(n_faces);
+
+	int f = 0, time = cache_size + 1, cursor = 1;
+	while (f >= 0) {
+		candidates.clear();
+		for (int i = first[f]; i < first[f + 1]; i++) {
+			int t = faces[i];
+			if (emitted[t])
+				continue;
+			emitted[t] = 1;
+			order.push_back(t);
+			for (int k = 0; k < 3; k++) {
+				int v = tris[3*t+k];
+				dead_end.push_back(v);
+				candidates.push_back(v);
+				live[v]--;
+				if (time - cache_time[v] > cache_size)
+					cache_time[v] = time++;
+			}
+		}
+
+		// the candidate that stays in the cache while its remaining faces go out
+		int best = -1, best_priority = -1;
+		for (size_t i = 0; i < candidates.size(); i++) {
+			int v = candidates[i];
+			if (live[v] <= 0)
+				continue;
+			int priority = 0;
+			if (time - cache_time[v] + 2 * live[v] <= cache_size)
+				priority = time - cache_time[v];
+			if (priority > best_priority) {
+				best_priority = priority;
+				best = v;
+			}
+		}
+		if (best < 0) {
+			// back to a recent vertex with faces left, or the next one in order
+			while (!dead_end.empty() && best < 0) {
+				int v = dead_end.back();
+				dead_end.pop_back();
+				if (live[v] > 0)
+					best = v;
+			}
+			while (best < 0 && cursor < n_verts) {
+				if (live[cursor] > 0)
+					best = cursor;
+				cursor++;
+			}
+		}
+		f = best;
+	}
+}
+
+// ---------------------------------------------------------------------------
+
+bool encode_mesh(const vector<int> &tris, const vector<float> &verts,
+				 const vector<float> *normals, const vector<unsigned char> *occlusion,
+				 int position_bits, vector<unsigned char> &out)
+{
+	int n_verts = (int) verts.size() / 3;
+	int n_tris = (int) tris.size() / 3;
+	for (size_t i = 0; i < tris.size(); i++)
+		if (tris[i] < 0 || tris[i] >= n_verts) {
+			cerr << "mesh codec: face " << i/3 << " refers to a missing vertex" << endl;
+			return false;
+		}
+	if (position_bits < 1 || position_bits > 24) {
+		cerr << "mesh codec: positions take 1 to 24 bits" << endl;
+		return false;
+	}
+	if (normals && normals->size() != verts.size())
+		normals = NULL;
+	if (occlusion && (int) occlusion->size() != n_verts)
+		occlusion = NULL;
+
+	vector<int> order;
+	tipsify(tris, n_verts, CODEC_CACHE_SIZE, order);
+
+	// vertices in order of first use, then the unused ones
+	vector<int> remap(n_verts, -1), vertex_order;
+	vertex_order.reserve(n_verts);
+	vector<unsigned char> index_bytes;
+	index_bytes.reserve(tris.size() + tris.size() / 2);
+	int next = 0;
+	for (size_t i = 0; i < order.size(); i++)
+		for (int k = 0; k < 3; k++) {
+			int v = tris[3*order[i]+k];
+			if (remap[v] < 0) {
+				remap[v] = next++;
+				vertex_order.push_back(v);
+				put_varint(index_bytes, 0);
+			} else {
+				put_varint(index_bytes, (uint32_t) (next - remap[v]));
+			}
+		}
+	for (int v = 0; v < n_verts; v++)
+		if (remap[v] < 0) {
+			remap[v] = next++;
+			vertex_order.push_back(v);
+		}
+
+	codec_header h;
+	memcpy(h.magic, CODEC_MAGIC, 4);
+	h.version = CODEC_VERSION;
+	h.n_verts = n_verts;
+	h.n_tris = n_tris;
+	h.flags = (normals ? CODEC_NORMALS : 0) | (occlusion ? CODEC_OCCLUSION : 0);
+	h.position_bits = position_bits;
+	const uint32_t q_max = (1u << position_bits) - 1;
+	for (int k = 0; k < 3; k++) {
+		float lo = n_verts > 0 ? verts[k] : 0.0f, hi = lo;
+		for (int v = 0; v < n_verts; v++) {
+			lo = min(lo, verts[3*v+k]);
+			hi = max(hi, verts[3*v+k]);
+		}
+		h.lo[k] = lo;
+		h.step[k] = (hi - lo) / q_max;
+	}
+
+	vector<unsigned char> position_bytes;
+	position_bytes.reserve(4 * verts.size());
+	int32_t prev[3] = { 0, 0, 0 };
+	for (int i = 0; i < n_verts; i++)
+		for (int k = 0; k < 3; k++) {
+			float x = verts[3*vertex_order[i]+k];
+			int32_t q = h.step[k] > 0.0f ? (int32_t) lrintf((x - h.lo[k]) / h.step[k]) : 0;
+			q = max(0, min(q, (int32_t) q_max));
+			put_varint(position_bytes, zigzag(q - prev[k]));
+			prev[k] = q;
+		}
+
+	out.clear();
+	out.resize(sizeof(h));
+	memcpy(&out[0], &h, sizeof(h));
+	write_stream(index_bytes, out);
+	write_stream(position_bytes, out);
+
+	if (normals) {
+		vector<unsigned char> normal_bytes(2 * n_verts);
+		unsigned char last[2] = { 0, 0 };
+		for (int i = 0; i < n_verts; i++) {
+			unsigned char oct[2];
+			oct_encode(&(*normals)[3*vertex_order[i]], oct);
+			for (int k = 0; k < 2; k++) {
+				normal_bytes[2*i+k] = (unsigned char) (oct[k] - last[k]);
+				last[k] = oct[k];
+			}
+		}
+		write_stream(normal_bytes, out);
+	}
+	if (occlusion) {
+		vector<unsigned char> occlusion_bytes(n_verts);
+		unsigned char last = 0;
+		for (int i = 0; i < n_verts; i++) {
+			unsigned char a = (*occlusion)[vertex_order[i]];
+			occlusion_bytes[i] = (unsigned char) (a - last);
+			last = a;
+		}
+		write_stream(occlusion_bytes, out);
+	}
+	return true;
+}
+
+static bool read_header(const unsigned char *data, size_t size, codec_header &h) {
+	if (size < sizeof(h))
+		return false;
+	memcpy(&h, data, sizeof(h));
+	return memcmp(h.magic, CODEC_MAGIC, 4) == 0 && h.version == CODEC_VERSION &&
+		h.position_bits >= 1 && h.position_bits <= 24;
+}
+
+/* Finds the streams after the header, indices and positions first and
+ * then normals and occlusion if the flags say so, and checks that their
+ * decoded sizes can hold the counts the header gives: at least a byte per
+ * index and per position coordinate, exactly the bytes of the others. A
+ * damaged header is thus caught before anything is sized by it.
+ */
+static bool locate_streams(const unsigned char *data, size_t size, const codec_header &h,
+						   const unsigned char *streams[4], int &n_streams)
+{
+	const unsigned char *p = data + sizeof(h), *end = data + size;
+	n_streams = 2 + ((h.flags & CODEC_NORMALS) ? 1 : 0) + ((h.flags & CODEC_OCCLUSION) ? 1 : 0);
+	size_t need[4] = { 3 * (size_t) h.n_tris, 3 * (size_t) h.n_verts, 0, 0 };
+	int s = 2;
+	if (h.flags & CODEC_NORMALS)
+		need[s++] = 2 * (size_t) h.n_verts;
+	if (h.flags & CODEC_OCCLUSION)
+		need[s++] = h.n_verts;
+	for (int i = 0; i < n_streams; i++) {
+		streams[i] = p;
+		if (!read_stream(p, end, NULL))
+			return false;
+		uint32_t raw_size;
+		memcpy(&raw_size, streams[i] + 1, 4);
+		if (i < 2 ? raw_size < need[i] : raw_size != need[i])
+			return false;
+	}
+	return true;
+}
+
+bool read_coded_mesh_info(const unsigned char *data, size_t size, coded_mesh_info &info) {
+	codec_header h;
+	const unsigned char *streams[4];
+	int n_streams;
+	if (!read_header(data, size, h) || !locate_streams(data, size, h, streams, n_streams))
+		return false;
+	info.n_verts = h.n_verts;
+	info.n_tris = h.n_tris;
+	info.has_normals = (h.flags & CODEC_NORMALS) != 0;
+	info.has_occlusion = (h.flags & CODEC_OCCLUSION) != 0;
+	info.max_error = 0.5f * max(h.step[0], max(h.step[1], h.step[2]));
+	return true;
+}
+
+// Each channel decodes on its own; stream is where its stream starts
+static bool decode_indices(const unsigned char *stream, const unsigned char *end,
+						   const codec_header &h, int *indices)
+{
+	owned_array<unsigned char> raw;
+	if (!read_stream(stream, end, &raw))
+		return false;
+	const unsigned char *q = raw.data(), *q_end = q + raw.size();
+	int next = 0;
+	bool ok = true;
+	for (size_t i = 0; i < 3 * (size_t) h.n_tris && ok; i++) {
+		uint32_t back;
+		if (!get_varint(q, q_end, back))
+			return false;
+		int v = back == 0 ? next++ : next - (int) back;
+		ok = ok && v >= 0 && (uint32_t) v < h.n_verts;
+		indices[i] = v;
+	}
+	return ok;
+}
+
+static bool decode_positions(const unsigned char *stream, const unsigned char *end,
+							 const codec_header &h, float *out, int stride)
+{
+	owned_array<unsigned char> raw;
+	if (!read_stream(stream, end, &raw))
+		return false;
+	const unsigned char *q = raw.data(), *q_end = q + raw.size();
+	int32_t prev[3] = { 0, 0, 0 };
+	for (uint32_t v = 0; v < h.n_verts; v++, out += stride)
+		for (int k = 0; k < 3; k++) {
+			uint32_t d;
+			if (!get_varint(q, q_end, d))
+				return false;
+			prev[k] += unzigzag(d);
+			out[k] = h.lo[k] + prev[k] * h.step[k];
+		}
+	return true;
+}
+
+static bool decode_normals(const unsigned char *stream, const unsigned char *end,
+						   const codec_header &h, float *out, int stride)
+{
+	owned_array<unsigned char> raw;
+	if (!read_stream(stream, end, &raw) || raw.size() != 2 * (size_t) h.n_verts)
+		return false;
+	unsigned char a = 0, b = 0;
+	for (size_t v = 0; v < h.n_verts; v++, out += stride) {
+		a += raw[2*v];
+		b += raw[2*v+1];
+		oct_decode(a, b, out);
+	}
+	return true;
+}
+
+static bool decode_occlusion(const unsigned char *stream, const unsigned char *end,
+							 const codec_header &h, unsigned char *out)
+{
+	owned_array<unsigned char> raw;
+	if (!read_stream(stream, end, &raw) || raw.size() != h.n_verts)
+		return false;
+	unsigned char a = 0;
+	for (uint32_t v = 0; v < h.n_verts; v++) {
+		a += raw[v];
+		out[v] = a;
+	}
+	return true;
+}
+
+/* The streams are found first and then decoded side by side, one channel
+ * per job.
+ */
+bool decode_mesh(const unsigned char *data, size_t size, const mesh_decode_target &target) {
+	codec_header h;
+	if (!read_header(data, size, h)) {
+		cerr << "mesh codec: not a coded mesh" << endl;
+		return false;
+	}
+	const unsigned char *end = data + size;
+	const unsigned char *streams[4];
+	int n_streams;
+	if (!locate_streams(data, size, h, streams, n_streams)) {
+		cerr << "mesh codec: truncated data, or counts its streams cannot hold" << endl;
+		return false;
+	}
+
+	// stream of each channel, or NULL where there is nothing to decode
+	int s = 2;
+	const unsigned char *normal_stream = (h.flags & CODEC_NORMALS) ? streams[s++] : NULL;
+	const unsigned char *occlusion_stream = (h.flags & CODEC_OCCLUSION) ? streams[s++] : NULL;
+	std::atomic<bool> good(true);
+	parallel_for(4, 1, [&](size_t b, size_t e) {
+		for (size_t c = b; c < e; c++) {
+			bool r = true;
+			if (c == 0 && target.indices)
+				r = decode_indices(streams[0], end, h, target.indices);
+			else if (c == 1 && target.positions)
+				r = decode_positions(streams[1], end, h, target.positions, target.position_stride);
+			else if (c == 2 && target.normals && normal_stream)
+				r = decode_normals(normal_stream, end, h, target.normals, target.normal_stride);
+			else if (c == 3 && target.occlusion && occlusion_stream)
+				r = decode_occlusion(occlusion_stream, end, h, target.occlusion);
+			if (!r)
+				good = false;
+		}
+	});
+
+	if (!good)
+		cerr << "mesh codec: corrupt data" << endl;
+	return good;
+}
+
+bool is_coded_mesh(const unsigned char *head, size_t size) {
+	return size >= 4 && memcmp(head, CODEC_MAGIC, 4) == 0;
+}
+
+bool write_coded_mesh_file(const char *file, const vector<unsigned char> &data) {
+	ofstream out(file, ios::binary);
+	out.write((const char *) &data[0], data.size());
+	return (bool) out;
+}
+
+bool read_coded_mesh_file(const char *file, vector<int> &tris, vector<float> &verts,
+						  vector<float> *normals, vector<unsigned char> *occlusion)
+{
+	ifstream in(file, ios::binary);
+	if (!in) {
+		cerr << "Cannot open " << file << endl;
+		return false;
+	}
+	in.seekg(0, ios::end);
+	vector<unsigned char> data((size_t) in.tellg());
+	in.seekg(0, ios::beg);
+	if (!data.empty())
+		in.read((char *) &data[0], data.size());
+
+	coded_mesh_info info;
+	// the counts are checked against the streams before anything is sized by them
+	if (!read_coded_mesh_info(data.empty() ? NULL : &data[0], data.size(), info)) {
+		cerr << file << " is not a coded mesh, or is damaged" << endl;
+		return false;
+	}
+	tris.resize(3 * (size_t) info.n_tris);
+	verts.resize(3 * (size_t) info.n_verts);
+	mesh_decode_target target;
+	target.indices = tris.empty() ? NULL : &tris[0];
+	target.positions = verts.empty() ? NULL : &verts[0];
+	if (normals) {
+		normals->resize(info.has_normals ? verts.size() : 0);
+		target.normals = normals->empty() ? NULL : &(*normals)[0];
+	}
+	if (occlusion) {
+		occlusion->resize(info.has_occlusion ? info.n_verts : 0);
+		target.occlusion = occlusion->empty() ? NULL : &(*occlusion)[0];
+	}
+	return decode_mesh(&data[0], data.size(), target);
+}
@@ -0,0 +1,71 @@
+//
+//  mesh_codec.h
+//  pipeline
+//
+//  Compact binary meshes: quantized, reordered and entropy coded indexed
+//  triangles with optional normals and baked occlusion, and a decoder that
+//  writes straight into the caller's (upload) buffers.
+//
+
+#ifndef mesh_codec_h
+#define mesh_codec_h
+
+#include <stdint.h>
+#include <vector>
+using namespace std;
+
+const int CODEC_DEFAULT_POSITION_BITS = 16;
+
+/* Faces are put in vertex cache order (Tipsify) and vertices renumbered in
+ * order of first use, so an index is coded as how far back it is from the
+ * next new vertex: 0 for a new vertex and mostly small otherwise. Positions
+ * are quantized to position_bits per axis over the bounding box and coded
+ * as zigzag deltas from the previous vertex; normals are octahedral, 8 bits
+ * per coordinate, and like occlusion coded as byte deltas. Every channel
+ * then goes through an order-0 rANS coder with four interleaved states.
+ *
+ * Vertices no face uses are kept, after the others. normals (3 floats per
+ * vertex) and occlusion (1 byte per vertex) may be NULL.
+ */
+bool encode_mesh(const vector<int> &tris, const vector<float> &verts,
+				 const vector<float> *normals, const vector<unsigned char> *occlusion,
+				 int position_bits, vector<unsigned char> &out);
+
+struct coded_mesh_info {
+	uint32_t n_verts, n_tris;
+	bool has_normals, has_occlusion;
+	float max_error;       // of a position coordinate, half a quantization step
+};
+
+// Fails unless the streams are all there and can hold the counts the header gives
+bool read_coded_mesh_info(const unsigned char *data, size_t size, coded_mesh_info &info);
+
+/* Where decode_mesh writes; strides are in floats so positions can go
+ * straight into, say, vec4 arrays. Channels left NULL are skipped, as are
+ * channels the data does not have.
+ */
+struct mesh_decode_target {
+	int *indices;                      // 3 * n_tris
+	float *positions;
+	int position_stride;
+	float *normals;
+	int normal_stride;
+	unsigned char *occlusion;
+
+	mesh_decode_target() : indices(NULL), positions(NULL), position_stride(3),
+		normals(NULL), normal_stride(3), occlusion(NULL) {}
+};
+
+bool decode_mesh(const unsigned char *data, size_t size, const mesh_decode_target &target);
+
+// Checks the magic number at the start of a file only
+bool is_coded_mesh(const unsigned char *head, size_t size);
+bool write_coded_mesh_file(const char *file, const vector<unsigned char> &data);
+
+/* Reads and decodes a whole file into the usual arrays; normals and
+ * occlusion are left empty when the file has none (or they are NULL).
+ */
+bool read_coded_mesh_file(const char *file, vector<int> &tris, vector<float> &verts,
+						  vector<float> *normals, vector<unsigned char> *occlusion);
+
+#endif /* mesh_codec_h */
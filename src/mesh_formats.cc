@@ -0,0 +1,635 @@
+//
+//  mesh_formats.cc
+//  pipeline
+//
+
+#include <stdint.h>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include "mesh_formats.h"
+#include "arena.h"
+#include "mesh_codec.h"
+#include "parser.h"
+#include "weld.h"
+
+using namespace std;
+
+// The whole file with a 0 after it, so text can be scanned with strtod
+static bool read_whole_file(const char *file, owned_array<char> &data) {
+	ifstream in(file, ios::binary | ios::ate);
+	if (!in) {
+		cerr << "Cannot open " << file << endl;
+		return false;
+	}
+	size_t size = (size_t) in.tellg();
+	in.seekg(0, ios::beg);
+	data.resize(size + 1);
+	in.read(data.data(), size);
+	data[size] = 0;
+	data.resize(size);
+	if (!in) {
+		cerr << "Failed to read " << file << endl;
+		return false;
+	}
+	return true;
+}
+
+static void report_counts(const vector<int> &tris, const vector<float> &verts) {
+	cout << "found this many tris, verts: " << tris.size() / 3.0 << "  " << verts.size() / 3.0 << endl;
+}
+
+static bool host_little_endian() {
+	uint16_t one = 1;
+	unsigned char first;
+	memcpy(&first, &one, 1);
+	return first == 1;
+}
+
+static uint32_t le_uint32(const char *p) {
+	const unsigned char *b = (const unsigned char *) p;
+	return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+}
+
+static float le_float(const char *p) {
+	uint32_t bits = le_uint32(p);
+	float f;
+	memcpy(&f, &bits, 4);
+	return f;
+}
+
+// PLY
+
+enum ply_type { PLY_NONE, PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32,
+	PLY_FLOAT32, PLY_FLOAT64 };
+static const int PLY_SIZES[] = { 0, 1, 1, 2, 2, 4, 4, 4, 8 };
+
+static ply_type ply_type_named(const string &s) {
+	if (s == "char" || s == "int8") return PLY_INT8;
+	if (s == "uchar" || s == "uint8") return PLY_UINT8;
+	if (s == "short" || s == "int16") return PLY_INT16;
+	if (s == "ushort" || s == "uint16") return PLY_UINT16;
+	if (s == "int" || s == "int32") return PLY_INT32;
+	if (s == "uint" || s == "uint32") return PLY_UINT32;
+	if (s == "float" || s == "float32") return PLY_FLOAT32;
+	if (s == "double" || s == "float64") return PLY_FLOAT64;
+	return PLY_NONE;
+}
+
+struct ply_property {
+	string name;
+	ply_type type;
+	ply_type count_type;     // PLY_NONE unless the property is a list
+};
+
+struct ply_element {
+	string name;
+	size_t count;
+	vector<ply_property> props;
+
+	// bytes per record in a binary file, 0 if records hold lists
+	size_t fixed_size() const {
+		size_t size = 0;
+		for (size_t i = 0; i < props.size(); i++) {
+			if (props[i].count_type != PLY_NONE)
+				return 0;
+			size += PLY_SIZES[props[i].type];
+		}
+		return size;
+	}
+};
+
+enum ply_encoding { PLY_ASCII, PLY_BINARY_LE, PLY_BINARY_BE };
+
+/* Values of the data section one by one, whatever the encoding. Running
+ * out of data clears ok and yields zeros from then on.
+ */
+struct ply_reader {
+	const char *p, *end;
+	ply_encoding encoding;
+	bool swap;             // binary in the other byte order than ours
+	bool ok;
+
+	double next(ply_type t) {
+		if (encoding == PLY_ASCII) {
+			char *after;
+			double v = strtod(p, &after);
+			if (after == p) {
+				ok = false;
+				return 0.0;
+			}
+			p = after;
+			return v;
+		}
+		int size = PLY_SIZES[t];
+		if (end - p < size) {
+			ok = false;
+			p = end;
+			return 0.0;
+		}
+		unsigned char b[8];
+		memcpy(b, p, size);
+		p += size;
+		if (swap)
+			for (int i = 0; i < size / 2; i++)
+				std::swap(b[i], b[size - 1 - i]);
+		switch (t) {
+			case PLY_INT8:    return (int8_t) b[0];
+			case PLY_UINT8:   return b[0];
+			case PLY_INT16:   { int16_t v; memcpy(&v, b, 2); return v; }
+			case PLY_UINT16:  { uint16_t v; memcpy(&v, b, 2); return v; }
+			case PLY_INT32:   { int32_t v; memcpy(&v, b, 4); return v; }
+			case PLY_UINT32:  { uint32_t v; memcpy(&v, b, 4); return v; }
+			case PLY_FLOAT32: { float v; memcpy(&v, b, 4); return v; }
+			case PLY_FLOAT64: { double v; memcpy(&v, b, 8); return v; }
+			default:          return 0.0;
+		}
+	}
+
+	bool binary_native() const { return encoding != PLY_ASCII && !swap; }
+};
+
+static bool parse_ply_header(ply_reader &in, vector<ply_element> &elements) {
+	bool have_format = false;
+	for (int line = 0; in.p < in.end; line++) {
+		const char *eol = (const char *) memchr(in.p, '\n', in.end - in.p);
+		if (eol == NULL)
+			return false;
+		istringstream iss(string(in.p, eol));
+		in.p = eol + 1;
+		string word;
+		iss >> word;
+		if (line == 0 && word != "ply")
+			return false;
+		if (word == "format") {
+			string f;
+			iss >> f;
+			if (f == "ascii")
+				in.encoding = PLY_ASCII;
+			else if (f == "binary_little_endian")
+				in.encoding = PLY_BINARY_LE;
+			else if (f == "binary_big_endian")
+				in.encoding = PLY_BINARY_BE;
+			else
+				return false;
+			have_format = true;
+		}
+		else if (word == "element") {
+			ply_element e;
+			e.count = 0;
+			iss >> e.name >> e.count;
+			elements.push_back(e);
+		}
+		else if (word == "property") {
+			if (elements.empty())
+				return false;
+			ply_property prop;
+			string type;
+			iss >> type;
+			if (type == "list") {
+				string count_type, item_type;
+				iss >> count_type >> item_type >> prop.name;
+				prop.count_type = ply_type_named(count_type);
+				prop.type = ply_type_named(item_type);
+				if (prop.count_type == PLY_NONE)
+					return false;
+			} else {
+				prop.count_type = PLY_NONE;
+				prop.type = ply_type_named(type);
+				iss >> prop.name;
+			}
+			if (prop.type == PLY_NONE)
+				return false;
+			elements.back().props.push_back(prop);
+		}
+		else if (word == "end_header") {
+			in.swap = in.encoding != PLY_ASCII && (in.encoding == PLY_BINARY_LE) != host_little_endian();
+			return have_format;
+		}
+		// comment, obj_info and the like are ignored
+	}
+	return false;
+}
+
+static void skip_ply_element(ply_reader &in, const ply_element &e) {
+	size_t record = e.fixed_size();
+	if (in.encoding != PLY_ASCII && record > 0) {
+		if ((size_t) (in.end - in.p) / record < e.count) {
+			in.ok = false;
+			in.p = in.end;
+		} else
+			in.p += e.count * record;
+		return;
+	}
+	for (size_t r = 0; r < e.count && in.ok; r++)
+		for (size_t i = 0; i < e.props.size(); i++) {
+			const ply_property &prop = e.props[i];
+			size_t n = prop.count_type == PLY_NONE ? 1 : (size_t) in.next(prop.count_type);
+			for (size_t j = 0; j < n && in.ok; j++)
+				in.next(prop.type);
+		}
+}
+
+static bool read_ply_vertices(ply_reader &in, const ply_element &e, vector<float> &verts) {
+	const char *names[3] = { "x", "y", "z" };
+	int axis_prop[3] = { -1, -1, -1 };
+	size_t axis_offset[3] = { 0, 0, 0 };
+	bool float_axes = true;
+	size_t offset = 0;
+	for (size_t i = 0; i < e.props.size(); i++) {
+		for (int k = 0; k < 3; k++)
+			if (e.props[i].name == names[k] && e.props[i].count_type == PLY_NONE) {
+				axis_prop[k] = (int) i;
+				axis_offset[k] = offset;
+				float_axes = float_axes && e.props[i].type == PLY_FLOAT32;
+			}
+		offset += PLY_SIZES[e.props[i].type];
+	}
+	if (axis_prop[0] < 0 || axis_prop[1] < 0 || axis_prop[2] < 0) {
+		cerr << "PLY: vertices have no x, y and z" << endl;
+		return false;
+	}
+	verts.resize(3 * e.count);
+
+	// the usual layout: records of plain values with float positions, in our byte order
+	size_t record = e.fixed_size();
+	if (in.binary_native() && record > 0 && float_axes) {
+		if ((size_t) (in.end - in.p) / record < e.count) {
+			in.ok = false;
+			return false;
+		}
+		const char *r = in.p;
+		for (size_t v = 0; v < e.count; v++, r += record)
+			for (int k = 0; k < 3; k++)
+				memcpy(&verts[3*v + k], r + axis_offset[k], 4);
+		in.p = r;
+		return true;
+	}
+
+	for (size_t v = 0; v < e.count && in.ok; v++)
+		for (size_t i = 0; i < e.props.size(); i++) {
+			const ply_property &prop = e.props[i];
+			if (prop.count_type != PLY_NONE) {
+				size_t n = (size_t) in.next(prop.count_type);
+				for (size_t j = 0; j < n && in.ok; j++)
+					in.next(prop.type);
+				continue;
+			}
+			double value = in.next(prop.type);
+			for (int k = 0; k < 3; k++)
+				if (axis_prop[k] == (int) i)
+					verts[3*v + k] = (float) value;
+		}
+	return in.ok;
+}
+
+// Polygons become fans around their first corner
+static bool read_ply_faces(ply_reader &in, const ply_element &e, vector<int> &tris) {
+	int index_prop = -1;
+	for (size_t i = 0; i < e.props.size(); i++)
+		if (e.props[i].count_type != PLY_NONE &&
+			(e.props[i].name == "vertex_indices" || e.props[i].name == "vertex_index"))
+			index_prop = (int) i;
+	if (index_prop < 0) {
+		cerr << "PLY: faces have no vertex_indices" << endl;
+		return false;
+	}
+	tris.reserve(tris.size() + 3 * e.count);
+
+	// the usual layout: nothing but a byte count and int indices, in our byte order
+	const ply_property &only = e.props[0];
+	if (in.binary_native() && e.props.size() == 1 &&
+		(only.count_type == PLY_UINT8 || only.count_type == PLY_INT8) &&
+		(only.type == PLY_INT32 || only.type == PLY_UINT32)) {
+		const char *r = in.p;
+		for (size_t f = 0; f < e.count; f++) {
+			if (r == in.end) {
+				in.ok = false;
+				return false;
+			}
+			int n = (unsigned char) *r++;
+			if (in.end - r < 4 * n) {
+				in.ok = false;
+				return false;
+			}
+			if (n == 3) {
+				size_t t = tris.size();
+				tris.resize(t + 3);
+				memcpy(&tris[t], r, 12);
+			} else {
+				int first = 0, prev = 0;
+				for (int j = 0; j < n; j++) {
+					int v;
+					memcpy(&v, r + 4 * j, 4);
+					if (j == 0)
+						first = v;
+					else if (j >= 2) {
+						tris.push_back(first);
+						tris.push_back(prev);
+						tris.push_back(v);
+					}
+					prev = v;
+				}
+			}
+			r += 4 * n;
+		}
+		in.p = r;
+		return true;
+	}
+
+	for (size_t f = 0; f < e.count && in.ok; f++)
+		for (size_t i = 0; i < e.props.size(); i++) {
+			const ply_property &prop = e.props[i];
+			size_t n = prop.count_type == PLY_NONE ? 1 : (size_t) in.next(prop.count_type);
+			int first = 0, prev = 0;
+			for (size_t j = 0; j < n && in.ok; j++) {
+				double value = in.next(prop.type);
+				if ((int) i != index_prop)
+					continue;
+				int v = (int) value;
+				if (j == 0)
+					first = v;
+				else if (j >= 2) {
+					tris.push_back(first);
+					tris.push_back(prev);
+					tris.push_back(v);
+				}
+				prev = v;
+			}
+		}
+	return in.ok;
+}
+
+bool read_ply_file(const char *file, vector<int> &tris, vector<float> &verts) {
+	tris.clear();
+	verts.clear();
+	owned_array<char> data;
+	if (!read_whole_file(file, data))
+		return false;
+
+	ply_reader in;
+	in.p = data.data();
+	in.end = in.p + data.size();
+	in.encoding = PLY_ASCII;
+	in.swap = false;
+	in.ok = true;
+	vector<ply_element> elements;
+	if (!parse_ply_header(in, elements)) {
+		cerr << "PLY: bad header in " << file << endl;
+		return false;
+	}
+
+	// elements follow each other in the order of the header
+	for (size_t i = 0; i < elements.size(); i++) {
+		const ply_element &e = elements[i];
+		bool ok;
+		if (e.name == "vertex")
+			ok = read_ply_vertices(in, e, verts);
+		else if (e.name == "face")
+			ok = read_ply_faces(in, e, tris);
+		else {
+			skip_ply_element(in, e);
+			ok = in.ok;
+		}
+		if (!ok) {
+			cerr << "PLY: " << file << " ends in the middle of its " << e.name << " element" << endl;
+			return false;
+		}
+	}
+
+	int n_verts = (int) (verts.size() / 3);
+	for (size_t i = 0; i < tris.size(); i++)
+		if (tris[i] < 0 || tris[i] >= n_verts) {
+			cerr << "PLY: face " << i / 3 << " of " << file << " uses vertex " << tris[i]
+				 << " of " << n_verts << endl;
+			tris.clear();
+			return false;
+		}
+	report_counts(tris, verts);
+	return true;
+}
+
+// STL
+
+static const size_t STL_HEADER_BYTES = 84;
+static const size_t STL_FACET_BYTES = 50;
+
+static bool is_binary_stl(const char *head, size_t head_size, size_t file_size) {
+	if (head_size < STL_HEADER_BYTES)
+		return false;
+	uint64_t facets = le_uint32(head + 80);
+	return STL_HEADER_BYTES + STL_FACET_BYTES * facets == file_size;
+}
+
+bool read_stl_file(const char *file, vector<int> &tris, vector<float> &verts) {
+	tris.clear();
+	verts.clear();
+	owned_array<char> data;
+	if (!read_whole_file(file, data))
+		return false;
+
+	vector<float> corners;
+	const char *p = data.data(), *end = p + data.size();
+	if (is_binary_stl(p, data.size(), data.size())) {
+		size_t facets = le_uint32(p + 80);
+		corners.resize(9 * facets);
+		const char *f = p + STL_HEADER_BYTES;
+		// each facet is a normal, three corners and a 2 byte attribute
+		for (size_t i = 0; i < facets; i++, f += STL_FACET_BYTES)
+			for (int k = 0; k < 9; k++)
+				corners[9*i + k] = le_float(f + 12 + 4 * k);
+	} else {
+		while (p < end && isspace((unsigned char) *p))
+			p++;
+		if (end - p < 5 || strncmp(p, "solid", 5) != 0) {
+			cerr << "STL: " << file << " is neither binary nor ASCII STL" << endl;
+			return false;
+		}
+		// only the corners matter: "vertex x y z"
+		while (p < end) {
+			while (p < end && isspace((unsigned char) *p))
+				p++;
+			const char *word = p;
+			while (p < end && !isspace((unsigned char) *p))
+				p++;
+			if (p - word != 6 || strncmp(word, "vertex", 6) != 0)
+				continue;
+			for (int k = 0; k < 3; k++) {
+				char *after;
+				float v = strtof(p, &after);
+				if (after == p) {
+					cerr << "STL: bad vertex in " << file << endl;
+					return false;
+				}
+				corners.push_back(v);
+				p = after;
+			}
+		}
+		if (corners.size() % 9 != 0) {
+			cerr << "STL: " << file << " has a facet without three corners" << endl;
+			return false;
+		}
+	}
+
+	// every corner its own vertex, until equal ones are welded
+	tris.resize(corners.size() / 3);
+	for (size_t i = 0; i < tris.size(); i++)
+		tris[i] = (int) i;
+	verts.swap(corners);
+	weld_params exact;
+	weld_result welded;
+	weld_vertices(tris, verts, exact, welded);
+	report_counts(tris, verts);
+	return true;
+}
+
+// The registry
+
+static bool sniff_coded(const unsigned char *head, size_t head_size, size_t) {
+	return is_coded_mesh(head, head_size);
+}
+
+static bool sniff_ply(const unsigned char *head, size_t head_size, size_t) {
+	return head_size >= 4 && memcmp(head, "ply", 3) == 0 && (head[3] == '\n' || head[3] == '\r');
+}
+
+// Binary STL by its size, as its header may well start with "solid" too
+static bool sniff_stl(const unsigned char *head, size_t head_size, size_t file_size) {
+	const char *p = (const char *) head, *end = p + head_size;
+	if (is_binary_stl(p, head_size, file_size))
+		return true;
+	while (p < end && isspace((unsigned char) *p))
+		p++;
+	return end - p >= 5 && strncmp(p, "solid", 5) == 0;
+}
+
+// The first word of the first line that is neither blank nor a comment
+static string first_word(const unsigned char *head, size_t head_size) {
+	const char *p = (const char *) head, *end = p + head_size;
+	while (p < end) {
+		while (p < end && isspace((unsigned char) *p))
+			p++;
+		if (p < end && *p == '#') {
+			p = (const char *) memchr(p, '\n', end - p);
+			if (p == NULL)
+				break;
+			continue;
+		}
+		const char *word = p;
+		while (p < end && !isspace((unsigned char) *p))
+			p++;
+		return string(word, p);
+	}
+	return string();
+}
+
+// Bezier files start with the number of patches
+static bool sniff_bezier(const unsigned char *head, size_t head_size, size_t) {
+	string word = first_word(head, head_size);
+	if (word.empty())
+		return false;
+	for (size_t i = 0; i < word.size(); i++)
+		if (!isdigit((unsigned char) word[i]))
+			return false;
+	return true;
+}
+
+// Any OBJ statement, or nothing but comments as far as the head goes
+static bool sniff_obj(const unsigned char *head, size_t head_size, size_t) {
+	static const char *statements[] = { "v", "vt", "vn", "vp", "f", "l", "p", "o", "g", "s",
+		"mtllib", "usemtl" };
+	string word = first_word(head, head_size);
+	if (word.empty())
+		return true;
+	for (size_t i = 0; i < sizeof(statements) / sizeof(statements[0]); i++)
+		if (word == statements[i])
+			return true;
+	return false;
+}
+
+static bool read_coded(const char *file, vector<int> &tris, vector<float> &verts,
+					   vector<float> *normals, vector<unsigned char> *occlusion)
+{
+	return read_coded_mesh_file(file, tris, verts, normals, occlusion);
+}
+
+static bool read_ply(const char *file, vector<int> &tris, vector<float> &verts, vector<float> *,
+					 vector<unsigned char> *) {
+	return read_ply_file(file, tris, verts);
+}
+
+static bool read_stl(const char *file, vector<int> &tris, vector<float> &verts, vector<float> *,
+					 vector<unsigned char> *) {
+	return read_stl_file(file, tris, verts);
+}
+
+static bool read_obj(const char *file, vector<int> &tris, vector<float> &verts, vector<float> *,
+					 vector<unsigned char> *) {
+	read_wavefront_file(file, tris, verts);
+	return true;
+}
+
+static vector<mesh_format> built_in_formats() {
+	mesh_format built_in[] = {
+		{ "coded mesh", sniff_coded, read_coded },
+		{ "PLY", sniff_ply, read_ply },
+		{ "STL", sniff_stl, read_stl },
+		{ "Bezier patches", sniff_bezier, NULL },
+		{ "OBJ", sniff_obj, read_obj },
+	};
+	return vector<mesh_format>(built_in, built_in + sizeof(built_in) / sizeof(built_in[0]));
+}
+
+// Built in the initializer, which C++11 runs once however many loader
+// threads get here first
+static vector<mesh_format> &mesh_formats() {
+	static vector<mesh_format> formats = built_in_formats();
+	return formats;
+}
+
+// Not thread safe: register before loading starts
+void register_mesh_format(const mesh_format &format) {
+	vector<mesh_format> &formats = mesh_formats();
+	formats.insert(formats.begin(), format);
+}
+
+const mesh_format *find_mesh_format(const char *file) {
+	ifstream in(file, ios::binary | ios::ate);
+	if (!in) {
+		cerr << "Cannot open " << file << endl;
+		return NULL;
+	}
+	size_t file_size = (size_t) in.tellg();
+	in.seekg(0, ios::beg);
+	unsigned char head[MESH_SNIFF_BYTES];
+	in.read((char *) head, sizeof(head));
+	size_t head_size = (size_t) in.gcount();
+
+	const vector<mesh_format> &formats = mesh_formats();
+	for (size_t i = 0; i < formats.size(); i++)
+		if (formats[i].sniff(head, head_size, file_size))
+			return &formats[i];
+	cerr << "Unknown model format: " << file << endl;
+	return NULL;
+}
+
+bool read_mesh_file(const char *file, vector<int> &tris, vector<float> &verts,
+					vector<unsigned char> *occlusion, vector<float> *normals)
+{
+	const mesh_format *format = find_mesh_format(file);
+	if (format == NULL)
+		return false;
+	if (format->patches()) {
+		cerr << file << " holds " << format->name << ", not a triangle mesh" << endl;
+		return false;
+	}
+	if (occlusion)
+		occlusion->clear();
+	if (normals)
+		normals->clear();
+	return format->read(file, tris, verts, normals, occlusion);
+}
@@ -0,0 +1,61 @@
+//
+//  mesh_formats.h
+//  pipeline
+//
+//  Model file formats: a registry of readers that recognise their files
+//  from the first bytes, with binary and ASCII PLY and STL next to OBJ,
+//  coded meshes and Bezier patches.
+//
+
+#ifndef mesh_formats_h
+#define mesh_formats_h
+
+#include <stddef.h>
+#include <vector>
+using namespace std;
+
+// How much of a file the formats get to look at
+const size_t MESH_SNIFF_BYTES = 512;
+
+struct mesh_format {
+	const char *name;
+
+	// true if head, the first bytes of a file of file_size bytes, is this format
+	bool (*sniff)(const unsigned char *head, size_t head_size, size_t file_size);
+
+	/* Reads indexed triangles the way read_wavefront_file does: 0-based
+	 * indices into 3 floats per vertex. Formats that carry vertex normals
+	 * or baked occlusion fill normals (3 floats per vertex) and occlusion,
+	 * either of which may be NULL; the others leave them empty. NULL for
+	 * patch formats, which the renderer tessellates itself.
+	 */
+	bool (*read)(const char *file, vector<int> &tris, vector<float> &verts,
+				 vector<float> *normals, vector<unsigned char> *occlusion);
+
+	bool patches() const { return read == NULL; }
+};
+
+/* Formats are tried in order, binary ones first and OBJ last. Formats
+ * registered here are tried before all of them.
+ */
+void register_mesh_format(const mesh_format &format);
+
+// Reads the head of file once; NULL (with a message) if unreadable or unknown
+const mesh_format *find_mesh_format(const char *file);
+
+// Any triangle mesh format; false for patches and unknown formats
+bool read_mesh_file(const char *file, vector<int> &tris, vector<float> &verts,
+					vector<unsigned char> *occlusion = NULL, vector<float> *normals = NULL);
+
+/* Vertex and face elements of a PLY file, in any of its three encodings;
+ * polygons are split into fans. Other elements and properties are skipped.
+ */
+bool read_ply_file(const char *file, vector<int> &tris, vector<float> &verts);
+
+/* Binary or ASCII STL. STL stores three corners per facet, so corners with
+ * exactly equal positions are welded into shared vertices, and facets
+ * that collapse are dropped.
+ */
+bool read_stl_file(const char *file, vector<int> &tris, vector<float> &verts);
+
+#endif /* mesh_formats_h */
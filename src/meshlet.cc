@@ -0,0 +1,290 @@
+//
+//  meshlet.cc
+//  pipeline
+//
+
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+#include "meshlet.h"
+#include "halfedge.h"
+
+using namespace std;
+
+// Spreads the low 10 bits of x so that there are two zero bits between each
+static inline uint32_t part1by2(uint32_t x) {
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+static void compute_bounds(const vector<int> &tris, const vector<float> &verts,
+						   const vector<float> &normals, meshlet &m)
+{
+	float lo[3] = { 1e30f, 1e30f, 1e30f }, hi[3] = { -1e30f, -1e30f, -1e30f };
+	float axis[3] = { 0, 0, 0 };
+	for (int f = m.first; f < m.first + m.count; f++) {
+		for (int k = 0; k < 3; k++) {
+			const float *p = &verts[3*tris[3*f+k]];
+			for (int c = 0; c < 3; c++) {
+				lo[c] = min(lo[c], p[c]);
+				hi[c] = max(hi[c], p[c]);
+			}
+		}
+		for (int c = 0; c < 3; c++)
+			axis[c] += normals[3*f+c];
+	}
+
+	float r2 = 0.0f;
+	for (int c = 0; c < 3; c++)
+		m.center[c] = 0.5f * (lo[c] + hi[c]);
+	for (int f = m.first; f < m.first + m.count; f++) {
+		for (int k = 0; k < 3; k++) {
+			const float *p = &verts[3*tris[3*f+k]];
+			float dx = p[0] - m.center[0], dy = p[1] - m.center[1], dz = p[2] - m.center[2];
+			r2 = max(r2, dx*dx + dy*dy + dz*dz);
+		}
+	}
+	m.radius = sqrtf(r2);
+
+	float len = sqrtf(axis[0]*axis[0] + axis[1]*axis[1] + axis[2]*axis[2]);
+	m.cone_cutoff = 1.0f;
+	if (len <= 0.0f) {
+		m.cone_axis[0] = m.cone_axis[1] = 0.0f;
+		m.cone_axis[2] = 1.0f;
+		return;
+	}
+	for (int c = 0; c < 3; c++)
+		m.cone_axis[c] = axis[c] / len;
+
+	float min_dot = 1.0f;
+	for (int f = m.first; f < m.first + m.count; f++) {
+		const float *n = &normals[3*f];
+		min_dot = min(min_dot, n[0]*m.cone_axis[0] + n[1]*m.cone_axis[1] + n[2]*m.cone_axis[2]);
+	}
+	// cones wider than ~84 degrees never cull anything
+	if (min_dot > 0.1f)
+		m.cone_cutoff = sqrtf(1.0f - min_dot*min_dot);
+}
+
+void build_meshlets(vector<int> &tris, const vector<float> &verts, int max_tris,
+					vector<meshlet> &out)
+{
+	out.clear();
+	const int n_faces = (int) tris.size() / 3;
+	if (n_faces == 0)
+		return;
+	if (max_tris <= 0)
+		max_tris = MESHLET_MAX_TRIS;
+
+	vector<float> normals(3 * n_faces), centroids(3 * n_faces);
+	float lo[3] = { 1e30f, 1e30f, 1e30f }, hi[3] = { -1e30f, -1e30f, -1e30f };
+	double area = 0.0;
+	for (int f = 0; f < n_faces; f++) {
+		const float *p0 = &verts[3*tris[3*f]], *p1 = &verts[3*tris[3*f+1]], *p2 = &verts[3*tris[3*f+2]];
+		float e1[3] = { p1[0]-p0[0], p1[1]-p0[1], p1[2]-p0[2] };
+		float e2[3] = { p2[0]-p0[0], p2[1]-p0[1], p2[2]-p0[2] };
+		float n[3] = { e1[1]*e2[2] - e1[2]*e2[1], e1[2]*e2[0] - e1[0]*e2[2], e1[0]*e2[1] - e1[1]*e2[0] };
+		float len = sqrtf(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+		area += 0.5 * len;
+		for (int c = 0; c < 3; c++) {
+			normals[3*f+c] = len > 0.0f ? n[c] / len : 0.0f;
+			centroids[3*f+c] = (p0[c] + p1[c] + p2[c]) / 3.0f;
+			lo[c] = min(lo[c], centroids[3*f+c]);
+			hi[c] = max(hi[c], centroids[3*f+c]);
+		}
+	}
+
+	// seed clusters in Morton order so consecutive clusters stay close
+	vector< pair<uint32_t, int> > seeds(n_faces);
+	for (int f = 0; f < n_faces; f++) {
+		uint32_t code = 0;
+		for (int c = 0; c < 3; c++) {
+			float extent = hi[c] - lo[c];
+			float t = extent > 0.0f ? (centroids[3*f+c] - lo[c]) / extent : 0.0f;
+			code |= part1by2((uint32_t) (t * 1023.0f)) << c;
+		}
+		seeds[f] = make_pair(code, f);
+	}
+	sort(seeds.begin(), seeds.end());
+
+	halfedge_mesh topology;
+	topology.build(tris, (int) verts.size() / 3);
+
+	// expected extent of a full cluster, used to keep clusters compact
+	float scale = (float) sqrt(area / n_faces * max_tris);
+	if (scale <= 0.0f)
+		scale = 1.0f;
+
+	vector<int> cluster_of(n_faces, -1);
+	vector<int> frontier_stamp(n_faces, -1);
+	vector<int> order;
+	order.reserve(n_faces);
+	vector<int> frontier;
+
+	for (int s = 0; s < n_faces; s++) {
+		int seed = seeds[s].second;
+		if (cluster_of[seed] >= 0)
+			continue;
+
+		meshlet m;
+		m.first = (int) order.size();
+		m.count = 0;
+		int id = (int) out.size();
+		float avg[3] = { 0, 0, 0 };
+		const float *origin = &centroids[3*seed];
+		frontier.clear();
+		frontier.push_back(seed);
+		frontier_stamp[seed] = id;
+
+		while (m.count < max_tris && !frontier.empty()) {
+			// take the frontier face best aligned with the cluster so far
+			float len = sqrtf(avg[0]*avg[0] + avg[1]*avg[1] + avg[2]*avg[2]);
+			size_t best = 0;
+			float best_score = -1e30f;
+			for (size_t i = 0; i < frontier.size(); i++) {
+				int f = frontier[i];
+				const float *n = &normals[3*f], *c = &centroids[3*f];
+				float align = len > 0.0f ? (n[0]*avg[0] + n[1]*avg[1] + n[2]*avg[2]) / len : 1.0f;
+				float dx = c[0] - origin[0], dy = c[1] - origin[1], dz = c[2] - origin[2];
+				float score = align - sqrtf(dx*dx + dy*dy + dz*dz) / scale;
+				if (score > best_score) {
+					best_score = score;
+					best = i;
+				}
+			}
+			int f = frontier[best];
+			frontier[best] = frontier.back();
+			frontier.pop_back();
+
+			cluster_of[f] = id;
+			order.push_back(f);
+			m.count++;
+			for (int c = 0; c < 3; c++)
+				avg[c] += normals[3*f+c];
+
+			for (int k = 0; k < 3; k++) {
+				int o = topology.opposite(3*f + k);
+				if (o < 0) continue;
+				int g = halfedge_mesh::face(o);
+				if (cluster_of[g] < 0 && frontier_stamp[g] != id) {
+					frontier_stamp[g] = id;
+					frontier.push_back(g);
+				}
+			}
+		}
+		// faces left in the frontier stay available for later clusters
+		out.push_back(m);
+	}
+
+	vector<int> sorted(tris.size());
+	vector<float> sorted_normals(normals.size());
+	for (int i = 0; i < n_faces; i++) {
+		for (int k = 0; k < 3; k++) {
+			sorted[3*i+k] = tris[3*order[i]+k];
+			sorted_normals[3*i+k] = normals[3*order[i]+k];
+		}
+	}
+	tris.swap(sorted);
+
+	for (size_t i = 0; i < out.size(); i++)
+		compute_bounds(tris, verts, sorted_normals, out[i]);
+}
+
+void extract_frustum(const float *m, frustum &f) {
+	// Gribb/Hartmann: combine the w row with the x, y and z rows
+	const float *r0 = m, *r1 = m + 4, *r2 = m + 8, *r3 = m + 12;
+	for (int i = 0; i < 4; i++) {
+		f.planes[0][i] = r3[i] + r0[i];   // left
+		f.planes[1][i] = r3[i] - r0[i];   // right
+		f.planes[2][i] = r3[i] + r1[i];   // bottom
+		f.planes[3][i] = r3[i] - r1[i];   // top
+		f.planes[4][i] = r3[i] + r2[i];   // near
+		f.planes[5][i] = r3[i] - r2[i];   // far
+	}
+	for (int p = 0; p < 6; p++) {
+		float *pl = f.planes[p];
+		float len = sqrtf(pl[0]*pl[0] + pl[1]*pl[1] + pl[2]*pl[2]);
+		if (len > 0.0f)
+			for (int i = 0; i < 4; i++)
+				pl[i] /= len;
+	}
+}
+
+bool sphere_in_frustum(const frustum &f, const float *c, float radius) {
+	for (int p = 0; p < 6; p++) {
+		const float *pl = f.planes[p];
+		if (pl[0]*c[0] + pl[1]*c[1] + pl[2]*c[2] + pl[3] < -radius)
+			return false;
+	}
+	return true;
+}
+
+bool cone_backfacing(const meshlet &m, const float *eye) {
+	if (m.cone_cutoff >= 1.0f)
+		return false;
+	float v[3] = { m.center[0] - eye[0], m.center[1] - eye[1], m.center[2] - eye[2] };
+	float dist = sqrtf(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+	float d = v[0]*m.cone_axis[0] + v[1]*m.cone_axis[1] + v[2]*m.cone_axis[2];
+	return d >= m.cone_cutoff * dist + m.radius;
+}
+
+// Appends a draw range, or extends the last one when it ends at first
+static int append_range(int first, int count, int &next, vector<int> &firsts, vector<int> &counts)
+{
+	bool merged = first == next;
+	if (merged) {
+		counts.back() += count;
+	} else {
+		firsts.push_back(first);
+		counts.push_back(count);
+	}
+	next = first + count;
+	return merged ? 0 : 1;
+}
+
+int cull_meshlets(const vector<meshlet> &meshlets, int base, const frustum &f,
+				  const float *eye, bool backface,
+				  vector<int> &firsts, vector<int> &counts, cull_stats &stats,
+				  hiz_buffer *occluders, float occluder_margin, bool front_to_back)
+{
+	vector< pair<float, int> > visible;   // distance and cluster, front to back
+	int ranges = 0;
+	int next = -1;   // vertex following the last appended range
+	for (size_t i = 0; i < meshlets.size(); i++) {
+		const meshlet &m = meshlets[i];
+		stats.clusters++;
+		stats.tris += m.count;
+		if (!sphere_in_frustum(f, m.center, m.radius)) {
+			stats.frustum_culled++;
+			stats.tris_culled += m.count;
+			continue;
+		}
+		if (backface && cone_backfacing(m, eye)) {
+			stats.backface_culled++;
+			stats.tris_culled += m.count;
+			continue;
+		}
+		if (occluders && occluders->sphere_occluded(m.center, m.radius + occluder_margin)) {
+			stats.occlusion_culled++;
+			stats.tris_culled += m.count;
+			continue;
+		}
+		if (front_to_back) {
+			float d[3] = { m.center[0] - eye[0], m.center[1] - eye[1], m.center[2] - eye[2] };
+			visible.push_back(make_pair(d[0]*d[0] + d[1]*d[1] + d[2]*d[2], (int) i));
+			continue;
+		}
+		ranges += append_range(base + 3 * m.first, 3 * m.count, next, firsts, counts);
+	}
+	
+	sort(visible.begin(), visible.end());
+	for (size_t k = 0; k < visible.size(); k++) {
+		const meshlet &m = meshlets[visible[k].second];
+		ranges += append_range(base + 3 * m.first, 3 * m.count, next, firsts, counts);
+	}
+	return ranges;
+}
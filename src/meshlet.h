@@ -0,0 +1,81 @@
+//
+//  meshlet.h
+//  pipeline
+//
+//  Partitioning of triangle meshes into small clusters with bounding
+//  spheres and normal cones, and the CPU culling pass that rejects whole
+//  clusters outside the view frustum or facing away from the camera.
+//
+//  Nothing here depends on OpenGL so the culling can be exercised without
+//  a context.
+//
+
+#ifndef meshlet_h
+#define meshlet_h
+
+#include <vector>
+#include "hiz.h"
+using namespace std;
+
+struct meshlet {
+	int first;            // first triangle of the cluster
+	int count;            // number of triangles
+	float center[3];      // bounding sphere
+	float radius;
+	float cone_axis[3];   // average facing direction
+	float cone_cutoff;    // sine of the cone half angle, 1 when the cone is too wide
+};
+
+const int MESHLET_MAX_TRIS = 128;
+
+/* Reorders the faces of tris so that every cluster is contiguous and fills
+ * out with one entry per cluster. Clusters are grown over edge adjacency
+ * from seeds taken in spatial order, preferring faces that keep the normal
+ * cone narrow, and hold at most max_tris triangles.
+ */
+void build_meshlets(vector<int> &tris, const vector<float> &verts, int max_tris,
+					vector<meshlet> &out);
+
+// Six planes (a, b, c, d) with a*x + b*y + c*z + d >= 0 inside
+struct frustum {
+	float planes[6][4];
+};
+
+/* Extracts the clip planes of a row-major projection * view matrix, as
+ * produced by amath's Perspective() * LookAt().
+ */
+void extract_frustum(const float *m, frustum &f);
+
+bool sphere_in_frustum(const frustum &f, const float *center, float radius);
+
+// True when every triangle in the cluster faces away from eye
+bool cone_backfacing(const meshlet &m, const float *eye);
+
+struct cull_stats {
+	int clusters;
+	int frustum_culled;
+	int backface_culled;
+	int occlusion_culled;
+	int tris;
+	int tris_culled;
+};
+
+/* Appends a (first vertex, vertex count) draw range for every visible
+ * cluster, with vertex numbers offset by base. Adjacent visible clusters
+ * are merged into one range. Returns the number of ranges appended.
+ *
+ * With occluders, clusters that pass the other tests are also tested
+ * against the depth pyramid, their spheres grown by occluder_margin: the
+ * most the occluders may stand in front of the surface they stand for.
+ *
+ * front_to_back appends the visible clusters nearest first, by the
+ * distance of their centres from eye, so the near ones fill the depth
+ * buffer before the ones they hide are shaded; fewer ranges merge then.
+ */
+int cull_meshlets(const vector<meshlet> &meshlets, int base, const frustum &f,
+				  const float *eye, bool backface,
+				  vector<int> &firsts, vector<int> &counts, cull_stats &stats,
+				  hiz_buffer *occluders = NULL, float occluder_margin = 0.0f,
+				  bool front_to_back = false);
+
+#endif /* meshlet_h */
@@ -0,0 +1,64 @@
+//
+//  normals.cc
+//  pipeline
+//
+
+#include <cmath>
+#include "normals.h"
+#include "parallel.h"
+
+using namespace std;
+
+/* The face normals and the final normalization run in parallel; the
+ * scatter in between stays serial, which keeps the sums (and so the result)
+ * exactly those of the single threaded version.
+ */
+void compute_vertex_normals(const vector<int> &tris, const vector<float> &verts,
+							vector<float> &normals)
+{
+	const size_t n_faces = tris.size() / 3, n_verts = verts.size() / 3;
+	normals.assign(verts.size(), 0.0f);
+
+	// unit normal per face, zero for degenerate faces
+	vector<float> face_norms(3 * n_faces);
+	parallel_for(n_faces, 4096, [&](size_t b, size_t e) {
+		for (size_t f = b; f < e; f++) {
+			const float *p0 = &verts[3*tris[3*f]], *p1 = &verts[3*tris[3*f+1]], *p2 = &verts[3*tris[3*f+2]];
+			float e1[3] = { p1[0]-p0[0], p1[1]-p0[1], p1[2]-p0[2] };
+			float e2[3] = { p2[0]-p0[0], p2[1]-p0[1], p2[2]-p0[2] };
+			float n[3] = { e1[1]*e2[2] - e1[2]*e2[1], e1[2]*e2[0] - e1[0]*e2[2], e1[0]*e2[1] - e1[1]*e2[0] };
+			float len = sqrtf(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+			float *d = &face_norms[3*f];
+			if (len <= 0.0f) {
+				d[0] = d[1] = d[2] = 0.0f;
+				continue;
+			}
+			d[0] = n[0] / len;
+			d[1] = n[1] / len;
+			d[2] = n[2] / len;
+		}
+	});
+
+	/* Add all normals for all vertices. Shared */
+	for (size_t f = 0; f < n_faces; f++) {
+		const float *n = &face_norms[3*f];
+		for (int k = 0; k < 3; k++) {
+			float *d = &normals[3*tris[3*f+k]];
+			d[0] += n[0];
+			d[1] += n[1];
+			d[2] += n[2];
+		}
+	}
+
+	parallel_for(n_verts, 4096, [&](size_t b, size_t e) {
+		for (size_t v = b; v < e; v++) {
+			float *d = &normals[3*v];
+			float len = sqrtf(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+			if (len > 0.0f) {
+				d[0] /= len;
+				d[1] /= len;
+				d[2] /= len;
+			}
+		}
+	});
+}
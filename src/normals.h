@@ -0,0 +1,18 @@
+//
+//  normals.h
+//  pipeline
+//
+
+#ifndef normals_h
+#define normals_h
+
+#include <vector>
+using namespace std;
+
+/* Smooth per-vertex normals (3 floats per vertex): the normalized sum of
+ * the unit normals of the faces around each vertex.
+ */
+void compute_vertex_normals(const vector<int> &tris, const vector<float> &verts,
+							vector<float> &normals);
+
+#endif /* normals_h */
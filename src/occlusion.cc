@@ -0,0 +1,183 @@
+//
+//  occlusion.cc
+//  pipeline
+//
+
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <thread>
+#include <stdint.h>
+#include <string.h>
+#include "occlusion.h"
+
+using namespace std;
+
+static const char AO_MAGIC[4] = { 'P', 'A', 'O', '1' };
+static const size_t AO_CHUNK = 256;    // vertices per job
+
+static float radical_inverse(uint32_t i) {
+	i = (i << 16) | (i >> 16);
+	i = ((i & 0x55555555u) << 1) | ((i & 0xaaaaaaaau) >> 1);
+	i = ((i & 0x33333333u) << 2) | ((i & 0xccccccccu) >> 2);
+	i = ((i & 0x0f0f0f0fu) << 4) | ((i & 0xf0f0f0f0u) >> 4);
+	i = ((i & 0x00ff00ffu) << 8) | ((i & 0xff00ff00u) >> 8);
+	return (float) i * (1.0f / 4294967296.0f);
+}
+
+static uint32_t hash_index(uint32_t x) {
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+static float fract(float x) {
+	return x - floorf(x);
+}
+
+/* Stratified (Hammersley) samples, shifted by a per-vertex offset so that
+ * neighbouring vertices do not share the same pattern and band.
+ */
+static unsigned char bake_vertex(const bvh &tree, const float *p, const float *n,
+								 int rays, float offset, float max_distance, uint32_t seed)
+{
+	// tangent frame around n
+	float t[3], b[3];
+	if (fabsf(n[0]) > 0.9f) {
+		float len = sqrtf(n[0]*n[0] + n[2]*n[2]);
+		t[0] = -n[2] / len; t[1] = 0.0f; t[2] = n[0] / len;
+	} else {
+		float len = sqrtf(n[1]*n[1] + n[2]*n[2]);
+		t[0] = 0.0f; t[1] = n[2] / len; t[2] = -n[1] / len;
+	}
+	b[0] = n[1]*t[2] - n[2]*t[1];
+	b[1] = n[2]*t[0] - n[0]*t[2];
+	b[2] = n[0]*t[1] - n[1]*t[0];
+
+	float shift1 = (hash_index(seed) & 0xffffff) / 16777216.0f;
+	float shift2 = (hash_index(seed ^ 0x9e3779b9u) & 0xffffff) / 16777216.0f;
+
+	ray r;
+	for (int k = 0; k < 3; k++)
+		r.org[k] = p[k] + offset * n[k];
+	r.tmin = 0.0f;
+	r.tmax = max_distance;
+
+	int open = 0;
+	for (int i = 0; i < rays; i++) {
+		// cosine weighted: uniform on the disk, projected up to the hemisphere
+		float u1 = fract((i + 0.5f) / rays + shift1);
+		float u2 = fract(radical_inverse((uint32_t) i) + shift2);
+		float rad = sqrtf(u1), ang = 2.0f * (float) M_PI * u2;
+		float x = rad * cosf(ang), y = rad * sinf(ang), z = sqrtf(max(0.0f, 1.0f - u1));
+		for (int k = 0; k < 3; k++)
+			r.dir[k] = x * t[k] + y * b[k] + z * n[k];
+		if (!tree.occluded(r))
+			open++;
+	}
+	return (unsigned char) ((open * 255 + rays / 2) / rays);
+}
+
+void bake_vertex_occlusion(const bvh &tree, const vector<float> &verts,
+						   const vector<float> &normals, int rays, float max_distance,
+						   job_pool &pool, vector<unsigned char> &occlusion, ostream *progress)
+{
+	const size_t n_verts = verts.size() / 3;
+	occlusion.assign(n_verts, 255);
+	if (n_verts == 0 || tree.empty() || rays <= 0)
+		return;
+
+	float lo[3] = { verts[0], verts[1], verts[2] }, hi[3] = { verts[0], verts[1], verts[2] };
+	for (size_t i = 0; i < verts.size(); i += 3)
+		for (int k = 0; k < 3; k++) {
+			lo[k] = min(lo[k], verts[i+k]);
+			hi[k] = max(hi[k], verts[i+k]);
+		}
+	float diagonal = sqrtf((hi[0]-lo[0])*(hi[0]-lo[0]) + (hi[1]-lo[1])*(hi[1]-lo[1]) +
+						   (hi[2]-lo[2])*(hi[2]-lo[2]));
+	if (max_distance <= 0.0f)
+		max_distance = 0.25f * diagonal;
+	// lifts the origins off their own faces
+	const float offset = 1e-4f * diagonal;
+
+	std::atomic<size_t> baked(0);
+	// only this thread reports, so output never interleaves; worker index 0
+	// would not do, as every thread outside the pool has it
+	const std::thread::id reporter = std::this_thread::get_id();
+	int last_percent = -1;
+	vector<job_pool::job> jobs;
+	for (size_t first = 0; first < n_verts; first += AO_CHUNK) {
+		size_t last = min(first + AO_CHUNK, n_verts);
+		jobs.push_back([&, first, last]() {
+			for (size_t v = first; v < last; v++) {
+				const float *n = &normals[3*v];
+				// isolated and degenerate vertices have no normal and stay open
+				if (n[0] == 0.0f && n[1] == 0.0f && n[2] == 0.0f)
+					continue;
+				occlusion[v] = bake_vertex(tree, &verts[3*v], n, rays, offset, max_distance,
+										   (uint32_t) v);
+			}
+			size_t done = baked += last - first;
+			if (progress && std::this_thread::get_id() == reporter) {
+				int percent = (int) (100 * done / n_verts);
+				if (percent != last_percent) {
+					*progress << "\rbaking occlusion: " << percent << "%" << flush;
+					last_percent = percent;
+				}
+			}
+		});
+	}
+	pool.run(jobs);
+	if (progress)
+		*progress << "\rbaking occlusion: 100%" << endl;
+}
+
+string occlusion_file(const char *model_file) {
+	return string(model_file) + ".ao";
+}
+
+/* Layout: magic, vertex count and rays per vertex as 32 bit words in host
+ * byte order, then one byte per vertex.
+ */
+bool write_occlusion(const char *file, const vector<unsigned char> &occlusion, int rays) {
+	ofstream out(file, ios::binary);
+	if (!out)
+		return false;
+	uint32_t header[2] = { (uint32_t) occlusion.size(), (uint32_t) rays };
+	out.write(AO_MAGIC, sizeof(AO_MAGIC));
+	out.write((const char *) header, sizeof(header));
+	if (!occlusion.empty())
+		out.write((const char *) &occlusion[0], occlusion.size());
+	return (bool) out;
+}
+
+bool read_occlusion(const char *file, size_t n_verts, vector<unsigned char> &occlusion) {
+	ifstream in(file, ios::binary);
+	if (!in)
+		return false;
+	char magic[4];
+	uint32_t header[2];
+	in.read(magic, sizeof(magic));
+	in.read((char *) header, sizeof(header));
+	if (!in || memcmp(magic, AO_MAGIC, sizeof(magic)) != 0) {
+		cerr << file << " is not an occlusion bake" << endl;
+		return false;
+	}
+	if (header[0] != n_verts) {
+		cerr << file << " was baked for " << header[0] << " vertices, the mesh has "
+			 << n_verts << "; ignoring it" << endl;
+		return false;
+	}
+	vector<unsigned char> data(n_verts);
+	if (n_verts > 0)
+		in.read((char *) &data[0], n_verts);
+	if (!in) {
+		cerr << file << " is truncated" << endl;
+		return false;
+	}
+	occlusion.swap(data);
+	return true;
+}
@@ -0,0 +1,43 @@
+//
+//  occlusion.h
+//  pipeline
+//
+//  Offline per-vertex ambient occlusion, baked against a mesh BVH and kept
+//  next to the model in a small binary file.
+//
+
+#ifndef occlusion_h
+#define occlusion_h
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include "bvh.h"
+#include "jobs.h"
+using namespace std;
+
+const int AO_DEFAULT_RAYS = 64;
+
+/* Casts rays cosine distributed over the hemisphere around each vertex
+ * normal and stores the unoccluded fraction, 0 (fully occluded) to 255
+ * (open), per vertex of verts, the mesh the tree was built over. Hits
+ * farther than max_distance do not count; max_distance <= 0 uses a quarter
+ * of the bounding box diagonal. Vertices are baked in chunks on the pool, and when progress is
+ * given the percentage done is written to it as the bake runs.
+ */
+void bake_vertex_occlusion(const bvh &tree, const vector<float> &verts,
+						   const vector<float> &normals, int rays, float max_distance,
+						   job_pool &pool, vector<unsigned char> &occlusion,
+						   ostream *progress = NULL);
+
+// Name of the bake file that belongs to a model file
+string occlusion_file(const char *model_file);
+
+bool write_occlusion(const char *file, const vector<unsigned char> &occlusion, int rays);
+
+/* Reads a bake made for a mesh with n_verts vertices; fails (leaving
+ * occlusion untouched) if the file is missing or was baked for another mesh.
+ */
+bool read_occlusion(const char *file, size_t n_verts, vector<unsigned char> &occlusion);
+
+#endif /* occlusion_h */
@@ -0,0 +1,73 @@
+//
+//  overdraw.cc
+//  pipeline
+//
+
+#include "overdraw.h"
+
+using namespace std;
+
+overdraw_meter::overdraw_meter() : used(0), counting(false) {
+	frame_stats = overdraw_stats();
+}
+
+void overdraw_meter::begin_frame() {
+	used = 0;
+	depth_only.clear();
+}
+
+void overdraw_meter::begin_pass(bool depth) {
+	if (counting)
+		end_pass();
+	if (used == queries.size()) {
+		queries.push_back(0);
+		glGenQueries(1, &queries.back());
+	}
+	depth_only.push_back(depth);
+	glBeginQuery(GL_SAMPLES_PASSED, queries[used++]);
+	counting = true;
+}
+
+void overdraw_meter::end_pass() {
+	if (!counting)
+		return;
+	glEndQuery(GL_SAMPLES_PASSED);
+	counting = false;
+}
+
+void overdraw_meter::end_frame(int width, int height) {
+	end_pass();
+	overdraw_stats &s = frame_stats;
+	s = overdraw_stats();
+	for (size_t i = 0; i < used; i++) {
+		GLuint64 samples = 0;
+		glGetQueryObjectui64v(queries[i], GL_QUERY_RESULT, &samples);
+		(depth_only[i] ? s.depth_fragments : s.shaded_fragments) += (long long) samples;
+	}
+
+	depths.resize((size_t) width * height);
+	if (!depths.empty()) {
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		glReadPixels(0, 0, width, height, GL_DEPTH_COMPONENT, GL_FLOAT, &depths[0]);
+	}
+	for (size_t i = 0; i < depths.size(); i++)
+		s.covered_pixels += depths[i] < 1.0f ? 1 : 0;
+	if (s.covered_pixels > 0) {
+		s.shaded_per_pixel = (double) s.shaded_fragments / s.covered_pixels;
+		s.depth_per_pixel = (double) s.depth_fragments / s.covered_pixels;
+	}
+}
+
+void overdraw_meter::release() {
+	end_pass();
+	if (!queries.empty())
+		glDeleteQueries((GLsizei) queries.size(), &queries[0]);
+	queries.clear();
+	used = 0;
+}
+
+void print_overdraw_stats(ostream &os, const overdraw_stats &stats) {
+	os << stats.shaded_fragments << " fragments shaded over " << stats.covered_pixels << " pixels ("
+	   << stats.shaded_per_pixel << " per pixel), " << stats.depth_fragments << " in depth passes ("
+	   << stats.depth_per_pixel << " per pixel)" << endl;
+}
@@ -0,0 +1,62 @@
+//
+//  overdraw.h
+//  pipeline
+//
+//  Counts how many fragments a frame shades for every pixel it covers, to
+//  see how much of the shading work overdraw throws away and whether a
+//  depth pre-pass or front-to-back ordering wins it back.
+//
+
+#ifndef overdraw_h
+#define overdraw_h
+
+#include <iostream>
+#include <vector>
+#include "amath.h"
+using namespace std;
+
+struct overdraw_stats {
+	long long depth_fragments;      // passing the depth test in depth-only passes
+	long long shaded_fragments;     // passing it in shading passes
+	long long covered_pixels;       // left nearer than the far plane
+	double shaded_per_pixel;
+	double depth_per_pixel;
+};
+
+/* Fragments are counted with GL_SAMPLES_PASSED queries around the passes,
+ * which count those that pass the depth test: with early depth testing,
+ * the ones the fragment shader runs for. Covered pixels are counted from
+ * the depth buffer at the end of the frame, so measuring stalls the
+ * pipeline and is meant to be switched on only while looking.
+ */
+class overdraw_meter {
+public:
+	overdraw_meter();
+
+	void begin_frame();
+	void begin_pass(bool depth_only);
+	void end_pass();
+
+	// Reads the queries and the depth buffer of the viewport; stalls
+	void end_frame(int width, int height);
+
+	const overdraw_stats &stats() const { return frame_stats; }
+
+	// Deletes the queries; needs the GL context
+	void release();
+
+private:
+	vector<GLuint> queries;
+	vector<bool> depth_only;        // per query used this frame
+	size_t used;
+	bool counting;
+	vector<GLfloat> depths;
+	overdraw_stats frame_stats;
+
+	overdraw_meter(const overdraw_meter &);
+	overdraw_meter &operator= (const overdraw_meter &);
+};
+
+void print_overdraw_stats(ostream &os, const overdraw_stats &stats);
+
+#endif /* overdraw_h */
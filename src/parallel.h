@@ -0,0 +1,28 @@
+//
+//  parallel.h
+//  pipeline
+//
+//  Minimal data-parallel helpers used by the mesh processing stages, run on
+//  the shared job system.
+//
+
+#ifndef parallel_h
+#define parallel_h
+
+#include "jobs.h"
+
+// Number of workers parallel_for spreads over (at least 1)
+inline unsigned int parallel_workers() {
+	return job_system().workers();
+}
+
+/* Calls fn(begin, end) on contiguous sub-ranges of [0, count) on the
+ * shared pool. Ranges smaller than grain are not split further, so small
+ * inputs run on the calling thread.
+ */
+template <typename Fn>
+void parallel_for(size_t count, size_t grain, const Fn &fn) {
+	parallel_for(job_system(), count, grain, fn);
+}
+
+#endif /* parallel_h */
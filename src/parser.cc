@@ -7,43 +7,183 @@
 //
 
 #include <stdlib.h>
+#include <string.h>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <vector>
 #include "parser.h"
 #include "amath.h"
+#include "parallel.h"
 
 using namespace std;
 
 #define IM_DEBUGGING
 
-bool checkIfOBJFileType (const char *file) {
-	ifstream in;
-	in.open(file, ios::in);
-	char buffer[1025];
-	string cmd;
+// Lines of one slice of an OBJ file, parsed on its own
+struct obj_chunk {
+	const char *begin, *end;
+	vector<float> verts;
+	vector<int> tris;
+	vector<int> bad_lines;   // relative to the chunk's first line
+	int lines;
+};
+
+static const size_t OBJ_CHUNK_BYTES = 1 << 20;
+
+static bool is_space(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+/* strtod and strtol skip leading whitespace, newlines included, so the
+ * spaces are skipped here and a field missing from the line is a failure
+ * rather than a read of the next line (or past the buffer on the last).
+ */
+static bool read_float(const char *&p, const char *eol, float &out) {
+	while (p < eol && is_space(*p))
+		p++;
+	if (p == eol)
+		return false;
+	char *next;
+	double d = strtod(p, &next);
+	if (next == p || next > eol)
+		return false;
+	out = (float) d;
+	p = next;
+	return true;
+}
+
+// A face corner's vertex number, past its texture and normal indices
+static bool read_index(const char *&p, const char *eol, int &out) {
+	while (p < eol && is_space(*p))
+		p++;
+	if (p == eol)
+		return false;
+	char *next;
+	long i = strtol(p, &next, 10);
+	if (next == p || next > eol || i < 1)
+		return false;
+	out = (int) i;
+	p = next;
+	while (p < eol && !is_space(*p))
+		p++;
+	return true;
+}
+
+static void parse_obj_chunk(obj_chunk &c) {
+	c.lines = 0;
+	const char *p = c.begin;
+	while (p < c.end) {
+		const char *eol = (const char *) memchr(p, '\n', c.end - p);
+		if (!eol)
+			eol = c.end;
+		while (p < eol && is_space(*p))
+			p++;
+		const char *cmd = p;
+		while (p < eol && !is_space(*p))
+			p++;
+		size_t len = p - cmd;
+		
+		if (len == 0 || cmd[0] == '#') {
+			// ignore comments or blank lines
+		}
+		else if (len == 1 && cmd[0] == 'v') {
+			// got a vertex:
+			float v[3];
+			if (read_float(p, eol, v[0]) && read_float(p, eol, v[1]) && read_float(p, eol, v[2]))
+				c.verts.insert(c.verts.end(), v, v + 3);
+			else
+				c.bad_lines.push_back(c.lines);
+		}
+		else if (len == 1 && cmd[0] == 'f') {
+			// got a face (triangle); OBJ numbers vertices from 1, so shift
+			// everything down by 1. Texture and normal indices are skipped.
+			int f[3];
+			if (read_index(p, eol, f[0]) && read_index(p, eol, f[1]) && read_index(p, eol, f[2]))
+				for (int i = 0; i < 3; i++)
+					c.tris.push_back(f[i] - 1);
+			else
+				c.bad_lines.push_back(c.lines);
+		}
+		else {
+			c.bad_lines.push_back(c.lines);
+		}
+		c.lines++;
+		p = eol + 1;
+	}
+}
+
+/* The file is read in windows of a few slices per worker. Each window is
+ * cut into slices at line breaks, which are parsed in parallel and then
+ * handed on in file order.
+ */
+void stream_wavefront_file(const char *file, const obj_block_fn &block)
+{
+	ifstream in(file, ios::binary);
+	const size_t window = OBJ_CHUNK_BYTES * 4 * parallel_workers();
+	vector<char> text;
+	size_t carry = 0;    // start of a line cut off at the end of the last window
+	bool eof = !in;
+	int line = 1;
 	
-	bool fileType;
-	while (in.good()) {
-		in.getline(buffer,1024);
-		buffer[in.gcount()]=0;
+	for (;;) {
+		text.resize(carry + window);
+		size_t size = carry;
+		if (!eof) {
+			in.read(&text[carry], window);
+			size += (size_t) in.gcount();
+			eof = size < carry + window;
+		}
+		text.resize(size);
 		
-		cmd="";
-		istringstream iss (buffer);
+		// parse up to the last complete line; at the end of the file that is all of it
+		size_t cut;
+		if (eof) {
+			text.push_back('\n');
+			cut = text.size();
+		} else {
+			cut = size;
+			while (cut > 0 && text[cut - 1] != '\n')
+				cut--;
+			if (cut == 0) {
+				// a line longer than the window; read on
+				carry = size;
+				continue;
+			}
+		}
 		
-		iss >> cmd;
+		vector<obj_chunk> chunks;
+		const char *p = &text[0], *end = p + cut;
+		while (p < end) {
+			obj_chunk c;
+			c.begin = p;
+			c.end = p + OBJ_CHUNK_BYTES < end ? p + OBJ_CHUNK_BYTES : end;
+			// extend to the end of the line the cut falls in
+			const char *eol = (const char *) memchr(c.end - 1, '\n', end - (c.end - 1));
+			c.end = eol + 1;
+			chunks.push_back(c);
+			p = c.end;
+		}
+		
+		parallel_for(chunks.size(), 1, [&](size_t b, size_t e) {
+			for (size_t i = b; i < e; i++)
+				parse_obj_chunk(chunks[i]);
+		});
+		
+		for (size_t i = 0; i < chunks.size(); i++) {
+			obj_chunk &c = chunks[i];
+			block(c.verts, c.tris);
+			for (size_t k = 0; k < c.bad_lines.size(); k++)
+				std::cerr << "Parser error: invalid line " << line + c.bad_lines[k] << std::endl;
+			line += c.lines;
+		}
 		
-		if (cmd[0]=='#' || cmd.empty())
-			continue;
-		else if (cmd=="v" || cmd =="f")
-			fileType = true; // OBJ
-		else
-			fileType = false; // Bezier
-		break;
+		if (eof)
+			break;
+		carry = size - cut;
+		if (carry > 0)
+			memmove(&text[0], &text[cut], carry);
 	}
-	in.close();
-	return fileType;
 }
 
 void read_wavefront_file (
@@ -56,56 +196,10 @@ void read_wavefront_file (
 	tris.clear ();
 	verts.clear ();
 	
-	ifstream in(file);
-	char buffer[1025];
-	string cmd;
-	
-	
-	for (int line=1; in.good(); line++) {
-		in.getline(buffer,1024);
-		buffer[in.gcount()]=0;
-		
-		cmd="";
-		
-		istringstream iss (buffer);
-		
-		iss >> cmd;
-		
-		if (cmd[0]=='#' or cmd.empty()) {
-			// ignore comments or blank lines
-			continue;
-		}
-		else if (cmd=="v") {
-			// got a vertex:
-			
-			// read in the parameters:
-			double pa, pb, pc;
-			iss >> pa >> pb >> pc;
-			
-			verts.push_back (pa);
-			verts.push_back (pb);
-			verts.push_back (pc);
-		}
-		else if (cmd=="f") {
-			// got a face (triangle)
-			
-			// read in the parameters:
-			int i, j, k;
-			iss >> i >> j >> k;
-			
-			// vertex numbers in OBJ files start with 1, but in C++ array
-			// indices start with 0, so we're shifting everything down by
-			// 1
-			tris.push_back (i-1);
-			tris.push_back (j-1);
-			tris.push_back (k-1);
-		}
-		else {
-			std::cerr << "Parser error: invalid command at line " << line << std::endl;
-		}
-		
-	}
-	in.close();
+	stream_wavefront_file(file, [&](const vector<float> &v, const vector<int> &t) {
+		verts.insert(verts.end(), v.begin(), v.end());
+		tris.insert(tris.end(), t.begin(), t.end());
+	});
 	
 	std::cout << "found this many tris, verts: " << tris.size () / 3.0 << "  "  << verts.size () / 3.0 << std::endl;
 }
@@ -9,15 +9,20 @@
 #ifndef parser_h
 #define parser_h
 
+#include <functional>
 #include <iostream>
 #include <vector>
 #include "bezier_surface.h"
 using namespace std;
 
-// Returns true if file is OBJ
-bool checkIfOBJFileType (const char *file);
-
 void read_wavefront_file (const char *file, vector<int> &tris, vector<float> &verts);
+
+/* Parses an OBJ without holding all of it: block(verts, tris) receives the
+ * vertices and faces (0-based, indexing the whole file) of consecutive
+ * pieces of the file, in order, on the calling thread.
+ */
+typedef std::function<void (const vector<float> &verts, const vector<int> &tris)> obj_block_fn;
+void stream_wavefront_file(const char *file, const obj_block_fn &block);
 void read_bezier_file(const char* file, vector<bezier_surf> &s);
 
 class bezier_surf;
@@ -0,0 +1,173 @@
+//
+//  pick.cc
+//  pipeline
+//
+
+#include <algorithm>
+#include <cmath>
+#include "pick.h"
+
+using namespace std;
+
+// Grid used to find starting parameters for the Newton iteration
+static const int PATCH_GRID = 8;
+static const int NEWTON_ITERATIONS = 10;
+
+ray pick_ray(int x, int y, int width, int height, const mat4 &proj, const mat4 &view) {
+	float ndc_x = 2.0f * (x + 0.5f) / width - 1.0f;
+	float ndc_y = 1.0f - 2.0f * (y + 0.5f) / height;
+
+	// unproject the pixel on the near and far clip planes
+	mat4 inv = inverse(proj * view);
+	vec4 near_pt = inv * vec4(ndc_x, ndc_y, -1.0, 1.0);
+	vec4 far_pt = inv * vec4(ndc_x, ndc_y, 1.0, 1.0);
+	near_pt /= near_pt.w;
+	far_pt /= far_pt.w;
+
+	ray r;
+	for (int i = 0; i < 3; i++) {
+		r.org[i] = near_pt[i];
+		r.dir[i] = far_pt[i] - near_pt[i];
+	}
+	r.tmin = 0.0f;
+	r.tmax = 1.0f;
+	return r;
+}
+
+void patch_bounds(vector<bezier_surf> &surfaces, vector<float> &bounds) {
+	bounds.resize(6 * surfaces.size());
+	for (size_t i = 0; i < surfaces.size(); i++) {
+		double lo[3], hi[3];
+		surfaces[i].bounds(lo, hi);
+		for (int c = 0; c < 3; c++) {
+			bounds[6*i+c] = (float) lo[c];
+			bounds[6*i+3+c] = (float) hi[c];
+		}
+	}
+}
+
+static inline double dot3(const double *a, const point &p) {
+	return a[0]*p.x + a[1]*p.y + a[2]*p.z;
+}
+
+/* Solves S(u, v) on both planes containing the ray. Starts from (u, v) and
+ * returns the refined parameters and ray distance on convergence.
+ */
+static bool refine(bezier_surf &s, const ray &r, const double *n1, double d1,
+				   const double *n2, double d2, double tol,
+				   double &u, double &v, float &t)
+{
+	point p;
+	vect su, sv;
+	for (int it = 0; it < NEWTON_ITERATIONS; it++) {
+		s.evaluate_derivs(u, v, p, su, sv);
+		double f1 = dot3(n1, p) + d1, f2 = dot3(n2, p) + d2;
+		if (fabs(f1) + fabs(f2) < tol) {
+			if (u < -1e-6 || u > 1.0 + 1e-6 || v < -1e-6 || v > 1.0 + 1e-6)
+				return false;
+			double dd = r.dir[0]*r.dir[0] + r.dir[1]*r.dir[1] + r.dir[2]*r.dir[2];
+			t = (float) (((p.x - r.org[0])*r.dir[0] + (p.y - r.org[1])*r.dir[1] +
+						  (p.z - r.org[2])*r.dir[2]) / dd);
+			return t >= r.tmin && t <= r.tmax;
+		}
+		double a = dot3(n1, su), b = dot3(n1, sv);
+		double c = dot3(n2, su), d = dot3(n2, sv);
+		double det = a*d - b*c;
+		if (fabs(det) < 1e-14)
+			return false;
+		u -= (d*f1 - b*f2) / det;
+		v -= (a*f2 - c*f1) / det;
+		// let the iterate leave the domain a little but not run away
+		u = min(max(u, -0.1), 1.1);
+		v = min(max(v, -0.1), 1.1);
+	}
+	return false;
+}
+
+bool pick_patch(vector<bezier_surf> &surfaces, const vector<float> &bounds,
+				const ray &r, patch_hit &hit)
+{
+	hit.patch = -1;
+	hit.t = r.tmax;
+
+	// candidates sorted by where the ray enters their control net box
+	vector< pair<float, int> > candidates;
+	for (size_t i = 0; i < surfaces.size(); i++) {
+		const float *lo = &bounds[6*i], *hi = lo + 3;
+		float t0 = r.tmin, t1 = r.tmax;
+		for (int c = 0; c < 3; c++) {
+			float inv = 1.0f / (fabsf(r.dir[c]) > 1e-20f ? r.dir[c] : 1e-20f);
+			float a = (lo[c] - r.org[c]) * inv, b = (hi[c] - r.org[c]) * inv;
+			t0 = max(t0, min(a, b));
+			t1 = min(t1, max(a, b));
+		}
+		if (t0 <= t1)
+			candidates.push_back(make_pair(t0, (int) i));
+	}
+	sort(candidates.begin(), candidates.end());
+
+	// two planes whose intersection is the ray
+	double dir[3] = { r.dir[0], r.dir[1], r.dir[2] };
+	double n1[3];
+	if (fabs(dir[0]) > fabs(dir[1]) && fabs(dir[0]) > fabs(dir[2])) {
+		n1[0] = dir[1]; n1[1] = -dir[0]; n1[2] = 0.0;
+	} else {
+		n1[0] = 0.0; n1[1] = dir[2]; n1[2] = -dir[1];
+	}
+	double l1 = sqrt(n1[0]*n1[0] + n1[1]*n1[1] + n1[2]*n1[2]);
+	for (int c = 0; c < 3; c++) n1[c] /= l1;
+	double n2[3] = { n1[1]*dir[2] - n1[2]*dir[1], n1[2]*dir[0] - n1[0]*dir[2], n1[0]*dir[1] - n1[1]*dir[0] };
+	double l2 = sqrt(n2[0]*n2[0] + n2[1]*n2[1] + n2[2]*n2[2]);
+	for (int c = 0; c < 3; c++) n2[c] /= l2;
+	double d1 = -(n1[0]*r.org[0] + n1[1]*r.org[1] + n1[2]*r.org[2]);
+	double d2 = -(n2[0]*r.org[0] + n2[1]*r.org[1] + n2[2]*r.org[2]);
+
+	const int g = PATCH_GRID;
+	vector<point> grid((g+1) * (g+1));
+	for (size_t c = 0; c < candidates.size(); c++) {
+		if (candidates[c].first > hit.t)
+			break;
+		int i = candidates[c].second;
+		bezier_surf &s = surfaces[i];
+
+		const float *lo = &bounds[6*i], *hi = lo + 3;
+		double diag = sqrt((hi[0]-lo[0])*(hi[0]-lo[0]) + (hi[1]-lo[1])*(hi[1]-lo[1]) +
+						   (hi[2]-lo[2])*(hi[2]-lo[2]));
+		double tol = 1e-6 * (diag > 0.0 ? diag : 1.0);
+
+		for (int y = 0; y <= g; y++)
+			for (int x = 0; x <= g; x++) {
+				vect du, dv;
+				s.evaluate_derivs((double) x / g, (double) y / g, grid[y*(g+1) + x], du, dv);
+			}
+
+		for (int y = 0; y < g; y++)
+			for (int x = 0; x < g; x++) {
+				// corners (u, v) of the two triangles of the cell
+				int corner[2][3][2] = { { {x, y}, {x+1, y}, {x+1, y+1} },
+										{ {x, y}, {x+1, y+1}, {x, y+1} } };
+				for (int k = 0; k < 2; k++) {
+					const point &p0 = grid[corner[k][0][1]*(g+1) + corner[k][0][0]];
+					const point &p1 = grid[corner[k][1][1]*(g+1) + corner[k][1][0]];
+					const point &p2 = grid[corner[k][2][1]*(g+1) + corner[k][2][0]];
+					float tri[9] = { (float) p0.x, (float) p0.y, (float) p0.z,
+									 (float) (p1.x-p0.x), (float) (p1.y-p0.y), (float) (p1.z-p0.z),
+									 (float) (p2.x-p0.x), (float) (p2.y-p0.y), (float) (p2.z-p0.z) };
+					float t, bu, bv;
+					if (!intersect_triangle(r, tri, t, bu, bv))
+						continue;
+
+					double u = ((1-bu-bv)*corner[k][0][0] + bu*corner[k][1][0] + bv*corner[k][2][0]) / g;
+					double v = ((1-bu-bv)*corner[k][0][1] + bu*corner[k][1][1] + bv*corner[k][2][1]) / g;
+					float pt;
+					if (refine(s, r, n1, d1, n2, d2, tol, u, v, pt) && pt < hit.t) {
+						hit.patch = i;
+						hit.u = min(max(u, 0.0), 1.0);
+						hit.v = min(max(v, 0.0), 1.0);
+						hit.t = pt;
+					}
+				}
+			}
+	}
+	return hit.patch >= 0;
+}
@@ -0,0 +1,41 @@
+//
+//  pick.h
+//  pipeline
+//
+//  Mouse picking: unprojects a window position into a world space ray and
+//  intersects it with a mesh BVH or with Bezier patches.
+//
+
+#ifndef pick_h
+#define pick_h
+
+#include <vector>
+#include "amath.h"
+#include "bezier_surface.h"
+#include "bvh.h"
+using namespace std;
+
+/* Ray through window pixel (x, y) (GLUT coordinates, origin top left) of a
+ * width x height viewport for the given projection and view matrices. The
+ * ray starts on the near plane and t = 1 is on the far plane.
+ */
+ray pick_ray(int x, int y, int width, int height, const mat4 &proj, const mat4 &view);
+
+struct patch_hit {
+	int patch;      // index into the surfaces, -1 if missed
+	double u, v;    // surface parameters of the hit, v from the bottom row
+	float t;
+};
+
+// Axis aligned box of each patch's control net, 6 floats (lo, hi) per patch
+void patch_bounds(vector<bezier_surf> &surfaces, vector<float> &bounds);
+
+/* Closest hit of r with the patches. Candidate patches are visited in order
+ * of their box entry; each is sampled on a coarse grid to find starting
+ * parameters, which Newton iteration on the two-plane form of the ray then
+ * refines to the exact surface point.
+ */
+bool pick_patch(vector<bezier_surf> &surfaces, const vector<float> &bounds,
+				const ray &r, patch_hit &hit);
+
+#endif /* pick_h */
@@ -0,0 +1,204 @@
+//
+//  range_allocator.cc
+//  pipeline
+//
+
+#include "range_allocator.h"
+
+using namespace std;
+
+static int floor_log2(size_t x) {
+	return 63 - __builtin_clzll((unsigned long long) x);
+}
+
+// Size class of a size: below SL_COUNT every size is its own class
+static void size_class(size_t size, int sl_bits, int &fl, int &sl) {
+	size_t sl_count = (size_t) 1 << sl_bits;
+	if (size < sl_count) {
+		fl = 0;
+		sl = (int) size;
+		return;
+	}
+	int log = floor_log2(size);
+	fl = log - sl_bits + 1;
+	sl = (int) ((size >> (log - sl_bits)) - sl_count);
+}
+
+range_allocator::range_allocator(size_t capacity) {
+	reset(capacity);
+}
+
+void range_allocator::reset(size_t capacity) {
+	total = capacity;
+	in_use = 0;
+	n_free = 0;
+	ranges.clear();
+	spare.clear();
+	allocated.clear();
+	fl_bitmap = 0;
+	for (int f = 0; f < FL_COUNT; f++) {
+		sl_bitmap[f] = 0;
+		for (int s = 0; s < SL_COUNT; s++)
+			heads[f][s] = -1;
+	}
+	if (capacity > 0)
+		insert_free(new_node(0, capacity));
+}
+
+int range_allocator::new_node(size_t offset, size_t size) {
+	range r = { offset, size, -1, -1, -1, -1, true };
+	if (!spare.empty()) {
+		int i = spare.back();
+		spare.pop_back();
+		ranges[i] = r;
+		return i;
+	}
+	ranges.push_back(r);
+	return (int) ranges.size() - 1;
+}
+
+void range_allocator::insert_free(int r) {
+	int fl, sl;
+	size_class(ranges[r].size, SL_BITS, fl, sl);
+	ranges[r].free = true;
+	ranges[r].prev_free = -1;
+	ranges[r].next_free = heads[fl][sl];
+	if (heads[fl][sl] >= 0)
+		ranges[heads[fl][sl]].prev_free = r;
+	heads[fl][sl] = r;
+	fl_bitmap |= (uint64_t) 1 << fl;
+	sl_bitmap[fl] |= 1u << sl;
+	n_free++;
+}
+
+void range_allocator::remove_free(int r) {
+	int fl, sl;
+	size_class(ranges[r].size, SL_BITS, fl, sl);
+	int p = ranges[r].prev_free, n = ranges[r].next_free;
+	if (p >= 0)
+		ranges[p].next_free = n;
+	else
+		heads[fl][sl] = n;
+	if (n >= 0)
+		ranges[n].prev_free = p;
+	if (heads[fl][sl] < 0) {
+		sl_bitmap[fl] &= ~(1u << sl);
+		if (sl_bitmap[fl] == 0)
+			fl_bitmap &= ~((uint64_t) 1 << fl);
+	}
+	ranges[r].free = false;
+	n_free--;
+}
+
+// A free range of at least size from the first class that guarantees it
+int range_allocator::find_free(size_t size) const {
+	if (size >= (size_t) SL_COUNT)
+		size += ((size_t) 1 << (floor_log2(size) - SL_BITS)) - 1;
+	int fl, sl;
+	size_class(size, SL_BITS, fl, sl);
+	if (fl >= FL_COUNT)
+		return -1;
+	uint32_t sl_map = sl_bitmap[fl] & (~0u << sl);
+	if (sl_map == 0) {
+		uint64_t fl_map = fl + 1 < 64 ? fl_bitmap & (~(uint64_t) 0 << (fl + 1)) : 0;
+		if (fl_map == 0)
+			return -1;
+		fl = __builtin_ctzll(fl_map);
+		sl_map = sl_bitmap[fl];
+	}
+	return heads[fl][__builtin_ctz(sl_map)];
+}
+
+// Cuts r down to size; the rest becomes a new range after it, not yet listed
+void range_allocator::split(int r, size_t size) {
+	int n = new_node(ranges[r].offset + size, ranges[r].size - size);
+	ranges[r].size = size;
+	ranges[n].prev = r;
+	ranges[n].next = ranges[r].next;
+	if (ranges[n].next >= 0)
+		ranges[ranges[n].next].prev = n;
+	ranges[r].next = n;
+}
+
+size_t range_allocator::allocate(size_t size, size_t align) {
+	if (size == 0)
+		size = 1;
+	if (align == 0)
+		align = 1;
+	int r = find_free(size + align - 1);
+	if (r < 0)
+		return npos;
+	remove_free(r);
+
+	// the part before the aligned offset stays free
+	size_t aligned = (ranges[r].offset + align - 1) & ~(align - 1);
+	if (aligned > ranges[r].offset) {
+		split(r, aligned - ranges[r].offset);
+		insert_free(r);
+		r = ranges[r].next;
+	}
+	if (ranges[r].size > size) {
+		split(r, size);
+		insert_free(ranges[r].next);
+	}
+	ranges[r].free = false;
+	in_use += size;
+	allocated[aligned] = r;
+	return aligned;
+}
+
+void range_allocator::release(size_t offset) {
+	unordered_map<size_t, int>::iterator it = allocated.find(offset);
+	if (it == allocated.end()) {
+		cerr << "range_allocator: no range at " << offset << endl;
+		return;
+	}
+	int r = it->second;
+	allocated.erase(it);
+	in_use -= ranges[r].size;
+
+	int n = ranges[r].next;
+	if (n >= 0 && ranges[n].free) {
+		remove_free(n);
+		ranges[r].size += ranges[n].size;
+		ranges[r].next = ranges[n].next;
+		if (ranges[r].next >= 0)
+			ranges[ranges[r].next].prev = r;
+		spare.push_back(n);
+	}
+	int p = ranges[r].prev;
+	if (p >= 0 && ranges[p].free) {
+		remove_free(p);
+		ranges[p].size += ranges[r].size;
+		ranges[p].next = ranges[r].next;
+		if (ranges[p].next >= 0)
+			ranges[ranges[p].next].prev = p;
+		spare.push_back(r);
+		r = p;
+	}
+	insert_free(r);
+}
+
+size_t range_allocator::largest_free() const {
+	if (fl_bitmap == 0)
+		return 0;
+	int fl = floor_log2(fl_bitmap);
+	int sl = 31 - __builtin_clz(sl_bitmap[fl]);
+	size_t best = 0;
+	for (int r = heads[fl][sl]; r >= 0; r = ranges[r].next_free)
+		best = max(best, ranges[r].size);
+	return best;
+}
+
+float range_allocator::fragmentation() const {
+	size_t free_space = total - in_use;
+	if (free_space == 0)
+		return 0.0f;
+	return 1.0f - (float) largest_free() / free_space;
+}
+
+void range_allocator::print_report(ostream &os) const {
+	os << allocations() << " ranges, " << used() << "/" << capacity() << " used, "
+	   << free_ranges() << " free ranges, largest " << largest_free() << ", fragmentation "
+	   << 100.0f * fragmentation() << "%" << endl;
+}
@@ -0,0 +1,79 @@
+//
+//  range_allocator.h
+//  pipeline
+//
+//  Sub-allocation of ranges from one large block (a GPU buffer, usually):
+//  a two-level segregated fit (TLSF) allocator that only does bookkeeping,
+//  so it works, and can be tried out, without a GL context.
+//
+
+#ifndef range_allocator_h
+#define range_allocator_h
+
+#include <stdint.h>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+/* Free ranges are kept in lists by size class: the first level is the
+ * power of two of the size, the second splits that power into 16 steps.
+ * Two bitmaps tell which lists are non-empty, so allocate() and release()
+ * take constant time whatever the number of ranges. A request is served
+ * from a list whose every range is large enough, so sizes may be rounded
+ * up by up to 1/16 when looking, but a found range is split exactly.
+ * Freed ranges merge with free neighbours at once.
+ */
+class range_allocator {
+public:
+	static const size_t npos = (size_t) -1;
+
+	explicit range_allocator(size_t capacity = 0);
+
+	// Offset of size units aligned to align (a power of two), or npos if none fits
+	size_t allocate(size_t size, size_t align = 1);
+	// Gives back the range allocate() returned at offset
+	void release(size_t offset);
+	// Forgets all ranges
+	void reset(size_t capacity);
+
+	size_t capacity() const { return total; }
+	size_t used() const { return in_use; }
+	size_t largest_free() const;
+	int free_ranges() const { return n_free; }
+	int allocations() const { return (int) allocated.size(); }
+
+	// 0 when all free space is one range, towards 1 as it splinters
+	float fragmentation() const;
+
+	void print_report(ostream &os) const;
+
+private:
+	static const int SL_BITS = 4;
+	static const int SL_COUNT = 1 << SL_BITS;
+	static const int FL_COUNT = 64 - SL_BITS + 1;
+
+	struct range {
+		size_t offset, size;
+		int prev, next;            // neighbours by offset, -1 at the ends
+		int prev_free, next_free;  // in the size class list while free
+		bool free;
+	};
+
+	size_t total, in_use;
+	int n_free;
+	vector<range> ranges;          // nodes; unused ones are chained in spare
+	vector<int> spare;
+	unordered_map<size_t, int> allocated;   // offset to node
+	uint64_t fl_bitmap;
+	uint32_t sl_bitmap[FL_COUNT];
+	int heads[FL_COUNT][SL_COUNT];
+
+	int new_node(size_t offset, size_t size);
+	void insert_free(int r);
+	void remove_free(int r);
+	int find_free(size_t size) const;
+	void split(int r, size_t size);
+};
+
+#endif /* range_allocator_h */
@@ -0,0 +1,302 @@
+//
+//  raycast.cc
+//  pipeline
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include "raycast.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+// Primary ray through the center of pixel (x, y), from the near to the far plane
+static void camera_ray(const mat4 &inv, int x, int y, int w, int h, ray &r) {
+	float ndc_x = 2.0f * (x + 0.5f) / w - 1.0f;
+	float ndc_y = 1.0f - 2.0f * (y + 0.5f) / h;
+	vec4 a = inv * vec4(ndc_x, ndc_y, -1.0, 1.0);
+	vec4 b = inv * vec4(ndc_x, ndc_y, 1.0, 1.0);
+	a /= a.w;
+	b /= b.w;
+	for (int i = 0; i < 3; i++) {
+		r.org[i] = a[i];
+		r.dir[i] = b[i] - a[i];
+	}
+	r.tmin = 0.0f;
+	r.tmax = 1.0f;
+}
+
+/* Blinn-Phong as in fshader_passthrough.glsl: ambient (scaled by the baked
+ * occlusion, if any), plus diffuse and specular terms for a point light,
+ * with the viewer along the ray.
+ */
+static void shade(const shading_params &sp, const vector<int> &tris, const vector<float> &verts,
+				  const vector<float> &normals, const vector<unsigned char> &occlusion,
+				  const ray &r, const ray_hit &hit,
+				  unsigned char *out)
+{
+	vec4 c;
+	if (hit.tri < 0) {
+		c = sp.background;
+	} else {
+		const int *f = &tris[3*hit.tri];
+		float w = 1.0f - hit.u - hit.v;
+		vec3 n, p;
+		for (int i = 0; i < 3; i++) {
+			n[i] = w*normals[3*f[0]+i] + hit.u*normals[3*f[1]+i] + hit.v*normals[3*f[2]+i];
+			p[i] = w*verts[3*f[0]+i] + hit.u*verts[3*f[1]+i] + hit.v*verts[3*f[2]+i];
+		}
+		n = normalize(n);
+		vec3 l = normalize(vec3(sp.light_position.x, sp.light_position.y, sp.light_position.z) - p);
+		vec3 v = normalize(-vec3(r.dir[0], r.dir[1], r.dir[2]));
+
+		c = sp.light_ambient * sp.material_ambient;
+		if (!occlusion.empty())
+			c *= (w*occlusion[f[0]] + hit.u*occlusion[f[1]] + hit.v*occlusion[f[2]]) / 255.0f;
+		float dd = max(0.0f, dot(l, n));
+		c += dd * (sp.light_diffuse * sp.material_diffuse);
+		float sd = 0.0f;
+		if (dot(l, n) > 0.0f && dot(v, n) > 0.0f)
+			sd = max(dot(normalize(l + v), n), 0.0f);
+		if (sd > 0.0f)
+			sd = pow(sd, sp.shininess);
+		c += sd * (sp.light_specular * sp.material_specular);
+	}
+	for (int i = 0; i < 3; i++)
+		out[i] = (unsigned char) (min(max(c[i], 0.0f), 1.0f) * 255.0f + 0.5f);
+}
+
+#ifdef __SSE2__
+
+// Four rays traced together, one per SSE lane
+struct ray_packet {
+	__m128 ox, oy, oz, dx, dy, dz, ix, iy, iz;
+	__m128 t, u, v;
+	__m128i tri;
+	__m128 active;
+};
+
+static inline __m128 select_ps(__m128 mask, __m128 a, __m128 b) {
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+// Lanes that enter the node before their current hit, and the nearest entry
+static inline int packet_box(const bvh_node &n, const ray_packet &p, float &entry) {
+	__m128 x1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.lo[0]), p.ox), p.ix);
+	__m128 x2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.hi[0]), p.ox), p.ix);
+	__m128 y1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.lo[1]), p.oy), p.iy);
+	__m128 y2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.hi[1]), p.oy), p.iy);
+	__m128 z1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.lo[2]), p.oz), p.iz);
+	__m128 z2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.hi[2]), p.oz), p.iz);
+	__m128 t0 = _mm_max_ps(_mm_max_ps(_mm_min_ps(x1, x2), _mm_min_ps(y1, y2)),
+						   _mm_max_ps(_mm_min_ps(z1, z2), _mm_setzero_ps()));
+	__m128 t1 = _mm_min_ps(_mm_min_ps(_mm_max_ps(x1, x2), _mm_max_ps(y1, y2)),
+						   _mm_min_ps(_mm_max_ps(z1, z2), p.t));
+	__m128 mask = _mm_and_ps(_mm_cmple_ps(t0, t1), p.active);
+	int bits = _mm_movemask_ps(mask);
+	if (bits) {
+		float e[4];
+		_mm_storeu_ps(e, select_ps(mask, t0, _mm_set1_ps(1e30f)));
+		entry = min(min(e[0], e[1]), min(e[2], e[3]));
+	}
+	return bits;
+}
+
+static inline void packet_triangle(const float *tri, int id, ray_packet &p) {
+	__m128 v0x = _mm_set1_ps(tri[0]), v0y = _mm_set1_ps(tri[1]), v0z = _mm_set1_ps(tri[2]);
+	__m128 e1x = _mm_set1_ps(tri[3]), e1y = _mm_set1_ps(tri[4]), e1z = _mm_set1_ps(tri[5]);
+	__m128 e2x = _mm_set1_ps(tri[6]), e2y = _mm_set1_ps(tri[7]), e2z = _mm_set1_ps(tri[8]);
+
+	__m128 px = _mm_sub_ps(_mm_mul_ps(p.dy, e2z), _mm_mul_ps(p.dz, e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(p.dz, e2x), _mm_mul_ps(p.dx, e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(p.dx, e2y), _mm_mul_ps(p.dy, e2x));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	__m128 abs_det = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+	__m128 inv = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+	__m128 sx = _mm_sub_ps(p.ox, v0x), sy = _mm_sub_ps(p.oy, v0y), sz = _mm_sub_ps(p.oz, v0z);
+	__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv);
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+	__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(p.dx, qx), _mm_mul_ps(p.dy, qy)), _mm_mul_ps(p.dz, qz)), inv);
+	__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv);
+
+	__m128 zero = _mm_setzero_ps();
+	__m128 mask = _mm_and_ps(p.active, _mm_cmpgt_ps(abs_det, _mm_set1_ps(1e-12f)));
+	mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero)));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+	mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(t, zero), _mm_cmplt_ps(t, p.t)));
+	if (!_mm_movemask_ps(mask))
+		return;
+
+	p.t = select_ps(mask, t, p.t);
+	p.u = select_ps(mask, u, p.u);
+	p.v = select_ps(mask, v, p.v);
+	__m128i m = _mm_castps_si128(mask);
+	p.tri = _mm_or_si128(_mm_and_si128(m, _mm_set1_epi32(id)), _mm_andnot_si128(m, p.tri));
+}
+
+/* Packet traversal: a node is visited if any active lane enters it, and
+ * the child entered first by some lane is visited first.
+ */
+static void trace_packet(const bvh &tree, ray_packet &p) {
+	const vector<bvh_node> &nodes = tree.node_array();
+	float entry;
+	if (nodes.empty() || !packet_box(nodes[0], p, entry))
+		return;
+
+	int stack[BVH_MAX_DEPTH];
+	int sp = 0;
+	int node = 0;
+	for (;;) {
+		const bvh_node &n = nodes[node];
+		if (n.count > 0) {
+			for (int i = n.index; i < n.index + n.count; i++)
+				packet_triangle(tree.tri_data(i), tree.prim(i), p);
+		} else {
+			float ta = 1e30f, tb = 1e30f;
+			int a = n.index, b = n.index + 1;
+			int ha = packet_box(nodes[a], p, ta);
+			int hb = packet_box(nodes[b], p, tb);
+			if (ha && hb) {
+				if (tb < ta)
+					swap(a, b);
+				stack[sp++] = b;
+				node = a;
+				continue;
+			}
+			if (ha || hb) {
+				node = ha ? a : b;
+				continue;
+			}
+		}
+		if (sp == 0)
+			return;
+		node = stack[--sp];
+	}
+}
+
+static void trace_tile(const bvh &tree, const vector<int> &tris, const vector<float> &verts,
+					   const vector<float> &normals, const vector<unsigned char> &occlusion,
+					   const mat4 &inv, const shading_params &sp,
+					   int x0, int y0, int x1, int y1, rgb_image &img)
+{
+	for (int y = y0; y < y1; y += 2)
+		for (int x = x0; x < x1; x += 2) {
+			float o[3][4], d[3][4], act[4];
+			ray rays[4];
+			for (int k = 0; k < 4; k++) {
+				int px = x + (k & 1), py = y + (k >> 1);
+				act[k] = (px < x1 && py < y1) ? 1.0f : 0.0f;
+				camera_ray(inv, min(px, x1 - 1), min(py, y1 - 1), img.width, img.height, rays[k]);
+				for (int c = 0; c < 3; c++) {
+					o[c][k] = rays[k].org[c];
+					d[c][k] = rays[k].dir[c];
+				}
+			}
+
+			ray_packet p;
+			p.ox = _mm_loadu_ps(o[0]); p.oy = _mm_loadu_ps(o[1]); p.oz = _mm_loadu_ps(o[2]);
+			p.dx = _mm_loadu_ps(d[0]); p.dy = _mm_loadu_ps(d[1]); p.dz = _mm_loadu_ps(d[2]);
+			for (int c = 0; c < 3; c++)
+				for (int k = 0; k < 4; k++)
+					if (fabsf(d[c][k]) < 1e-20f)
+						d[c][k] = 1e-20f;
+			__m128 one = _mm_set1_ps(1.0f);
+			p.ix = _mm_div_ps(one, _mm_loadu_ps(d[0]));
+			p.iy = _mm_div_ps(one, _mm_loadu_ps(d[1]));
+			p.iz = _mm_div_ps(one, _mm_loadu_ps(d[2]));
+			p.t = one;
+			p.u = p.v = _mm_setzero_ps();
+			p.tri = _mm_set1_epi32(-1);
+			p.active = _mm_cmpgt_ps(_mm_loadu_ps(act), _mm_setzero_ps());
+
+			trace_packet(tree, p);
+
+			float t[4], u[4], v[4];
+			int tri[4];
+			_mm_storeu_ps(t, p.t);
+			_mm_storeu_ps(u, p.u);
+			_mm_storeu_ps(v, p.v);
+			_mm_storeu_si128((__m128i *) tri, p.tri);
+			for (int k = 0; k < 4; k++) {
+				if (act[k] == 0.0f)
+					continue;
+				ray_hit h = { tri[k], t[k], u[k], v[k] };
+				int px = x + (k & 1), py = y + (k >> 1);
+				shade(sp, tris, verts, normals, occlusion, rays[k], h, &img.pixels[3 * (py * img.width + px)]);
+			}
+		}
+}
+
+#else
+
+static void trace_tile(const bvh &tree, const vector<int> &tris, const vector<float> &verts,
+					   const vector<float> &normals, const vector<unsigned char> &occlusion,
+					   const mat4 &inv, const shading_params &sp,
+					   int x0, int y0, int x1, int y1, rgb_image &img)
+{
+	for (int y = y0; y < y1; y++)
+		for (int x = x0; x < x1; x++) {
+			ray r;
+			ray_hit h;
+			camera_ray(inv, x, y, img.width, img.height, r);
+			tree.intersect(r, h);
+			shade(sp, tris, verts, normals, occlusion, r, h, &img.pixels[3 * (y * img.width + x)]);
+		}
+}
+
+#endif // __SSE2__
+
+void raycast_image(const bvh &tree, const vector<int> &tris, const vector<float> &verts,
+				   const vector<float> &normals, const vector<unsigned char> &occlusion,
+				   const mat4 &proj, const mat4 &view,
+				   const shading_params &params, job_pool &pool,
+				   rgb_image &img, render_stats &stats)
+{
+	typedef std::chrono::steady_clock clock;
+	const mat4 inv = inverse(proj * view);
+	const int tiles_x = (img.width + RENDER_TILE - 1) / RENDER_TILE;
+	const int tiles_y = (img.height + RENDER_TILE - 1) / RENDER_TILE;
+
+	stats.workers = pool.workers();
+	stats.rays = (long long) img.width * img.height;
+	stats.tile_ms.assign(tiles_x * tiles_y, 0.0);
+
+	vector<job_pool::job> jobs;
+	for (int ty = 0; ty < tiles_y; ty++)
+		for (int tx = 0; tx < tiles_x; tx++) {
+			jobs.push_back([&, tx, ty]() {
+				clock::time_point start = clock::now();
+				int x0 = tx * RENDER_TILE, y0 = ty * RENDER_TILE;
+				trace_tile(tree, tris, verts, normals, occlusion, inv, params, x0, y0,
+						   min(x0 + RENDER_TILE, img.width), min(y0 + RENDER_TILE, img.height), img);
+				stats.tile_ms[ty * tiles_x + tx] =
+					std::chrono::duration<double, std::milli>(clock::now() - start).count();
+			});
+		}
+
+	clock::time_point start = clock::now();
+	pool.run(jobs);
+	stats.seconds = std::chrono::duration<double>(clock::now() - start).count();
+}
+
+void print_render_stats(ostream &os, const render_stats &stats) {
+	if (stats.tile_ms.empty())
+		return;
+	double lo = 1e30, hi = 0.0, sum = 0.0;
+	for (size_t i = 0; i < stats.tile_ms.size(); i++) {
+		lo = min(lo, stats.tile_ms[i]);
+		hi = max(hi, stats.tile_ms[i]);
+		sum += stats.tile_ms[i];
+	}
+	os << "raycast: " << stats.rays << " rays in " << stats.seconds * 1000.0 << " ms, "
+	   << stats.rays / stats.seconds / 1e6 << " Mrays/s on " << stats.workers << " workers" << endl;
+	os << "raycast: " << stats.tile_ms.size() << " tiles of " << RENDER_TILE << "x" << RENDER_TILE
+	   << ", min " << lo << " ms, avg " << sum / stats.tile_ms.size() << " ms, max " << hi << " ms" << endl;
+}
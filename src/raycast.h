@@ -0,0 +1,52 @@
+//
+//  raycast.h
+//  pipeline
+//
+//  Headless ray caster for thumbnails and reference images, shading with
+//  the same Blinn-Phong model as the GL renderer.
+//
+
+#ifndef raycast_h
+#define raycast_h
+
+#include <iostream>
+#include <vector>
+#include "amath.h"
+#include "bvh.h"
+#include "image.h"
+#include "jobs.h"
+using namespace std;
+
+struct shading_params {
+	vec4 light_position;
+	vec4 light_ambient, light_diffuse, light_specular;
+	vec4 material_ambient, material_diffuse, material_specular;
+	float shininess;
+	vec4 background;
+};
+
+struct render_stats {
+	unsigned int workers;
+	double seconds;
+	long long rays;
+	vector<double> tile_ms;   // time spent on each tile, row major
+};
+
+// Tile edge in pixels; tiles are the unit of work handed to the pool
+const int RENDER_TILE = 32;
+
+/* Renders the mesh as seen through proj * view into img (whose size is
+ * used as the viewport). normals holds one smooth normal per vertex and
+ * occlusion is either empty or one baked ambient factor per vertex. Tiles
+ * are traced on the pool, in 2x2 ray packets with SSE where available.
+ */
+void raycast_image(const bvh &tree, const vector<int> &tris, const vector<float> &verts,
+				   const vector<float> &normals, const vector<unsigned char> &occlusion,
+				   const mat4 &proj, const mat4 &view,
+				   const shading_params &params, job_pool &pool,
+				   rgb_image &img, render_stats &stats);
+
+// Total rays/s plus the fastest, average and slowest tiles
+void print_render_stats(ostream &os, const render_stats &stats);
+
+#endif /* raycast_h */
@@ -0,0 +1,145 @@
+//
+//  render_queue.cc
+//  pipeline
+//
+
+#include <algorithm>
+#include <chrono>
+#include "render_queue.h"
+
+using namespace std;
+
+static bool item_order(const render_item &a, const render_item &b) {
+	if (a.program != b.program)
+		return a.program < b.program;
+	if (a.layout != b.layout)
+		return a.layout < b.layout;
+	if (a.material != b.material)
+		return a.material < b.material;
+	return a.first < b.first;
+}
+
+static bool item_front_to_back(const render_item &a, const render_item &b) {
+	if (a.program != b.program)
+		return a.program < b.program;
+	if (a.layout != b.layout)
+		return a.layout < b.layout;
+	return a.depth < b.depth;
+}
+
+render_queue::render_queue() : indirect_buffer(0), indirect_capacity(0), multi_draw(false) {
+	frame_stats = render_queue_stats();
+}
+
+bool render_queue::multi_draw_supported() {
+#ifdef GLEW_ARB_multi_draw_indirect
+	return GLEW_ARB_multi_draw_indirect && base_instance_supported();
+#else
+	return false;
+#endif
+}
+
+bool render_queue::base_instance_supported() {
+#ifdef GLEW_ARB_base_instance
+	return GLEW_ARB_base_instance || GLEW_VERSION_4_2;
+#else
+	return false;
+#endif
+}
+
+void render_queue::prepare(bool use_multi_draw, bool front_to_back) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	render_queue_stats &s = frame_stats;
+	s = render_queue_stats();
+	s.items = (int) items.size();
+	multi_draw = use_multi_draw && multi_draw_supported();
+	sort(items.begin(), items.end(), front_to_back ? item_front_to_back : item_order);
+
+	if (multi_draw && !items.empty()) {
+		commands.resize(items.size());
+		for (size_t i = 0; i < items.size(); i++) {
+			draw_arrays_command &c = commands[i];
+			c.count = items[i].count;
+			c.instance_count = 1;
+			c.first = items[i].first;
+			c.base_instance = items[i].instance;
+		}
+		size_t bytes = sizeof(draw_arrays_command) * commands.size();
+		if (indirect_buffer == 0)
+			glGenBuffers(1, &indirect_buffer);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer);
+		if (bytes > indirect_capacity) {
+			indirect_capacity = max(bytes, 2 * indirect_capacity);
+			glBufferData(GL_DRAW_INDIRECT_BUFFER, indirect_capacity, NULL, GL_STREAM_DRAW);
+		}
+		glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, bytes, &commands[0]);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	}
+	s.submit_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void render_queue::draw(const std::function<void (int layout)> &bind_layout, GLuint program_override) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	render_queue_stats &s = frame_stats;
+	if (multi_draw && !items.empty())
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer);
+
+	GLuint program = 0, bound = 0;
+	int layout = -1, material = -1;
+	for (size_t i = 0; i < items.size(); ) {
+		const render_item &item = items[i];
+		if (i == 0 || item.program != program) {
+			program = item.program;
+			GLuint use = program_override ? program_override : program;
+			if (i == 0 || use != bound) {
+				glUseProgram(use);
+				bound = use;
+				s.program_changes++;
+			}
+		}
+		if (i == 0 || item.layout != layout) {
+			bind_layout(item.layout);
+			layout = item.layout;
+			s.layout_changes++;
+		}
+
+		// the run this item starts: same program and layout
+		size_t end = i + 1;
+		while (end < items.size() && items[end].program == program && items[end].layout == layout)
+			end++;
+		for (size_t k = i; k < end && program_override == 0; k++)
+			if (k == 0 || items[k].material != material) {
+				material = items[k].material;
+				s.material_changes++;
+			}
+
+		if (multi_draw) {
+			glMultiDrawArraysIndirect(GL_TRIANGLES, BUFFER_OFFSET(sizeof(draw_arrays_command) * i),
+									  (GLsizei) (end - i), 0);
+			s.draws++;
+		} else {
+			for (size_t k = i; k < end; k++) {
+				glDrawArraysInstancedBaseInstance(GL_TRIANGLES, items[k].first, items[k].count, 1,
+												  items[k].instance);
+				s.draws++;
+			}
+		}
+		i = end;
+	}
+	if (multi_draw)
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	s.submit_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void render_queue::release() {
+	if (indirect_buffer)
+		glDeleteBuffers(1, &indirect_buffer);
+	indirect_buffer = 0;
+	indirect_capacity = 0;
+}
+
+void print_render_queue_stats(ostream &os, const render_queue_stats &stats) {
+	os << stats.items << " items in " << stats.draws << " draws, " << stats.program_changes << " program, "
+	   << stats.layout_changes << " layout and " << stats.material_changes << " material changes, submitted in "
+	   << stats.submit_ms << " ms" << endl;
+}
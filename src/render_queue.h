@@ -0,0 +1,104 @@
+//
+//  render_queue.h
+//  pipeline
+//
+//  Draws gathered over a frame, sorted so that those sharing a program and
+//  a vertex layout sit together, and submitted with as few state changes
+//  and draw calls as the driver allows.
+//
+
+#ifndef render_queue_h
+#define render_queue_h
+
+#include <functional>
+#include <iostream>
+#include <vector>
+#include "amath.h"
+using namespace std;
+
+/* One glDrawArrays worth of triangles. The instance is the row of the
+ * per-instance attributes the draw reads, so placement and material can
+ * differ between draws that are merged into one call.
+ */
+struct render_item {
+	GLuint program;
+	int layout;        // which vertex ranges the attributes point at
+	int material;
+	GLint first;
+	GLsizei count;
+	GLuint instance;
+	float depth;       // distance from the eye, for front-to-back order
+};
+
+struct render_queue_stats {
+	int items;
+	int draws;              // draw calls issued, over every pass
+	int program_changes;
+	int layout_changes;
+	int material_changes;   // runs of one material; free when materials are per instance
+	double submit_ms;       // sorting and every pass included
+};
+
+// The layout of GL_DRAW_INDIRECT_BUFFER records for glMultiDrawArraysIndirect
+struct draw_arrays_command {
+	GLuint count;
+	GLuint instance_count;
+	GLuint first;
+	GLuint base_instance;
+};
+
+/* Items are sorted by program, then layout, then material, or front to
+ * back by depth in place of material. Each run of items with the same
+ * program and layout becomes one glMultiDrawArraysIndirect when
+ * multi-draw indirect is there and asked for; otherwise every item is its
+ * own glDrawArraysInstancedBaseInstance. The commands of a frame go into
+ * one buffer, written once however many times the frame draws them.
+ */
+class render_queue {
+public:
+	render_queue();
+
+	void clear() { items.clear(); }
+	void add(const render_item &item) { items.push_back(item); }
+
+	// Sorts the items and writes their commands
+	void prepare(bool multi_draw, bool front_to_back = false);
+
+	/* Draws the prepared items. bind_layout is called to point the vertex
+	 * attributes at a layout whenever it changes. A program other than 0 is
+	 * used in place of every item's own, as a depth-only pass does, and
+	 * the runs are still split where the items' programs change.
+	 */
+	void draw(const std::function<void (int layout)> &bind_layout, GLuint program = 0);
+
+	void submit(bool multi_draw, const std::function<void (int layout)> &bind_layout) {
+		prepare(multi_draw);
+		draw(bind_layout);
+	}
+
+	const render_queue_stats &stats() const { return frame_stats; }
+
+	// glMultiDrawArraysIndirect with base instances (GL 4.3)
+	static bool multi_draw_supported();
+
+	// glDrawArraysInstancedBaseInstance (GL 4.2), which draw needs either way
+	static bool base_instance_supported();
+
+	// Deletes the command buffer; needs the GL context
+	void release();
+
+private:
+	vector<render_item> items;
+	vector<draw_arrays_command> commands;
+	GLuint indirect_buffer;
+	size_t indirect_capacity;
+	bool multi_draw;        // as prepared
+	render_queue_stats frame_stats;
+
+	render_queue(const render_queue &);
+	render_queue &operator= (const render_queue &);
+};
+
+void print_render_queue_stats(ostream &os, const render_queue_stats &stats);
+
+#endif /* render_queue_h */
@@ -0,0 +1,411 @@
+//
+//  shader_manager.cc
+//  pipeline
+//
+
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string.h>
+#include <sys/stat.h>
+#include "shader_manager.h"
+#include "uniform_blocks.h"
+
+using namespace std;
+
+static const char BINARY_MAGIC[4] = { 'P', 'S', 'H', 'B' };
+
+static double ms_since(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// FNV-1a
+static uint64_t hash_bytes(const string &s, uint64_t h = 14695981039346656037ull) {
+	for (size_t i = 0; i < s.size(); i++)
+		h = (h ^ (unsigned char) s[i]) * 1099511628211ull;
+	return h;
+}
+
+/* The defines go after the #version and #extension lines, which have to
+ * come first, and a #line keeps the compiler's line numbers those of the
+ * file.
+ */
+static string with_defines(const string &text, const vector<string> &defines) {
+	if (defines.empty())
+		return text;
+	size_t insert = 0;
+	int lines = 0, line = 0;
+	for (size_t p = 0; p < text.size(); line++) {
+		size_t eol = text.find('\n', p);
+		size_t next = eol == string::npos ? text.size() : eol + 1;
+		if (text.compare(p, 8, "#version") == 0 || text.compare(p, 10, "#extension") == 0) {
+			insert = next;
+			lines = line + 1;
+		}
+		p = next;
+	}
+	ostringstream out;
+	out << text.substr(0, insert);
+	if (insert > 0 && text[insert - 1] != '\n')
+		out << '\n';
+	for (size_t i = 0; i < defines.size(); i++)
+		out << "#define " << defines[i] << '\n';
+	out << "#line " << lines + 1 << '\n' << text.substr(insert);
+	return out.str();
+}
+
+// Files and defines of a variant, cheap to build for every lookup
+static string variant_name(const shader_variant &v) {
+	string name = v.compute_file.empty() ? v.vertex_file + '\n' + v.fragment_file
+		: "compute\n" + v.compute_file;
+	for (size_t i = 0; i < v.defines.size(); i++)
+		name += '\n' + v.defines[i];
+	return name;
+}
+
+static void print_shader_log(GLuint shader, const string &name) {
+	GLint compiled, size;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+	if (compiled)
+		return;
+	glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &size);
+	vector<char> log(size + 1, 0);
+	glGetShaderInfoLog(shader, size, NULL, &log[0]);
+	cerr << name << " failed to compile:" << endl << &log[0] << endl;
+}
+
+static const char *stage_name(GLenum type) {
+	switch (type) {
+	case GL_VERTEX_SHADER: return "vertex shader";
+	case GL_FRAGMENT_SHADER: return "fragment shader";
+	default: return "compute shader";
+	}
+}
+
+shader_manager::shader_manager(const string &cache_dir)
+	: cache_dir(cache_dir), initialized(false), parallel_compile(false), binaries(false),
+	  n_compiled(0), n_loaded(0), n_failed(0), compile_ms(0.0), load_ms(0.0) {}
+
+void shader_manager::bind_attribute(const char *name, GLuint location) {
+	attributes.push_back(make_pair(string(name), location));
+}
+
+void shader_manager::bind_uniform_block(const char *name, GLuint binding) {
+	blocks.push_back(make_pair(string(name), binding));
+}
+
+void shader_manager::bind_sampler(const char *name, GLuint unit) {
+	samplers.push_back(make_pair(string(name), unit));
+}
+
+// Blocks and samplers of a linked program; sampler units are program state
+void shader_manager::attach_bindings(GLuint program) {
+	for (size_t i = 0; i < blocks.size(); i++)
+		attach_uniform_block(program, blocks[i].first.c_str(), blocks[i].second);
+	GLint current = 0;
+	bool switched = false;
+	for (size_t i = 0; i < samplers.size(); i++) {
+		GLint location = glGetUniformLocation(program, samplers[i].first.c_str());
+		if (location < 0)
+			continue;
+		if (!switched) {
+			glGetIntegerv(GL_CURRENT_PROGRAM, &current);
+			glUseProgram(program);
+			switched = true;
+		}
+		glUniform1i(location, samplers[i].second);
+	}
+	if (switched)
+		glUseProgram(current);
+}
+
+// Needs the GL context, so it waits for the first program
+void shader_manager::init() {
+	if (initialized)
+		return;
+	initialized = true;
+	driver = string((const char *) glGetString(GL_VENDOR)) + "|" + (const char *) glGetString(GL_RENDERER) +
+		"|" + (const char *) glGetString(GL_VERSION);
+#ifdef GLEW_KHR_parallel_shader_compile
+	if (GLEW_KHR_parallel_shader_compile) {
+		glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+		parallel_compile = true;
+	}
+#endif
+#ifdef GLEW_ARB_parallel_shader_compile
+	if (!parallel_compile && GLEW_ARB_parallel_shader_compile) {
+		glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+		parallel_compile = true;
+	}
+#endif
+#ifdef GLEW_ARB_get_program_binary
+	if (GLEW_ARB_get_program_binary && !cache_dir.empty()) {
+		GLint formats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+		binaries = formats > 0;
+		if (binaries)
+			mkdir(cache_dir.c_str(), 0755);
+	}
+#endif
+}
+
+const string &shader_manager::source(const string &file) {
+	unordered_map<string, string>::iterator it = sources.find(file);
+	if (it != sources.end())
+		return it->second;
+	ifstream in(file.c_str(), ios::binary);
+	ostringstream text;
+	if (in)
+		text << in.rdbuf();
+	else
+		cerr << "Failed to read " << file << endl;
+	return sources[file] = text.str();
+}
+
+// A compute program's source goes in vertex, with fragment left empty
+uint64_t shader_manager::build_sources(const shader_variant &v, string &vertex, string &fragment) {
+	bool compute = !v.compute_file.empty();
+	vertex = with_defines(source(compute ? v.compute_file : v.vertex_file), v.defines);
+	fragment = compute ? string() : with_defines(source(v.fragment_file), v.defines);
+	uint64_t h = hash_bytes(driver);
+	if (compute)
+		h = hash_bytes("compute", h);
+	h = hash_bytes(vertex, h);
+	h = hash_bytes(string(1, '\0'), h);
+	h = hash_bytes(fragment, h);
+	for (size_t i = 0; i < attributes.size(); i++) {
+		ostringstream a;
+		a << attributes[i].first << '=' << attributes[i].second << ';';
+		h = hash_bytes(a.str(), h);
+	}
+	return h;
+}
+
+string shader_manager::binary_file(uint64_t key) const {
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long) key);
+	return cache_dir + "/" + name;
+}
+
+bool shader_manager::load_binary(uint64_t key, entry &e) {
+#ifdef GLEW_ARB_get_program_binary
+	if (!binaries)
+		return false;
+	ifstream in(binary_file(key).c_str(), ios::binary);
+	char magic[4];
+	GLenum format;
+	uint32_t size;
+	if (!in.read(magic, 4) || memcmp(magic, BINARY_MAGIC, 4) != 0 ||
+		!in.read((char *) &format, sizeof(format)) || !in.read((char *) &size, sizeof(size)))
+		return false;
+	vector<char> data(size);
+	if (size == 0 || !in.read(&data[0], size))
+		return false;
+
+	e.program = glCreateProgram();
+	glProgramBinary(e.program, format, &data[0], size);
+	GLint linked;
+	glGetProgramiv(e.program, GL_LINK_STATUS, &linked);
+	if (!linked) {
+		// a driver update, say; it is compiled again and the file replaced
+		glDeleteProgram(e.program);
+		e.program = 0;
+		return false;
+	}
+	return true;
+#else
+	(void) key;
+	(void) e;
+	return false;
+#endif
+}
+
+void shader_manager::save_binary(uint64_t key, const entry &e) {
+#ifdef GLEW_ARB_get_program_binary
+	if (!binaries)
+		return;
+	GLint size = 0;
+	glGetProgramiv(e.program, GL_PROGRAM_BINARY_LENGTH, &size);
+	if (size <= 0)
+		return;
+	vector<char> data(size);
+	GLenum format;
+	glGetProgramBinary(e.program, size, NULL, &format, &data[0]);
+	uint32_t bytes = (uint32_t) size;
+	ofstream out(binary_file(key).c_str(), ios::binary);
+	out.write(BINARY_MAGIC, 4);
+	out.write((const char *) &format, sizeof(format));
+	out.write((const char *) &bytes, sizeof(bytes));
+	out.write(&data[0], size);
+#else
+	(void) key;
+	(void) e;
+#endif
+}
+
+shader_manager::entry &shader_manager::start(const shader_variant &v, uint64_t &key) {
+	init();
+	string name = variant_name(v);
+	unordered_map<string, uint64_t>::iterator known = variant_keys.find(name);
+	if (known != variant_keys.end()) {
+		key = known->second;
+		return programs[key];
+	}
+	string vertex, fragment;
+	key = build_sources(v, vertex, fragment);
+	variant_keys[name] = key;
+	unordered_map<uint64_t, entry>::iterator it = programs.find(key);
+	if (it != programs.end())
+		return it->second;
+
+	entry &e = programs[key];
+	e.program = 0;
+	e.shaders[0] = e.shaders[1] = 0;
+	e.done = false;
+	e.from_binary = false;
+
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	if (load_binary(key, e)) {
+		e.from_binary = true;
+		e.done = true;
+		attach_bindings(e.program);
+		n_loaded++;
+		load_ms += ms_since(begin);
+		return e;
+	}
+
+	// compile and link without asking how it went, so the driver can get on with it
+	const string *text[2] = { &vertex, &fragment };
+	GLenum types[2] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+	int stages = 2;
+	if (!v.compute_file.empty()) {
+		types[0] = GL_COMPUTE_SHADER;
+		stages = 1;
+	}
+	e.types[0] = types[0];
+	e.types[1] = types[1];
+	e.program = glCreateProgram();
+	for (int s = 0; s < stages; s++) {
+		e.shaders[s] = glCreateShader(types[s]);
+		const GLchar *src = text[s]->c_str();
+		glShaderSource(e.shaders[s], 1, &src, NULL);
+		glCompileShader(e.shaders[s]);
+		glAttachShader(e.program, e.shaders[s]);
+	}
+	for (size_t i = 0; i < attributes.size(); i++)
+		glBindAttribLocation(e.program, attributes[i].second, attributes[i].first.c_str());
+#ifdef GLEW_ARB_get_program_binary
+	if (binaries)
+		glProgramParameteri(e.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+#endif
+	glLinkProgram(e.program);
+	compile_ms += ms_since(begin);
+	return e;
+}
+
+// Waits for the link, reports failures and keeps the binary
+void shader_manager::finish(entry &e, uint64_t key) {
+	if (e.done)
+		return;
+	e.done = true;
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	GLint linked;
+	glGetProgramiv(e.program, GL_LINK_STATUS, &linked);
+	if (!linked) {
+		for (int s = 0; s < 2; s++)
+			if (e.shaders[s])
+				print_shader_log(e.shaders[s], stage_name(e.types[s]));
+		GLint size;
+		glGetProgramiv(e.program, GL_INFO_LOG_LENGTH, &size);
+		vector<char> log(size + 1, 0);
+		glGetProgramInfoLog(e.program, size, NULL, &log[0]);
+		cerr << "Shader program failed to link" << endl << &log[0] << endl;
+		glDeleteProgram(e.program);
+		e.program = 0;
+		n_failed++;
+	} else {
+		attach_bindings(e.program);
+		save_binary(key, e);
+		n_compiled++;
+	}
+	for (int s = 0; s < 2; s++) {
+		if (e.shaders[s] == 0)
+			continue;
+		if (e.program)
+			glDetachShader(e.program, e.shaders[s]);
+		glDeleteShader(e.shaders[s]);
+		e.shaders[s] = 0;
+	}
+	compile_ms += ms_since(begin);
+}
+
+void shader_manager::prepare(const vector<shader_variant> &variants) {
+	uint64_t key;
+	for (size_t i = 0; i < variants.size(); i++) {
+		entry &e = start(variants[i], key);
+		if (!parallel_compile)
+			finish(e, key);
+	}
+}
+
+GLuint shader_manager::program(const shader_variant &v) {
+	uint64_t key;
+	entry &e = start(v, key);
+	finish(e, key);
+	return e.program;
+}
+
+bool shader_manager::completed(const entry &e) const {
+	if (e.done)
+		return true;
+	GLint complete = GL_TRUE;
+#ifdef GLEW_KHR_parallel_shader_compile
+	if (parallel_compile)
+		glGetProgramiv(e.program, GL_COMPLETION_STATUS_KHR, &complete);
+#endif
+	return complete == GL_TRUE;
+}
+
+bool shader_manager::ready(const shader_variant &v) {
+	uint64_t key;
+	entry &e = start(v, key);
+	if (completed(e))
+		finish(e, key);
+	return e.done;
+}
+
+int shader_manager::poll() {
+	int pending = 0;
+	for (unordered_map<uint64_t, entry>::iterator it = programs.begin(); it != programs.end(); ++it) {
+		if (it->second.done)
+			continue;
+		if (completed(it->second))
+			finish(it->second, it->first);
+		else
+			pending++;
+	}
+	return pending;
+}
+
+void shader_manager::clear() {
+	for (unordered_map<uint64_t, entry>::iterator it = programs.begin(); it != programs.end(); ++it) {
+		entry &e = it->second;
+		for (int s = 0; s < 2; s++)
+			if (e.shaders[s])
+				glDeleteShader(e.shaders[s]);
+		if (e.program)
+			glDeleteProgram(e.program);
+	}
+	programs.clear();
+	variant_keys.clear();
+}
+
+void shader_manager::print_report(ostream &os) const {
+	int pending = 0;
+	for (unordered_map<uint64_t, entry>::const_iterator it = programs.begin(); it != programs.end(); ++it)
+		pending += it->second.done ? 0 : 1;
+	os << "shaders: " << programs.size() << " programs, " << n_loaded << " from binaries ("
+	   << load_ms << " ms), " << n_compiled << " compiled (" << compile_ms << " ms waited), "
+	   << pending << " still compiling, " << n_failed << " failed"
+	   << (parallel_compile ? ", parallel compile" : "") << endl;
+}
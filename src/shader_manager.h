@@ -0,0 +1,114 @@
+//
+//  shader_manager.h
+//  pipeline
+//
+//  GLSL programs (vertex and fragment, or compute) and their variants (the same files built with different
+//  #define sets), compiled side by side where the driver allows, and kept
+//  in memory by source hash and on disk as program binaries, so that later
+//  launches skip compiling.
+//
+
+#ifndef shader_manager_h
+#define shader_manager_h
+
+#include <stdint.h>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "amath.h"
+using namespace std;
+
+struct shader_variant {
+	string vertex_file, fragment_file;
+	string compute_file;         // a compute program has this alone
+	vector<string> defines;      // "NAME" or "NAME value", added after #version and #extension
+
+	shader_variant(const string &vertex, const string &fragment)
+		: vertex_file(vertex), fragment_file(fragment) {}
+	explicit shader_variant(const string &compute) : compute_file(compute) {}
+
+	shader_variant &define(const string &d) {
+		defines.push_back(d);
+		return *this;
+	}
+};
+
+/* Programs are keyed by a hash of their final sources, the attribute
+ * locations and the driver, so variants that come out the same share one
+ * program and a binary from another driver is never tried. Lookups go by
+ * the variant's files and defines, so the sources are only built the first
+ * time a variant is asked for. Failures are
+ * reported with the compile and link logs and give program 0; nothing
+ * exits.
+ */
+class shader_manager {
+public:
+	// Binaries are kept in cache_dir, created if need be; "" keeps none
+	explicit shader_manager(const string &cache_dir = "");
+
+	// For every program: attribute locations are fixed before linking, so
+	// one vertex array layout fits all, and blocks and samplers are bound after
+	void bind_attribute(const char *name, GLuint location);
+	void bind_uniform_block(const char *name, GLuint binding);
+	void bind_sampler(const char *name, GLuint unit);
+
+	/* Starts building the variants without waiting for any. With
+	 * KHR_parallel_shader_compile the driver compiles them all at once on
+	 * its own threads; without it they are built here, one by one.
+	 */
+	void prepare(const vector<shader_variant> &variants);
+
+	// The linked program of v, waiting for it if need be; 0 if it failed
+	GLuint program(const shader_variant &v);
+
+	// True once v's program is there (or has failed) without waiting
+	bool ready(const shader_variant &v);
+
+	/* Checks, without waiting, the programs still compiling and keeps the
+	 * binaries of those done; called once a frame, it saves the variants
+	 * not used yet for the next launch. Returns how many are still going.
+	 */
+	int poll();
+
+	// Deletes every program; needs the GL context
+	void clear();
+
+	void print_report(ostream &os) const;
+
+private:
+	struct entry {
+		GLuint program;
+		GLuint shaders[2];      // while compiling; a compute program has the first only
+		GLenum types[2];
+		bool done;              // linked (or loaded) and checked
+		bool from_binary;
+	};
+
+	string cache_dir;
+	vector< pair<string, GLuint> > attributes, blocks, samplers;
+	unordered_map<string, string> sources;      // files read so far
+	unordered_map<uint64_t, entry> programs;
+	unordered_map<string, uint64_t> variant_keys;  // program key of each variant asked for
+	bool initialized, parallel_compile, binaries;
+	string driver;
+	int n_compiled, n_loaded, n_failed;
+	double compile_ms, load_ms;
+
+	void init();
+	const string &source(const string &file);
+	uint64_t build_sources(const shader_variant &v, string &vertex, string &fragment);
+	entry &start(const shader_variant &v, uint64_t &key);
+	void finish(entry &e, uint64_t key);
+	bool completed(const entry &e) const;
+	void attach_bindings(GLuint program);
+	bool load_binary(uint64_t key, entry &e);
+	void save_binary(uint64_t key, const entry &e);
+	string binary_file(uint64_t key) const;
+
+	shader_manager(const shader_manager &);
+	shader_manager &operator= (const shader_manager &);
+};
+
+#endif /* shader_manager_h */
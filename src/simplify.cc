@@ -0,0 +1,422 @@
+//
+//  simplify.cc
+//  pipeline
+//
+
+#include <cmath>
+#include <queue>
+#include "simplify.h"
+#include "halfedge.h"
+#include "arena.h"
+
+using namespace std;
+
+// Symmetric 4x4 error quadric, upper triangle:
+// a00 a01 a02 a03 a11 a12 a13 a22 a23 a33
+struct quadric {
+	double a[10];
+
+	quadric() { for (int i = 0; i < 10; i++) a[i] = 0.0; }
+
+	// squared distance to the plane n.p + d = 0, scaled by w
+	void add_plane(double nx, double ny, double nz, double d, double w) {
+		a[0] += w*nx*nx; a[1] += w*nx*ny; a[2] += w*nx*nz; a[3] += w*nx*d;
+		a[4] += w*ny*ny; a[5] += w*ny*nz; a[6] += w*ny*d;
+		a[7] += w*nz*nz; a[8] += w*nz*d;
+		a[9] += w*d*d;
+	}
+
+	quadric& operator+= (const quadric &q) {
+		for (int i = 0; i < 10; i++) a[i] += q.a[i];
+		return *this;
+	}
+
+	double eval(double x, double y, double z) const {
+		return a[0]*x*x + 2*a[1]*x*y + 2*a[2]*x*z + 2*a[3]*x
+			 + a[4]*y*y + 2*a[5]*y*z + 2*a[6]*y
+			 + a[7]*z*z + 2*a[8]*z
+			 + a[9];
+	}
+
+	// position minimizing the error, false if the system is singular
+	bool optimum(double &x, double &y, double &z) const {
+		double det = a[0]*(a[4]*a[7] - a[5]*a[5])
+				   - a[1]*(a[1]*a[7] - a[5]*a[2])
+				   + a[2]*(a[1]*a[5] - a[4]*a[2]);
+		if (fabs(det) < 1e-12)
+			return false;
+		double bx = -a[3], by = -a[6], bz = -a[8];
+		x = (bx*(a[4]*a[7] - a[5]*a[5]) - a[1]*(by*a[7] - a[5]*bz) + a[2]*(by*a[5] - a[4]*bz)) / det;
+		y = (a[0]*(by*a[7] - bz*a[5]) - bx*(a[1]*a[7] - a[5]*a[2]) + a[2]*(a[1]*bz - by*a[2])) / det;
+		z = (a[0]*(a[4]*bz - a[5]*by) - a[1]*(a[1]*bz - by*a[2]) + bx*(a[1]*a[5] - a[4]*a[2])) / det;
+		return true;
+	}
+};
+
+struct collapse {
+	double cost;
+	int a, b;
+	unsigned int sa, sb;   // vertex versions the entry was computed with
+	double p[3];
+
+	bool operator> (const collapse &c) const { return cost > c.cost; }
+};
+
+// Weight of the penalty planes that keep open borders in place
+static const double BOUNDARY_WEIGHT = 1000.0;
+// Smallest allowed cosine between a face normal before and after a collapse
+static const double MIN_NORMAL_DOT = 0.2;
+
+class qem_simplifier {
+public:
+	qem_simplifier(const vector<int> &tris, const vector<float> &verts);
+
+	// Collapses edges until at most target faces remain or the next
+	// collapse costs more than max_cost. Returns false when it stopped early.
+	bool run(int target, double max_cost);
+	void snapshot(mesh_lod &lod) const;
+
+	int faces() const { return live_faces; }
+	double max_error() const { return sqrt(worst_cost); }
+
+private:
+	vector<int> t;
+	vector<double> pos;
+	vector<quadric> q;
+	vector<unsigned int> version;
+	vector<char> alive, face_alive;
+	arena face_lists;                  // vfaces' storage
+	vector< arena_list<int> > vfaces;
+	vector<unsigned int> mark;
+	unsigned int stamp;
+	int live_faces;
+	double worst_cost;
+	priority_queue<collapse, vector<collapse>, greater<collapse> > heap;
+
+	void face_normal(int f, double n[3], double &area) const;
+	void push_edge(int a, int b);
+	bool valid(const collapse &c);
+	void apply(const collapse &c);
+};
+
+qem_simplifier::qem_simplifier(const vector<int> &tris, const vector<float> &verts)
+: t(tris), pos(verts.begin(), verts.end()),
+  // the initial lists plus about as much again for the lists that grow
+  face_lists(2 * sizeof(int) * tris.size() + ARENA_BLOCK_BYTES), stamp(0), worst_cost(0.0)
+{
+	int n_verts = (int) verts.size() / 3;
+	int n_faces = (int) tris.size() / 3;
+	q.resize(n_verts);
+	version.assign(n_verts, 0);
+	alive.assign(n_verts, 1);
+	face_alive.assign(n_faces, 1);
+	vfaces.resize(n_verts);
+	mark.assign(n_verts, 0);
+	live_faces = n_faces;
+
+	// each vertex's face list starts out exactly as large as its valence
+	vector<uint32_t> valence(n_verts, 0);
+	for (int i = 0; i < 3 * n_faces; i++)
+		valence[t[i]]++;
+	for (int v = 0; v < n_verts; v++)
+		vfaces[v].reserve(face_lists, valence[v]);
+
+	for (int f = 0; f < n_faces; f++) {
+		if (t[3*f] == t[3*f+1] || t[3*f+1] == t[3*f+2] || t[3*f] == t[3*f+2]) {
+			face_alive[f] = 0;
+			live_faces--;
+			continue;
+		}
+		double n[3], area;
+		face_normal(f, n, area);
+		const double *p = &pos[3*t[3*f]];
+		double d = -(n[0]*p[0] + n[1]*p[1] + n[2]*p[2]);
+		for (int k = 0; k < 3; k++) {
+			q[t[3*f+k]].add_plane(n[0], n[1], n[2], d, 1.0);
+			vfaces[t[3*f+k]].push_back(face_lists, f);
+		}
+	}
+
+	halfedge_mesh topology;
+	topology.build(t, n_verts);
+	for (int h = 0; h < topology.num_halfedges(); h++) {
+		if (!face_alive[halfedge_mesh::face(h)])
+			continue;
+		int a = topology.origin(h), b = topology.dest(h);
+		int o = topology.opposite(h);
+		if (o == halfedge_mesh::BOUNDARY) {
+			// plane through the border edge, perpendicular to its face
+			double n[3], area;
+			face_normal(halfedge_mesh::face(h), n, area);
+			double e[3] = { pos[3*b] - pos[3*a], pos[3*b+1] - pos[3*a+1], pos[3*b+2] - pos[3*a+2] };
+			double m[3] = { e[1]*n[2] - e[2]*n[1], e[2]*n[0] - e[0]*n[2], e[0]*n[1] - e[1]*n[0] };
+			double len = sqrt(m[0]*m[0] + m[1]*m[1] + m[2]*m[2]);
+			if (len > 0.0) {
+				m[0] /= len; m[1] /= len; m[2] /= len;
+				double d = -(m[0]*pos[3*a] + m[1]*pos[3*a+1] + m[2]*pos[3*a+2]);
+				q[a].add_plane(m[0], m[1], m[2], d, BOUNDARY_WEIGHT);
+				q[b].add_plane(m[0], m[1], m[2], d, BOUNDARY_WEIGHT);
+			}
+		}
+		if (o < 0 || h < o)
+			push_edge(a, b);
+	}
+}
+
+void qem_simplifier::face_normal(int f, double n[3], double &area) const {
+	const double *p0 = &pos[3*t[3*f]], *p1 = &pos[3*t[3*f+1]], *p2 = &pos[3*t[3*f+2]];
+	double e1[3] = { p1[0]-p0[0], p1[1]-p0[1], p1[2]-p0[2] };
+	double e2[3] = { p2[0]-p0[0], p2[1]-p0[1], p2[2]-p0[2] };
+	n[0] = e1[1]*e2[2] - e1[2]*e2[1];
+	n[1] = e1[2]*e2[0] - e1[0]*e2[2];
+	n[2] = e1[0]*e2[1] - e1[1]*e2[0];
+	double len = sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+	area = 0.5 * len;
+	if (len > 0.0) { n[0] /= len; n[1] /= len; n[2] /= len; }
+}
+
+void qem_simplifier::push_edge(int a, int b) {
+	quadric e = q[a];
+	e += q[b];
+
+	collapse c;
+	c.a = a;
+	c.b = b;
+	c.sa = version[a];
+	c.sb = version[b];
+	if (!e.optimum(c.p[0], c.p[1], c.p[2])) {
+		// fall back to the best of the endpoints and the midpoint
+		const double *pa = &pos[3*a], *pb = &pos[3*b];
+		double best = -1.0;
+		for (int i = 0; i < 3; i++) {
+			double s = 0.5 * i;
+			double x = pa[0] + s*(pb[0]-pa[0]), y = pa[1] + s*(pb[1]-pa[1]), z = pa[2] + s*(pb[2]-pa[2]);
+			double cost = e.eval(x, y, z);
+			if (best < 0.0 || cost < best) {
+				best = cost;
+				c.p[0] = x; c.p[1] = y; c.p[2] = z;
+			}
+		}
+	}
+	c.cost = e.eval(c.p[0], c.p[1], c.p[2]);
+	if (c.cost < 0.0)
+		c.cost = 0.0;
+	heap.push(c);
+}
+
+/* Rejects collapses that would make the surface non-manifold (the two
+ * vertices share more neighbours than faces) or flip a face.
+ */
+bool qem_simplifier::valid(const collapse &c) {
+	int a = c.a, b = c.b;
+
+	stamp++;
+	int shared_faces = 0;
+	for (size_t i = 0; i < vfaces[a].size(); i++) {
+		int f = vfaces[a][i];
+		if (!face_alive[f]) continue;
+		for (int k = 0; k < 3; k++)
+			mark[t[3*f+k]] = stamp;
+	}
+	int shared_verts = 0;
+	stamp++;
+	for (size_t i = 0; i < vfaces[b].size(); i++) {
+		int f = vfaces[b][i];
+		if (!face_alive[f]) continue;
+		bool has_a = false;
+		for (int k = 0; k < 3; k++) {
+			int v = t[3*f+k];
+			if (v == a) has_a = true;
+			if (v != a && v != b && mark[v] == stamp - 1) {
+				shared_verts++;
+				mark[v] = stamp;   // count each neighbour once
+			}
+		}
+		if (has_a) shared_faces++;
+	}
+	if (shared_faces == 0 || shared_verts != shared_faces)
+		return false;
+
+	for (int side = 0; side < 2; side++) {
+		int v = side ? b : a;
+		int other = side ? a : b;
+		for (size_t i = 0; i < vfaces[v].size(); i++) {
+			int f = vfaces[v][i];
+			if (!face_alive[f]) continue;
+			const double *p[3];
+			bool has_other = false;
+			for (int k = 0; k < 3; k++) {
+				int w = t[3*f+k];
+				if (w == other) has_other = true;
+				p[k] = (w == v) ? c.p : &pos[3*w];
+			}
+			if (has_other) continue;   // removed by the collapse
+
+			double n0[3], area;
+			face_normal(f, n0, area);
+			double e1[3] = { p[1][0]-p[0][0], p[1][1]-p[0][1], p[1][2]-p[0][2] };
+			double e2[3] = { p[2][0]-p[0][0], p[2][1]-p[0][1], p[2][2]-p[0][2] };
+			double n1[3] = { e1[1]*e2[2] - e1[2]*e2[1], e1[2]*e2[0] - e1[0]*e2[2], e1[0]*e2[1] - e1[1]*e2[0] };
+			double len = sqrt(n1[0]*n1[0] + n1[1]*n1[1] + n1[2]*n1[2]);
+			if (len <= 1e-12)
+				return false;
+			if ((n0[0]*n1[0] + n0[1]*n1[1] + n0[2]*n1[2]) / len < MIN_NORMAL_DOT)
+				return false;
+		}
+	}
+	return true;
+}
+
+void qem_simplifier::apply(const collapse &c) {
+	int a = c.a, b = c.b;
+	pos[3*a] = c.p[0]; pos[3*a+1] = c.p[1]; pos[3*a+2] = c.p[2];
+	q[a] += q[b];
+	version[a]++;
+	version[b]++;
+	alive[b] = 0;
+
+	for (size_t i = 0; i < vfaces[b].size(); i++) {
+		int f = vfaces[b][i];
+		if (!face_alive[f]) continue;
+		bool has_a = false;
+		for (int k = 0; k < 3; k++)
+			if (t[3*f+k] == a) has_a = true;
+		if (has_a) {
+			face_alive[f] = 0;
+			live_faces--;
+		} else {
+			for (int k = 0; k < 3; k++)
+				if (t[3*f+k] == b) t[3*f+k] = a;
+			vfaces[a].push_back(face_lists, f);
+		}
+	}
+	vfaces[b].clear();
+
+	// drop dead faces and re-queue every edge around a
+	arena_list<int> &fa = vfaces[a];
+	size_t n = 0;
+	stamp++;
+	mark[a] = stamp;
+	for (size_t i = 0; i < fa.size(); i++) {
+		int f = fa[i];
+		if (!face_alive[f]) continue;
+		fa[n++] = f;
+		for (int k = 0; k < 3; k++) {
+			int v = t[3*f+k];
+			if (mark[v] != stamp) {
+				mark[v] = stamp;
+				push_edge(a, v);
+			}
+		}
+	}
+	fa.resize(n);
+}
+
+bool qem_simplifier::run(int target, double max_cost) {
+	while (live_faces > target) {
+		if (heap.empty())
+			return false;
+		collapse c = heap.top();
+		if (!alive[c.a] || !alive[c.b] || c.sa != version[c.a] || c.sb != version[c.b]) {
+			heap.pop();
+			continue;
+		}
+		if (c.cost > max_cost)
+			return false;
+		heap.pop();
+		if (!valid(c))
+			continue;
+		apply(c);
+		if (c.cost > worst_cost)
+			worst_cost = c.cost;
+	}
+	return true;
+}
+
+void qem_simplifier::snapshot(mesh_lod &lod) const {
+	lod.tris.clear();
+	lod.verts.clear();
+	lod.source.clear();
+	lod.tris.reserve(3 * live_faces);
+
+	vector<int> remap(alive.size(), -1);
+	for (size_t f = 0; f < face_alive.size(); f++) {
+		if (!face_alive[f]) continue;
+		for (int k = 0; k < 3; k++) {
+			int v = t[3*f+k];
+			if (remap[v] < 0) {
+				remap[v] = (int) lod.verts.size() / 3;
+				lod.verts.push_back((float) pos[3*v]);
+				lod.verts.push_back((float) pos[3*v+1]);
+				lod.verts.push_back((float) pos[3*v+2]);
+				lod.source.push_back(v);
+			}
+			lod.tris.push_back(remap[v]);
+		}
+	}
+	lod.error = (float) max_error();
+}
+
+void build_lod_chain(const vector<int> &tris, const vector<float> &verts,
+					 const float *ratios, int n_ratios, float max_error,
+					 vector<mesh_lod> &lods)
+{
+	lods.clear();
+	lods.resize(1);
+	lods[0].tris = tris;
+	lods[0].verts = verts;
+	lods[0].source.resize(verts.size() / 3);
+	for (size_t v = 0; v < lods[0].source.size(); v++)
+		lods[0].source[v] = (int) v;
+	lods[0].error = 0.0;
+	lods[0].ratio = 1.0;
+
+	int n_faces = (int) tris.size() / 3;
+	if (n_faces == 0)
+		return;
+
+	qem_simplifier s(tris, verts);
+	double max_cost = (double) max_error * max_error;
+	for (int i = 0; i < n_ratios; i++) {
+		int target = (int) (ratios[i] * n_faces);
+		bool reached = s.run(target, max_cost);
+		// only keep levels that actually removed something
+		if (s.faces() < (int) lods.back().tris.size() / 3) {
+			lods.push_back(mesh_lod());
+			s.snapshot(lods.back());
+			lods.back().ratio = (float) s.faces() / n_faces;
+		}
+		if (!reached)
+			break;
+	}
+}
+
+float pixels_per_unit(float distance, float fovy, int viewport_h) {
+	if (distance <= 0.0f)
+		return 1e30f;
+	return viewport_h / (2.0f * distance * tanf(0.5f * fovy * (float) M_PI / 180.0f));
+}
+
+int select_lod(const vector<mesh_lod> &lods, float pixels_per_unit, float pixel_tolerance) {
+	int best = 0;
+	for (int i = 1; i < (int) lods.size(); i++)
+		if (lods[i].error * pixels_per_unit <= pixel_tolerance)
+			best = i;
+	return best;
+}
+
+float mean_triangle_area(const mesh_lod &lod) {
+	const vector<int> &t = lod.tris;
+	const vector<float> &v = lod.verts;
+	if (t.empty())
+		return 0.0f;
+	double area = 0.0;
+	for (size_t i = 0; i + 2 < t.size(); i += 3) {
+		const float *a = &v[3*t[i]], *b = &v[3*t[i+1]], *c = &v[3*t[i+2]];
+		float e1[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+		float e2[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+		float n[3] = { e1[1]*e2[2] - e1[2]*e2[1], e1[2]*e2[0] - e1[0]*e2[2], e1[0]*e2[1] - e1[1]*e2[0] };
+		area += 0.5 * sqrt(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+	}
+	return (float) (area / (t.size() / 3));
+}
@@ -0,0 +1,51 @@
+//
+//  simplify.h
+//  pipeline
+//
+//  Quadric error metric (Garland-Heckbert) simplification and discrete
+//  level-of-detail selection for meshes read by read_wavefront_file.
+//
+
+#ifndef simplify_h
+#define simplify_h
+
+#include <vector>
+using namespace std;
+
+struct mesh_lod {
+	vector<int> tris;
+	vector<float> verts;
+	vector<int> source;  // input vertex each level vertex survives from
+	float error;   // largest collapse error so far, in model units
+	float ratio;   // triangle count relative to the input mesh
+};
+
+/* Builds a chain of LODs from (tris, verts). lods[0] is the input mesh and
+ * every following level keeps about ratios[i] of the input triangles.
+ * Levels are produced by one progressive collapse sequence, so the whole
+ * chain costs about as much as the coarsest level. Simplification stops
+ * early (and no further levels are produced) once the next collapse would
+ * exceed max_error. Boundaries are preserved with penalty quadrics.
+ */
+void build_lod_chain(const vector<int> &tris, const vector<float> &verts,
+					 const float *ratios, int n_ratios, float max_error,
+					 vector<mesh_lod> &lods);
+
+/* Projected size of a model distance units away from a camera with the
+ * given vertical field of view (degrees) and viewport height, in pixels
+ * per model unit.
+ */
+float pixels_per_unit(float distance, float fovy, int viewport_h);
+
+/* Returns the coarsest level whose error projects to at most
+ * pixel_tolerance pixels at the given scale (see pixels_per_unit).
+ */
+int select_lod(const vector<mesh_lod> &lods, float pixels_per_unit, float pixel_tolerance);
+
+/* Mean area of a level's triangles in square model units; times the
+ * square of pixels_per_unit it is how many pixels one covers facing the
+ * camera.
+ */
+float mean_triangle_area(const mesh_lod &lod);
+
+#endif /* simplify_h */
@@ -0,0 +1,73 @@
+//
+//  spsc_queue.h
+//  pipeline
+//
+//  Bounded lock-free queue between exactly one producer and one consumer
+//  thread.
+//
+
+#ifndef spsc_queue_h
+#define spsc_queue_h
+
+#include <atomic>
+#include <vector>
+using namespace std;
+
+/* Ring buffer with a power of two number of slots. The producer only
+ * writes tail and the consumer only writes head, so one acquire/release
+ * pair per operation is all the synchronisation needed. Both counters run
+ * freely and are masked on access; they sit on separate cache lines so the
+ * two threads do not fight over one.
+ */
+template <typename T>
+class spsc_queue {
+public:
+	explicit spsc_queue(size_t capacity) : head(0), tail(0) {
+		size_t n = 1;
+		while (n < capacity)
+			n <<= 1;
+		slots.resize(n);
+		mask = n - 1;
+	}
+
+	size_t capacity() const { return slots.size(); }
+
+	// Producer only; false if the queue is full
+	bool push(const T &value) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) == slots.size())
+			return false;
+		slots[t & mask] = value;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer only; false if the queue is empty
+	bool pop(T &value) {
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+			return false;
+		value = slots[h & mask];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Either side; only a snapshot while the other side is running
+	bool empty() const {
+		return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+	}
+
+private:
+	vector<T> slots;
+	size_t mask;
+	char pad0[64];
+	std::atomic<size_t> head;   // next slot to pop
+	char pad1[64];
+	std::atomic<size_t> tail;   // next slot to push
+	char pad2[64];
+
+	spsc_queue(const spsc_queue &);
+	spsc_queue &operator= (const spsc_queue &);
+};
+
+#endif /* spsc_queue_h */
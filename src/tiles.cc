@@ -0,0 +1,562 @@
+//
+//  tiles.cc
+//  pipeline
+//
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "tiles.h"
+#include "normals.h"
+#include "parallel.h"
+#include "parser.h"
+#include "simplify.h"
+
+using namespace std;
+
+static const char TILE_MAGIC[8] = { 'P', 'T', 'I', 'L', 'E', 'S', '\0', '\0' };
+static const uint32_t TILE_VERSION = 1;
+
+// Octree cells at the deepest level: 128^3 Morton codes
+static const int CELL_BITS = 7;
+
+// Each level keeps about this much of the tile's finest level
+static const float TILE_RATIOS[] = { 0.25, 0.06, 0.015 };
+
+/* Maps a whole file, read-only or (for a new file of the given size)
+ * writable. Pages are loaded on demand and belong to the page cache.
+ */
+class mapped_file {
+public:
+	mapped_file() : ptr(NULL), len(0) {}
+	~mapped_file() { unmap(); }
+
+	bool map_read(const char *file) {
+		int fd = ::open(file, O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		bool ok = fstat(fd, &st) == 0;
+		len = ok ? (size_t) st.st_size : 0;
+		ptr = NULL;
+		if (ok && len > 0) {
+			void *p = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+			ok = p != MAP_FAILED;
+			ptr = ok ? (char *) p : NULL;
+		}
+		::close(fd);
+		return ok;
+	}
+
+	bool map_new(const char *file, size_t size) {
+		int fd = ::open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			return false;
+		bool ok = ftruncate(fd, (off_t) size) == 0;
+		len = size;
+		ptr = NULL;
+		if (ok && len > 0) {
+			void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			ok = p != MAP_FAILED;
+			ptr = ok ? (char *) p : NULL;
+		}
+		::close(fd);
+		return ok;
+	}
+
+	void unmap() {
+		if (ptr)
+			munmap(ptr, len);
+		ptr = NULL;
+		len = 0;
+	}
+
+	// Lets the kernel reclaim [begin, end) right away
+	void drop(size_t begin, size_t end) {
+		size_t page = (size_t) sysconf(_SC_PAGESIZE);
+		begin = (begin + page - 1) / page * page;
+		if (ptr && begin < end)
+			madvise(ptr + begin, end - begin, MADV_DONTNEED);
+	}
+
+	char *ptr;
+	size_t len;
+};
+
+static uint32_t spread_bits(uint32_t x) {
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+// Octree cell of a face's centroid within the cube (origin, extent)
+static uint32_t face_cell(const float *verts, const int *f, const float *origin, float extent) {
+	uint32_t c[3];
+	const float cells = (float) (1 << CELL_BITS);
+	for (int k = 0; k < 3; k++) {
+		float m = (verts[3*f[0]+k] + verts[3*f[1]+k] + verts[3*f[2]+k]) / 3.0f;
+		int i = (int) ((m - origin[k]) / extent * cells);
+		c[k] = (uint32_t) max(0, min(i, (1 << CELL_BITS) - 1));
+	}
+	return spread_bits(c[0]) | (spread_bits(c[1]) << 1) | (spread_bits(c[2]) << 2);
+}
+
+struct octree_leaf {
+	uint32_t first_cell, end_cell;
+	uint32_t depth;
+};
+
+// Nodes are contiguous ranges of Morton codes, so counts come from prefix sums
+static void collect_leaves(const vector<uint64_t> &start, uint32_t begin, uint32_t end,
+						   uint32_t depth, int max_tris, vector<octree_leaf> &leaves)
+{
+	uint64_t n = start[end] - start[begin];
+	if (n == 0)
+		return;
+	if (n <= (uint64_t) max_tris || depth == (uint32_t) CELL_BITS) {
+		octree_leaf l = { begin, end, depth };
+		leaves.push_back(l);
+		return;
+	}
+	uint32_t step = (end - begin) / 8;
+	for (int c = 0; c < 8; c++)
+		collect_leaves(start, begin + c * step, begin + (c + 1) * step, depth + 1, max_tris, leaves);
+}
+
+// A finished tile waiting to be written
+struct tile_blob {
+	tile_info info;
+	vector<char> bytes;
+};
+
+static void build_tile(const int *faces, size_t n_faces, const float *all_verts, uint32_t depth,
+					   tile_blob &blob)
+{
+	// local vertex numbering: the sorted distinct indices of the tile's faces
+	vector<int> ids(faces, faces + 3 * n_faces);
+	sort(ids.begin(), ids.end());
+	ids.erase(unique(ids.begin(), ids.end()), ids.end());
+
+	vector<int> tris(3 * n_faces);
+	for (size_t i = 0; i < tris.size(); i++)
+		tris[i] = (int) (lower_bound(ids.begin(), ids.end(), faces[i]) - ids.begin());
+	vector<float> verts(3 * ids.size());
+	for (size_t v = 0; v < ids.size(); v++)
+		for (int k = 0; k < 3; k++)
+			verts[3*v+k] = all_verts[3*(size_t)ids[v]+k];
+
+	memset(&blob.info, 0, sizeof(blob.info));
+	blob.info.depth = depth;
+	for (int k = 0; k < 3; k++) {
+		blob.info.lo[k] = FLT_MAX;
+		blob.info.hi[k] = -FLT_MAX;
+	}
+	for (size_t v = 0; v < verts.size(); v += 3)
+		for (int k = 0; k < 3; k++) {
+			blob.info.lo[k] = min(blob.info.lo[k], verts[v+k]);
+			blob.info.hi[k] = max(blob.info.hi[k], verts[v+k]);
+		}
+
+	/* Tile borders are open edges to the simplifier, which holds them with
+	 * its boundary quadrics, so neighbouring tiles at different levels
+	 * still (nearly) meet.
+	 */
+	vector<mesh_lod> lods;
+	build_lod_chain(tris, verts, TILE_RATIOS, sizeof(TILE_RATIOS)/sizeof(TILE_RATIOS[0]),
+					FLT_MAX, lods);
+	blob.info.n_levels = (uint32_t) min((int) lods.size(), TILE_MAX_LEVELS);
+
+	vector<float> norms;
+	for (uint32_t l = 0; l < blob.info.n_levels; l++) {
+		const mesh_lod &lod = lods[l];
+		compute_vertex_normals(lod.tris, lod.verts, norms);
+		tile_level &tl = blob.info.levels[l];
+		tl.offset = blob.bytes.size();   // relative until written
+		tl.n_verts = (uint32_t) (lod.verts.size() / 3);
+		tl.n_tris = (uint32_t) (lod.tris.size() / 3);
+		tl.error = lod.error;
+		size_t at = blob.bytes.size();
+		blob.bytes.resize(at + 4 * (lod.verts.size() + norms.size() + lod.tris.size()));
+		char *p = &blob.bytes[at];
+		memcpy(p, lod.verts.data(), 4 * lod.verts.size());
+		p += 4 * lod.verts.size();
+		memcpy(p, norms.data(), 4 * norms.size());
+		p += 4 * norms.size();
+		memcpy(p, lod.tris.data(), 4 * lod.tris.size());
+	}
+}
+
+bool build_tile_file(const char *obj_file, const char *tile_file, int max_tris)
+{
+	string verts_tmp = string(tile_file) + ".verts.tmp";
+	string faces_tmp = string(tile_file) + ".faces.tmp";
+	string sorted_tmp = string(tile_file) + ".sorted.tmp";
+
+	// pass 1: spill the OBJ into flat binary arrays
+	float lo[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	size_t n_verts = 0, n_faces = 0;
+	{
+		ofstream vout(verts_tmp.c_str(), ios::binary), fout(faces_tmp.c_str(), ios::binary);
+		if (!vout || !fout) {
+			cerr << "Cannot create temporary files next to " << tile_file << endl;
+			return false;
+		}
+		stream_wavefront_file(obj_file, [&](const vector<float> &v, const vector<int> &t) {
+			for (size_t i = 0; i < v.size(); i += 3)
+				for (int k = 0; k < 3; k++) {
+					lo[k] = min(lo[k], v[i+k]);
+					hi[k] = max(hi[k], v[i+k]);
+				}
+			if (!v.empty())
+				vout.write((const char *) &v[0], 4 * v.size());
+			if (!t.empty())
+				fout.write((const char *) &t[0], 4 * t.size());
+			n_verts += v.size() / 3;
+			n_faces += t.size() / 3;
+		});
+	}
+	cout << "tiles: " << n_faces << " faces, " << n_verts << " vertices" << endl;
+
+	mapped_file vmap, fmap;
+	if (n_faces == 0 || !vmap.map_read(verts_tmp.c_str()) || !fmap.map_read(faces_tmp.c_str())) {
+		cerr << "No triangles in " << obj_file << endl;
+		unlink(verts_tmp.c_str());
+		unlink(faces_tmp.c_str());
+		return false;
+	}
+	const float *verts = (const float *) vmap.ptr;
+	const int *faces = (const int *) fmap.ptr;
+
+	float extent = max(hi[0] - lo[0], max(hi[1] - lo[1], hi[2] - lo[2]));
+	extent = extent > 0.0f ? extent * 1.0001f : 1.0f;
+
+	// pass 2: faces per cell; faces with indices outside the file are dropped
+	const uint32_t n_cells = 1u << (3 * CELL_BITS);
+	vector<uint64_t> start(n_cells + 1, 0);
+	size_t dropped = 0;
+	for (size_t f = 0; f < n_faces; f++) {
+		const int *t = &faces[3*f];
+		if (t[0] < 0 || t[1] < 0 || t[2] < 0 || (size_t) t[0] >= n_verts ||
+			(size_t) t[1] >= n_verts || (size_t) t[2] >= n_verts) {
+			dropped++;
+			continue;
+		}
+		start[face_cell(verts, t, lo, extent) + 1]++;
+	}
+	if (dropped > 0)
+		cerr << "tiles: dropped " << dropped << " faces with bad vertex indices" << endl;
+	for (uint32_t c = 0; c < n_cells; c++)
+		start[c + 1] += start[c];
+
+	vector<octree_leaf> leaves;
+	collect_leaves(start, 0, n_cells, 0, max_tris, leaves);
+
+	// pass 3: faces in Morton order of their cells
+	const size_t n_kept = n_faces - dropped;
+	mapped_file smap;
+	if (!smap.map_new(sorted_tmp.c_str(), 12 * n_kept)) {
+		cerr << "Cannot create " << sorted_tmp << endl;
+		unlink(verts_tmp.c_str());
+		unlink(faces_tmp.c_str());
+		return false;
+	}
+	int *sorted = (int *) smap.ptr;
+	{
+		vector<uint64_t> cursor(start.begin(), start.end() - 1);
+		for (size_t f = 0; f < n_faces; f++) {
+			const int *t = &faces[3*f];
+			if (t[0] < 0 || t[1] < 0 || t[2] < 0 || (size_t) t[0] >= n_verts ||
+				(size_t) t[1] >= n_verts || (size_t) t[2] >= n_verts)
+				continue;
+			memcpy(&sorted[3 * cursor[face_cell(verts, t, lo, extent)]++], t, 12);
+		}
+	}
+	fmap.unmap();
+	unlink(faces_tmp.c_str());
+
+	// tiles are simplified a batch at a time and appended in order
+	ofstream out(tile_file, ios::binary);
+	tile_header header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TILE_MAGIC, sizeof(TILE_MAGIC));
+	header.version = TILE_VERSION;
+	header.n_tiles = (uint32_t) leaves.size();
+	for (int k = 0; k < 3; k++) {
+		header.lo[k] = lo[k];
+		header.hi[k] = hi[k];
+	}
+	header.n_tris = n_kept;
+	out.write((const char *) &header, sizeof(header));
+
+	vector<tile_info> table(leaves.size());
+	uint64_t offset = sizeof(header);
+	const size_t batch = 2 * parallel_workers();
+	for (size_t b = 0; b < leaves.size(); b += batch) {
+		size_t e = min(b + batch, leaves.size());
+		vector<tile_blob> blobs(e - b);
+		parallel_for(e - b, 1, [&](size_t lb, size_t le) {
+			for (size_t i = lb; i < le; i++) {
+				const octree_leaf &l = leaves[b + i];
+				uint64_t first = start[l.first_cell], last = start[l.end_cell];
+				build_tile(&sorted[3 * first], (size_t) (last - first), verts, l.depth, blobs[i]);
+			}
+		});
+		for (size_t i = 0; i < blobs.size(); i++) {
+			tile_info &info = blobs[i].info;
+			for (uint32_t lv = 0; lv < info.n_levels; lv++)
+				info.levels[lv].offset += offset;
+			table[b + i] = info;
+			out.write(&blobs[i].bytes[0], blobs[i].bytes.size());
+			offset += blobs[i].bytes.size();
+		}
+		// done with these faces
+		smap.drop(12 * start[leaves[b].first_cell], 12 * start[leaves[e - 1].end_cell]);
+		cout << "\rtiles: " << e << "/" << leaves.size() << flush;
+	}
+	cout << endl;
+
+	header.table_offset = offset;
+	out.write((const char *) &table[0], sizeof(tile_info) * table.size());
+	out.seekp(0);
+	out.write((const char *) &header, sizeof(header));
+	bool ok = (bool) out;
+	out.close();
+
+	smap.unmap();
+	vmap.unmap();
+	unlink(sorted_tmp.c_str());
+	unlink(verts_tmp.c_str());
+	if (!ok)
+		cerr << "Failed to write " << tile_file << endl;
+	else
+		cout << "wrote " << leaves.size() << " tiles (" << (offset + sizeof(tile_info) * table.size()) / (1024 * 1024)
+			 << " MB) to " << tile_file << endl;
+	return ok;
+}
+
+tile_file::tile_file() : data(NULL), size(0), header(NULL), table(NULL) {}
+
+tile_file::~tile_file() {
+	close();
+}
+
+bool tile_file::open(const char *file) {
+	close();
+	int fd = ::open(file, O_RDONLY);
+	if (fd < 0) {
+		cerr << "Cannot open " << file << endl;
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(tile_header)) {
+		cerr << file << " is not a tile file" << endl;
+		::close(fd);
+		return false;
+	}
+	size = (size_t) st.st_size;
+	void *p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (p == MAP_FAILED) {
+		cerr << "Cannot map " << file << endl;
+		size = 0;
+		return false;
+	}
+	data = (const char *) p;
+
+	const tile_header *h = (const tile_header *) data;
+	if (memcmp(h->magic, TILE_MAGIC, sizeof(TILE_MAGIC)) != 0 || h->version != TILE_VERSION ||
+		h->table_offset + sizeof(tile_info) * (uint64_t) h->n_tiles > size) {
+		cerr << file << " is not a tile file of version " << TILE_VERSION << endl;
+		close();
+		return false;
+	}
+	header = h;
+	table = (const tile_info *) (data + h->table_offset);
+	return true;
+}
+
+void tile_file::close() {
+	if (data)
+		munmap((void *) data, size);
+	data = NULL;
+	size = 0;
+	header = NULL;
+	table = NULL;
+}
+
+const float *tile_file::positions(int t, int l) const {
+	return (const float *) (data + table[t].levels[l].offset);
+}
+
+const float *tile_file::normals(int t, int l) const {
+	return positions(t, l) + 3 * table[t].levels[l].n_verts;
+}
+
+const uint32_t *tile_file::indices(int t, int l) const {
+	return (const uint32_t *) (normals(t, l) + 3 * table[t].levels[l].n_verts);
+}
+
+size_t tile_file::level_bytes(int t, int l) const {
+	const tile_level &tl = table[t].levels[l];
+	return 24 * (size_t) tl.n_verts + 12 * (size_t) tl.n_tris;
+}
+
+void tile_file::advise(int t, int l, int advice) const {
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	size_t begin = (size_t) table[t].levels[l].offset;
+	size_t end = begin + level_bytes(t, l);
+	// whole pages only; madvise wants an aligned start
+	begin = advice == MADV_DONTNEED ? (begin + page - 1) / page * page : begin / page * page;
+	if (begin < end)
+		madvise((void *) (data + begin), end - begin, advice);
+}
+
+void tile_file::prefetch(int t, int l) const {
+	advise(t, l, MADV_WILLNEED);
+}
+
+void tile_file::release(int t, int l) const {
+	advise(t, l, MADV_DONTNEED);
+}
+
+void tile_requests(const tile_file &file, const frustum &f, const float *eye,
+				   float fovy, int viewport_h, float pixel_tolerance,
+				   vector<tile_request> &out)
+{
+	out.clear();
+	for (int t = 0; t < file.num_tiles(); t++) {
+		const tile_info &ti = file.tile(t);
+		float center[3], radius = 0.0f, d2 = 0.0f;
+		for (int k = 0; k < 3; k++) {
+			center[k] = 0.5f * (ti.lo[k] + ti.hi[k]);
+			radius += 0.25f * (ti.hi[k] - ti.lo[k]) * (ti.hi[k] - ti.lo[k]);
+			// distance to the box, 0 inside it
+			float d = max(ti.lo[k] - eye[k], max(0.0f, eye[k] - ti.hi[k]));
+			d2 += d * d;
+		}
+		if (!sphere_in_frustum(f, center, sqrtf(radius)))
+			continue;
+
+		tile_request r;
+		r.tile = t;
+		r.distance = sqrtf(d2);
+		float scale = pixels_per_unit(r.distance, fovy, viewport_h);
+		r.level = 0;
+		for (uint32_t l = 1; l < ti.n_levels; l++)
+			if (ti.levels[l].error * scale <= pixel_tolerance)
+				r.level = (int) l;
+		out.push_back(r);
+	}
+	sort(out.begin(), out.end(), [](const tile_request &a, const tile_request &b) {
+		return a.distance < b.distance;
+	});
+}
+
+tile_pager::tile_pager(size_t budget) : limit(budget), bytes(0), frame(0) {}
+
+int tile_pager::resident_level(int tile) const {
+	return tile < (int) level.size() ? level[tile] : -1;
+}
+
+int tile_pager::resident_tiles() const {
+	int n = 0;
+	for (size_t t = 0; t < level.size(); t++)
+		if (level[t] >= 0)
+			n++;
+	return n;
+}
+
+// Evicts tiles not used this frame, oldest first, until need more bytes fit
+bool tile_pager::make_room(const tile_file &file, size_t need, vector<tile_request> &evict) {
+	while (bytes + need > limit) {
+		int victim = -1;
+		for (size_t t = 0; t < level.size(); t++)
+			if (level[t] >= 0 && last_used[t] < frame && (victim < 0 || last_used[t] < last_used[victim]))
+				victim = (int) t;
+		if (victim < 0)
+			return false;
+		tile_request r = { victim, level[victim], 0.0f };
+		evict.push_back(r);
+		bytes -= file.level_bytes(victim, level[victim]);
+		level[victim] = -1;
+	}
+	return true;
+}
+
+// Makes level l of w's tile resident in place of whatever level it has now
+bool tile_pager::place(const tile_file &file, const tile_request &w, int l,
+					   vector<tile_request> &load, vector<tile_request> &evict)
+{
+	int have = level[w.tile];
+	// the level in use is given back when its replacement is loaded
+	size_t freed = have >= 0 ? file.level_bytes(w.tile, have) : 0;
+	size_t need = file.level_bytes(w.tile, l);
+	if (need > freed && !make_room(file, need - freed, evict))
+		return false;
+	if (have >= 0) {
+		// a level loaded earlier this update was never uploaded: drop its load
+		size_t k = 0;
+		while (k < load.size() && load[k].tile != w.tile)
+			k++;
+		if (k < load.size()) {
+			load.erase(load.begin() + k);
+		} else {
+			tile_request old = { w.tile, have, w.distance };
+			evict.push_back(old);
+		}
+	}
+	bytes = bytes - freed + need;
+	level[w.tile] = l;
+	tile_request r = { w.tile, l, w.distance };
+	load.push_back(r);
+	return true;
+}
+
+void tile_pager::update(const tile_file &file, const vector<tile_request> &wanted, int max_loads,
+						vector<tile_request> &load, vector<tile_request> &evict)
+{
+	load.clear();
+	evict.clear();
+	level.resize(file.num_tiles(), -1);
+	last_used.resize(file.num_tiles(), -1);
+	frame++;
+	for (size_t i = 0; i < wanted.size(); i++)
+		last_used[wanted[i].tile] = frame;
+
+	// first every visible tile gets its coarsest level, so nothing is missing
+	for (size_t i = 0; i < wanted.size() && (int) load.size() < max_loads; i++) {
+		const tile_request &w = wanted[i];
+		if (level[w.tile] < 0)
+			place(file, w, (int) file.tile(w.tile).n_levels - 1, load, evict);
+	}
+
+	// then the nearest are refined, as finely as the budget still allows
+	for (size_t i = 0; i < wanted.size() && (int) load.size() < max_loads; i++) {
+		const tile_request &w = wanted[i];
+		int have = level[w.tile];
+		if (have < 0 || have == w.level)
+			continue;
+		// more detail than needed is given back; a coarser level is smaller
+		// and fits in what the finer frees, but should one not, the next is tried
+		if (have < w.level) {
+			for (int l = w.level; l > have; l--)
+				if (place(file, w, l, load, evict))
+					break;
+			continue;
+		}
+		for (int l = w.level; l < have; l++)
+			if (place(file, w, l, load, evict))
+				break;
+	}
+}
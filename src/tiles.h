@@ -0,0 +1,140 @@
+//
+//  tiles.h
+//  pipeline
+//
+//  Out-of-core tiled meshes: a preprocessing step that cuts a large OBJ into
+//  octree tiles with their own levels of detail, stored in one file that is
+//  memory mapped for rendering, and the paging policy that keeps the tiles
+//  in use under a memory budget.
+//
+
+#ifndef tiles_h
+#define tiles_h
+
+#include <stdint.h>
+#include <vector>
+#include "meshlet.h"
+using namespace std;
+
+const int TILE_MAX_LEVELS = 4;
+const int TILE_DEFAULT_MAX_TRIS = 65536;
+
+/* One level of a tile: n_verts positions (3 floats each), then n_verts
+ * normals (3 floats), then n_tris faces (3 uint32 each), at offset.
+ */
+struct tile_level {
+	uint64_t offset;
+	uint32_t n_verts, n_tris;
+	float error;       // largest collapse error, in model units
+	uint32_t reserved;
+};
+
+struct tile_info {
+	float lo[3], hi[3];
+	uint32_t depth;    // of the octree node the tile is
+	uint32_t n_levels;
+	tile_level levels[TILE_MAX_LEVELS];
+};
+
+/* File layout: tile_header, the levels' data, then n_tiles tile_info at
+ * table_offset. Tiles are in Morton order, so neighbours in space tend to
+ * be neighbours in the file.
+ */
+struct tile_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t n_tiles;
+	float lo[3], hi[3];
+	uint64_t table_offset;
+	uint64_t n_tris;   // finest level, over all tiles
+};
+
+/* Preprocesses obj_file into tile_file. The OBJ is streamed and its
+ * vertices and faces spilled to temporary files next to the output, which
+ * are memory mapped, so the model itself never has to fit in memory: only
+ * per-cell face counts and the few tiles being simplified at a time do.
+ * Faces are bucketed by centroid into the leaves of an octree that splits
+ * until a node holds at most max_tris faces (or reaches depth 7).
+ */
+bool build_tile_file(const char *obj_file, const char *tile_file, int max_tris);
+
+// Read-only mapping of a tile file
+class tile_file {
+public:
+	tile_file();
+	~tile_file();
+
+	bool open(const char *file);
+	void close();
+
+	int num_tiles() const { return header ? (int) header->n_tiles : 0; }
+	const tile_header &info() const { return *header; }
+	const tile_info &tile(int t) const { return table[t]; }
+
+	const float *positions(int t, int l) const;
+	const float *normals(int t, int l) const;
+	const uint32_t *indices(int t, int l) const;
+	size_t level_bytes(int t, int l) const;
+
+	// Asks the kernel to start reading a level in
+	void prefetch(int t, int l) const;
+	// Drops a level's pages from this process once it has been copied out
+	void release(int t, int l) const;
+
+private:
+	const char *data;
+	size_t size;
+	const tile_header *header;
+	const tile_info *table;
+
+	void advise(int t, int l, int advice) const;
+
+	tile_file(const tile_file &);
+	tile_file &operator= (const tile_file &);
+};
+
+struct tile_request {
+	int tile, level;
+	float distance;    // from the eye to the tile's box
+};
+
+/* Tiles in the frustum, nearest first, each with the coarsest level whose
+ * error stays under pixel_tolerance pixels (see pixels_per_unit).
+ */
+void tile_requests(const tile_file &file, const frustum &f, const float *eye,
+				   float fovy, int viewport_h, float pixel_tolerance,
+				   vector<tile_request> &out);
+
+/* Residency bookkeeping under a byte budget. Every frame update() is given
+ * the requests; it returns which levels to load now (at most max_loads)
+ * and which to drop, and assumes the caller does both. Visible tiles get
+ * their coarsest level first and are then refined nearest first; a tile
+ * refined in the update that first loads it is loaded once, refined. Tiles not
+ * requested this frame are evicted least recently used first to make
+ * room; when even that is not enough, far tiles stay coarser than asked,
+ * so resident bytes never exceed the budget.
+ */
+class tile_pager {
+public:
+	explicit tile_pager(size_t budget);
+
+	void update(const tile_file &file, const vector<tile_request> &wanted, int max_loads,
+				vector<tile_request> &load, vector<tile_request> &evict);
+
+	int resident_level(int tile) const;      // -1 when not resident
+	size_t resident_bytes() const { return bytes; }
+	size_t budget() const { return limit; }
+	int resident_tiles() const;
+
+private:
+	size_t limit, bytes;
+	long long frame;
+	vector<int> level;               // resident level per tile, -1 if none
+	vector<long long> last_used;
+
+	bool make_room(const tile_file &file, size_t need, vector<tile_request> &evict);
+	bool place(const tile_file &file, const tile_request &w, int l,
+			   vector<tile_request> &load, vector<tile_request> &evict);
+};
+
+#endif /* tiles_h */
@@ -0,0 +1,37 @@
+//
+//  uniform_blocks.cc
+//  pipeline
+//
+
+#include "uniform_blocks.h"
+
+using namespace std;
+
+void copy_uniform(const vec4 &v, GLfloat out[4]) {
+	out[0] = v.x;
+	out[1] = v.y;
+	out[2] = v.z;
+	out[3] = v.w;
+}
+
+void set_camera_uniforms(const mat4 &proj, const mat4 &view, const mat4 &model, camera_uniforms &u) {
+	mat4 model_view = view * model;
+	mat4 mvp = proj * model_view;
+	mat4 inv = inverse(model_view);
+	for (int r = 0; r < 4; r++) {
+		copy_uniform(mvp[r], &u.mvp[4*r]);
+		copy_uniform(model_view[r], &u.model_view[4*r]);
+	}
+	// rows of the transposed inverse are the columns of the inverse
+	for (int r = 0; r < 3; r++) {
+		for (int c = 0; c < 3; c++)
+			u.normal_matrix[4*r + c] = inv[c][r];
+		u.normal_matrix[4*r + 3] = 0.0;
+	}
+}
+
+void attach_uniform_block(GLuint program, const char *name, GLuint binding) {
+	GLuint index = glGetUniformBlockIndex(program, name);
+	if (index != GL_INVALID_INDEX)
+		glUniformBlockBinding(program, index, binding);
+}
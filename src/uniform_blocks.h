@@ -0,0 +1,100 @@
+//
+//  uniform_blocks.h
+//  pipeline
+//
+//  Shader state that changes rarely (camera, light, material) kept in
+//  std140 uniform buffers that are only written when their contents change.
+//
+
+#ifndef uniform_blocks_h
+#define uniform_blocks_h
+
+#include <string.h>
+#include "amath.h"
+
+// Binding points, the same for every program
+enum { CAMERA_BLOCK_BINDING = 0, LIGHT_BLOCK_BINDING = 1, MATERIAL_BLOCK_BINDING = 2, CULL_BLOCK_BINDING = 3,
+	CLUSTER_BLOCK_BINDING = 4 };
+
+/* Mirrors of the blocks in the shaders, laid out by the std140 rules. The
+ * blocks are row_major like mat4, and a mat3 takes three vec4 rows.
+ */
+struct camera_uniforms {
+	GLfloat mvp[16];
+	GLfloat model_view[16];
+	GLfloat normal_matrix[12];   // inverse transpose of model_view
+};
+
+struct light_uniforms {
+	GLfloat position[4];         // in eye space
+	GLfloat ambient[4], diffuse[4], specular[4];
+};
+
+struct material_uniforms {
+	GLfloat ambient[4], diffuse[4], specular[4];
+	GLfloat shininess, pad[3];
+};
+
+// The light cluster grid (see light_clusters.h)
+struct cluster_uniforms {
+	GLfloat grid[4];             // tiles across, tiles up, slices, tile size in pixels
+	GLfloat depth[4];            // slice scale and bias, light count, unused
+};
+
+/* Combines the matrices once on the CPU, so shaders only ever multiply a
+ * matrix by a vector.
+ */
+void set_camera_uniforms(const mat4 &proj, const mat4 &view, const mat4 &model, camera_uniforms &u);
+
+void copy_uniform(const vec4 &v, GLfloat out[4]);
+
+// Binds the program's block called name, if it has one, to binding
+void attach_uniform_block(GLuint program, const char *name, GLuint binding);
+
+/* One uniform buffer holding a T. set() keeps the value and notes whether
+ * it changed, upload() writes the buffer only then, so state that stays
+ * the same from frame to frame costs no GL calls at all.
+ */
+template <typename T>
+class uniform_block {
+public:
+	uniform_block() : buffer(0), dirty(false) { memset(&data, 0, sizeof(T)); }
+
+	// Creates the buffer and binds it to binding; needs the GL context
+	void create(GLuint binding) {
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(T), &data, GL_DYNAMIC_DRAW);
+		glBindBufferBase(GL_UNIFORM_BUFFER, binding, buffer);
+		dirty = false;
+	}
+
+	void set(const T &value) {
+		if (memcmp(&value, &data, sizeof(T)) != 0) {
+			data = value;
+			dirty = true;
+		}
+	}
+
+	// True if the buffer had to be written
+	bool upload() {
+		if (!dirty || buffer == 0)
+			return false;
+		glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(T), &data);
+		dirty = false;
+		return true;
+	}
+
+	const T &get() const { return data; }
+
+private:
+	GLuint buffer;
+	T data;
+	bool dirty;
+
+	uniform_block(const uniform_block &);
+	uniform_block &operator= (const uniform_block &);
+};
+
+#endif /* uniform_blocks_h */
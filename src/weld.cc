@@ -0,0 +1,176 @@
+//
+//  weld.cc
+//  pipeline
+//
+
+#include <stdint.h>
+#include <cmath>
+#include <cstring>
+#include "weld.h"
+#include "parallel.h"
+
+using namespace std;
+
+static const size_t WELD_GRAIN = 16384;
+
+/* Grid cell of a position: coordinates in units of the cell size, or with
+ * no tolerance the bits of the coordinates (0 and -0 alike), so that only
+ * equal positions share a cell. low tells, per axis, whether the position
+ * is in the lower half of its cell.
+ */
+static void cell_of(const float *p, double inv_cell, int64_t cell[3], bool low[3]) {
+	for (int k = 0; k < 3; k++) {
+		if (inv_cell == 0.0) {
+			float f = p[k] == 0.0f ? 0.0f : p[k];
+			uint32_t bits;
+			memcpy(&bits, &f, 4);
+			cell[k] = bits;
+			low[k] = false;
+		} else {
+			double x = p[k] * inv_cell;
+			double c = floor(x);
+			cell[k] = (int64_t) max(-4e18, min(4e18, c));
+			low[k] = x - c < 0.5;
+		}
+	}
+}
+
+static uint32_t cell_hash(int64_t x, int64_t y, int64_t z) {
+	uint64_t h = (uint64_t) x * 0x9E3779B97F4A7C15ull;
+	h = (h ^ (h >> 29)) + (uint64_t) y * 0xC2B2AE3D27D4EB4Full;
+	h = (h ^ (h >> 31)) + (uint64_t) z * 0x165667B19E3779F9ull;
+	return (uint32_t) (h ^ (h >> 32));
+}
+
+void weld_vertices(vector<int> &tris, vector<float> &verts, const weld_params &params,
+				   weld_result &result)
+{
+	const int n = (int) (verts.size() / 3);
+	result.verts_before = n;
+	result.tris_before = (int) (tris.size() / 3);
+	result.remap.resize(n);
+	result.source.clear();
+	if (n == 0) {
+		result.verts_after = 0;
+		result.tris_after = result.tris_before;
+		return;
+	}
+
+	const float *pos = &verts[0];
+	vector<float> *normals = params.normals && params.normals->size() == verts.size() ? params.normals : NULL;
+	const float *nrm = normals ? &(*normals)[0] : NULL;
+	const float min_dot = (float) cos(params.normal_angle * M_PI / 180.0);
+	const float tol = params.tolerance > 0.0 ? params.tolerance : 0.0f;
+	const float tol2 = tol * tol;
+	const double inv_cell = tol > 0.0 ? 0.5 / tol : 0.0;
+	const int reach = tol > 0.0 ? 1 : 0;
+
+	size_t buckets = 1;
+	while (buckets < (size_t) n)
+		buckets <<= 1;
+	const uint32_t mask = (uint32_t) (buckets - 1);
+
+	// bucket of the cell of each vertex
+	vector<uint32_t> bucket(n);
+	parallel_for(n, WELD_GRAIN, [&](size_t b, size_t e) {
+		for (size_t i = b; i < e; i++) {
+			int64_t c[3];
+			bool low[3];
+			cell_of(pos + 3 * i, inv_cell, c, low);
+			bucket[i] = cell_hash(c[0], c[1], c[2]) & mask;
+		}
+	});
+
+	// vertices by bucket, in index order within each: a counting sort
+	vector<int> first(buckets + 1, 0), order(n);
+	for (int i = 0; i < n; i++)
+		first[bucket[i]]++;
+	for (size_t b = 1; b <= buckets; b++)
+		first[b] += first[b - 1];
+	for (int i = n - 1; i >= 0; i--)
+		order[--first[bucket[i]]] = i;
+
+	// the lowest numbered vertex near each vertex, itself if there is none
+	vector<int> link(n);
+	parallel_for(n, WELD_GRAIN, [&](size_t b, size_t e) {
+		for (size_t i = b; i < e; i++) {
+			const float *p = pos + 3 * i;
+			int64_t c[3];
+			bool low[3];
+			cell_of(p, inv_cell, c, low);
+			// the cells a position within the tolerance can be in
+			int64_t from[3];
+			for (int k = 0; k < 3; k++)
+				from[k] = low[k] ? c[k] - reach : c[k];
+			int best = (int) i;
+			for (int dx = 0; dx <= reach; dx++)
+				for (int dy = 0; dy <= reach; dy++)
+					for (int dz = 0; dz <= reach; dz++) {
+						uint32_t h = cell_hash(from[0] + dx, from[1] + dy, from[2] + dz) & mask;
+						for (int k = first[h]; k < first[h + 1]; k++) {
+							int j = order[k];
+							if (j >= best)
+								break;
+							const float *q = pos + 3 * j;
+							float d[3] = { q[0] - p[0], q[1] - p[1], q[2] - p[2] };
+							if (d[0]*d[0] + d[1]*d[1] + d[2]*d[2] > tol2)
+								continue;
+							if (nrm) {
+								const float *a = nrm + 3 * i, *o = nrm + 3 * j;
+								if (a[0]*o[0] + a[1]*o[1] + a[2]*o[2] < min_dot)
+									continue;
+							}
+							best = j;
+							break;
+						}
+					}
+			link[i] = best;
+		}
+	});
+
+	// links always point back, so one pass in order settles every chain
+	for (int i = 0; i < n; i++) {
+		if (link[i] == i) {
+			result.remap[i] = (int) result.source.size();
+			result.source.push_back(i);
+		} else
+			result.remap[i] = result.remap[link[i]];
+	}
+	const int kept = (int) result.source.size();
+	result.verts_after = kept;
+
+	vector<float> welded(3 * (size_t) kept), welded_normals(nrm ? 3 * (size_t) kept : 0);
+	parallel_for(kept, WELD_GRAIN, [&](size_t b, size_t e) {
+		for (size_t v = b; v < e; v++) {
+			size_t s = 3 * (size_t) result.source[v];
+			memcpy(&welded[3 * v], pos + s, 3 * sizeof(float));
+			if (nrm)
+				memcpy(&welded_normals[3 * v], nrm + s, 3 * sizeof(float));
+		}
+	});
+	verts.swap(welded);
+	if (normals)
+		normals->swap(welded_normals);
+
+	parallel_for(tris.size(), 3 * WELD_GRAIN, [&](size_t b, size_t e) {
+		for (size_t t = b; t < e; t++)
+			tris[t] = result.remap[tris[t]];
+	});
+	size_t out = 0;
+	for (size_t t = 0; t + 2 < tris.size(); t += 3) {
+		int a = tris[t], b = tris[t + 1], c = tris[t + 2];
+		if (a == b || b == c || c == a)
+			continue;
+		tris[out++] = a;
+		tris[out++] = b;
+		tris[out++] = c;
+	}
+	tris.resize(out);
+	result.tris_after = (int) (out / 3);
+}
+
+void weld_result::print_report(ostream &os) const {
+	os << "welding: " << verts_before << " vertices into " << verts_after << " ("
+	   << verts_before - verts_after << " merged), " << tris_before - tris_after
+	   << " degenerate faces dropped" << endl;
+}
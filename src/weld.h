@@ -0,0 +1,65 @@
+//
+//  weld.h
+//  pipeline
+//
+//  Vertex welding for meshes whose faces carry their own copies of shared
+//  corners (STL, many exported OBJ files): vertices closer than a tolerance
+//  become one and the faces that collapse are dropped.
+//
+
+#ifndef weld_h
+#define weld_h
+
+#include <iostream>
+#include <vector>
+using namespace std;
+
+// Normals of welded vertices may differ by up to this many degrees
+const float WELD_DEFAULT_NORMAL_ANGLE = 30.0;
+
+struct weld_params {
+	float tolerance;               // distance; 0 merges equal positions only
+	vector<float> *normals;        // 3 per vertex, unit length; NULL to weld on position only
+	float normal_angle;            // degrees, when welding on normals too
+
+	weld_params() : tolerance(0.0), normals(NULL), normal_angle(WELD_DEFAULT_NORMAL_ANGLE) {}
+};
+
+struct weld_result {
+	int verts_before, verts_after;
+	int tris_before, tris_after;
+	vector<int> remap;             // new index of each old vertex
+	vector<int> source;            // old index of each new vertex
+
+	weld_result() : verts_before(0), verts_after(0), tris_before(0), tris_after(0) {}
+
+	void print_report(ostream &os) const;
+};
+
+/* Positions are hashed into a grid of cells twice the tolerance across,
+ * so each vertex only looks through the 8 cells nearest to it. Every vertex
+ * finds the lowest numbered vertex near it in parallel, and chains of such
+ * links are then followed in index order, so the result does not depend on
+ * the number of workers and takes linear time. A vertex keeps the position
+ * (and normal) of the lowest numbered vertex of its group.
+ *
+ * verts, tris and params.normals are rewritten; faces with a repeated
+ * vertex after welding are dropped. Other per-vertex data can follow with
+ * weld_vertex_data.
+ */
+void weld_vertices(vector<int> &tris, vector<float> &verts, const weld_params &params,
+				   weld_result &result);
+
+// Keeps the values (components per vertex) of the vertices that remain
+template <typename T>
+void weld_vertex_data(const weld_result &result, int components, vector<T> &values) {
+	if (values.size() != (size_t) result.verts_before * components)
+		return;
+	vector<T> welded((size_t) result.verts_after * components);
+	for (size_t v = 0; v < result.source.size(); v++)
+		for (int c = 0; c < components; c++)
+			welded[v * components + c] = values[(size_t) result.source[v] * components + c];
+	values.swap(welded);
+}
+
+#endif /* weld_h */